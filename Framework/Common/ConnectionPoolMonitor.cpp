@@ -0,0 +1,384 @@
+/**
+ * MongoDB Plugin - A plugin for Orthanc DICOM Server for storing DICOM data in MongoDB Database
+ * Copyright (C) 2017 - 2023  (Doc Cirrus GmbH)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "ConnectionPoolMonitor.h"
+
+#include <Logging.h>
+#include <OrthancException.h>
+
+#include <boost/lexical_cast.hpp>
+
+#include <algorithm>
+#include <cassert>
+
+
+namespace OrthancDatabases
+{
+  const unsigned int ConnectionPoolMonitor::BUCKETS[BUCKETS_COUNT] = {
+    1, 5, 10, 50, 100, 500, 1000, 5000
+  };
+
+  // A pool is grown if more than 1 acquisition out of SLOW_WAITS_RATIO had to block
+  static const uint64_t SLOW_WAITS_RATIO = 10;
+
+  // A pool is shrunk by one connection after this number of intervals without queueing
+  static const unsigned int SHRINK_ROUNDS = 3;
+
+
+  ConnectionPoolMonitor::Scope::Scope(ConnectionPoolMonitor& monitor) :
+    monitor_(monitor),
+    start_(boost::posix_time::microsec_clock::universal_time()),
+    acquired_(false)
+  {
+  }
+
+
+  ConnectionPoolMonitor::Scope::~Scope()
+  {
+    if (acquired_)
+    {
+      monitor_.SignalReleased();
+    }
+  }
+
+
+  void ConnectionPoolMonitor::Scope::SetAcquired()
+  {
+    if (acquired_)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+
+    const boost::posix_time::time_duration elapsed =
+      boost::posix_time::microsec_clock::universal_time() - start_;
+
+    acquired_ = true;
+    monitor_.SignalAcquired(static_cast<uint64_t>(std::max<int64_t>(0, elapsed.total_microseconds())));
+  }
+
+
+  void ConnectionPoolMonitor::SignalAcquired(uint64_t microseconds)
+  {
+    const uint64_t milliseconds = microseconds / 1000;
+
+    size_t bucket = 0;
+    while (bucket < BUCKETS_COUNT &&
+           milliseconds >= BUCKETS[bucket])
+    {
+      bucket++;
+    }
+
+    buckets_[bucket]++;
+    waits_++;
+    totalWaitMicroseconds_ += microseconds;
+
+    const size_t inUse = ++inUse_;
+    const size_t size = size_;
+    const size_t idle = (inUse >= size ? 0 : size - inUse);
+
+    boost::mutex::scoped_lock lock(sampleMutex_);
+    minIdle_ = std::min(minIdle_, idle);
+  }
+
+
+  ConnectionPoolMonitor::ConnectionPoolMonitor(const std::string& name,
+                                               size_t size) :
+    name_(name),
+    size_(size),
+    inUse_(0),
+    waits_(0),
+    timeouts_(0),
+    totalWaitMicroseconds_(0),
+    lastWaits_(0),
+    lastSlowWaits_(0),
+    lastTimeouts_(0),
+    lastTotalWaitMicroseconds_(0),
+    minIdle_(size)
+  {
+    for (size_t i = 0; i <= BUCKETS_COUNT; i++)
+    {
+      buckets_[i] = 0;
+    }
+  }
+
+
+  void ConnectionPoolMonitor::SetSize(size_t size)
+  {
+    size_ = size;
+  }
+
+
+  void ConnectionPoolMonitor::SignalTimeout()
+  {
+    timeouts_++;
+
+    boost::mutex::scoped_lock lock(sampleMutex_);
+    minIdle_ = 0;
+  }
+
+
+  void ConnectionPoolMonitor::SignalReleased()
+  {
+    assert(inUse_ > 0);
+    inUse_--;
+  }
+
+
+  void ConnectionPoolMonitor::GetSample(Sample& target)
+  {
+    boost::mutex::scoped_lock lock(sampleMutex_);
+
+    const uint64_t waits = waits_;
+    const uint64_t fastWaits = buckets_[0];
+    const uint64_t slowWaits = waits - std::min(waits, fastWaits);
+    const uint64_t timeouts = timeouts_;
+    const uint64_t totalWaitMicroseconds = totalWaitMicroseconds_;
+
+    target.waits = waits - lastWaits_;
+    target.slowWaits = slowWaits - std::min(slowWaits, lastSlowWaits_);
+    target.timeouts = timeouts - lastTimeouts_;
+    target.totalWaitMicroseconds = totalWaitMicroseconds - lastTotalWaitMicroseconds_;
+    target.minIdle = minIdle_;
+    target.size = size_;
+
+    lastWaits_ = waits;
+    lastSlowWaits_ = slowWaits;
+    lastTimeouts_ = timeouts;
+    lastTotalWaitMicroseconds_ = totalWaitMicroseconds;
+
+    const size_t inUse = inUse_;
+    minIdle_ = (inUse >= target.size ? 0 : target.size - inUse);
+  }
+
+
+  void ConnectionPoolMonitor::Publish(OrthancPluginContext* context) const
+  {
+#if defined(ORTHANC_PLUGINS_VERSION_IS_ABOVE)         // Macro introduced in Orthanc 1.3.1
+#  if ORTHANC_PLUGINS_VERSION_IS_ABOVE(1, 5, 4)
+    if (context == NULL)
+    {
+      return;
+    }
+
+    const std::string prefix = "mongodb_" + name_ + "_pool_";
+
+    const size_t size = size_;
+    const size_t inUse = inUse_;
+    const uint64_t waits = waits_;
+
+    OrthancPluginSetMetricsValue(context, (prefix + "size").c_str(),
+                                 static_cast<float>(size), OrthancPluginMetricsType_Default);
+    OrthancPluginSetMetricsValue(context, (prefix + "in_use").c_str(),
+                                 static_cast<float>(inUse), OrthancPluginMetricsType_Default);
+    OrthancPluginSetMetricsValue(context, (prefix + "idle").c_str(),
+                                 static_cast<float>(inUse >= size ? 0 : size - inUse), OrthancPluginMetricsType_Default);
+    OrthancPluginSetMetricsValue(context, (prefix + "waits_count").c_str(),
+                                 static_cast<float>(waits), OrthancPluginMetricsType_Default);
+    OrthancPluginSetMetricsValue(context, (prefix + "timeouts_count").c_str(),
+                                 static_cast<float>(timeouts_), OrthancPluginMetricsType_Default);
+    OrthancPluginSetMetricsValue(context, (prefix + "wait_total_ms").c_str(),
+                                 static_cast<float>(totalWaitMicroseconds_ / 1000), OrthancPluginMetricsType_Default);
+
+    // Cumulative histogram, in the spirit of the "le" buckets of Prometheus
+    uint64_t cumulated = 0;
+    for (size_t i = 0; i < BUCKETS_COUNT; i++)
+    {
+      cumulated += buckets_[i];
+      const std::string name = prefix + "wait_le_" + boost::lexical_cast<std::string>(BUCKETS[i]) + "ms";
+      OrthancPluginSetMetricsValue(context, name.c_str(), static_cast<float>(cumulated), OrthancPluginMetricsType_Default);
+    }
+#  endif
+#endif
+  }
+
+
+  void ConnectionPoolController::Worker()
+  {
+    for (;;)
+    {
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+
+        const boost::system_time timeout = boost::get_system_time() + boost::posix_time::seconds(intervalSeconds_);
+
+        while (!done_)
+        {
+          if (!wakeup_.timed_wait(lock, timeout))
+          {
+            break;
+          }
+        }
+
+        if (done_)
+        {
+          return;
+        }
+      }
+
+      for (std::list<Pool>::iterator it = pools_.begin(); it != pools_.end(); ++it)
+      {
+        try
+        {
+          Adjust(*it);
+          it->monitor->Publish(context_);
+        }
+        catch (Orthanc::OrthancException& e)
+        {
+          LOG(ERROR) << "Cannot adjust the size of the " << it->monitor->GetName()
+                     << " connection pool: " << e.What();
+        }
+        catch (std::runtime_error& e)
+        {
+          LOG(ERROR) << "Cannot adjust the size of the " << it->monitor->GetName()
+                     << " connection pool: " << e.what();
+        }
+      }
+    }
+  }
+
+
+  void ConnectionPoolController::Adjust(Pool& pool)
+  {
+    ConnectionPoolMonitor::Sample sample;
+    pool.monitor->GetSample(sample);
+
+    if (!pool.resizer ||
+        pool.minSize >= pool.maxSize)
+    {
+      return;  // Monitoring only
+    }
+
+    size_t target = sample.size;
+
+    if ((sample.timeouts > 0 ||
+         sample.slowWaits * SLOW_WAITS_RATIO > sample.waits) &&
+        sample.size < pool.maxSize)
+    {
+      // Requests have been queueing: grow by 25%, with at least one more connection
+      target = std::min(pool.maxSize, sample.size + std::max<size_t>(1, sample.size / 4));
+      pool.idleRounds = 0;
+    }
+    else if (sample.minIdle > 0 &&
+             sample.size > pool.minSize)
+    {
+      // Some connections have not been used at all during this interval
+      pool.idleRounds++;
+
+      if (pool.idleRounds >= SHRINK_ROUNDS)
+      {
+        target = sample.size - 1;
+        pool.idleRounds = 0;
+      }
+    }
+    else
+    {
+      pool.idleRounds = 0;
+    }
+
+    if (target != sample.size)
+    {
+      const size_t reached = pool.resizer(target);
+      pool.monitor->SetSize(reached);
+
+      if (reached != sample.size)
+      {
+        LOG(INFO) << "The " << pool.monitor->GetName() << " connection pool has been resized from "
+                  << sample.size << " to " << reached << " connection(s)";
+      }
+    }
+  }
+
+
+  ConnectionPoolController::ConnectionPoolController(OrthancPluginContext* context,
+                                                     unsigned int intervalSeconds) :
+    context_(context),
+    intervalSeconds_(intervalSeconds),
+    done_(false)
+  {
+    if (intervalSeconds == 0)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+  }
+
+
+  ConnectionPoolController::~ConnectionPoolController()
+  {
+    Stop();
+  }
+
+
+  void ConnectionPoolController::AddPool(ConnectionPoolMonitor& monitor,
+                                         Resizer resizer,
+                                         size_t minSize,
+                                         size_t maxSize)
+  {
+    if (thread_.joinable())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+
+    if (minSize == 0 ||
+        minSize > maxSize)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange,
+                                      "Invalid bounds for the " + monitor.GetName() + " connection pool");
+    }
+
+    Pool pool;
+    pool.monitor = &monitor;
+    pool.resizer = resizer;
+    pool.minSize = minSize;
+    pool.maxSize = maxSize;
+    pool.idleRounds = 0;
+    pools_.push_back(pool);
+  }
+
+
+  void ConnectionPoolController::Start()
+  {
+    if (thread_.joinable())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      done_ = false;
+    }
+
+    thread_ = boost::thread(&ConnectionPoolController::Worker, this);
+  }
+
+
+  void ConnectionPoolController::Stop()
+  {
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      done_ = true;
+    }
+
+    wakeup_.notify_all();
+
+    if (thread_.joinable())
+    {
+      thread_.join();
+    }
+  }
+}
@@ -0,0 +1,180 @@
+/**
+ * MongoDB Plugin - A plugin for Orthanc DICOM Server for storing DICOM data in MongoDB Database
+ * Copyright (C) 2017 - 2023  (Doc Cirrus GmbH)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include <orthanc/OrthancCPlugin.h>
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread.hpp>
+
+#include <atomic>
+#include <list>
+#include <string>
+
+
+namespace OrthancDatabases
+{
+  /**
+   * Telemetry about a pool of connections (the "DatabaseManager"
+   * objects of the index, or the "mongoc_client_pool_t" of the
+   * storage area): time spent waiting for a connection, number of
+   * connections in use, and number of waits that timed out.
+   *
+   * The metrics are published to Orthanc as
+   * "mongodb_<name>_pool_XXX", and are thus available from
+   * "/tools/metrics-prometheus".
+   **/
+  class ConnectionPoolMonitor : public boost::noncopyable
+  {
+  public:
+    // Upper bounds (in milliseconds) of the buckets of the wait-time histogram
+    static const size_t BUCKETS_COUNT = 8;
+    static const unsigned int BUCKETS[BUCKETS_COUNT];
+
+    // Statistics accumulated since the previous call to "GetSample()"
+    struct Sample
+    {
+      uint64_t  waits;
+      uint64_t  slowWaits;   // Waits that had to block
+      uint64_t  timeouts;
+      uint64_t  totalWaitMicroseconds;
+      size_t    minIdle;
+      size_t    size;
+    };
+
+    class Scope : public boost::noncopyable
+    {
+    private:
+      ConnectionPoolMonitor&    monitor_;
+      boost::posix_time::ptime  start_;
+      bool                      acquired_;
+
+    public:
+      explicit Scope(ConnectionPoolMonitor& monitor);
+
+      ~Scope();
+
+      // To be called once the connection is obtained
+      void SetAcquired();
+    };
+
+  private:
+    std::string            name_;
+    std::atomic<size_t>    size_;
+    std::atomic<size_t>    inUse_;
+    std::atomic<uint64_t>  buckets_[BUCKETS_COUNT + 1];
+    std::atomic<uint64_t>  waits_;
+    std::atomic<uint64_t>  timeouts_;
+    std::atomic<uint64_t>  totalWaitMicroseconds_;
+
+    boost::mutex  sampleMutex_;
+    uint64_t      lastWaits_;
+    uint64_t      lastSlowWaits_;
+    uint64_t      lastTimeouts_;
+    uint64_t      lastTotalWaitMicroseconds_;
+    size_t        minIdle_;
+
+  public:
+    ConnectionPoolMonitor(const std::string& name,
+                          size_t size);
+
+    const std::string& GetName() const
+    {
+      return name_;
+    }
+
+    size_t GetSize() const
+    {
+      return size_;
+    }
+
+    void SetSize(size_t size);
+
+    size_t GetInUse() const
+    {
+      return inUse_;
+    }
+
+    // A connection has been obtained after waiting for "microseconds"
+    void SignalAcquired(uint64_t microseconds);
+
+    void SignalTimeout();
+
+    void SignalReleased();
+
+    void GetSample(Sample& target);
+
+    void Publish(OrthancPluginContext* context) const;
+  };
+
+
+  /**
+   * Background thread publishing the metrics of a set of pools, and
+   * optionally growing or shrinking them according to the observed
+   * queueing.
+   **/
+  class ConnectionPoolController : public boost::noncopyable
+  {
+  public:
+    // Applies a new size to the pool, returns the size that was actually reached
+    typedef boost::function<size_t (size_t)>  Resizer;
+
+  private:
+    struct Pool
+    {
+      ConnectionPoolMonitor*  monitor;
+      Resizer                 resizer;
+      size_t                  minSize;
+      size_t                  maxSize;
+      unsigned int            idleRounds;
+    };
+
+    OrthancPluginContext*  context_;
+    unsigned int           intervalSeconds_;
+    std::list<Pool>        pools_;
+    bool                   done_;
+    boost::mutex           mutex_;
+    boost::condition_variable  wakeup_;
+    boost::thread          thread_;
+
+    void Worker();
+
+    void Adjust(Pool& pool);
+
+  public:
+    ConnectionPoolController(OrthancPluginContext* context,
+                             unsigned int intervalSeconds);
+
+    ~ConnectionPoolController();
+
+    // The monitor must outlive the controller. A pool with "minSize ==
+    // maxSize" or without resizer is only monitored.
+    void AddPool(ConnectionPoolMonitor& monitor,
+                 Resizer resizer,
+                 size_t minSize,
+                 size_t maxSize);
+
+    void Start();
+
+    void Stop();
+  };
+}
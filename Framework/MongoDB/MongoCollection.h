@@ -0,0 +1,166 @@
+/**
+ * MongoDB Plugin - A plugin for Orthanc DICOM Server for storing DICOM data in MongoDB Database
+ * Copyright (C) 2017 - 2023  (Doc Cirrus GmbH)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include "MongoWriteBuffer.h"
+
+#include <mongocxx/bulk_write.hpp>
+#include <mongocxx/client_session.hpp>
+#include <mongocxx/collection.hpp>
+
+#include <utility>
+
+namespace OrthancDatabases {
+    /**
+     * Collection bound to the session of a MongoDatabase: every operation goes through the session, and thus
+     * belongs to the transaction in progress if any. The method names mirror those of mongocxx::collection, so
+     * that the callers do not have to pass the session around.
+     *
+     * The pending writes of the connection are flushed before any operation, so that they are visible to it.
+     **/
+    class MongoCollection {
+    private:
+        mongocxx::collection collection_;
+        mongocxx::client_session *session_;  // can be null
+        MongoWriteBuffer *buffer_;  // can be null
+
+        void FlushPending() {
+            if (buffer_ != nullptr && buffer_->HasPending()) {
+                buffer_->Flush();
+            }
+        }
+
+    public:
+        MongoCollection(mongocxx::collection collection, mongocxx::client_session *session,
+                        MongoWriteBuffer *buffer = nullptr) :
+                collection_(std::move(collection)), session_(session), buffer_(buffer) {}
+
+        // escape hatch for the operations that must not be part of the transaction
+        mongocxx::collection &GetRaw() {
+            return collection_;
+        }
+
+        // queued in the write buffer of the connection until the next flush; "commutative" writes can be applied
+        // in any order with respect to the other writes of this collection (e.g. inserts of distinct documents)
+        void Defer(mongocxx::model::write operation, bool commutative) {
+            if (buffer_ != nullptr) {
+                buffer_->Append(std::string(collection_.name()), std::move(operation), commutative);
+            } else {
+                auto bulk = session_ ? collection_.create_bulk_write(*session_) : collection_.create_bulk_write();
+                bulk.append(operation);
+                bulk.execute();
+            }
+        }
+
+        template<typename... Args>
+        auto aggregate(Args &&... args) {
+            FlushPending();
+            return session_ ? collection_.aggregate(*session_, std::forward<Args>(args)...)
+                            : collection_.aggregate(std::forward<Args>(args)...);
+        }
+
+        template<typename... Args>
+        auto count_documents(Args &&... args) {
+            FlushPending();
+            return session_ ? collection_.count_documents(*session_, std::forward<Args>(args)...)
+                            : collection_.count_documents(std::forward<Args>(args)...);
+        }
+
+        template<typename... Args>
+        auto create_bulk_write(Args &&... args) {
+            FlushPending();
+            return session_ ? collection_.create_bulk_write(*session_, std::forward<Args>(args)...)
+                            : collection_.create_bulk_write(std::forward<Args>(args)...);
+        }
+
+        template<typename... Args>
+        auto delete_many(Args &&... args) {
+            FlushPending();
+            return session_ ? collection_.delete_many(*session_, std::forward<Args>(args)...)
+                            : collection_.delete_many(std::forward<Args>(args)...);
+        }
+
+        template<typename... Args>
+        auto delete_one(Args &&... args) {
+            FlushPending();
+            return session_ ? collection_.delete_one(*session_, std::forward<Args>(args)...)
+                            : collection_.delete_one(std::forward<Args>(args)...);
+        }
+
+        template<typename... Args>
+        auto find(Args &&... args) {
+            FlushPending();
+            return session_ ? collection_.find(*session_, std::forward<Args>(args)...)
+                            : collection_.find(std::forward<Args>(args)...);
+        }
+
+        template<typename... Args>
+        auto find_one(Args &&... args) {
+            FlushPending();
+            return session_ ? collection_.find_one(*session_, std::forward<Args>(args)...)
+                            : collection_.find_one(std::forward<Args>(args)...);
+        }
+
+        template<typename... Args>
+        auto find_one_and_update(Args &&... args) {
+            FlushPending();
+            return session_ ? collection_.find_one_and_update(*session_, std::forward<Args>(args)...)
+                            : collection_.find_one_and_update(std::forward<Args>(args)...);
+        }
+
+        template<typename... Args>
+        auto insert_many(Args &&... args) {
+            FlushPending();
+            return session_ ? collection_.insert_many(*session_, std::forward<Args>(args)...)
+                            : collection_.insert_many(std::forward<Args>(args)...);
+        }
+
+        template<typename... Args>
+        auto insert_one(Args &&... args) {
+            FlushPending();
+            return session_ ? collection_.insert_one(*session_, std::forward<Args>(args)...)
+                            : collection_.insert_one(std::forward<Args>(args)...);
+        }
+
+        template<typename... Args>
+        auto update_many(Args &&... args) {
+            FlushPending();
+            return session_ ? collection_.update_many(*session_, std::forward<Args>(args)...)
+                            : collection_.update_many(std::forward<Args>(args)...);
+        }
+
+        template<typename... Args>
+        auto update_one(Args &&... args) {
+            FlushPending();
+            return session_ ? collection_.update_one(*session_, std::forward<Args>(args)...)
+                            : collection_.update_one(std::forward<Args>(args)...);
+        }
+
+        // indexes cannot be managed inside a transaction
+        template<typename... Args>
+        auto create_index(Args &&... args) {
+            return collection_.create_index(std::forward<Args>(args)...);
+        }
+
+        auto indexes() {
+            return collection_.indexes();
+        }
+    };
+}
@@ -22,21 +22,88 @@
 
 #include <OrthancException.h>
 
+#include <mongocxx/options/create_collection.hpp>
+#include <mongocxx/options/transaction.hpp>
+#include <mongocxx/pipeline.hpp>
+#include <mongocxx/read_concern.hpp>
+#include <mongocxx/read_preference.hpp>
+#include <mongocxx/write_concern.hpp>
+
+#include <boost/lexical_cast.hpp>
+#include <boost/thread/mutex.hpp>
+#include <map>
+#include <vector>
+
 namespace OrthancDatabases {
     namespace {
+        // range of ids reserved by this process, shared by all the connections
+        struct SequenceBlock {
+            int64_t next = 1;
+            int64_t last = 0;
+
+            // blocks reserved by concurrent refills, used up once the current one is exhausted
+            std::vector<std::pair<int64_t, int64_t> > spare;
+        };
+
+        boost::mutex sequenceBlocksMutex_;
+        std::map<std::string, SequenceBlock> sequenceBlocks_;  // indexed by "database/sequence"
+
+        // sends the writes deferred by a transaction, with the error codes of Orthanc
+        void CommitWrites(MongoWriteBuffer &buffer) {
+            try {
+                buffer.Commit();
+            } catch (const mongocxx::operation_exception &e) {
+                const Orthanc::ErrorCode code = MongoDatabase::GetErrorCode(e);
+                if (code == Orthanc::ErrorCode_DatabaseCannotSerialize) {
+                    throw Orthanc::OrthancException(code);
+                } else {
+                    throw Orthanc::OrthancException(code, "Cannot write to MongoDB: " + std::string(e.what()));
+                }
+            }
+        }
+
         class DummyTransaction : public ITransaction {
+        private:
+            MongoWriteBuffer *buffer_;  // null for read-only transactions
+            MongoGroupCommit *groupCommit_;  // can be null
+            mongocxx::database database_;
 
         public:
-            explicit DummyTransaction() {}
+            explicit DummyTransaction(MongoWriteBuffer *buffer) : buffer_(buffer), groupCommit_(nullptr) {}
+
+            DummyTransaction(MongoWriteBuffer *buffer, MongoGroupCommit *groupCommit,
+                             const mongocxx::database &database) :
+                    buffer_(buffer), groupCommit_(groupCommit), database_(database) {}
+
+            virtual ~DummyTransaction() {
+                // also after a failed commit, whose immediate writes are undone by the rollback hooks
+                if (buffer_ != nullptr) {
+                    buffer_->Discard();
+                }
+            }
 
             virtual bool IsImplicit() const ORTHANC_OVERRIDE {
                 return false;
             }
 
             virtual void Rollback() override {
+                if (buffer_ != nullptr) {
+                    buffer_->Discard();
+                }
             }
 
             virtual void Commit() override {
+                if (buffer_ == nullptr) {
+                    return;
+                } else if (groupCommit_ != nullptr) {
+                    MongoWriteBuffer::Batch batch;
+                    buffer_->Extract(batch);
+                    groupCommit_->Commit(database_, batch);
+                } else {
+                    CommitWrites(*buffer_);
+                }
+
+                buffer_->RunCommitHooks();
             }
 
             virtual bool DoesTableExist(const std::string &name) override {
@@ -47,36 +114,363 @@ namespace OrthancDatabases {
                 return false;
             }
         };
+
+        class MongoTransaction : public ITransaction {
+        private:
+            mongocxx::client_session &session_;
+            MongoWriteBuffer &buffer_;
+            bool active_;
+
+        public:
+            MongoTransaction(mongocxx::client_session &session, MongoWriteBuffer &buffer,
+                             const mongocxx::options::transaction &options) :
+                    session_(session), buffer_(buffer), active_(false) {
+                session_.start_transaction(options);
+                buffer_.Enable();
+                active_ = true;
+            }
+
+            virtual ~MongoTransaction() {
+                buffer_.Discard();
+
+                if (active_) {
+                    try {
+                        session_.abort_transaction();
+                    } catch (const mongocxx::operation_exception &e) {
+                        LOG(WARNING) << "Cannot abort a MongoDB transaction: " << e.what();
+                    }
+                }
+            }
+
+            virtual bool IsImplicit() const ORTHANC_OVERRIDE {
+                return false;
+            }
+
+            virtual void Rollback() override {
+                buffer_.Discard();
+
+                if (active_) {
+                    active_ = false;
+
+                    try {
+                        session_.abort_transaction();
+                    } catch (const mongocxx::operation_exception &e) {
+                        // the server may have aborted the transaction by itself, e.g. after a write conflict
+                        LOG(WARNING) << "Cannot abort a MongoDB transaction: " << e.what();
+                    }
+                }
+            }
+
+            virtual void Commit() override {
+                if (!active_) {
+                    throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+                }
+
+                // a failure of the deferred writes is reported like any other error of the transaction, which is then
+                // aborted by Rollback() or by the destructor
+                CommitWrites(buffer_);
+
+                for (unsigned int retry = 0; ; retry++) {
+                    try {
+                        session_.commit_transaction();
+                        active_ = false;
+                        buffer_.RunCommitHooks();
+                        return;
+                    } catch (const mongocxx::operation_exception &e) {
+                        // the commit itself can be retried as long as its outcome is unknown
+                        if (e.has_error_label("UnknownTransactionCommitResult") && retry < 3) {
+                            continue;
+                        }
+
+                        const Orthanc::ErrorCode code = MongoDatabase::GetErrorCode(e);
+                        if (code == Orthanc::ErrorCode_DatabaseCannotSerialize) {
+                            throw Orthanc::OrthancException(code);
+                        } else {
+                            throw Orthanc::OrthancException(code, "Cannot commit a MongoDB transaction: " +
+                                                                  std::string(e.what()));
+                        }
+                    }
+                }
+            }
+
+            virtual bool DoesTableExist(const std::string &name) override {
+                return true;
+            }
+
+            virtual bool DoesTriggerExist(const std::string &name) override {
+                return false;
+            }
+        };
+
+        mongocxx::options::transaction CreateTransactionOptions(const MongoDatabase::Options &options) {
+            mongocxx::read_concern readConcern;
+            if (options.readConcern == "local") {
+                readConcern.acknowledge_level(mongocxx::read_concern::level::k_local);
+            } else if (options.readConcern == "majority") {
+                readConcern.acknowledge_level(mongocxx::read_concern::level::k_majority);
+            } else if (options.readConcern == "snapshot") {
+                readConcern.acknowledge_level(mongocxx::read_concern::level::k_snapshot);
+            } else {
+                throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange,
+                                                "Unsupported read concern for transactions: " + options.readConcern);
+            }
+
+            mongocxx::write_concern writeConcern;
+            if (options.writeConcern == "majority") {
+                writeConcern.acknowledge_level(mongocxx::write_concern::level::k_majority);
+            } else {
+                try {
+                    writeConcern.nodes(boost::lexical_cast<int32_t>(options.writeConcern));
+                } catch (boost::bad_lexical_cast &) {
+                    throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange,
+                                                    "Unsupported write concern for transactions: " +
+                                                    options.writeConcern);
+                }
+            }
+
+            mongocxx::read_preference readPreference;
+            readPreference.mode(mongocxx::read_preference::read_mode::k_primary);
+
+            mongocxx::options::transaction result;
+            result.read_concern(readConcern);
+            result.write_concern(writeConcern);
+            result.read_preference(readPreference);
+            return result;
+        }
+    }
+
+    bool MongoDatabase::IsTransientError(const mongocxx::operation_exception &e) {
+        // 112 is WriteConflict, 251 is NoSuchTransaction (the server has already aborted the transaction)
+        return (e.has_error_label("TransientTransactionError") ||
+                e.code().value() == 112 ||
+                e.code().value() == 251);
+    }
+
+    Orthanc::ErrorCode MongoDatabase::GetErrorCode(const mongocxx::operation_exception &e) {
+        return IsTransientError(e) ? Orthanc::ErrorCode_DatabaseCannotSerialize : Orthanc::ErrorCode_Database;
     }
 
     ITransaction *MongoDatabase::CreateTransaction(TransactionType type) {
-        return new DummyTransaction();
+        transactionState_.reset();
+
+        // the read-only and implicit transactions of Orthanc don't need isolation from the concurrent writers
+        if (session_ && type == TransactionType_ReadWrite) {
+            return new MongoTransaction(*session_, writeBuffer_, CreateTransactionOptions(options_));
+        } else if (type == TransactionType_ReadWrite) {
+            // without server transactions, the writes are still batched until the commit
+            writeBuffer_.Enable();
+            return new DummyTransaction(&writeBuffer_, groupCommit_.get(), GetObject());
+        } else {
+            writeBuffer_.Discard();
+            return new DummyTransaction(nullptr);
+        }
+    }
+
+    int64_t MongoDatabase::ReserveSequence(const std::string &sequence, int64_t count) {
+        // outside of the session: the ids must stay reserved even if the transaction is rolled back, and the
+        // counter is too hot to become part of the write set of every transaction
+        auto collection = GetCollection("Sequences").GetRaw();
+
+        // the counter holds the last id ever handed out, so that it stays compatible with one-by-one allocation
+        mongocxx::options::find_one_and_update options;
+        options.return_document(mongocxx::options::return_document::k_after);
+        options.upsert(true);
+
+        auto seqDocument = collection.find_one_and_update(
+                make_document(kvp("name", sequence)),
+                make_document(kvp("$inc", make_document(kvp("i", count)))),
+                options
+        );
+
+        if (!seqDocument) {
+            throw Orthanc::OrthancException(Orthanc::ErrorCode_Database, "Cannot allocate ids for " + sequence);
+        }
+
+        return seqDocument->view()["i"].get_int64().value;
+    }
+
+    int64_t MongoDatabase::GetNextSequence(const std::string &sequence, bool strict) {
+        const bool ordered = (strict &&
+                              (sequence == "Changes" || sequence == "ExportedResources"));
+
+        if (options_.sequenceBlockSize <= 1 || ordered) {
+            return ReserveSequence(sequence, 1);
+        }
+
+        const std::string key = dbname_ + "/" + sequence;
+
+        {
+            boost::mutex::scoped_lock lock(sequenceBlocksMutex_);
+            SequenceBlock &block = sequenceBlocks_[key];
+
+            if (block.next <= block.last) {
+                return block.next++;
+            }
+
+            if (!block.spare.empty()) {
+                block.next = block.spare.back().first;
+                block.last = block.spare.back().second;
+                block.spare.pop_back();
+                return block.next++;
+            }
+        }
+
+        // the round trip is made without the lock, so that the other sequences and the other connections do not
+        // wait for it. The ids left unused in a block when the process stops are simply lost.
+        const int64_t count = static_cast<int64_t>(options_.sequenceBlockSize);
+        const int64_t last = ReserveSequence(sequence, count);
+        const int64_t first = last - count + 1;
+
+        boost::mutex::scoped_lock lock(sequenceBlocksMutex_);
+        SequenceBlock &block = sequenceBlocks_[key];
+
+        if (block.next <= block.last) {
+            // another connection has refilled the block meanwhile
+            if (count > 1) {
+                block.spare.push_back(std::make_pair(first + 1, last));
+            }
+        } else {
+            block.next = first + 1;
+            block.last = last;
+        }
+
+        return first;
     }
 
     // factory related
+    void MongoDatabase::PrepareLogCollection(const std::string &log) {
+        const Options::Retention &retention = options_.GetRetention(log);
+        auto database = GetObject();
+
+        if (retention.mode == Options::Retention_Capped) {
+            if (retention.limit <= 0) {
+                throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange,
+                                                "The capped retention of " + log + " needs a size in MB");
+            }
+
+            const int64_t size = retention.limit * 1024 * 1024;
+
+            auto existing = database.list_collections(make_document(kvp("name", log)));
+            auto collection = existing.begin();
+
+            if (collection == existing.end()) {
+                mongocxx::options::create_collection options;
+                options.capped(true).size(size);
+
+                try {
+                    database.create_collection(log, options);
+                } catch (const mongocxx::operation_exception &e) {
+                    // NamespaceExists (48): a concurrent write has created the collection meanwhile
+                    if (e.code().value() != 48) {
+                        throw;
+                    }
+
+                    database.run_command(make_document(kvp("convertToCapped", log), kvp("size", size)));
+                }
+            } else {
+                auto capped = (*collection)["options"]["capped"];
+
+                if (!capped || !capped.get_bool().value) {
+                    LOG(WARNING) << "Converting the " << log << " collection into a capped collection";
+                    database.run_command(make_document(kvp("convertToCapped", log), kvp("size", size)));
+                }
+            }
+        }
+
+        GetCollection(database, log).create_index(make_document(kvp("id", 1)));
+
+        if (retention.mode == Options::Retention_TTL) {
+            if (retention.limit <= 0) {
+                throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange,
+                                                "The TTL retention of " + log + " needs a number of seconds");
+            }
+
+            auto keys = make_document(kvp("createdAt", 1));
+            auto ttl = make_document(kvp("expireAfterSeconds", retention.limit));
+
+            try {
+                GetCollection(database, log).create_index(keys.view(), ttl.view());
+            } catch (const mongocxx::operation_exception &e) {
+                // IndexOptionsConflict (85): the delay has changed
+                if (e.code().value() != 85) {
+                    throw;
+                }
+
+                database.run_command(make_document(
+                        kvp("collMod", log),
+                        kvp("index", make_document(kvp("keyPattern", keys.view()),
+                                                   kvp("expireAfterSeconds", retention.limit)))
+                ));
+            }
+
+            // the entries logged before the TTL was enabled start expiring now
+            mongocxx::pipeline stamp;
+            stamp.append_stage(make_document(kvp("$set", make_document(kvp("createdAt", "$$NOW")))));
+
+            GetCollection(database, log).GetRaw().update_many(
+                    make_document(kvp("createdAt", make_document(kvp("$exists", false)))), stamp
+            );
+        } else {
+            try {
+                GetCollection(database, log).indexes().drop_one("createdAt_1");
+            } catch (const mongocxx::operation_exception &e) {
+                // IndexNotFound (27) or NamespaceNotFound (26): no TTL to remove
+                if (e.code().value() != 27 && e.code().value() != 26) {
+                    throw;
+                }
+            }
+        }
+    }
+
+    void MongoDatabase::ResetLogCollection(const std::string &log) {
+        // the pending writes go first, so that none of them lands in the new collection
+        writeBuffer_.Flush();
+
+        GetCollection(log).GetRaw().drop();
+        PrepareLogCollection(log);
+    }
+
     class MongoDatabase::Factory : public IDatabaseFactory {
     private:
         std::string url_;
-        int chunkSize_;
+        Options options_;
+        std::shared_ptr<MongoGroupCommit> groupCommit_;
+        std::shared_ptr<MongoExecutor> executor_;
 
     public:
-        Factory(const std::string &url, const int &chunkSize) : url_(url), chunkSize_(chunkSize) {}
+        Factory(const std::string &url, const Options &options,
+                const std::shared_ptr<MongoGroupCommit> &groupCommit,
+                const std::shared_ptr<MongoExecutor> &executor) :
+                url_(url), options_(options), groupCommit_(groupCommit), executor_(executor) {}
 
         virtual IDatabase *Open() override {
             std::unique_ptr<MongoDatabase> db(new MongoDatabase);
-            db->SetChunkSize(chunkSize_);
+            db->SetOptions(options_);
+            db->SetGroupCommit(groupCommit_);
+            db->SetExecutor(executor_);
             db->Open(url_);
 
             return db.release();
         }
     };
 
+    IDatabaseFactory *MongoDatabase::CreateDatabaseFactory(const std::string &url, const Options &options,
+                                                           const std::shared_ptr<MongoGroupCommit> &groupCommit,
+                                                           const std::shared_ptr<MongoExecutor> &executor) {
+        return new Factory(url, options, groupCommit, executor);
+    }
+
     IDatabaseFactory *MongoDatabase::CreateDatabaseFactory(const std::string &url, const int &chunkSize) {
-        return new Factory(url, chunkSize);
+        Options options;
+        options.chunkSize = chunkSize;
+        return new Factory(url, options, nullptr, nullptr);
     }
 
     MongoDatabase *MongoDatabase::CreateDatabaseConnection(const std::string &url, const int &chunkSize) {
-        Factory factory(url, chunkSize);
+        Options options;
+        options.chunkSize = chunkSize;
+
+        Factory factory(url, options, nullptr, nullptr);
         return dynamic_cast<MongoDatabase *>(factory.Open());
     }
 }
@@ -20,12 +20,20 @@
 #pragma once
 
 #include <mongocxx/client.hpp>
+#include <mongocxx/client_session.hpp>
 #include <mongocxx/instance.hpp>
 #include <mongocxx/uri.hpp>
 #include <mongocxx/pool.hpp>
+#include <mongocxx/exception/operation_exception.hpp>
 
+#include "MongoCollection.h"
+#include "MongoExecutor.h"
+#include "MongoGroupCommit.h"
+#include "MongoWriteBuffer.h"
 #include "../Common/IDatabase.h"
 #include "../Common/IDatabaseFactory.h"
+#include <Compatibility.h>  // For std::unique_ptr<>
+#include <Enumerations.h>
 #include <Logging.h>
 
 // mongocxx related
@@ -36,57 +44,164 @@ namespace OrthancDatabases {
     static mongocxx::instance &inst = mongocxx::instance::current();
 
     class MongoDatabase : public IDatabase {
+    public:
+        // settings shared by all the connections of the index, see "PLUGIN_CONFIGURATION.md"
+        struct Options {
+            // how the "Changes" and "ExportedResources" logs are kept from growing forever
+            enum RetentionMode {
+                Retention_None,
+                Retention_Capped,  // capped collection of "limit" MB
+                Retention_TTL,     // entries expire "limit" seconds after their creation
+                Retention_Window   // only the last "limit" entries are kept
+            };
+
+            struct Retention {
+                RetentionMode mode = Retention_None;
+                int64_t limit = 0;
+            };
+
+            int chunkSize = 261120;
+
+            // "sequenceBlockSize" ids are reserved at once in the "Sequences" collection, and handed out from
+            // memory. If "strictSequences" is set, the ids of "Changes" and "ExportedResources" are still
+            // allocated one by one, so that they keep increasing even if several Orthanc share the database.
+            unsigned int sequenceBlockSize = 1;
+            bool strictSequences = true;
+
+            // read-write transactions of Orthanc are mapped onto MongoDB transactions (replica sets only)
+            bool enableTransactions = false;
+            std::string readConcern = "snapshot";
+            std::string writeConcern = "majority";
+
+            // milliseconds during which the commits of concurrent transactions are gathered, 0 to disable
+            unsigned int groupCommitWindow = 0;
+
+            // threads sending the bulk writes of a transaction on different collections concurrently, 0 to disable
+            unsigned int parallelWrites = 4;
+
+            Retention changesRetention;
+            Retention exportedResourcesRetention;
+
+            // the resources embed their main and identifier tags, indexed by wildcard indexes
+            bool embeddedTags = false;
+
+            const Retention &GetRetention(const std::string &log) const {
+                return (log == "Changes" ? changesRetention : exportedResourcesRetention);
+            }
+        };
+
+        // data attached by the index to the transaction in progress, see SetTransactionState()
+        class ITransactionState {
+        public:
+            virtual ~ITransactionState() {}
+        };
+
     private:
         class Factory;
 
-        int chunkSize_;
+        Options options_;
         std::string dbname_;
-        mongocxx::pool* pool_;
+        std::shared_ptr<MongoGroupCommit> groupCommit_;  // shared by the connections of the index, can be null
+        std::shared_ptr<MongoExecutor> executor_;  // same
 
-    public:
-        ~MongoDatabase() {
+        // destroyed in reverse order: the session before the client, the client before the pool
+        std::unique_ptr<mongocxx::pool> pool_;
+        std::unique_ptr<mongocxx::pool::entry> client_;
+        std::unique_ptr<mongocxx::client_session> session_;
+        MongoWriteBuffer writeBuffer_;
+        std::unique_ptr<ITransactionState> transactionState_;
 
-        }
+        // reserves "count" ids at once, returns the last one
+        int64_t ReserveSequence(const std::string &sequence, int64_t count);
 
+    public:
+        // the connection keeps one client of its pool, and one session on it, for its whole lifetime
         void Open(const std::string &url) {
             auto const uri = mongocxx::uri{url};
 
             dbname_ = uri.database();
-            mongocxx::pool *p = new mongocxx::pool(uri);
-            
-            SetPool(p);
+            pool_.reset(new mongocxx::pool(uri));
+            client_.reset(new mongocxx::pool::entry(pool_->acquire()));
+
+            if (options_.enableTransactions) {
+                session_.reset(new mongocxx::client_session((*client_)->start_session()));
+            }
+
+            writeBuffer_.SetTarget((**client_)[dbname_], session_.get());
+
+            if (executor_) {
+                writeBuffer_.SetExecutor(executor_.get(), *pool_, dbname_);
+            }
+        }
+
+        void SetOptions(const Options &options) {
+            options_ = options;
+
+            if (options_.sequenceBlockSize == 0) {
+                options_.sequenceBlockSize = 1;
+            }
+        }
+
+        const Options &GetOptions() const {
+            return options_;
         }
 
-        void SetChunkSize(const int &chunkSize) {
-            chunkSize_ = chunkSize;
+        void SetGroupCommit(const std::shared_ptr<MongoGroupCommit> &groupCommit) {
+            groupCommit_ = groupCommit;
         }
 
-        void SetPool(mongocxx::pool *pool) {
-            pool_ = pool;
+        void SetExecutor(const std::shared_ptr<MongoExecutor> &executor) {
+            executor_ = executor;
         }
 
         mongocxx::pool &GetPool() const {
             return *pool_;
         }
 
+        // another client of the pool of this connection, outside of its session
         mongocxx::pool::entry GetPoolEntry() const {
             return GetPool().acquire();
         }
 
+        // null if transactions are disabled
+        mongocxx::client_session *GetSession() const {
+            return session_.get();
+        }
+
         mongocxx::database GetObject() const {
-            auto entry = GetPoolEntry();
-            return (*entry)[dbname_];
+            return (**client_)[dbname_];
         }
 
-        mongocxx::collection GetCollection(const std::string &name) const {
-            auto database = GetObject();
-            return database[name];
+        MongoCollection GetCollection(const std::string &name) {
+            return MongoCollection(GetObject()[name], session_.get(), &writeBuffer_);
+        }
+
+        MongoCollection GetCollection(const mongocxx::database &database, const std::string &name) {
+            return MongoCollection(database[name], session_.get(), &writeBuffer_);
+        }
+
+        // the writes deferred by the current transaction, see MongoCollection::Defer()
+        MongoWriteBuffer &GetWriteBuffer() {
+            return writeBuffer_;
         }
 
-        mongocxx::collection GetCollection(const mongocxx::database &database, const std::string &name) const {
-            return database[name];
+        // Takes the ownership of "state" (can be null), which is dropped when the next transaction of this
+        // connection begins. A connection only runs one transaction at a time, so no locking is needed.
+        void SetTransactionState(ITransactionState *state) {
+            transactionState_.reset(state);
         }
 
+        // null if none has been set since the current transaction began
+        ITransactionState *GetTransactionState() const {
+            return transactionState_.get();
+        }
+
+        // WriteConflict and transient transaction errors: the whole transaction can be retried
+        static bool IsTransientError(const mongocxx::operation_exception &e);
+
+        // maps the errors of the driver to the error codes of Orthanc
+        static Orthanc::ErrorCode GetErrorCode(const mongocxx::operation_exception &e);
+
         // database related tasks
         bool IsMaster() const {
             auto database = GetObject();
@@ -95,25 +210,63 @@ namespace OrthancDatabases {
             return isMasterDocument.view()["ismaster"].get_bool().value;
         }
 
-        void CreateIndices() {
+        // transactions require a replica set or a sharded cluster
+        bool SupportsTransactions() const {
+            auto database = GetObject();
+            auto helloDocument = database.run_command(make_document(kvp("isMaster", 1)));
+            auto view = helloDocument.view();
+
+            return (view["setName"] ||
+                    (view["msg"] && view["msg"].type() == bsoncxx::type::k_utf8 &&
+                     view["msg"].get_string().value == bsoncxx::stdx::string_view("isdbgrid")));
+        }
+
+        // the public ids are unique, which makes concurrent upserts of the same resource safe. The index is sparse,
+        // as the resources waiting for the purge have no public id anymore (see MongoDBResourcePurger).
+        static void CreateUniquePublicIdIndex(mongocxx::collection resources) {
+            auto keys = make_document(kvp("publicId", 1));
+            auto unique = make_document(kvp("unique", true), kvp("sparse", true));
+
+            try {
+                resources.create_index(keys.view(), unique.view());
+            } catch (const mongocxx::operation_exception &e) {
+                // IndexOptionsConflict (85) or IndexKeySpecsConflict (86): older releases created a plain index, or a
+                // unique index that is not sparse
+                if (e.code().value() != 85 && e.code().value() != 86) {
+                    throw;
+                }
+
+                LOG(WARNING) << "Replacing the index on Resources.publicId by a sparse unique index";
+                resources.indexes().drop_one("publicId_1");
+
+                try {
+                    resources.create_index(keys.view(), unique.view());
+                } catch (const mongocxx::operation_exception &e) {
+                    LOG(ERROR) << "Cannot create a unique index on Resources.publicId, the database contains "
+                               << "duplicated resources: " << e.what();
+                    resources.create_index(keys.view());
+                }
+            }
+        }
+
+        // the indexes needed by the ingest itself
+        void CreateEssentialIndices() {
             auto database = GetObject();
 
             GetCollection(database, "fs.files").create_index(make_document(kvp("filename", 1)));
 
             GetCollection(database, "Resources").create_index(make_document(kvp("parentId", 1)));
-            GetCollection(database, "Resources").create_index(make_document(kvp("publicId", 1)));
+            CreateUniquePublicIdIndex(GetCollection(database, "Resources").GetRaw());
             GetCollection(database, "Resources").create_index(make_document(kvp("resourceType", 1)));
             GetCollection(database, "Resources").create_index(make_document(kvp("internalId", 1)));
-            GetCollection(database, "PatientRecyclingOrder").create_index(make_document(kvp("patientId", 1)));
-            GetCollection(database, "MainDicomTags").create_index(make_document(kvp("id", 1)));
-            GetCollection(database, "MainDicomTags").create_index(
-                    make_document(kvp("tagGroup", 1), kvp("tagElement", 1), kvp("value", 1))
+            GetCollection(database, "Resources").create_index(make_document(kvp("0", 1)));
+            GetCollection(database, "Resources").create_index(make_document(kvp("1", 1)));
+            GetCollection(database, "Resources").create_index(make_document(kvp("2", 1)));
+            GetCollection(database, "Resources").create_index(
+                    make_document(kvp("deleted.internalId", 1)), make_document(kvp("sparse", true))
             );
+            GetCollection(database, "MainDicomTags").create_index(make_document(kvp("id", 1)));
             GetCollection(database, "DicomIdentifiers").create_index(make_document(kvp("id", 1)));
-            GetCollection(database, "DicomIdentifiers").create_index(
-                    make_document(kvp("tagGroup", 1), kvp("tagElement", 1), kvp("value", 1))
-            );
-            GetCollection(database, "Changes").create_index(make_document(kvp("internalId", 1)));
             GetCollection(database, "AttachedFiles").create_index(make_document(kvp("id", 1)));
             GetCollection(database, "Metadata").create_index(make_document(kvp("id", 1)));
             GetCollection(database, "GlobalProperties").create_index(make_document(kvp("property", 1)));
@@ -122,33 +275,89 @@ namespace OrthancDatabases {
             );
         }
 
-        int64_t GetNextSequence(const std::string &sequence) const {
-            int64_t num = 1;
-            auto collection = GetCollection("Sequences");
+        // the indexes only used by lookups, deletions and recycling, which can be built after a bulk load
+        void CreateSecondaryIndices() {
+            auto database = GetObject();
 
-            mongocxx::options::find_one_and_update options;
-            options.return_document(mongocxx::options::return_document::k_after);
-            auto seqDocument = collection.find_one_and_update(
-                    make_document(kvp("name", sequence)),
-                    make_document(kvp("$inc", make_document(kvp("i", int64_t(1))))),
-                    options
+            // "oldest unprotected patient", only the unprotected patients have a stamp
+            GetCollection(database, "Resources").create_index(
+                    make_document(kvp("recyclingStamp", 1), kvp("internalId", 1)),
+                    make_document(kvp("partialFilterExpression", make_document(
+                            kvp("recyclingStamp", make_document(kvp("$exists", true)))
+                    )))
+            );
+            // the id makes the index cover the lookups of MongoDBLookupExecutor
+            GetCollection(database, "MainDicomTags").create_index(
+                    make_document(kvp("tagGroup", 1), kvp("tagElement", 1), kvp("value", 1), kvp("id", 1))
+            );
+            GetCollection(database, "DicomIdentifiers").create_index(
+                    make_document(kvp("tagGroup", 1), kvp("tagElement", 1), kvp("value", 1), kvp("id", 1))
             );
 
-            if (seqDocument) {
-                bsoncxx::document::element element = seqDocument->view()["i"];
-                num = element.get_int64().value;
-            } else {
-                collection.insert_one(make_document(
-                        kvp("name", sequence),
-                        kvp("i", int64_t(1))
-                ));
+            // superseded by the indexes above
+            DropIndex("MainDicomTags", "tagGroup_1_tagElement_1_value_1");
+            DropIndex("DicomIdentifiers", "tagGroup_1_tagElement_1_value_1");
+            GetCollection(database, "Changes").create_index(make_document(kvp("internalId", 1)));
+
+            if (options_.embeddedTags) {
+                GetCollection(database, "Resources").create_index(make_document(kvp("tags.$**", 1)));
+                GetCollection(database, "Resources").create_index(make_document(kvp("identifiers.$**", 1)));
             }
+        }
+
+        void DropSecondaryIndices() {
+            static const char *const indexes[][2] = {
+                    {"Resources",             "recyclingStamp_1_internalId_1"},
+                    {"MainDicomTags",         "tagGroup_1_tagElement_1_value_1_id_1"},
+                    {"DicomIdentifiers",      "tagGroup_1_tagElement_1_value_1_id_1"},
+                    {"Changes",               "internalId_1"},
+                    {"Resources",             "tags.$**_1"},
+                    {"Resources",             "identifiers.$**_1"}
+            };
 
-            return num;
+            for (const auto &index: indexes) {
+                DropIndex(index[0], index[1]);
+            }
         }
 
+        // does nothing if the index does not exist
+        void DropIndex(const std::string &collection, const std::string &name) {
+            try {
+                GetCollection(collection).indexes().drop_one(name);
+            } catch (const mongocxx::operation_exception &e) {
+                // IndexNotFound (27) or NamespaceNotFound (26): nothing to drop
+                if (e.code().value() != 27 && e.code().value() != 26) {
+                    throw;
+                }
+            }
+        }
+
+        void CreateIndices() {
+            CreateEssentialIndices();
+            CreateSecondaryIndices();
+        }
+
+        // Creates the "Changes" or "ExportedResources" collection, with its index on "id" and the storage that its
+        // retention mode needs (capped collection, TTL index). Existing collections are converted.
+        void PrepareLogCollection(const std::string &log);
+
+        // empties a log by dropping and recreating it, instead of deleting its entries one by one
+        void ResetLogCollection(const std::string &log);
+
+        int64_t GetNextSequence(const std::string &sequence) {
+            return GetNextSequence(sequence, options_.strictSequences);
+        }
+
+        // "strict" overrides the "strictSequences" option, e.g. during a bulk load
+        int64_t GetNextSequence(const std::string &sequence, bool strict);
+
         virtual ITransaction *CreateTransaction(TransactionType type) override;
 
+        // "groupCommit" and "executor" (both can be null) are shared by all the connections of the factories given
+        // them
+        static IDatabaseFactory* CreateDatabaseFactory(const std::string &url, const Options &options,
+                                                       const std::shared_ptr<MongoGroupCommit> &groupCommit,
+                                                       const std::shared_ptr<MongoExecutor> &executor);
         static IDatabaseFactory* CreateDatabaseFactory(const std::string &url, const int &chunkSize);
         static MongoDatabase* CreateDatabaseConnection(const std::string &url, const int &chunkSize);
     };
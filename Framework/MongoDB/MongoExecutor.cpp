@@ -0,0 +1,171 @@
+/**
+ * MongoDB Plugin - A plugin for Orthanc DICOM Server for storing DICOM data in MongoDB Database
+ * Copyright (C) 2017 - 2023  (Doc Cirrus GmbH)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#include "MongoExecutor.h"
+
+#include <OrthancException.h>
+
+#include <exception>
+
+namespace OrthancDatabases {
+    // the tasks submitted by one call to RunAll()
+    class MongoExecutor::Group : public boost::noncopyable {
+    private:
+        std::string database_;
+        boost::mutex mutex_;
+        boost::condition_variable finished_;
+        size_t remaining_;
+        std::exception_ptr error_;
+
+    public:
+        Group(const std::string &database, size_t count) :
+                database_(database), remaining_(count) {}
+
+        void Run(Task &task, mongocxx::client &client) {
+            auto database = client[database_];
+            Run(task, database);
+        }
+
+        void Run(Task &task, mongocxx::database &database) {
+            std::exception_ptr error;
+
+            try {
+                task(database);
+            } catch (...) {
+                error = std::current_exception();
+            }
+
+            boost::mutex::scoped_lock lock(mutex_);
+
+            if (error && !error_) {
+                error_ = error;
+            }
+
+            remaining_--;
+            if (remaining_ == 0) {
+                finished_.notify_all();
+            }
+        }
+
+        void Wait() {
+            boost::mutex::scoped_lock lock(mutex_);
+
+            while (remaining_ > 0) {
+                finished_.wait(lock);
+            }
+
+            if (error_) {
+                std::rethrow_exception(error_);
+            }
+        }
+    };
+
+    MongoExecutor::MongoExecutor(unsigned int threads) : done_(false) {
+        if (threads == 0) {
+            throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+        }
+
+        for (unsigned int i = 0; i < threads; i++) {
+            workers_.push_back(new boost::thread(&MongoExecutor::Worker, this));
+        }
+    }
+
+    MongoExecutor::~MongoExecutor() {
+        {
+            boost::mutex::scoped_lock lock(mutex_);
+            done_ = true;
+        }
+
+        available_.notify_all();
+
+        for (auto worker: workers_) {
+            if (worker->joinable()) {
+                worker->join();
+            }
+
+            delete worker;
+        }
+    }
+
+    void MongoExecutor::Worker() {
+        for (;;) {
+            Job job;
+
+            {
+                boost::mutex::scoped_lock lock(mutex_);
+
+                while (queue_.empty() && !done_) {
+                    available_.wait(lock);
+                }
+
+                if (done_) {
+                    return;
+                }
+
+                job = queue_.front();
+                queue_.pop_front();
+            }
+
+            job.group->Run(*job.task, *job.client);
+        }
+    }
+
+    void MongoExecutor::RunAll(mongocxx::pool &pool, const std::string &database, mongocxx::database &own,
+                               std::vector<Task> &tasks) {
+        if (tasks.empty()) {
+            return;
+        }
+
+        // the fan-out is bounded by the clients that are free right now, waiting for one could deadlock if the
+        // clients are all held by connections flushing at the same time
+        std::vector<mongocxx::pool::entry> clients;
+
+        while (clients.size() + 1 < tasks.size() && clients.size() < workers_.size()) {
+            auto client = pool.try_acquire();
+            if (!client) {
+                break;
+            }
+
+            clients.push_back(std::move(*client));
+        }
+
+        Group group(database, tasks.size());
+
+        {
+            boost::mutex::scoped_lock lock(mutex_);
+
+            // the first task and those without a free client are kept for the calling thread, which would otherwise
+            // only wait
+            for (size_t i = 0; i < clients.size(); i++) {
+                queue_.push_back(Job{&group, &tasks[i + 1], clients[i].get()});
+            }
+        }
+
+        available_.notify_all();
+
+        group.Run(tasks[0], own);
+
+        for (size_t i = clients.size() + 1; i < tasks.size(); i++) {
+            group.Run(tasks[i], own);
+        }
+
+        group.Wait();
+    }
+}
@@ -0,0 +1,73 @@
+/**
+ * MongoDB Plugin - A plugin for Orthanc DICOM Server for storing DICOM data in MongoDB Database
+ * Copyright (C) 2017 - 2023  (Doc Cirrus GmbH)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#pragma once
+
+#include <mongocxx/database.hpp>
+#include <mongocxx/pool.hpp>
+
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread.hpp>
+
+#include <deque>
+#include <string>
+#include <vector>
+
+namespace OrthancDatabases {
+    /**
+     * Small pool of threads running independent MongoDB operations of one index call concurrently, e.g. the bulk
+     * writes of a write buffer on different collections. The tasks run by the threads use a client of their own, taken
+     * from the pool of the calling connection, as the clients and sessions of the driver are not thread-safe. The
+     * others, at least the first one, run on the calling thread with its own client, so that a pool without free
+     * client only serializes the tasks instead of blocking them.
+     **/
+    class MongoExecutor : public boost::noncopyable {
+    public:
+        typedef boost::function<void(mongocxx::database &)> Task;
+
+    private:
+        class Group;
+
+        struct Job {
+            Group *group;
+            Task *task;
+            mongocxx::client *client;
+        };
+
+        boost::mutex mutex_;
+        boost::condition_variable available_;
+        std::deque<Job> queue_;
+        std::vector<boost::thread *> workers_;
+        bool done_;
+
+        void Worker();
+
+    public:
+        explicit MongoExecutor(unsigned int threads);
+
+        ~MongoExecutor();
+
+        // Returns once all the tasks are over, rethrows the first failure if any. "own" is the database of the calling
+        // connection, which already holds a client of "pool".
+        void RunAll(mongocxx::pool &pool, const std::string &database, mongocxx::database &own,
+                    std::vector<Task> &tasks);
+    };
+}
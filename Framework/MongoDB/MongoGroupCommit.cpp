@@ -0,0 +1,239 @@
+/**
+ * MongoDB Plugin - A plugin for Orthanc DICOM Server for storing DICOM data in MongoDB Database
+ * Copyright (C) 2017 - 2023  (Doc Cirrus GmbH)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#include "MongoGroupCommit.h"
+#include "MongoDatabase.h"
+
+#include <OrthancException.h>
+
+#include <boost/thread/thread.hpp>
+
+#include <algorithm>
+#include <set>
+
+namespace OrthancDatabases {
+    // positions of the operations rejected by the server in a bulk write, false if they are not known
+    static bool GetFailedOperations(std::set<size_t> &target, const mongocxx::operation_exception &e) {
+        if (!e.raw_server_error()) {
+            return false;
+        }
+
+        auto writeErrors = e.raw_server_error()->view()["writeErrors"];
+        if (!writeErrors || writeErrors.type() != bsoncxx::type::k_array) {
+            return false;
+        }
+
+        for (auto &&error: writeErrors.get_array().value) {
+            auto index = error["index"];
+            if (!index || index.type() != bsoncxx::type::k_int32) {
+                return false;
+            }
+
+            target.insert(static_cast<size_t>(index.get_int32().value));
+        }
+
+        return !target.empty();
+    }
+
+    MongoGroupCommit::MongoGroupCommit(unsigned int windowMilliseconds) :
+            windowMilliseconds_(windowMilliseconds), hasLeader_(false), groups_(0), commits_(0) {}
+
+    void MongoGroupCommit::Execute(mongocxx::database &database, std::list<Request *> &requests) {
+        std::vector<std::string> collections;
+        for (auto request: requests) {
+            for (const auto &collection: request->batch.collections) {
+                if (std::find(collections.begin(), collections.end(), collection) == collections.end()) {
+                    collections.push_back(collection);
+                }
+            }
+        }
+
+        for (const auto &collection: collections) {
+            // the operations of every transaction stay contiguous and in their order
+            MongoWriteBuffer::Pending merged;
+            std::vector<std::pair<Request *, size_t> > owners;  // transaction, end of its operations in "merged"
+
+            for (auto request: requests) {
+                auto found = request->batch.pending.find(collection);
+
+                // a transaction that has failed on a previous collection is not written any further
+                if (request->failed || found == request->batch.pending.end()) {
+                    continue;
+                }
+
+                for (auto &operation: found->second.operations) {
+                    merged.operations.push_back(std::move(operation));
+                }
+
+                merged.commutative = merged.commutative && found->second.commutative;
+                owners.emplace_back(request, merged.operations.size());
+            }
+
+            for (;;) {
+                Orthanc::ErrorCode errorCode = Orthanc::ErrorCode_Success;
+                std::string errorMessage;
+                std::set<size_t> failed;
+                bool known = false;
+
+                try {
+                    MongoWriteBuffer::Execute(database, nullptr, collection, merged);
+                    break;
+                } catch (const mongocxx::operation_exception &e) {
+                    errorCode = MongoDatabase::GetErrorCode(e);
+                    errorMessage = e.what();
+                    known = GetFailedOperations(failed, e);
+                } catch (const std::exception &e) {
+                    errorCode = Orthanc::ErrorCode_Database;
+                    errorMessage = e.what();
+                }
+
+                if (known && !merged.commutative) {
+                    // An ordered bulk stops at its first error: its owner fails, the operations of the transactions
+                    // after it have not been applied and are sent again
+                    const size_t position = *failed.begin();
+                    size_t next = 0;
+
+                    while (next < owners.size() && owners[next].second <= position) {
+                        next++;
+                    }
+
+                    if (next == owners.size()) {
+                        throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+                    }
+
+                    owners[next].first->failed = true;
+                    owners[next].first->errorCode = errorCode;
+                    owners[next].first->errorMessage = errorMessage;
+
+                    const size_t resume = owners[next].second;
+
+                    MongoWriteBuffer::Pending rest;
+                    rest.commutative = false;
+                    for (size_t i = resume; i < merged.operations.size(); i++) {
+                        rest.operations.push_back(std::move(merged.operations[i]));
+                    }
+
+                    std::vector<std::pair<Request *, size_t> > restOwners;
+                    for (size_t i = next + 1; i < owners.size(); i++) {
+                        restOwners.emplace_back(owners[i].first, owners[i].second - resume);
+                    }
+
+                    if (rest.operations.empty()) {
+                        break;
+                    }
+
+                    merged = std::move(rest);
+                    owners.swap(restOwners);
+                    continue;
+                }
+
+                // an unordered bulk only skips the rejected operations, and if they are not known, every
+                // transaction of the bulk is reported as failed
+                size_t begin = 0;
+                for (const auto &owner: owners) {
+                    const size_t end = owner.second;
+                    bool hit = true;
+
+                    if (known) {
+                        auto it = failed.lower_bound(begin);
+                        hit = (it != failed.end() && *it < end);
+                    }
+
+                    if (hit) {
+                        owner.first->failed = true;
+                        owner.first->errorCode = errorCode;
+                        owner.first->errorMessage = errorMessage;
+                    }
+
+                    begin = end;
+                }
+
+                break;
+            }
+        }
+    }
+
+    void MongoGroupCommit::Commit(mongocxx::database &database, MongoWriteBuffer::Batch &batch) {
+        if (batch.count == 0) {
+            return;
+        }
+
+        Request request;
+        request.batch = std::move(batch);
+
+        boost::mutex::scoped_lock lock(mutex_);
+        queue_.push_back(&request);
+
+        while (!request.done) {
+            if (hasLeader_) {
+                done_.wait(lock);
+                continue;
+            }
+
+            // this thread writes the batches of the whole group, including those queued during the window
+            hasLeader_ = true;
+
+            lock.unlock();
+            boost::this_thread::sleep(boost::posix_time::milliseconds(windowMilliseconds_));
+            lock.lock();
+
+            std::list<Request *> group;
+            group.swap(queue_);
+
+            groups_++;
+            commits_ += group.size();
+
+            lock.unlock();
+
+            try {
+                Execute(database, group);
+            } catch (...) {
+                for (auto pending: group) {
+                    pending->failed = true;
+                    pending->errorCode = Orthanc::ErrorCode_Database;
+                    pending->errorMessage = "Group commit interrupted";
+                }
+            }
+
+            lock.lock();
+
+            for (auto pending: group) {
+                pending->done = true;
+            }
+
+            hasLeader_ = false;
+            done_.notify_all();
+        }
+
+        if (request.failed) {
+            if (request.errorCode == Orthanc::ErrorCode_DatabaseCannotSerialize) {
+                throw Orthanc::OrthancException(request.errorCode);
+            } else {
+                throw Orthanc::OrthancException(request.errorCode, "Cannot write to MongoDB: " + request.errorMessage);
+            }
+        }
+    }
+
+    void MongoGroupCommit::GetStatistics(uint64_t &groups, uint64_t &commits) {
+        boost::mutex::scoped_lock lock(mutex_);
+        groups = groups_;
+        commits = commits_;
+    }
+}
@@ -0,0 +1,74 @@
+/**
+ * MongoDB Plugin - A plugin for Orthanc DICOM Server for storing DICOM data in MongoDB Database
+ * Copyright (C) 2017 - 2023  (Doc Cirrus GmbH)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#pragma once
+
+#include "MongoWriteBuffer.h"
+
+#include <Enumerations.h>
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <list>
+
+namespace OrthancDatabases {
+    /**
+     * Group commit of the write buffers of concurrent transactions: the first committer waits for a short window,
+     * then writes the batches of all the transactions that committed meanwhile, as one bulk write per collection,
+     * on its own connection. Every committer gets the outcome of its own operations: when an ordered bulk stops at
+     * the error of one transaction, the operations of the following transactions are sent again.
+     *
+     * Only for transactions that are not MongoDB transactions, whose writes must go through their own session.
+     **/
+    class MongoGroupCommit : public boost::noncopyable {
+    private:
+        struct Request {
+            MongoWriteBuffer::Batch batch;
+            bool done = false;
+            bool failed = false;
+            Orthanc::ErrorCode errorCode = Orthanc::ErrorCode_Success;
+            std::string errorMessage;
+        };
+
+        unsigned int windowMilliseconds_;
+        boost::mutex mutex_;
+        boost::condition_variable done_;
+        std::list<Request *> queue_;
+        bool hasLeader_;
+        uint64_t groups_;
+        uint64_t commits_;
+
+        static void Execute(mongocxx::database &database, std::list<Request *> &requests);
+
+    public:
+        explicit MongoGroupCommit(unsigned int windowMilliseconds);
+
+        unsigned int GetWindow() const {
+            return windowMilliseconds_;
+        }
+
+        // blocks until the batch is written, throws an OrthancException if any of its operations failed
+        void Commit(mongocxx::database &database, MongoWriteBuffer::Batch &batch);
+
+        // number of groups written so far, and of the commits they held
+        void GetStatistics(uint64_t &groups, uint64_t &commits);
+    };
+}
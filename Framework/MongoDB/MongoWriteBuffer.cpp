@@ -0,0 +1,176 @@
+/**
+ * MongoDB Plugin - A plugin for Orthanc DICOM Server for storing DICOM data in MongoDB Database
+ * Copyright (C) 2017 - 2023  (Doc Cirrus GmbH)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "MongoWriteBuffer.h"
+
+#include <mongocxx/bulk_write.hpp>
+#include <mongocxx/options/bulk_write.hpp>
+
+namespace OrthancDatabases {
+    // bounds the memory held by a transaction that writes a lot, e.g. the deletion of a large study
+    static const size_t MAX_PENDING_OPERATIONS = 1000;
+
+    MongoWriteBuffer::MongoWriteBuffer() : session_(nullptr), executor_(nullptr), pool_(nullptr), enabled_(false) {}
+
+    void MongoWriteBuffer::SetTarget(const mongocxx::database &database, mongocxx::client_session *session) {
+        database_ = database;
+        session_ = session;
+    }
+
+    void MongoWriteBuffer::SetExecutor(MongoExecutor *executor, mongocxx::pool &pool,
+                                       const std::string &databaseName) {
+        executor_ = executor;
+        pool_ = &pool;
+        databaseName_ = databaseName;
+    }
+
+    void MongoWriteBuffer::Enable() {
+        Discard();
+        enabled_ = true;
+    }
+
+    void MongoWriteBuffer::Execute(mongocxx::database &database,
+                                   mongocxx::client_session *session,
+                                   const std::string &collection,
+                                   Pending &pending) {
+        if (pending.operations.empty()) {
+            return;
+        }
+
+        // an unordered bulk lets the server apply independent inserts in parallel, the other operations (e.g. the
+        // "delete + insert" of a metadata) must keep their order
+        mongocxx::options::bulk_write options;
+        options.ordered(!pending.commutative);
+
+        auto target = database[collection];
+        auto bulk = session ? target.create_bulk_write(*session, options) : target.create_bulk_write(options);
+
+        for (auto &operation: pending.operations) {
+            bulk.append(operation);
+        }
+
+        bulk.execute();
+    }
+
+    void MongoWriteBuffer::Append(const std::string &collection, mongocxx::model::write operation, bool commutative) {
+        if (!enabled_) {
+            Pending single;
+            single.operations.push_back(std::move(operation));
+            Execute(database_, session_, collection, single);
+            return;
+        }
+
+        auto found = batch_.pending.find(collection);
+        if (found == batch_.pending.end()) {
+            batch_.collections.push_back(collection);
+            found = batch_.pending.emplace(collection, Pending()).first;
+        }
+
+        found->second.operations.push_back(std::move(operation));
+        found->second.commutative = found->second.commutative && commutative;
+        batch_.count++;
+
+        if (batch_.count >= MAX_PENDING_OPERATIONS) {
+            Flush();
+        }
+    }
+
+    void MongoWriteBuffer::Flush() {
+        if (batch_.count == 0) {
+            return;
+        }
+
+        // cleared first: if a bulk fails, the transaction is lost anyway, and must not be flushed twice
+        Batch batch;
+        std::swap(batch, batch_);
+
+        if (session_ == nullptr && executor_ != nullptr && batch.collections.size() > 1) {
+            // the collections are independent, their bulk writes only have to be over before the next operation
+            std::vector<MongoExecutor::Task> tasks;
+
+            for (const auto &collection: batch.collections) {
+                Pending *pending = &batch.pending[collection];
+                tasks.push_back([collection, pending](mongocxx::database &database) {
+                    Execute(database, nullptr, collection, *pending);
+                });
+            }
+
+            executor_->RunAll(*pool_, databaseName_, database_, tasks);
+        } else {
+            for (const auto &collection: batch.collections) {
+                Execute(database_, session_, collection, batch.pending[collection]);
+            }
+        }
+    }
+
+    void MongoWriteBuffer::Commit() {
+        try {
+            Flush();
+        } catch (...) {
+            enabled_ = false;
+            throw;
+        }
+
+        enabled_ = false;
+    }
+
+    void MongoWriteBuffer::Extract(Batch &target) {
+        target = std::move(batch_);
+        batch_ = Batch();
+        enabled_ = false;
+    }
+
+    void MongoWriteBuffer::Discard() {
+        batch_ = Batch();
+        commitHooks_.clear();
+        enabled_ = false;
+
+        std::vector<std::function<void()>> hooks;
+        hooks.swap(rollbackHooks_);
+
+        for (auto hook = hooks.rbegin(); hook != hooks.rend(); ++hook) {
+            (*hook)();
+        }
+    }
+
+    void MongoWriteBuffer::OnCommit(std::function<void()> hook) {
+        if (enabled_) {
+            commitHooks_.push_back(std::move(hook));
+        } else {
+            hook();
+        }
+    }
+
+    void MongoWriteBuffer::OnRollback(std::function<void()> hook) {
+        if (enabled_ && session_ == nullptr) {
+            rollbackHooks_.push_back(std::move(hook));
+        }
+    }
+
+    void MongoWriteBuffer::RunCommitHooks() {
+        rollbackHooks_.clear();
+
+        std::vector<std::function<void()>> hooks;
+        hooks.swap(commitHooks_);
+
+        for (auto &hook: hooks) {
+            hook();
+        }
+    }
+}
@@ -0,0 +1,119 @@
+/**
+ * MongoDB Plugin - A plugin for Orthanc DICOM Server for storing DICOM data in MongoDB Database
+ * Copyright (C) 2017 - 2023  (Doc Cirrus GmbH)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include "MongoExecutor.h"
+
+#include <mongocxx/client_session.hpp>
+#include <mongocxx/database.hpp>
+#include <mongocxx/model/write.hpp>
+
+#include <boost/noncopyable.hpp>
+
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace OrthancDatabases {
+    /**
+     * Write-behind buffer of a connection: during a read-write transaction, the mutations of the index are kept in
+     * memory, and sent as one bulk write per collection when the transaction is committed, or as soon as anything
+     * else has to reach the server (reads included, so that they see the pending writes).
+     *
+     * The operations must own their documents (i.e. be built from bsoncxx::document::value).
+     **/
+    class MongoWriteBuffer : public boost::noncopyable {
+    public:
+        struct Pending {
+            std::vector<mongocxx::model::write> operations;
+            bool commutative = true;  // if all the operations can be applied in any order
+        };
+
+        // the pending operations of a transaction
+        struct Batch {
+            std::vector<std::string> collections;  // in the order of their first write
+            std::map<std::string, Pending> pending;
+            size_t count = 0;
+        };
+
+    private:
+        mongocxx::database database_;
+        mongocxx::client_session *session_;  // can be null
+        MongoExecutor *executor_;  // can be null
+        mongocxx::pool *pool_;
+        std::string databaseName_;
+        bool enabled_;
+        Batch batch_;
+        std::vector<std::function<void()>> commitHooks_;
+        std::vector<std::function<void()>> rollbackHooks_;
+
+    public:
+        MongoWriteBuffer();
+
+        void SetTarget(const mongocxx::database &database, mongocxx::client_session *session);
+
+        // outside of a session, the bulk writes on different collections are then sent concurrently
+        void SetExecutor(MongoExecutor *executor, mongocxx::pool &pool, const std::string &databaseName);
+
+        bool IsEnabled() const {
+            return enabled_;
+        }
+
+        // buffering only happens between Enable() and Flush() or Discard()
+        void Enable();
+
+        bool HasPending() const {
+            return batch_.count > 0;
+        }
+
+        // executed right away if the buffer is disabled
+        void Append(const std::string &collection, mongocxx::model::write operation, bool commutative);
+
+        // sends the pending operations, the buffer stays enabled
+        void Flush();
+
+        // sends the pending operations, and stops buffering
+        void Commit();
+
+        // hands the pending operations over to the caller (e.g. a group commit), and stops buffering
+        void Extract(Batch &target);
+
+        // drops the pending operations and commit hooks, runs the rollback hooks, and stops buffering
+        void Discard();
+
+        // "hook" runs once the transaction is committed, or right away if the buffer is disabled
+        void OnCommit(std::function<void()> hook);
+
+        // to be called by the transaction once committed, the hooks must not throw
+        void RunCommitHooks();
+
+        // "hook" undoes a write sent right away, i.e. not deferred, if the transaction is discarded instead of
+        // committed. Ignored outside of a transaction, and within a MongoDB transaction that undoes it by itself.
+        // The hooks run in the reverse order of their registration, and must not throw.
+        void OnRollback(std::function<void()> hook);
+
+        // one bulk write, unordered if all the operations are commutative
+        static void Execute(mongocxx::database &database,
+                            mongocxx::client_session *session,
+                            const std::string &collection,
+                            Pending &pending);
+    };
+}
@@ -2,6 +2,8 @@
 
 #include "DatabaseBackendAdapterV3.h"
 
+#include "../Common/ConnectionPoolMonitor.h"
+
 #if defined(ORTHANC_PLUGINS_VERSION_IS_ABOVE)         // Macro introduced in Orthanc 1.3.1
 #  if ORTHANC_PLUGINS_VERSION_IS_ABOVE(1, 9, 2)
 
@@ -9,17 +11,42 @@
 #include <MultiThreading/SharedMessageQueue.h>
 #include <OrthancException.h>
 
+#include <boost/bind/bind.hpp>
+
+#include <algorithm>
 #include <stdexcept>
 #include <list>
 #include <string>
 #include <cassert>
 
+#if ORTHANC_ENABLE_MONGODB == 1
+#  include "../MongoDB/MongoDatabase.h"
+
+// Write conflicts inside a MongoDB transaction are reported as
+// "DatabaseCannotSerialize", so that Orthanc retries the whole
+// transaction
+#  define ORTHANC_PLUGINS_DATABASE_CATCH_MONGODB(context)               \
+  catch (::mongocxx::operation_exception& e)                            \
+  {                                                                     \
+    if (::OrthancDatabases::MongoDatabase::IsTransientError(e))         \
+    {                                                                   \
+      return OrthancPluginErrorCode_DatabaseCannotSerialize;            \
+    }                                                                   \
+    const std::string message = "Exception in database back-end: " + std::string(e.what()); \
+    OrthancPluginLogError(context, message.c_str());                    \
+    return OrthancPluginErrorCode_DatabasePlugin;                       \
+  }
+#else
+#  define ORTHANC_PLUGINS_DATABASE_CATCH_MONGODB(context)
+#endif
+
 
 #define ORTHANC_PLUGINS_DATABASE_CATCH(context)                         \
   catch (::Orthanc::OrthancException& e)                                \
   {                                                                     \
     return static_cast<OrthancPluginErrorCode>(e.GetErrorCode());       \
   }                                                                     \
+  ORTHANC_PLUGINS_DATABASE_CATCH_MONGODB(context)                       \
   catch (::std::runtime_error& e)                                       \
   {                                                                     \
     const std::string message = "Exception in database back-end: " + std::string(e.what()); \
@@ -90,11 +117,97 @@ namespace OrthancDatabases
     std::list<DatabaseManager*>    connections_;
     Orthanc::SharedMessageQueue    availableConnections_;
 
+    // "resizeMutex_" protects "connections_" and "countConnections_"
+    // while the pool is resized, which happens concurrently with the
+    // transactions (i.e. while "connectionsMutex_" is shared)
+    boost::mutex                   resizeMutex_;
+    size_t                         minConnections_;
+    size_t                         maxConnections_;
+    unsigned int                   monitoringInterval_;
+    ConnectionPoolMonitor          monitor_;
+    std::unique_ptr<ConnectionPoolController>  controller_;
+
+    size_t Resize(size_t target)
+    {
+      boost::shared_lock<boost::shared_mutex>  lock(connectionsMutex_);
+
+      size_t count;
+
+      {
+        boost::mutex::scoped_lock resizeLock(resizeMutex_);
+        count = countConnections_;
+      }
+
+      while (count < target)
+      {
+        // Open the connection before publishing it, so that no transaction waits for it
+        std::unique_ptr<DatabaseManager> manager(new DatabaseManager(backend_->CreateDatabaseFactory()));
+        manager->GetDatabase();
+
+        {
+          boost::mutex::scoped_lock resizeLock(resizeMutex_);
+          connections_.push_back(manager.release());
+          countConnections_++;
+          count = countConnections_;
+          availableConnections_.Enqueue(new ManagerReference(*connections_.back()));
+        }
+      }
+
+      while (count > target)
+      {
+        // Only an idle connection can be removed: give up if none is available right now
+        std::unique_ptr<Orthanc::IDynamicObject> reference(availableConnections_.Dequeue(1));
+        if (reference.get() == NULL)
+        {
+          break;
+        }
+
+        DatabaseManager* manager = &dynamic_cast<ManagerReference&>(*reference).GetManager();
+
+        {
+          boost::mutex::scoped_lock resizeLock(resizeMutex_);
+          connections_.remove(manager);
+          countConnections_--;
+          count = countConnections_;
+        }
+
+        delete manager;
+      }
+
+      return count;
+    }
+
+    void StartController()
+    {
+      if (monitoringInterval_ != 0)
+      {
+        controller_.reset(new ConnectionPoolController(context_, monitoringInterval_));
+        controller_->AddPool(monitor_, boost::bind(&Adapter::Resize, this, boost::placeholders::_1),
+                             minConnections_, maxConnections_);
+        controller_->Start();
+      }
+    }
+
+    void StopController()
+    {
+      if (controller_.get() != NULL)
+      {
+        controller_->Stop();
+        controller_.reset(NULL);
+      }
+    }
+
   public:
     Adapter(IndexBackend* backend,
-            size_t countConnections) :
+            size_t countConnections,
+            size_t maxConnections,
+            unsigned int monitoringInterval) :
       backend_(backend),
-      countConnections_(countConnections)
+      countConnections_(countConnections),
+      minConnections_(countConnections),
+      maxConnections_(std::max(countConnections, maxConnections)),
+      monitoringInterval_(monitoringInterval),
+      monitor_("index", countConnections)
     {
       if (countConnections == 0)
       {
@@ -113,6 +226,8 @@ namespace OrthancDatabases
 
     ~Adapter()
     {
+      StopController();
+
       for (std::list<DatabaseManager*>::iterator
              it = connections_.begin(); it != connections_.end(); ++it)
       {
@@ -159,10 +274,15 @@ namespace OrthancDatabases
       {
         throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
       }
+
+      lock.unlock();
+      StartController();
     }
 
     void CloseConnections()
     {
+      StopController();
+
       boost::unique_lock<boost::shared_mutex>  lock(connectionsMutex_);
 
       if (connections_.size() != countConnections_)
@@ -190,21 +310,32 @@ namespace OrthancDatabases
       boost::shared_lock<boost::shared_mutex>  lock_;
       Adapter&                                 adapter_;
       DatabaseManager*                         manager_;
+      ConnectionPoolMonitor::Scope             scope_;
 
     public:
       DatabaseAccessor(Adapter& adapter) :
         lock_(adapter.connectionsMutex_),
         adapter_(adapter),
-        manager_(NULL)
+        manager_(NULL),
+        scope_(adapter.monitor_)
       {
+        bool timedOut = false;
+
         for (;;)
         {
           std::unique_ptr<Orthanc::IDynamicObject> manager(adapter.availableConnections_.Dequeue(100));
           if (manager.get() != NULL)
           {
             manager_ = &dynamic_cast<ManagerReference&>(*manager).GetManager();
+            scope_.SetAcquired();
             return;
           }
+          else if (!timedOut)
+          {
+            // Counted once per caller, however long it keeps waiting
+            adapter.monitor_.SignalTimeout();
+            timedOut = true;
+          }
         }
       }
 
@@ -1967,6 +2098,16 @@ namespace OrthancDatabases
   void DatabaseBackendAdapterV3::Register(IndexBackend* backend,
                                           size_t countConnections,
                                           unsigned int maxDatabaseRetries)
+  {
+    Register(backend, countConnections, countConnections, maxDatabaseRetries, 0);
+  }
+
+
+  void DatabaseBackendAdapterV3::Register(IndexBackend* backend,
+                                          size_t countConnections,
+                                          size_t maxCountConnections,
+                                          unsigned int maxDatabaseRetries,
+                                          unsigned int monitoringInterval)
   {
     if (isBackendInUse_)
     {
@@ -2055,7 +2196,7 @@ namespace OrthancDatabases
 
     if (OrthancPluginRegisterDatabaseBackendV3(
           context, &params, sizeof(params), maxDatabaseRetries,
-          new Adapter(backend, countConnections)) != OrthancPluginErrorCode_Success)
+          new Adapter(backend, countConnections, maxCountConnections, monitoringInterval)) != OrthancPluginErrorCode_Success)
     {
       throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError, "Unable to register the database backend");
     }
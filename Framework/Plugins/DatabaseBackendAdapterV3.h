@@ -42,6 +42,12 @@ namespace OrthancDatabases
                          size_t countConnections,
                          unsigned int maxDatabaseRetries);
 
+    static void Register(IndexBackend* backend,
+                         size_t countConnections,
+                         size_t maxCountConnections,
+                         unsigned int maxDatabaseRetries,
+                         unsigned int monitoringInterval);
+
     static void Finalize();
   };
 }
@@ -601,6 +601,15 @@ namespace OrthancDatabases
   void IndexBackend::Register(IndexBackend *backend,
                               size_t countConnections,
                               unsigned int maxDatabaseRetries)
+  {
+    Register(backend, countConnections, countConnections, maxDatabaseRetries, 0);
+  }
+
+  void IndexBackend::Register(IndexBackend *backend,
+                              size_t countConnections,
+                              size_t maxCountConnections,
+                              unsigned int maxDatabaseRetries,
+                              unsigned int monitoringInterval)
   {
     if (backend == NULL)
     {
@@ -616,7 +625,13 @@ namespace OrthancDatabases
       LOG(WARNING) << "The index plugin will use " << countConnections << " connection(s) to the database, "
                    << "and will retry up to " << maxDatabaseRetries << " time(s) in the case of a collision";
 
-      OrthancDatabases::DatabaseBackendAdapterV3::Register(backend, countConnections, maxDatabaseRetries);
+      if (maxCountConnections > countConnections)
+      {
+        LOG(WARNING) << "The number of connections of the index plugin can grow up to " << maxCountConnections;
+      }
+
+      OrthancDatabases::DatabaseBackendAdapterV3::Register(backend, countConnections, maxCountConnections,
+                                                           maxDatabaseRetries, monitoringInterval);
       hasLoadedV3 = true;
     }
 #endif
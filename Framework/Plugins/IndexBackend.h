@@ -366,6 +366,17 @@ namespace OrthancDatabases
                          size_t countConnections,
                          unsigned int maxDatabaseRetries);
 
+    /**
+     * Same as above, but the pool of connections is monitored every
+     * "monitoringInterval" seconds (0 to disable), and is allowed to
+     * grow up to "maxCountConnections" if requests are queueing.
+     **/
+    static void Register(IndexBackend* backend,
+                         size_t countConnections,
+                         size_t maxCountConnections,
+                         unsigned int maxDatabaseRetries,
+                         unsigned int monitoringInterval);
+
     static void Finalize();
 
     static DatabaseManager* CreateSingleDatabaseManager(IDatabaseBackend& backend);
@@ -18,6 +18,7 @@
 
 #include <mongoc.h>
 #include "MongoDBIndex.h"
+#include "MongoDBIndexRestApi.h"
 
 #include "../../Framework/Plugins/PluginInitialization.h"
 #include "../../Resources/Orthanc/Plugins/OrthancPluginCppWrapper.h"
@@ -25,6 +26,37 @@
 #include <Logging.h>
 
 
+static OrthancDatabases::MongoDatabase::Options::Retention ReadRetention(
+        const OrthancPlugins::OrthancConfiguration &mongodb, const std::string &log) {
+    typedef OrthancDatabases::MongoDatabase::Options Options;
+
+    Options::Retention retention;
+    const std::string mode = mongodb.GetStringValue(log + "Retention", "None");
+
+    if (mode == "None") {
+        retention.mode = Options::Retention_None;
+    } else if (mode == "Capped") {
+        retention.mode = Options::Retention_Capped;
+    } else if (mode == "TTL") {
+        retention.mode = Options::Retention_TTL;
+    } else if (mode == "Window") {
+        retention.mode = Options::Retention_Window;
+    } else {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange,
+                                        "Unknown value for \"" + log + "Retention\": " + mode);
+    }
+
+    retention.limit = mongodb.GetUnsignedIntegerValue(log + "RetentionLimit", 0);
+
+    if (retention.mode != Options::Retention_None && retention.limit == 0) {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange,
+                                        "\"" + log + "RetentionLimit\" must be set");
+    }
+
+    return retention;
+}
+
+
 extern "C"
 {
 ORTHANC_PLUGINS_API int32_t OrthancPluginInitialize(OrthancPluginContext *context) {
@@ -57,7 +89,24 @@ ORTHANC_PLUGINS_API int32_t OrthancPluginInitialize(OrthancPluginContext *contex
         const unsigned int chunkSize = mongodb.GetUnsignedIntegerValue("ChunkSize", 261120);
 
         const unsigned int countConnections = mongodb.GetUnsignedIntegerValue("IndexConnectionsCount", 5);
+        const unsigned int maxCountConnections = mongodb.GetUnsignedIntegerValue("MaxIndexConnectionsCount",
+                                                                                countConnections);
         const unsigned int maxConnectionRetries = mongodb.GetUnsignedIntegerValue("MaxConnectionRetries", 10);
+        const unsigned int monitoringInterval = mongodb.GetUnsignedIntegerValue("ConnectionPoolMonitoringInterval",
+                                                                               10);
+
+        OrthancDatabases::MongoDatabase::Options options;
+        options.chunkSize = chunkSize;
+        options.sequenceBlockSize = mongodb.GetUnsignedIntegerValue("SequenceBlockSize", 100);
+        options.strictSequences = mongodb.GetBooleanValue("StrictSequenceOrdering", true);
+        options.enableTransactions = mongodb.GetBooleanValue("EnableTransactions", false);
+        options.readConcern = mongodb.GetStringValue("TransactionReadConcern", "snapshot");
+        options.writeConcern = mongodb.GetStringValue("TransactionWriteConcern", "majority");
+        options.groupCommitWindow = mongodb.GetUnsignedIntegerValue("GroupCommitWindow", 0);
+        options.parallelWrites = mongodb.GetUnsignedIntegerValue("ParallelWrites", 4);
+        options.changesRetention = ReadRetention(mongodb, "Changes");
+        options.exportedResourcesRetention = ReadRetention(mongodb, "ExportedResources");
+        options.embeddedTags = mongodb.GetBooleanValue("EmbeddedTags", false);
 
         if (connectionUri.empty()) {
             throw Orthanc::OrthancException(
@@ -66,9 +115,29 @@ ORTHANC_PLUGINS_API int32_t OrthancPluginInitialize(OrthancPluginContext *contex
             );
         }
 
+        std::unique_ptr<OrthancDatabases::MongoDBIndex> index(
+                new OrthancDatabases::MongoDBIndex(context, connectionUri, chunkSize));
+        index->SetOptions(options);
+        index->SetBulkLoadOnStartup(mongodb.GetBooleanValue("BulkLoad", false));
+        index->SetPurgeParameters(mongodb.GetUnsignedIntegerValue("PurgeBatchSize", 500),
+                                  mongodb.GetUnsignedIntegerValue("PurgeThrottle", 100));
+        index->SetChangesCacheSize(mongodb.GetUnsignedIntegerValue("ChangesCacheSize", 0));
+        index->SetResourceCacheSize(mongodb.GetUnsignedIntegerValue("ResourceCacheSize", 0));
+        index->SetSubtreeCacheSize(mongodb.GetUnsignedIntegerValue("SubtreeCacheSize", 0));
+        index->SetSummaryCacheSize(mongodb.GetUnsignedIntegerValue("SummaryCacheSize", 0));
+        index->SetPrefetchMatches(mongodb.GetBooleanValue("PrefetchMatches", true));
+        index->SetInProcessLookups(mongodb.GetBooleanValue("InProcessLookups", true));
+        index->SetTagStatisticsInterval(mongodb.GetUnsignedIntegerValue("TagStatisticsInterval", 0));
+        index->SetQueryCacheParameters(mongodb.GetUnsignedIntegerValue("QueryCacheSize", 0),
+                                       mongodb.GetUnsignedIntegerValue("QueryCacheTTL", 10));
+        index->SetCountersReconciliationInterval(
+                mongodb.GetUnsignedIntegerValue("CountersReconciliationInterval", 3600));
+
+        OrthancDatabases::MongoDBIndexRestApi::Register(*index);
+
         OrthancDatabases::IndexBackend::Register(
-                new OrthancDatabases::MongoDBIndex(context, connectionUri, chunkSize),
-                countConnections, maxConnectionRetries
+                index.release(),
+                countConnections, maxCountConnections, maxConnectionRetries, monitoringInterval
         );
     }
     catch (Orthanc::OrthancException &e) {
@@ -86,6 +155,7 @@ ORTHANC_PLUGINS_API int32_t OrthancPluginInitialize(OrthancPluginContext *contex
 
 ORTHANC_PLUGINS_API void OrthancPluginFinalize() {
     LOG(WARNING) << "MongoDB index is finalizing";
+    OrthancDatabases::MongoDBIndexRestApi::Finalize();
     OrthancDatabases::IndexBackend::Finalize();
 
     mongoc_cleanup();
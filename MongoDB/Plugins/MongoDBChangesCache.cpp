@@ -0,0 +1,467 @@
+/**
+ * MongoDB Plugin - A plugin for Orthanc DICOM Server for storing DICOM data in MongoDB Database
+ * Copyright (C) 2017 - 2023  (Doc Cirrus GmbH)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#include "MongoDBChangesCache.h"
+
+#include "../../Framework/MongoDB/MongoDatabase.h"
+
+#include <Logging.h>
+#include <OrthancException.h>
+
+#include <mongocxx/change_stream.hpp>
+#include <mongocxx/options/change_stream.hpp>
+
+#include <algorithm>
+#include <cstring>
+
+using bsoncxx::builder::basic::make_array;
+
+namespace OrthancDatabases {
+    class MongoDBChangesCache::Slot {
+    private:
+        static const size_t PUBLIC_ID_WORDS = 6;  // 48 bytes, the public ids of Orthanc have 44 characters
+        static const size_t DATE_WORDS = 4;  // 32 bytes, the dates of Orthanc have 15 characters
+
+        // Every field is atomic, so that a reader racing with a writer gets a torn copy rather than undefined
+        // behavior. The version is odd while the slot is being written, the readers discard their copy if it
+        // changed meanwhile.
+        std::atomic<uint64_t> version_;
+        std::atomic<int64_t> id_;  // 0 if the slot is empty
+        std::atomic<int64_t> internalId_;
+        std::atomic<int32_t> changeType_;
+        std::atomic<int32_t> resourceType_;
+        std::atomic<bool> removed_;
+        std::atomic<uint32_t> publicIdLength_;
+        std::atomic<uint32_t> dateLength_;
+        std::atomic<uint64_t> publicId_[PUBLIC_ID_WORDS];
+        std::atomic<uint64_t> date_[DATE_WORDS];
+
+        static void StoreText(std::atomic<uint64_t> *words, size_t count, const std::string &text) {
+            for (size_t i = 0; i < count; i++) {
+                uint64_t word = 0;
+
+                if (i * sizeof(word) < text.size()) {
+                    memcpy(&word, text.data() + i * sizeof(word), std::min(sizeof(word), text.size() - i * sizeof(word)));
+                }
+
+                words[i].store(word, std::memory_order_relaxed);
+            }
+        }
+
+        static void LoadText(std::string &target, const std::atomic<uint64_t> *words, size_t length) {
+            char buffer[PUBLIC_ID_WORDS * sizeof(uint64_t)];
+
+            for (size_t i = 0; i * sizeof(uint64_t) < length; i++) {
+                const uint64_t word = words[i].load(std::memory_order_relaxed);
+                memcpy(buffer + i * sizeof(uint64_t), &word, sizeof(word));
+            }
+
+            target.assign(buffer, length);
+        }
+
+        uint64_t Lock() {
+            for (;;) {
+                uint64_t version = version_.load(std::memory_order_relaxed);
+
+                if ((version & 1) == 0 &&
+                    version_.compare_exchange_weak(version, version + 1, std::memory_order_acquire)) {
+                    std::atomic_thread_fence(std::memory_order_release);
+                    return version;
+                }
+
+                boost::this_thread::yield();
+            }
+        }
+
+        void Unlock(uint64_t version) {
+            version_.store(version + 2, std::memory_order_release);
+        }
+
+    public:
+        Slot() : version_(0), id_(0), internalId_(0), changeType_(0), resourceType_(0), removed_(false),
+                 publicIdLength_(0), dateLength_(0) {
+            StoreText(publicId_, PUBLIC_ID_WORDS, "");
+            StoreText(date_, DATE_WORDS, "");
+        }
+
+        static bool Fits(const Change &change) {
+            return (change.publicId.size() <= PUBLIC_ID_WORDS * sizeof(uint64_t) &&
+                    change.date.size() <= DATE_WORDS * sizeof(uint64_t));
+        }
+
+        // "evict" gets the id of the overwritten change, if any, before anything is overwritten
+        template<typename Evict>
+        void Write(const Change &change, Evict evict) {
+            const uint64_t version = Lock();
+
+            const int64_t previous = id_.load(std::memory_order_relaxed);
+            if (previous != 0) {
+                evict(previous);
+            }
+
+            id_.store(change.id, std::memory_order_relaxed);
+            internalId_.store(change.internalId, std::memory_order_relaxed);
+            changeType_.store(change.changeType, std::memory_order_relaxed);
+            resourceType_.store(change.resourceType, std::memory_order_relaxed);
+            removed_.store(false, std::memory_order_relaxed);
+            publicIdLength_.store(static_cast<uint32_t>(change.publicId.size()), std::memory_order_relaxed);
+            dateLength_.store(static_cast<uint32_t>(change.date.size()), std::memory_order_relaxed);
+            StoreText(publicId_, PUBLIC_ID_WORDS, change.publicId);
+            StoreText(date_, DATE_WORDS, change.date);
+
+            Unlock(version);
+        }
+
+        void Clear() {
+            const uint64_t version = Lock();
+            id_.store(0, std::memory_order_relaxed);
+            Unlock(version);
+        }
+
+        void RemoveIf(const std::set<int64_t> &internalIds) {
+            // cheap check first, confirmed under the lock
+            if (internalIds.find(internalId_.load(std::memory_order_relaxed)) == internalIds.end()) {
+                return;
+            }
+
+            const uint64_t version = Lock();
+
+            if (internalIds.find(internalId_.load(std::memory_order_relaxed)) != internalIds.end()) {
+                removed_.store(true, std::memory_order_relaxed);
+            }
+
+            Unlock(version);
+        }
+
+        int64_t GetId() const {
+            return id_.load(std::memory_order_acquire);
+        }
+
+        // false if the slot is empty, "removed" if it holds the change of a deleted resource
+        bool Read(Change &target, bool &removed) const {
+            for (;;) {
+                const uint64_t before = version_.load(std::memory_order_acquire);
+
+                if ((before & 1) != 0) {
+                    boost::this_thread::yield();
+                    continue;
+                }
+
+                target.id = id_.load(std::memory_order_relaxed);
+                target.internalId = internalId_.load(std::memory_order_relaxed);
+                target.changeType = changeType_.load(std::memory_order_relaxed);
+                target.resourceType = resourceType_.load(std::memory_order_relaxed);
+                removed = removed_.load(std::memory_order_relaxed);
+                const size_t publicIdLength = std::min<size_t>(publicIdLength_.load(std::memory_order_relaxed),
+                                                               PUBLIC_ID_WORDS * sizeof(uint64_t));
+                const size_t dateLength = std::min<size_t>(dateLength_.load(std::memory_order_relaxed),
+                                                           DATE_WORDS * sizeof(uint64_t));
+                LoadText(target.publicId, publicId_, publicIdLength);
+                LoadText(target.date, date_, dateLength);
+
+                std::atomic_thread_fence(std::memory_order_acquire);
+
+                if (version_.load(std::memory_order_relaxed) == before) {
+                    return (target.id != 0);
+                }
+            }
+        }
+    };
+
+    MongoDBChangesCache::MongoDBChangesCache(size_t capacity) :
+            capacity_(capacity), next_(0), evicted_(0), valid_(false), done_(false) {
+        if (capacity == 0) {
+            throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+        }
+
+        slots_.reset(new Slot[capacity]);
+    }
+
+    MongoDBChangesCache::~MongoDBChangesCache() {
+        StopWatching();
+    }
+
+    void MongoDBChangesCache::RaiseEvicted(int64_t id) {
+        int64_t current = evicted_.load();
+
+        while (current < id && !evicted_.compare_exchange_weak(current, id)) {
+        }
+    }
+
+    void MongoDBChangesCache::Reset(int64_t lastId) {
+        valid_ = false;
+
+        for (size_t i = 0; i < capacity_; i++) {
+            slots_[i].Clear();
+        }
+
+        evicted_ = lastId;
+        valid_ = true;
+    }
+
+    void MongoDBChangesCache::Invalidate() {
+        valid_ = false;
+    }
+
+    void MongoDBChangesCache::Add(const Change &change) {
+        if (!Slot::Fits(change)) {
+            // cannot be kept in memory, the requests that would need it go to the collection
+            RaiseEvicted(change.id);
+            return;
+        }
+
+        const uint64_t position = next_.fetch_add(1);
+
+        slots_[position % capacity_].Write(change, [this](int64_t previous) {
+            RaiseEvicted(previous);
+        });
+    }
+
+    void MongoDBChangesCache::Remove(const std::set<int64_t> &internalIds) {
+        if (internalIds.empty()) {
+            return;
+        }
+
+        for (size_t i = 0; i < capacity_; i++) {
+            slots_[i].RemoveIf(internalIds);
+        }
+    }
+
+    bool MongoDBChangesCache::LookupChanges(std::vector<Change> &target, bool &done, int64_t since,
+                                            uint32_t maxResults) const {
+        if (!valid_) {
+            return false;
+        }
+
+        std::vector<std::pair<Change, bool> > changes;  // with their "removed" flag
+
+        for (size_t i = 0; i < capacity_; i++) {
+            if (slots_[i].GetId() > since) {
+                Change change;
+                bool removed;
+                if (slots_[i].Read(change, removed) && change.id > since) {
+                    changes.emplace_back(std::move(change), removed);
+                }
+            }
+        }
+
+        // read after the scan: a change evicted while scanning may have been missed
+        if (since < evicted_.load() || !valid_) {
+            return false;
+        }
+
+        std::sort(changes.begin(), changes.end(),
+                  [](const std::pair<Change, bool> &a, const std::pair<Change, bool> &b) {
+                      return a.first.id < b.first.id;
+                  });
+
+        // The changes enter the ring in the order of their commits, not of their ids: a change may not have arrived
+        // yet below a newer one, and a client moving its "since" past the newer one would never see it. Only the
+        // changes following "since" without any gap are answered, the collection decides when the next one is
+        // missing (e.g. a transaction in progress, or the id of a rolled back transaction).
+        size_t contiguous = 0;
+        int64_t expected = since + 1;
+
+        while (contiguous < changes.size() && changes[contiguous].first.id == expected) {
+            contiguous++;
+            expected++;
+        }
+
+        target.clear();
+
+        size_t position = 0;
+        for (; position < contiguous && target.size() < maxResults; position++) {
+            // the changes of the deleted resources are not answered, but they are no gap either
+            if (!changes[position].second) {
+                target.push_back(std::move(changes[position].first));
+            }
+        }
+
+        done = (position == changes.size());
+
+        // nothing to answer before a gap: the client would ask for the same changes over and over
+        return (done || !target.empty());
+    }
+
+    bool MongoDBChangesCache::LookupLastChange(Change &target) const {
+        if (!valid_) {
+            return false;
+        }
+
+        bool found = false;
+
+        for (size_t i = 0; i < capacity_; i++) {
+            if (slots_[i].GetId() > (found ? target.id : 0)) {
+                Change change;
+                bool removed;
+                if (slots_[i].Read(change, removed) && !removed && (!found || change.id > target.id)) {
+                    target = change;
+                    found = true;
+                }
+            }
+        }
+
+        return found && valid_;
+    }
+
+    bool MongoDBChangesCache::LookupLastChangeIndex(int64_t &target) const {
+        if (!valid_) {
+            return false;
+        }
+
+        target = evicted_.load();
+
+        for (size_t i = 0; i < capacity_; i++) {
+            target = std::max(target, slots_[i].GetId());
+        }
+
+        return valid_;
+    }
+
+    int64_t MongoDBChangesCache::ReadLastChangeIndex(MongoDatabase &database) {
+        mongocxx::options::find options;
+        options.sort(make_document(kvp("id", -1)));
+        options.projection(make_document(kvp("id", 1)));
+
+        auto last = database.GetCollection("Changes").find_one(make_document(), options);
+
+        return last ? last->view()["id"].get_int64().value : 0;
+    }
+
+    void MongoDBChangesCache::Watch() {
+        std::unique_ptr<IDatabase> connection(factory_->Open());
+        auto &database = dynamic_cast<MongoDatabase &>(*connection);
+
+        mongocxx::pipeline pipeline;
+        pipeline.match(make_document(kvp("$or", make_array(
+                make_document(kvp("operationType", "insert"), kvp("ns.coll", "Changes")),
+                make_document(kvp("operationType", "update"), kvp("ns.coll", "Resources"),
+                              kvp("updateDescription.updatedFields.deleted", make_document(kvp("$exists", true)))),
+                make_document(kvp("operationType", make_document(kvp("$in", make_array(
+                        "drop", "rename", "dropDatabase", "invalidate"
+                )))))
+        ))));
+
+        mongocxx::options::change_stream options;
+        options.max_await_time(std::chrono::milliseconds(1000));
+
+        auto stream = database.GetObject().watch(pipeline, options);
+
+        // the stream is open, the changes logged before are left to the collection
+        Reset(ReadLastChangeIndex(database));
+
+        mongocxx::options::find resourceOptions;
+        resourceOptions.projection(make_document(kvp("publicId", 1)));
+
+        std::set<int64_t> deleted;
+
+        while (!done_) {
+            for (const auto &event: stream) {
+                const bsoncxx::stdx::string_view operation = event["operationType"].get_string().value;
+
+                if (operation == "insert") {
+                    auto document = event["fullDocument"];
+
+                    Change change;
+                    change.id = document["id"].get_int64().value;
+                    change.changeType = document["changeType"].get_int32().value;
+                    change.resourceType = document["resourceType"].get_int32().value;
+                    change.internalId = document["internalId"].get_int64().value;
+                    change.date = std::string(document["date"].get_string().value);
+
+                    auto resource = database.GetCollection("Resources").find_one(
+                            make_document(kvp("internalId", change.internalId)), resourceOptions
+                    );
+
+                    if (resource) {
+                        change.publicId = std::string(resource->view()["publicId"].get_string().value);
+                        Add(change);
+                    }
+                } else if (operation == "update") {
+                    deleted.insert(event["updateDescription"]["updatedFields"]["deleted"]["internalId"]
+                                           .get_int64().value);
+
+                    // the resources are hidden one event at a time, the ring is scanned once per batch
+                    if (deleted.size() >= 10000) {
+                        Remove(deleted);
+                        deleted.clear();
+                    }
+                } else if (operation == "drop" &&
+                           event["ns"]["coll"].get_string().value != bsoncxx::stdx::string_view("Changes")) {
+                    // e.g. ClearExportedResources()
+                } else if (operation == "drop") {
+                    // ClearChanges(), possibly by another Orthanc
+                    Reset(0);
+                } else {
+                    throw Orthanc::OrthancException(Orthanc::ErrorCode_Database,
+                                                    "The change stream of the MongoDB index has been invalidated");
+                }
+
+                if (done_) {
+                    break;
+                }
+            }
+
+            Remove(deleted);
+            deleted.clear();
+        }
+    }
+
+    void MongoDBChangesCache::Worker() {
+        while (!done_) {
+            try {
+                Watch();
+            } catch (const Orthanc::OrthancException &e) {
+                LOG(ERROR) << "Cannot watch the changes of the MongoDB index: " << e.What();
+            } catch (const std::exception &e) {
+                LOG(ERROR) << "Cannot watch the changes of the MongoDB index: " << e.what();
+            }
+
+            // some changes may have been missed, until the stream is open again
+            Invalidate();
+
+            for (unsigned int i = 0; i < 10 && !done_; i++) {
+                boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+            }
+        }
+    }
+
+    void MongoDBChangesCache::StartWatching(IDatabaseFactory *factory) {
+        if (factory == nullptr) {
+            throw Orthanc::OrthancException(Orthanc::ErrorCode_NullPointer);
+        }
+
+        if (thread_.joinable()) {
+            throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+        }
+
+        factory_.reset(factory);
+        done_ = false;
+        thread_ = boost::thread(&MongoDBChangesCache::Worker, this);
+    }
+
+    void MongoDBChangesCache::StopWatching() {
+        done_ = true;
+
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+    }
+}
@@ -0,0 +1,118 @@
+/**
+ * MongoDB Plugin - A plugin for Orthanc DICOM Server for storing DICOM data in MongoDB Database
+ * Copyright (C) 2017 - 2023  (Doc Cirrus GmbH)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#pragma once
+
+#include "../../Framework/Common/IDatabaseFactory.h"
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread.hpp>
+
+#include <atomic>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace OrthancDatabases {
+    class MongoDatabase;
+
+    /**
+     * The most recent entries of the "Changes" collection, kept in memory so that the clients polling "/changes"
+     * do not reach MongoDB. The entries live in a ring of fixed size, whose slots are protected by sequence locks:
+     * readers never block the writers, and retry the slots that were being written while they read them.
+     *
+     * The ring is fed either by a change stream on the database, which also sees the changes logged by the other
+     * Orthanc sharing it (replica sets and sharded clusters), or by the transactions of this Orthanc once committed.
+     * A request is answered from memory only if no change newer than "since" has been evicted from the ring.
+     **/
+    class MongoDBChangesCache : public boost::noncopyable {
+    public:
+        struct Change {
+            int64_t id = 0;
+            int32_t changeType = 0;
+            int32_t resourceType = 0;
+            int64_t internalId = 0;
+            std::string publicId;
+            std::string date;
+        };
+
+    private:
+        class Slot;
+
+        std::unique_ptr<Slot[]> slots_;
+        size_t capacity_;
+        std::atomic<uint64_t> next_;
+
+        // the changes up to this id (included) are only available in the collection
+        std::atomic<int64_t> evicted_;
+
+        // false while the ring may have missed changes, e.g. after a failure of the change stream
+        std::atomic<bool> valid_;
+
+        std::unique_ptr<IDatabaseFactory> factory_;  // of the change stream, null if not watching
+        std::atomic<bool> done_;
+        boost::thread thread_;
+
+        void RaiseEvicted(int64_t id);
+
+        void Watch();
+
+        void Worker();
+
+    public:
+        explicit MongoDBChangesCache(size_t capacity);
+
+        ~MongoDBChangesCache();
+
+        // forgets all the entries, the changes up to "lastId" being left to the collection
+        void Reset(int64_t lastId);
+
+        // all the requests go to the collection until the next Reset()
+        void Invalidate();
+
+        void Add(const Change &change);
+
+        // drops the changes of the given resources, which have been deleted
+        void Remove(const std::set<int64_t> &internalIds);
+
+        // false if the changes after "since" are not all in memory
+        bool LookupChanges(std::vector<Change> &target, bool &done, int64_t since, uint32_t maxResults) const;
+
+        // false if the ring holds no change
+        bool LookupLastChange(Change &target) const;
+
+        // highest id seen so far, either in the ring or in the collection when the ring was reset
+        bool LookupLastChangeIndex(int64_t &target) const;
+
+        // Feeds the ring from a change stream, in a thread of its own, instead of the commits of this Orthanc. Takes
+        // the ownership of "factory".
+        void StartWatching(IDatabaseFactory *factory);
+
+        void StopWatching();
+
+        bool IsWatching() const {
+            return factory_.get() != nullptr;
+        }
+
+        // the id of the most recent entry of the collection, 0 if empty
+        static int64_t ReadLastChangeIndex(MongoDatabase &database);
+    };
+}
@@ -0,0 +1,351 @@
+/**
+ * MongoDB Plugin - A plugin for Orthanc DICOM Server for storing DICOM data in MongoDB Database
+ * Copyright (C) 2017 - 2023  (Doc Cirrus GmbH)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#include "MongoDBCounters.h"
+
+#include <Logging.h>
+#include <OrthancException.h>
+#include <Toolbox.h>
+
+#include <mongocxx/exception/operation_exception.hpp>
+
+#include <chrono>
+#include <functional>
+#include <thread>
+
+using bsoncxx::builder::basic::array;
+
+namespace OrthancDatabases {
+    static const unsigned int COUNTER_SLOTS = 16;
+
+    // the scan of the collections is given up after this number of attempts with moving counters
+    static const unsigned int MAX_RECONCILE_ATTEMPTS = 3;
+
+    // "_id" of the document of "Counters" holding the lease of the reconciliation, the slots being numbers
+    static const char *const LEASE_ID = "reconciliation";
+
+    static const char *const RESOURCE_FIELDS[4] = {"patients", "studies", "series", "instances"};
+
+    static int64_t GetInt64(const bsoncxx::document::view &doc, const char *field) {
+        auto element = doc[field];
+
+        if (!element) {
+            return 0;
+        }
+
+        switch (element.type()) {
+            case bsoncxx::type::k_int64:
+                return element.get_int64().value;
+            case bsoncxx::type::k_int32:
+                return element.get_int32().value;
+            default:
+                return 0;
+        }
+    }
+
+    // sums of the sizes of the attachments matching "filter"
+    static void SumAttachments(int64_t &compressedSize, int64_t &uncompressedSize, MongoDatabase &database,
+                               bsoncxx::document::view filter) {
+        mongocxx::pipeline stages;
+        stages.match(filter);
+        stages.group(make_document(
+                kvp("_id", bsoncxx::types::b_null()),
+                kvp("compressedSize", make_document(kvp("$sum", "$compressedSize"))),
+                kvp("uncompressedSize", make_document(kvp("$sum", "$uncompressedSize")))
+        ));
+
+        compressedSize = 0;
+        uncompressedSize = 0;
+
+        auto cursor = database.GetCollection("AttachedFiles").aggregate(stages);
+
+        for (auto &&doc: cursor) {
+            compressedSize = GetInt64(doc, "compressedSize");
+            uncompressedSize = GetInt64(doc, "uncompressedSize");
+        }
+    }
+
+    void MongoDBCounters::Apply(MongoDatabase &database, const Totals &delta) {
+        if (delta.IsEmpty()) {
+            return;
+        }
+
+        bsoncxx::builder::basic::document increments;
+
+        if (delta.compressedSize != 0) {
+            increments.append(kvp("compressedSize", delta.compressedSize));
+        }
+
+        if (delta.uncompressedSize != 0) {
+            increments.append(kvp("uncompressedSize", delta.uncompressedSize));
+        }
+
+        for (int level = 0; level < 4; level++) {
+            if (delta.resources[level] != 0) {
+                increments.append(kvp(RESOURCE_FIELDS[level], delta.resources[level]));
+            }
+        }
+
+        // the threads of Orthanc each tend to update their own slot
+        const int32_t slot = static_cast<int32_t>(std::hash<std::thread::id>()(std::this_thread::get_id()) %
+                                                  COUNTER_SLOTS);
+
+        mongocxx::model::update_one update{
+                make_document(kvp("_id", slot)),
+                make_document(kvp("$inc", increments.extract()))
+        };
+        update.upsert(true);
+
+        database.GetCollection("Counters").Defer(std::move(update), true);
+    }
+
+    void MongoDBCounters::Read(Totals &target, MongoDatabase &database) {
+        target = Totals();
+
+        auto cursor = database.GetCollection("Counters").find(make_document());
+
+        for (auto &&doc: cursor) {
+            target.compressedSize += GetInt64(doc, "compressedSize");
+            target.uncompressedSize += GetInt64(doc, "uncompressedSize");
+
+            for (int level = 0; level < 4; level++) {
+                target.resources[level] += GetInt64(doc, RESOURCE_FIELDS[level]);
+            }
+        }
+    }
+
+    // the totals of the collections, excluding the resources waiting for the purge
+    static void ComputeTotals(MongoDBCounters::Totals &actual, MongoDatabase &database) {
+        actual = MongoDBCounters::Totals();
+
+        SumAttachments(actual.compressedSize, actual.uncompressedSize, database, make_document().view());
+
+        {
+            // the resources waiting for the purge have no "resourceType" anymore
+            mongocxx::pipeline stages;
+            stages.match(make_document(kvp("resourceType", make_document(kvp("$exists", true)))));
+            stages.group(make_document(kvp("_id", "$resourceType"), kvp("count", make_document(kvp("$sum", 1)))));
+
+            auto cursor = database.GetCollection("Resources").aggregate(stages);
+
+            for (auto &&doc: cursor) {
+                if (doc["_id"].type() == bsoncxx::type::k_int32) {
+                    const int32_t level = doc["_id"].get_int32().value;
+
+                    if (level >= 0 && level < 4) {
+                        actual.resources[level] = GetInt64(doc, "count");
+                    }
+                }
+            }
+        }
+
+        {
+            // the attachments of the resources waiting for the purge are not counted anymore
+            mongocxx::options::find options;
+            options.projection(make_document(kvp("deleted.internalId", 1)));
+
+            auto cursor = database.GetCollection("Resources").find(
+                    make_document(kvp("deleted.internalId", make_document(kvp("$exists", true)))), options
+            );
+
+            std::vector<int64_t> batch;
+
+            auto subtract = [&]() {
+                if (batch.empty()) {
+                    return;
+                }
+
+                array ids;
+                for (const auto &id: batch) {
+                    ids.append(id);
+                }
+
+                int64_t compressedSize, uncompressedSize;
+                SumAttachments(compressedSize, uncompressedSize, database,
+                               make_document(kvp("id", make_document(kvp("$in", ids.extract())))).view());
+
+                actual.compressedSize -= compressedSize;
+                actual.uncompressedSize -= uncompressedSize;
+                batch.clear();
+            };
+
+            for (auto &&doc: cursor) {
+                batch.push_back(doc["deleted"]["internalId"].get_int64().value);
+
+                if (batch.size() >= 1000) {
+                    subtract();
+                }
+            }
+
+            subtract();
+        }
+    }
+
+    bool MongoDBCounters::Reconcile(MongoDatabase &database) {
+        Totals actual;
+        Totals current;
+
+        for (unsigned int attempt = 0;; attempt++) {
+            if (attempt == MAX_RECONCILE_ATTEMPTS) {
+                LOG(INFO) << "The counters of the MongoDB index keep changing, their reconciliation is postponed";
+                return false;
+            }
+
+            Totals before;
+            Read(before, database);
+
+            ComputeTotals(actual, database);
+
+            Read(current, database);
+
+            if (current.IsEqual(before)) {
+                break;
+            }
+        }
+
+        Totals correction;
+        correction.compressedSize = actual.compressedSize - current.compressedSize;
+        correction.uncompressedSize = actual.uncompressedSize - current.uncompressedSize;
+
+        for (int level = 0; level < 4; level++) {
+            correction.resources[level] = actual.resources[level] - current.resources[level];
+        }
+
+        if (!correction.IsEmpty()) {
+            LOG(WARNING) << "Correcting the counters of the MongoDB index by " << correction.compressedSize
+                         << " compressed bytes, " << correction.uncompressedSize << " uncompressed bytes, "
+                         << correction.resources[0] << " patient(s), " << correction.resources[1] << " study(ies), "
+                         << correction.resources[2] << " series and " << correction.resources[3] << " instance(s)";
+
+            Apply(database, correction);
+            database.GetWriteBuffer().Flush();
+        }
+
+        return true;
+    }
+
+    bool MongoDBCounters::AcquireLease(MongoDatabase &database, const std::string &owner, unsigned int duration) {
+        const auto now = std::chrono::system_clock::now();
+
+        // taken over once expired, e.g. if its owner has stopped
+        auto filter = make_document(
+                kvp("_id", LEASE_ID),
+                kvp("$or", bsoncxx::builder::basic::make_array(
+                        make_document(kvp("owner", owner)),
+                        make_document(kvp("expires", make_document(kvp("$lt", bsoncxx::types::b_date(now)))))
+                ))
+        );
+
+        auto update = make_document(kvp("$set", make_document(
+                kvp("owner", owner),
+                kvp("expires", bsoncxx::types::b_date(now + std::chrono::seconds(duration)))
+        )));
+
+        mongocxx::options::update options;
+        options.upsert(true);
+
+        try {
+            database.GetCollection("Counters").GetRaw().update_one(filter.view(), update.view(), options);
+            return true;
+        } catch (const mongocxx::operation_exception &e) {
+            if (e.code().value() == 11000) {
+                // held by another Orthanc: the upsert has collided with the existing lease
+                return false;
+            }
+
+            throw;
+        }
+    }
+
+    MongoDBCounters::MongoDBCounters(IDatabaseFactory *factory, unsigned int interval) :
+            factory_(factory), interval_(interval), owner_(Orthanc::Toolbox::GenerateUuid()), done_(false) {
+        if (factory == nullptr) {
+            throw Orthanc::OrthancException(Orthanc::ErrorCode_NullPointer);
+        }
+
+        if (interval == 0) {
+            throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+        }
+    }
+
+    MongoDBCounters::~MongoDBCounters() {
+        Stop();
+    }
+
+    void MongoDBCounters::Worker() {
+        for (;;) {
+            {
+                boost::mutex::scoped_lock lock(mutex_);
+
+                const boost::system_time timeout = boost::get_system_time() + boost::posix_time::seconds(interval_);
+
+                while (!done_) {
+                    if (!wakeup_.timed_wait(lock, timeout)) {
+                        break;
+                    }
+                }
+
+                if (done_) {
+                    return;
+                }
+            }
+
+            try {
+                std::unique_ptr<IDatabase> connection(factory_->Open());
+                auto &database = dynamic_cast<MongoDatabase &>(*connection);
+
+                // renewed at every round, and left to another Orthanc if this one misses two of them
+                if (AcquireLease(database, owner_, 2 * interval_)) {
+                    Reconcile(database);
+                }
+            } catch (const Orthanc::OrthancException &e) {
+                LOG(ERROR) << "Cannot reconcile the counters of the MongoDB index: " << e.What();
+            } catch (const std::exception &e) {
+                LOG(ERROR) << "Cannot reconcile the counters of the MongoDB index: " << e.what();
+            }
+        }
+    }
+
+    void MongoDBCounters::Start() {
+        if (thread_.joinable()) {
+            throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+        }
+
+        {
+            boost::mutex::scoped_lock lock(mutex_);
+            done_ = false;
+        }
+
+        thread_ = boost::thread(&MongoDBCounters::Worker, this);
+    }
+
+    void MongoDBCounters::Stop() {
+        {
+            boost::mutex::scoped_lock lock(mutex_);
+            done_ = true;
+        }
+
+        wakeup_.notify_all();
+
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+    }
+}
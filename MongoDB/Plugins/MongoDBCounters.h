@@ -0,0 +1,95 @@
+/**
+ * MongoDB Plugin - A plugin for Orthanc DICOM Server for storing DICOM data in MongoDB Database
+ * Copyright (C) 2017 - 2023  (Doc Cirrus GmbH)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#pragma once
+
+#include "../../Framework/Common/IDatabaseFactory.h"
+#include "../../Framework/MongoDB/MongoDatabase.h"
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread.hpp>
+
+#include <memory>
+#include <string>
+
+namespace OrthancDatabases {
+    /**
+     * Totals of the index (size of the attachments, number of resources per level), maintained with "$inc" in the
+     * "Counters" collection by the writes of the index, so that reading them does not scan "AttachedFiles" or
+     * "Resources". The totals are spread over several documents, one per slot, so that concurrent transactions
+     * rarely update the same document.
+     **/
+    class MongoDBCounters : public boost::noncopyable {
+    public:
+        struct Totals {
+            int64_t compressedSize = 0;
+            int64_t uncompressedSize = 0;
+            int64_t resources[4] = {0, 0, 0, 0};  // indexed by OrthancPluginResourceType
+
+            bool IsEmpty() const {
+                return (compressedSize == 0 && uncompressedSize == 0 && resources[0] == 0 && resources[1] == 0 &&
+                        resources[2] == 0 && resources[3] == 0);
+            }
+
+            bool IsEqual(const Totals &other) const {
+                return (compressedSize == other.compressedSize && uncompressedSize == other.uncompressedSize &&
+                        resources[0] == other.resources[0] && resources[1] == other.resources[1] &&
+                        resources[2] == other.resources[2] && resources[3] == other.resources[3]);
+            }
+        };
+
+    private:
+        std::unique_ptr<IDatabaseFactory> factory_;
+        unsigned int interval_;
+        std::string owner_;  // of the lease of the reconciliation, unique to this process
+
+        boost::mutex mutex_;
+        boost::condition_variable wakeup_;
+        bool done_;
+        boost::thread thread_;
+
+        void Worker();
+
+    public:
+        // queues the increments in the write buffer of "database", i.e. in the transaction in progress
+        static void Apply(MongoDatabase &database, const Totals &delta);
+
+        static void Read(Totals &target, MongoDatabase &database);
+
+        // Recomputes the totals from "AttachedFiles" and "Resources", and corrects the counters by the difference.
+        // The counters are read before and after the scan, which is retried if they have moved meanwhile, as the
+        // scan would then miss some of their increments. False if they never stood still, nothing being corrected.
+        static bool Reconcile(MongoDatabase &database);
+
+        // Only one of the Orthanc sharing the database reconciles the counters at a time, the one holding the lease
+        // stored in "Counters". True if "owner" holds it for "duration" seconds from now.
+        static bool AcquireLease(MongoDatabase &database, const std::string &owner, unsigned int duration);
+
+        // takes the ownership of "factory", "interval" is in seconds
+        MongoDBCounters(IDatabaseFactory *factory, unsigned int interval);
+
+        ~MongoDBCounters();
+
+        // reconciles the counters every "interval" seconds, in a thread of its own
+        void Start();
+
+        void Stop();
+    };
+}
@@ -23,6 +23,7 @@
 #include <mongocxx/client.hpp>
 #include <mongocxx/instance.hpp>
 #include <mongocxx/cursor.hpp>
+#include <mongocxx/exception/operation_exception.hpp>
 
 #include "../../Framework/Plugins/GlobalProperties.h"
 #include "../../Framework/MongoDB/MongoDatabase.h"
@@ -31,6 +32,13 @@
 #include <Logging.h>
 #include <OrthancException.h>
 
+#include <boost/lexical_cast.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <set>
+#include <tuple>
+
 // mongocxx related
 using bsoncxx::type;
 using bsoncxx::builder::basic::kvp;
@@ -59,18 +67,212 @@ namespace OrthancDatabases {
         return s;
     }
 
+    // set once the "0".."3" fields of all the resources only contain the ids of their ancestors
+    static const int32_t GlobalProperty_AncestorOnlyResources = Orthanc::GlobalProperty_DatabaseInternal0;
+
+    // present during a bulk load, holds the last internal id allocated before it started
+    static const int32_t GlobalProperty_BulkLoadWatermark = Orthanc::GlobalProperty_DatabaseInternal1;
+
+    // set once the "Counters" collection has been initialized from the existing collections
+    static const int32_t GlobalProperty_CountersInitialized = Orthanc::GlobalProperty_DatabaseInternal2;
+
+    // set once the recycling order has been moved from "PatientRecyclingOrder" into the patients themselves
+    static const int32_t GlobalProperty_RecyclingOnPatients = Orthanc::GlobalProperty_DatabaseInternal3;
+
+    // Orthanc adds the attachments of an instance, and logs the changes of its levels, right after creating it, in
+    // the same transaction and thus on the same thread: remembering the last created instance saves a lookup each
+    struct CreatedInstance {
+        int64_t internalIds[4] = {-1, -1, -1, -1};
+        std::string publicIds[4];
+    };
+
+    static thread_local CreatedInstance lastInstance_;
+
+    // adds "delta" to the total size of the attachments of the patient of "resourceId"
+    static void AddToPatientSize(MongoDatabase &database, int64_t resourceId, int64_t delta) {
+        if (delta == 0) {
+            return;
+        }
+
+        int64_t patient;
+
+        if (resourceId == lastInstance_.internalIds[3]) {
+            patient = lastInstance_.internalIds[0];
+        } else {
+            mongocxx::options::find options;
+            options.projection(make_document(kvp("0", 1)));
+
+            auto resource = database.GetCollection("Resources").find_one(
+                    make_document(kvp("internalId", resourceId)), options
+            );
+
+            if (!resource || !resource->view()["0"] || resource->view()["0"].type() != type::k_int64) {
+                return;
+            }
+
+            patient = resource->view()["0"].get_int64().value;
+        }
+
+        database.GetCollection("Resources").Defer(mongocxx::model::update_one{
+                make_document(kvp("internalId", patient)),
+                make_document(kvp("$inc", make_document(kvp("size", delta))))
+        }, true);
+    }
+
+    // Older releases kept the recycling order in a "PatientRecyclingOrder" collection, an unprotected patient having
+    // an entry with a sequence number. The sequence numbers become the "recyclingStamp" of the patients, which
+    // keeps their order as they are far below the stamps allocated from now on, and the patients without entry are
+    // flagged as protected, except those created by a bulk load in progress (above "watermark"). The compressed
+    // size of the attachments of each patient is computed at the same time.
+    static void MigrateRecyclingToPatients(MongoDatabase &database, int64_t watermark) {
+        auto resources = database.GetCollection("Resources");
+
+        auto flush = [&resources](std::vector<mongocxx::model::write> &writes) {
+            if (!writes.empty()) {
+                auto bulk = resources.create_bulk_write();
+                for (auto &write: writes) {
+                    bulk.append(write);
+                }
+                bulk.execute();
+                writes.clear();
+            }
+        };
+
+        std::vector<mongocxx::model::write> writes;
+
+        {
+            auto cursor = database.GetCollection("PatientRecyclingOrder").find(make_document());
+
+            for (auto &&doc: cursor) {
+                writes.emplace_back(mongocxx::model::update_one{
+                        make_document(kvp("internalId", doc["patientId"].get_int64().value)),
+                        make_document(kvp("$set", make_document(kvp("recyclingStamp", doc["id"].get_int64().value))))
+                });
+
+                if (writes.size() >= 1000) {
+                    flush(writes);
+                }
+            }
+
+            flush(writes);
+        }
+
+        bsoncxx::builder::basic::document unqueued;
+        unqueued.append(kvp("resourceType", static_cast<int32_t>(OrthancPluginResourceType_Patient)));
+        unqueued.append(kvp("recyclingStamp", make_document(kvp("$exists", false))));
+
+        if (watermark >= 0) {
+            unqueued.append(kvp("internalId", make_document(kvp("$lte", watermark))));
+        }
+
+        resources.update_many(unqueued.extract(), make_document(kvp("$set", make_document(kvp("protected", true)))));
+
+        {
+            mongocxx::pipeline pipeline;
+            pipeline.lookup(make_document(
+                    kvp("from", "Resources"),
+                    kvp("localField", "id"),
+                    kvp("foreignField", "internalId"),
+                    kvp("as", "resource")
+            ));
+            pipeline.unwind("$resource");
+            pipeline.group(make_document(
+                    kvp("_id", "$resource.0"),
+                    kvp("size", make_document(kvp("$sum", "$compressedSize")))
+            ));
+
+            mongocxx::options::aggregate options;
+            options.allow_disk_use(true);
+
+            auto cursor = database.GetCollection("AttachedFiles").aggregate(pipeline, options);
+
+            for (auto &&doc: cursor) {
+                if (doc["_id"].type() != type::k_int64) {
+                    continue;
+                }
+
+                writes.emplace_back(mongocxx::model::update_one{
+                        make_document(kvp("internalId", doc["_id"].get_int64().value)),
+                        make_document(kvp("$set", make_document(kvp("size", doc["size"].get_int64().value))))
+                });
+
+                if (writes.size() >= 1000) {
+                    flush(writes);
+                }
+            }
+
+            flush(writes);
+        }
+
+        database.GetObject()["PatientRecyclingOrder"].drop();
+    }
+
+    // Older releases stored, in the "0".."3" fields of each resource, the arrays of the ids of all its ancestors
+    // and descendants. Keep the ancestors (and the resource itself) as scalars, and drop the descendants.
+    static void MigrateToAncestorOnlyResources(MongoDatabase &database) {
+        auto collection = database.GetCollection("Resources");
+
+        for (int32_t level = 0; level < 4; level++) {
+            bsoncxx::builder::basic::document set;
+            for (int32_t i = 0; i <= level; i++) {
+                const std::string field = std::to_string(i);
+                set.append(kvp(field, make_document(kvp("$arrayElemAt", make_array("$" + field, 0)))));
+            }
+
+            array unset;
+            for (int32_t i = level + 1; i < 4; i++) {
+                unset.append(std::to_string(i));
+            }
+
+            mongocxx::pipeline update;
+            update.append_stage(make_document(kvp("$set", set.extract())));
+            if (level < 3) {
+                update.append_stage(make_document(kvp("$unset", unset.extract())));
+            }
+
+            auto result = collection.update_many(
+                    make_document(
+                            kvp("resourceType", level),
+                            kvp(std::to_string(level), make_document(kvp("$type", "array")))
+                    ),
+                    update
+            );
+
+            if (result && result->modified_count() > 0) {
+                LOG(WARNING) << "Migrated " << result->modified_count() << " resource(s) of level " << level
+                             << " to the ancestor-only schema";
+            }
+        }
+    }
+
     IDatabaseFactory *MongoDBIndex::CreateDatabaseFactory() {
-        return MongoDatabase::CreateDatabaseFactory(url_, chunkSize_);
+        boost::mutex::scoped_lock lock(factoriesMutex_);
+
+        // Orthanc opens every connection through a factory of its own, and a connection only runs one transaction
+        // at a time: the commits can only be grouped across the factories
+        if (options_.groupCommitWindow > 0 && groupCommit_.get() == nullptr) {
+            groupCommit_ = std::make_shared<MongoGroupCommit>(options_.groupCommitWindow);
+        }
+
+        // the threads of the parallel writes, shared by the connections of Orthanc and by the background workers
+        if (options_.parallelWrites > 0 && executor_.get() == nullptr) {
+            executor_ = std::make_shared<MongoExecutor>(options_.parallelWrites);
+        }
+
+        return MongoDatabase::CreateDatabaseFactory(url_, options_, groupCommit_, executor_);
     }
 
     // protected
     // methods override for mongodb
     void MongoDBIndex::SignalDeletedFiles(
             IDatabaseBackendOutput &output,
-            mongocxx::cursor &cursor
+            mongocxx::cursor &cursor,
+            MongoDBCounters::Totals &removed
     ) {
         for (auto doc: cursor) {
-            // auto v = doc.view();
+            removed.compressedSize -= doc["compressedSize"].get_int64().value;
+            removed.uncompressedSize -= doc["uncompressedSize"].get_int64().value;
+
             output.SignalDeletedAttachment(
                     std::string(doc["uuid"].get_string().value),
                     doc["fileType"].get_int32().value,
@@ -83,16 +285,30 @@ namespace OrthancDatabases {
         }
     }
 
-    void MongoDBIndex::SignalDeletedResources(
-            IDatabaseBackendOutput &output,
-            const std::vector<bsoncxx::document::view> deleted_resources_vec
-    ) {
-        for (auto &&doc: deleted_resources_vec) {
-            output.SignalDeletedResource(
-                    std::string(doc["publicId"].get_string().value),
-                    static_cast<OrthancPluginResourceType>(doc["resourceType"].get_int32().value)
-            );
+    // only keeps in "ids" the resources that are not waiting for the purge, in the same order
+    static void RemoveDeletedResources(MongoDatabase &database, std::list<int64_t> &ids) {
+        if (ids.empty()) {
+            return;
         }
+
+        array inIds;
+        for (const auto &id: ids) {
+            inIds.append(id);
+        }
+
+        mongocxx::options::find options;
+        options.projection(make_document(kvp("internalId", 1)));
+
+        auto cursor = database.GetCollection("Resources").find(
+                make_document(kvp("internalId", make_document(kvp("$in", inIds.extract())))), options
+        );
+
+        std::set<int64_t> live;
+        for (auto &&doc: cursor) {
+            live.insert(doc["internalId"].get_int64().value);
+        }
+
+        ids.remove_if([&live](int64_t id) { return live.find(id) == live.end(); });
     }
 
     void MongoDBIndex::ConfigureDatabase(DatabaseManager &manager) {
@@ -119,9 +335,54 @@ namespace OrthancDatabases {
             throw Orthanc::OrthancException(Orthanc::ErrorCode_Database);
         }
 
+        if (options_.enableTransactions && !database.SupportsTransactions()) {
+            throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange,
+                                            "\"EnableTransactions\" requires MongoDB to run as a replica set "
+                                            "or a sharded cluster");
+        }
+
+        // capped collections cannot be written by a transaction
+        if (options_.enableTransactions &&
+            (options_.changesRetention.mode == MongoDatabase::Options::Retention_Capped ||
+             options_.exportedResourcesRetention.mode == MongoDatabase::Options::Retention_Capped)) {
+            throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange,
+                                            "The \"Capped\" retention cannot be combined with \"EnableTransactions\"");
+        }
+
+        // a bulk load interrupted by a restart goes on until it is explicitly ended
+        std::string watermark;
+        const bool resumeBulkLoad = LookupGlobalProperty(watermark, manager, MISSING_SERVER_IDENTIFIER,
+                                                         GlobalProperty_BulkLoadWatermark);
+
         {
             // indexes creation
-            database.CreateIndices();
+            if (resumeBulkLoad || bulkLoadOnStartup_) {
+                database.CreateEssentialIndices();
+            } else {
+                database.CreateIndices();
+            }
+
+            database.PrepareLogCollection("Changes");
+            database.PrepareLogCollection("ExportedResources");
+        }
+
+        {
+            int migrated = 0;
+            if (!LookupGlobalIntegerProperty(migrated, manager, MISSING_SERVER_IDENTIFIER,
+                                             GlobalProperty_AncestorOnlyResources) || migrated != 1) {
+                MigrateToAncestorOnlyResources(database);
+                SetGlobalIntegerProperty(manager, MISSING_SERVER_IDENTIFIER, GlobalProperty_AncestorOnlyResources, 1);
+            }
+        }
+
+        {
+            int migrated = 0;
+            if (!LookupGlobalIntegerProperty(migrated, manager, MISSING_SERVER_IDENTIFIER,
+                                             GlobalProperty_RecyclingOnPatients) || migrated != 1) {
+                LOG(WARNING) << "Moving the recycling order of the patients into the Resources collection";
+                MigrateRecyclingToPatients(database, resumeBulkLoad ? boost::lexical_cast<int64_t>(watermark) : -1);
+                SetGlobalIntegerProperty(manager, MISSING_SERVER_IDENTIFIER, GlobalProperty_RecyclingOnPatients, 1);
+            }
         }
 
         {
@@ -152,11 +413,177 @@ namespace OrthancDatabases {
                 throw Orthanc::OrthancException(Orthanc::ErrorCode_Database);
             }
         }
+
+        {
+            int initialized = 0;
+            if (!LookupGlobalIntegerProperty(initialized, manager, MISSING_SERVER_IDENTIFIER,
+                                             GlobalProperty_CountersInitialized) || initialized != 1) {
+                LOG(WARNING) << "Initializing the counters of the MongoDB index, this may take a while";
+
+                // otherwise left to the next start, or to the periodic reconciliation
+                if (MongoDBCounters::Reconcile(database)) {
+                    SetGlobalIntegerProperty(manager, MISSING_SERVER_IDENTIFIER, GlobalProperty_CountersInitialized,
+                                             1);
+                }
+            }
+
+            // lets Orthanc know that the total size is read from the counters, not computed
+            SetGlobalIntegerProperty(manager, MISSING_SERVER_IDENTIFIER, Orthanc::GlobalProperty_GetTotalSizeIsFast, 1);
+        }
+
+        if (counters_.get() == nullptr && countersInterval_ != 0) {
+            counters_.reset(new MongoDBCounters(CreateDatabaseFactory(), countersInterval_));
+            counters_->Start();
+        }
+
+        if (changesCache_.get() == nullptr && changesCacheSize_ != 0) {
+            changesCache_.reset(new MongoDBChangesCache(changesCacheSize_));
+
+            if (database.SupportsTransactions()) {
+                // change streams are only available on replica sets and sharded clusters
+                changesCache_->StartWatching(CreateDatabaseFactory());
+            } else {
+                changesCache_->Reset(MongoDBChangesCache::ReadLastChangeIndex(database));
+            }
+        }
+
+        if (purger_.get() == nullptr) {
+            purger_.reset(new MongoDBResourcePurger(CreateDatabaseFactory(), purgeBatchSize_, purgeThrottle_));
+            purger_->Start();
+        }
+
+        if (!options_.embeddedTags) {
+            // the embedded tags of a previous run would not be kept up to date
+            MongoDBTagsMigration::Reset(database);
+        } else if (tagsMigration_.get() == nullptr) {
+            // paced like the purge, the resources being written in both forms meanwhile
+            tagsMigration_.reset(new MongoDBTagsMigration(CreateDatabaseFactory(), purgeBatchSize_, purgeThrottle_));
+            tagsMigration_->Start();
+        }
+
+        if (resumeBulkLoad) {
+            LOG(WARNING) << "The MongoDB index is still in bulk-load mode, end it with DELETE /mongodb/bulk-load";
+            bulkLoad_ = true;
+        } else if (bulkLoadOnStartup_) {
+            EnterBulkLoad(manager);
+        }
+
+        if (tagStatisticsInterval_ != 0 && tagStatistics_.get() == nullptr) {
+            tagStatistics_.reset(new MongoDBTagStatistics(CreateDatabaseFactory(), tagStatisticsInterval_));
+            tagStatistics_->SetPaused(bulkLoad_);
+            tagStatistics_->Start();
+        }
+    }
+
+    void MongoDBIndex::EnterBulkLoad(DatabaseManager &manager) {
+        boost::mutex::scoped_lock lock(bulkLoadMutex_);
+
+        if (bulkLoad_) {
+            return;
+        }
+
+        auto &database = dynamic_cast<MongoDatabase &>(manager.GetDatabase());
+
+        // the patients created from now on get their recycling order when the bulk load ends
+        int64_t watermark = 0;
+
+        auto last = database.GetCollection("Resources").find_one(
+                make_document(),
+                mongocxx::options::find{}.sort(make_document(kvp("internalId", -1)))
+                        .projection(make_document(kvp("internalId", 1)))
+        );
+
+        if (last) {
+            watermark = last->view()["internalId"].get_int64().value;
+        }
+
+        SetGlobalProperty(manager, MISSING_SERVER_IDENTIFIER, GlobalProperty_BulkLoadWatermark,
+                          boost::lexical_cast<std::string>(watermark).c_str());
+        database.DropSecondaryIndices();
+
+        if (tagStatistics_.get() != nullptr) {
+            tagStatistics_->SetPaused(true);
+        }
+
+        bulkLoad_ = true;
+        LOG(WARNING) << "The MongoDB index has entered bulk-load mode";
+    }
+
+    void MongoDBIndex::ExitBulkLoad(DatabaseManager &manager) {
+        boost::mutex::scoped_lock lock(bulkLoadMutex_);
+
+        if (!bulkLoad_) {
+            return;
+        }
+
+        auto &database = dynamic_cast<MongoDatabase &>(manager.GetDatabase());
+
+        LOG(WARNING) << "Rebuilding the secondary indexes of the MongoDB index after a bulk load";
+        database.CreateSecondaryIndices();
+
+        // The patients created during the bulk load, and not protected meanwhile, are queued for recycling in the
+        // order of their creation. They are the only unprotected patients without a stamp: their ids cannot be
+        // compared with the watermark, as they may come from blocks of ids reserved before the bulk load began.
+        auto resources = database.GetCollection("Resources");
+
+        mongocxx::options::find options;
+        options.projection(make_document(kvp("internalId", 1)));
+        options.sort(make_document(kvp("internalId", 1)));
+
+        auto cursor = resources.find(make_document(
+                kvp("resourceType", static_cast<int32_t>(OrthancPluginResourceType_Patient)),
+                kvp("recyclingStamp", make_document(kvp("$exists", false))),
+                kvp("protected", make_document(kvp("$ne", true)))
+        ), options);
+
+        std::vector<mongocxx::model::write> stamps;
+        size_t count = 0;
+
+        auto flush = [&]() {
+            if (!stamps.empty()) {
+                auto bulk = resources.create_bulk_write();
+                for (auto &stamp: stamps) {
+                    bulk.append(stamp);
+                }
+                bulk.execute();
+                count += stamps.size();
+                stamps.clear();
+            }
+        };
+
+        for (auto &&doc: cursor) {
+            stamps.emplace_back(mongocxx::model::update_one{
+                    make_document(kvp("internalId", doc["internalId"].get_int64().value)),
+                    make_document(kvp("$set", make_document(kvp("recyclingStamp", NextRecyclingStamp()))))
+            });
+
+            if (stamps.size() >= 1000) {
+                flush();
+            }
+        }
+
+        flush();
+
+        database.GetCollection("GlobalProperties").delete_many(
+                make_document(kvp("property", GlobalProperty_BulkLoadWatermark))
+        );
+
+        if (tagStatistics_.get() != nullptr) {
+            tagStatistics_->SetPaused(false);
+        }
+
+        bulkLoad_ = false;
+        LOG(WARNING) << "The MongoDB index has left bulk-load mode, " << count
+                     << " patient(s) added to the recycling order";
     }
 
 
     MongoDBIndex::MongoDBIndex(OrthancPluginContext *context, const std::string &url, const int &chunkSize) :
-            IndexBackend(context), url_(url), chunkSize_(chunkSize) {
+            IndexBackend(context), url_(url), bulkLoad_(false), bulkLoadOnStartup_(false),
+            purgeBatchSize_(500), purgeThrottle_(100), countersInterval_(3600), lastRecyclingStamp_(0),
+            changesCacheSize_(0), prefetchMatches_(true), inProcessLookups_(true), tagStatisticsInterval_(0) {
+        options_.chunkSize = chunkSize;
+
         if (url_.empty()) {
             throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
         }
@@ -164,7 +591,47 @@ namespace OrthancDatabases {
 
 
     MongoDBIndex::MongoDBIndex(OrthancPluginContext *context) :
-            IndexBackend(context) {
+            IndexBackend(context), bulkLoad_(false), bulkLoadOnStartup_(false), purgeBatchSize_(500),
+            purgeThrottle_(100), countersInterval_(3600), lastRecyclingStamp_(0), changesCacheSize_(0),
+            prefetchMatches_(true), inProcessLookups_(true), tagStatisticsInterval_(0) {
+    }
+
+    int64_t MongoDBIndex::NextRecyclingStamp() {
+        // microseconds since the epoch, so that the stamps of several Orthanc sharing the database roughly agree,
+        // and strictly increasing within this process
+        const int64_t now = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count();
+
+        int64_t last = lastRecyclingStamp_.load();
+        int64_t next;
+
+        do {
+            next = std::max(now, last + 1);
+        } while (!lastRecyclingStamp_.compare_exchange_weak(last, next));
+
+        return next;
+    }
+
+    MongoDBIndex::~MongoDBIndex() {
+        if (purger_.get() != nullptr) {
+            purger_->Stop();
+        }
+
+        if (counters_.get() != nullptr) {
+            counters_->Stop();
+        }
+
+        if (tagsMigration_.get() != nullptr) {
+            tagsMigration_->Stop();
+        }
+
+        if (tagStatistics_.get() != nullptr) {
+            tagStatistics_->Stop();
+        }
+
+        if (changesCache_.get() != nullptr) {
+            changesCache_->StopWatching();
+        }
     }
 
     void MongoDBIndex::AddAttachment(DatabaseManager &manager,
@@ -174,6 +641,8 @@ namespace OrthancDatabases {
         auto &database = dynamic_cast<MongoDatabase &>(manager.GetDatabase());
         auto collection = database.GetCollection("AttachedFiles");
 
+        InvalidateSummary(database, id);
+
         auto attachment_document = make_document(
                 kvp("id", id),
                 kvp("fileType", attachment.contentType),
@@ -186,7 +655,14 @@ namespace OrthancDatabases {
                 kvp("revision", revision)
         );
 
-        collection.insert_one(attachment_document.view());
+        collection.Defer(mongocxx::model::insert_one{std::move(attachment_document)}, true);
+
+        MongoDBCounters::Totals added;
+        added.compressedSize = static_cast<int64_t>(attachment.compressedSize);
+        added.uncompressedSize = static_cast<int64_t>(attachment.uncompressedSize);
+        MongoDBCounters::Apply(database, added);
+
+        AddToPatientSize(database, id, added.compressedSize);
     }
 
     void MongoDBIndex::AttachChild(DatabaseManager &manager,
@@ -199,20 +675,58 @@ namespace OrthancDatabases {
                 make_document(kvp("internalId", child)),
                 make_document(kvp("$set", make_document(kvp("parentId", parent))))
         );
+
+        // only used by the versions of Orthanc that do not call CreateInstance(), the subtrees are not tracked
+        if (subtreeCache_.get() != nullptr) {
+            subtreeCache_->Clear();
+        }
+
+        InvalidateQueries(database);
     }
 
     void MongoDBIndex::ClearChanges(DatabaseManager &manager) {
         auto &database = dynamic_cast<MongoDatabase &>(manager.GetDatabase());
-        auto collection = database.GetCollection("Changes");
+        database.ResetLogCollection("Changes");
+
+        if (changesCache_.get() != nullptr && !changesCache_->IsWatching()) {
+            changesCache_->Reset(0);
+        }
 
-        collection.delete_many({});
+        // Changes.internalId is a secondary index, rebuilt by ExitBulkLoad() during a bulk load
+        if (!bulkLoad_) {
+            database.CreateSecondaryIndices();
+        }
     }
 
     void MongoDBIndex::ClearExportedResources(DatabaseManager &manager) {
         auto &database = dynamic_cast<MongoDatabase &>(manager.GetDatabase());
-        auto collection = database.GetCollection("ExportedResources");
+        database.ResetLogCollection("ExportedResources");
+    }
+
+    // Adds the retention fields of a new entry of "log", and every WINDOW_TRIM_INTERVAL entries removes those that
+    // fell out of the window. Each id being handed out once, a single connection trims each range.
+    static void ApplyRetention(MongoDatabase &database, const std::string &log, int64_t id,
+                               bsoncxx::builder::basic::document &entry) {
+        static const int64_t WINDOW_TRIM_INTERVAL = 1000;
+
+        const MongoDatabase::Options::Retention &retention = database.GetOptions().GetRetention(log);
+
+        switch (retention.mode) {
+            case MongoDatabase::Options::Retention_TTL:
+                entry.append(kvp("createdAt", bsoncxx::types::b_date(std::chrono::system_clock::now())));
+                break;
 
-        collection.delete_many({});
+            case MongoDatabase::Options::Retention_Window:
+                if (id % WINDOW_TRIM_INTERVAL == 0 && id > retention.limit) {
+                    database.GetCollection(log).Defer(mongocxx::model::delete_many{
+                            make_document(kvp("id", make_document(kvp("$lte", id - retention.limit))))
+                    }, false);
+                }
+                break;
+
+            default:
+                break;
+        }
     }
 
     void MongoDBIndex::DeleteAttachment(IDatabaseBackendOutput &output,
@@ -221,6 +735,8 @@ namespace OrthancDatabases {
                                         int32_t attachment) {
         auto &database = dynamic_cast<MongoDatabase &>(manager.GetDatabase());
 
+        InvalidateSummary(database, id);
+
         {
             auto collection = database.GetCollection("AttachedFiles");
 
@@ -229,13 +745,15 @@ namespace OrthancDatabases {
                     kvp("fileType", attachment)
             );
 
-            mongocxx::pipeline stages;
-            stages.match(match.view());
-
-            auto attachedCursor = collection.aggregate(stages, mongocxx::options::aggregate{});
+            // the attachments are read before being deleted, the cursor being only evaluated when iterated
+            MongoDBCounters::Totals removed;
+            auto attachedCursor = collection.find(match.view());
+            SignalDeletedFiles(output, attachedCursor, removed);
 
             collection.delete_many(match.view());
-            SignalDeletedFiles(output, attachedCursor);
+            MongoDBCounters::Apply(database, removed);
+
+            AddToPatientSize(database, id, removed.compressedSize);
         }
 
     }
@@ -246,6 +764,8 @@ namespace OrthancDatabases {
         auto &database = dynamic_cast<MongoDatabase &>(manager.GetDatabase());
         auto collection = database.GetCollection("Metadata");
 
+        InvalidateSummary(database, id);
+
         collection.delete_many(make_document(
                 kvp("id", static_cast<int64_t>(id)),
                 kvp("type", metadataType)
@@ -260,72 +780,150 @@ namespace OrthancDatabases {
 
         // resources collection
         auto collection = database.GetCollection(databaseInstance, "Resources");
+        auto attachedFiles = database.GetCollection(databaseInstance, "AttachedFiles");
 
         int64_t parent = -1;
+        int64_t patient = -1;
+        MongoDBCounters::Totals removed;
+
+        // without change stream, the changes of the deleted resources are dropped from the cache at the commit
+        const bool forgetChanges = (changesCache_.get() != nullptr && !changesCache_->IsWatching());
+        std::set<int64_t> deleted;
+
+        // public ids of the deleted resources indexed by internal id, to be dropped from the cache of the identities
+        std::map<int64_t, std::string> forgotten;
+
+        // the studies whose subtree changes
+        std::set<int64_t> studies;
+
+        // each resource holds the ids of all its ancestors, and ids are unique across levels, so the subtree is
+        // whatever points to "id" in one of the level fields
+        auto subtree = make_document(
+                kvp("$or", make_array(
+                        make_document(kvp("internalId", id)),
+                        make_document(kvp("0", id)),
+                        make_document(kvp("1", id)),
+                        make_document(kvp("2", id))
+                ))
+        );
 
-        // remove resources
+        // signal the resources of the subtree, and their attachments by batches of bounded size
         {
-            std::vector<bsoncxx::document::view> deleted_resources_vec;
+            std::vector<int64_t> batch;
 
-            // find all resources to delete
-            mongocxx::pipeline stages;
-            auto resources_to_delete = array{};
+            auto signalAttachments = [&]() {
+                if (batch.empty()) {
+                    return;
+                }
 
-            auto match_stage = make_document(kvp("internalId", id));
-            auto add_field_stage = make_document(kvp("root", "$$ROOT"));
-            auto graph_lookup_stage = make_document(
-                    kvp("from", "Resources"),
-                    kvp("startWith", "$internalId"),
-                    kvp("connectFromField", "internalId"),
-                    kvp("connectToField", "parentId"),
-                    kvp("as", "children")
-            );
-            auto concat_fields_stage = make_document(
-                    kvp("items", make_document(
-                            kvp("$concatArrays", make_array(make_array("$root"), "$children"))
-                    ))
-            );
-            auto unwind_stage = make_document(kvp("path", "$items"));
-            auto replace_root_stage = make_document(kvp("newRoot", "$items"));
+                array ids;
+                for (const auto &internalId: batch) {
+                    ids.append(internalId);
+                }
+
+                auto cursor = attachedFiles.find(make_document(kvp("id", make_document(kvp("$in", ids.extract())))));
+                SignalDeletedFiles(output, cursor, removed);
+                batch.clear();
+            };
+
+            mongocxx::options::find options;
+            options.projection(make_document(
+                    kvp("internalId", 1), kvp("parentId", 1), kvp("publicId", 1), kvp("resourceType", 1), kvp("0", 1),
+                    kvp("1", 1)
+            ));
+
+            auto cursor = collection.find(subtree.view(), options);
+
+            for (auto &&doc: cursor) {
+                const int64_t internalId = doc["internalId"].get_int64().value;
+
+                if (internalId == id && doc["parentId"] && doc["parentId"].type() == type::k_int64) {
+                    parent = doc["parentId"].get_int64().value;
+                    patient = doc["0"].get_int64().value;
+                }
+
+                const int32_t level = doc["resourceType"].get_int32().value;
+
+                output.SignalDeletedResource(
+                        std::string(doc["publicId"].get_string().value),
+                        static_cast<OrthancPluginResourceType>(level)
+                );
+
+                if (level >= 0 && level < 4) {
+                    removed.resources[level]--;
+                }
 
-            stages.match(match_stage.view());
-            stages.add_fields(add_field_stage.view());
-            stages.graph_lookup(graph_lookup_stage.view());
-            stages.add_fields(concat_fields_stage.view());
-            stages.unwind(unwind_stage.view());
-            stages.replace_root(replace_root_stage.view());
+                batch.push_back(internalId);
+                if (forgetChanges) {
+                    deleted.insert(internalId);
+                }
 
-            auto deletedResourcesCursor = collection.aggregate(stages, mongocxx::options::aggregate{});
+                if (resourceCache_.get() != nullptr) {
+                    forgotten[internalId] = std::string(doc["publicId"].get_string().value);
+                }
 
-            for (auto &&doc: deletedResourcesCursor) {
-                int64_t internalId = doc["internalId"].get_int64().value;
-                int64_t parentId = doc["parentId"].type() == type::k_int64 ? doc["parentId"].get_int64().value : -1;
+                if (subtreeCache_.get() != nullptr && level >= 1) {
+                    studies.insert(doc["1"].get_int64().value);
+                }
 
-                parent = (internalId == id) ? parentId : parent;
+                InvalidateSummary(database, internalId);
 
-                resources_to_delete.append(internalId);
-                deleted_resources_vec.push_back(doc);
+                if (batch.size() >= 1000) {
+                    signalAttachments();
+                }
             }
 
-            auto inCriteria = make_document(kvp("$in", resources_to_delete.extract()));
-            auto byIdValue = make_document(kvp("id", inCriteria.view()));
-            auto byPatientIdValue = make_document(kvp("patientId", inCriteria.view()));
-            auto byInternalIdValue = make_document(kvp("internalId", inCriteria.view()));
+            signalAttachments();
+        }
+
+        // Hide the whole subtree in one write: the fields used by the lookups are moved under "deleted", where
+        // MongoDBResourcePurger finds them to remove the resources and their rows in the other collections
+        {
+            mongocxx::pipeline hide;
+            hide.append_stage(make_document(kvp("$set", make_document(kvp("deleted", make_document(
+                    kvp("internalId", "$internalId"),
+                    kvp("publicId", "$publicId"),
+                    kvp("resourceType", "$resourceType")
+            ))))));
+            hide.append_stage(make_document(kvp("$unset", make_array(
+                    "internalId", "publicId", "parentId", "resourceType", "0", "1", "2", "3", "recyclingStamp", "protected"
+            ))));
+
+            collection.update_many(subtree.view(), hide);
+        }
+
+        MongoDBCounters::Apply(database, removed);
 
-            // files to delete
-            auto attachedCursor = database.GetCollection(databaseInstance, "AttachedFiles").find(byIdValue.view());
+        // the patient remains if a study or a series is deleted
+        if (patient != -1) {
+            collection.Defer(mongocxx::model::update_one{
+                    make_document(kvp("internalId", patient)),
+                    make_document(kvp("$inc", make_document(kvp("size", removed.compressedSize))))
+            }, true);
+        }
+
+        if (purger_.get() != nullptr) {
+            purger_->Wake();
+        }
+
+        if (resourceCache_.get() != nullptr) {
+            // dropped at once for this transaction, and again at the commit for the lookups that ran meanwhile
+            resourceCache_->Remove(forgotten);
 
-            // Delete
-            database.GetCollection(databaseInstance, "Metadata").delete_many(byIdValue.view());
-            database.GetCollection(databaseInstance, "AttachedFiles").delete_many(byIdValue.view());
-            database.GetCollection(databaseInstance, "Changes").delete_many(byInternalIdValue.view());
-            database.GetCollection(databaseInstance, "PatientRecyclingOrder").delete_many(byPatientIdValue.view());
-            database.GetCollection(databaseInstance, "MainDicomTags").delete_many(byIdValue.view());
-            database.GetCollection(databaseInstance, "DicomIdentifiers").delete_many(byIdValue.view());
-            collection.delete_many(byInternalIdValue.view());
+            MongoDBResourceCache *cache = resourceCache_.get();
+            database.GetWriteBuffer().OnCommit([cache, forgotten]() {
+                cache->Remove(forgotten);
+            });
+        }
+
+        InvalidateSubtrees(database, studies);
+        InvalidateQueries(database);
 
-            SignalDeletedFiles(output, attachedCursor);
-            SignalDeletedResources(output, deleted_resources_vec);
+        if (forgetChanges) {
+            MongoDBChangesCache *cache = changesCache_.get();
+            database.GetWriteBuffer().OnCommit([cache, deleted]() {
+                cache->Remove(deleted);
+            });
         }
 
         // remain Ancestor
@@ -392,44 +990,195 @@ namespace OrthancDatabases {
     }
 
     /* Use GetOutput().AnswerChange() */
-    void MongoDBIndex::GetChanges(IDatabaseBackendOutput &output,
-                                  bool &done /*out*/,
-                                  DatabaseManager &manager,
-                                  int64_t since,
-                                  uint32_t maxResults) {
-        auto &database = dynamic_cast<MongoDatabase &>(manager.GetDatabase());
+    // Answers at most "limit" changes matching "filter", in the order of their ids, with the public id of their
+    // resource resolved by the same query. The changes of the resources that do not exist anymore, or are waiting
+    // for the purge, are dropped by the $unwind. Returns false if there is no change left after those answered.
+    static bool AnswerChanges(IDatabaseBackendOutput &output,
+                              MongoDatabase &database,
+                              bsoncxx::document::view filter,
+                              int32_t order,
+                              uint32_t limit) {
+        mongocxx::pipeline pipeline;
+        pipeline.match(filter);
+        pipeline.sort(make_document(kvp("id", order)));
+        pipeline.lookup(make_document(
+                kvp("from", "Resources"),
+                kvp("localField", "internalId"),
+                kvp("foreignField", "internalId"),
+                kvp("as", "resource")
+        ));
+        pipeline.unwind("$resource");
+        pipeline.limit(static_cast<int32_t>(limit) + 1);  // the extra change tells if there are more
+        pipeline.project(make_document(
+                kvp("_id", 0),
+                kvp("id", 1),
+                kvp("changeType", 1),
+                kvp("resourceType", 1),
+                kvp("date", 1),
+                kvp("publicId", "$resource.publicId")
+        ));
 
-        mongocxx::options::find options{};
-        options.sort(make_document(kvp("seq", 1))).limit(maxResults + 1);
-
-        done = true;
         uint32_t count = 0;
 
-        auto cursor = database.GetCollection("Changes").find(
-                make_document(kvp("id", make_document(kvp("$gt", since)))), options
-        );
+        auto cursor = database.GetCollection("Changes").aggregate(pipeline);
 
         for (auto &&doc: cursor) {
-            if (count == maxResults) {
-                done = false;
-                break;
+            if (count == limit) {
+                return true;
             }
 
             output.AnswerChange(
                     doc["id"].get_int64().value,
                     doc["changeType"].get_int32().value,
                     static_cast<OrthancPluginResourceType>(doc["resourceType"].get_int32().value),
-                    GetPublicId(manager, doc["internalId"].get_int64().value),
+                    std::string(doc["publicId"].get_string().value),
                     std::string(doc["date"].get_string().value)
             );
 
             count++;
         }
+
+        return false;
+    }
+
+    void MongoDBIndex::GetChanges(IDatabaseBackendOutput &output,
+                                  bool &done /*out*/,
+                                  DatabaseManager &manager,
+                                  int64_t since,
+                                  uint32_t maxResults) {
+        if (changesCache_.get() != nullptr) {
+            std::vector<MongoDBChangesCache::Change> changes;
+
+            if (changesCache_->LookupChanges(changes, done, since, maxResults)) {
+                for (const auto &change: changes) {
+                    output.AnswerChange(change.id, change.changeType,
+                                        static_cast<OrthancPluginResourceType>(change.resourceType),
+                                        change.publicId, change.date);
+                }
+
+                return;
+            }
+        }
+
+        auto &database = dynamic_cast<MongoDatabase &>(manager.GetDatabase());
+
+        done = !AnswerChanges(output, database, make_document(kvp("id", make_document(kvp("$gt", since)))).view(),
+                              1, maxResults);
+    }
+
+    void MongoDBIndex::SetSubtreeCacheSize(unsigned int size) {
+        if (size == 0) {
+            subtreeCache_.reset();
+        } else {
+            subtreeCache_.reset(new MongoDBSubtreeCache(static_cast<size_t>(size) * 1024 * 1024));
+        }
+    }
+
+    void MongoDBIndex::InvalidateSubtrees(MongoDatabase &database, const std::set<int64_t> &studies) {
+        if (subtreeCache_.get() == nullptr || studies.empty()) {
+            return;
+        }
+
+        // the lookups running until the commit may still load the former subtrees, which are dropped again then
+        for (const auto &study: studies) {
+            subtreeCache_->Invalidate(study);
+        }
+
+        MongoDBSubtreeCache *cache = subtreeCache_.get();
+        database.GetWriteBuffer().OnCommit([cache, studies]() {
+            for (const auto &study: studies) {
+                cache->Invalidate(study);
+            }
+        });
+    }
+
+    bool MongoDBIndex::LookupChildren(std::vector<MongoDBSubtreeCache::Child> &target,
+                                      DatabaseManager &manager,
+                                      int64_t id) {
+        if (subtreeCache_.get() == nullptr) {
+            return false;
+        }
+
+        if (subtreeCache_->LookupChildren(target, id)) {
+            return true;
+        }
+
+        auto &database = dynamic_cast<MongoDatabase &>(manager.GetDatabase());
+        auto collection = database.GetCollection("Resources");
+
+        int64_t study;
+
+        {
+            mongocxx::options::find options;
+            options.projection(make_document(kvp("_id", 0), kvp("resourceType", 1), kvp("1", 1)));
+
+            auto doc = collection.find_one(make_document(kvp("internalId", id)), options);
+            if (!doc) {
+                return false;
+            }
+
+            // the children of the patients are found directly, the instances have none
+            const int32_t level = doc->view()["resourceType"].get_int32().value;
+            if (level != 1 && level != 2) {
+                return false;
+            }
+
+            study = doc->view()["1"].get_int64().value;
+        }
+
+        const uint64_t generation = subtreeCache_->GetGeneration(study);
+
+        // the whole study at once, through the index on its ancestor field
+        auto subtree = std::make_shared<MongoDBSubtreeCache::Subtree>();
+        (*subtree)[study];
+
+        mongocxx::options::find options;
+        options.projection(make_document(
+                kvp("_id", 0), kvp("internalId", 1), kvp("parentId", 1), kvp("publicId", 1), kvp("resourceType", 1)
+        ));
+
+        auto cursor = collection.find(make_document(kvp("1", study)), options);
+
+        for (auto &&doc: cursor) {
+            const int32_t level = doc["resourceType"].get_int32().value;
+            if (level != 2 && level != 3) {
+                continue;
+            }
+
+            MongoDBSubtreeCache::Child child;
+            child.internalId = doc["internalId"].get_int64().value;
+            child.publicId = std::string(doc["publicId"].get_string().value);
+
+            if (level == 2) {
+                (*subtree)[child.internalId];
+            }
+
+            (*subtree)[doc["parentId"].get_int64().value].push_back(std::move(child));
+        }
+
+        target = (*subtree)[id];
+
+        MongoDBSubtreeCache *cache = subtreeCache_.get();
+        database.GetWriteBuffer().OnCommit([cache, study, subtree, generation]() {
+            cache->Add(study, *subtree, generation);
+        });
+
+        return true;
     }
 
     void MongoDBIndex::GetChildrenInternalId(std::list<int64_t> &target /*out*/,
                                              DatabaseManager &manager,
                                              int64_t id) {
+        std::vector<MongoDBSubtreeCache::Child> children;
+
+        if (LookupChildren(children, manager, id)) {
+            for (const auto &child: children) {
+                target.push_back(child.internalId);
+            }
+
+            return;
+        }
+
         auto &database = dynamic_cast<MongoDatabase &>(manager.GetDatabase());
 
         auto cursor = database.GetCollection("Resources").find(make_document(kvp("parentId", id)));
@@ -442,6 +1191,16 @@ namespace OrthancDatabases {
     void MongoDBIndex::GetChildrenPublicId(std::list<std::string> &target /*out*/,
                                            DatabaseManager &manager,
                                            int64_t id) {
+        std::vector<MongoDBSubtreeCache::Child> children;
+
+        if (LookupChildren(children, manager, id)) {
+            for (const auto &child: children) {
+                target.push_back(child.publicId);
+            }
+
+            return;
+        }
+
         auto &database = dynamic_cast<MongoDatabase &>(manager.GetDatabase());
 
         auto cursor = database.GetCollection("Resources").find(make_document(kvp("parentId", id)));
@@ -493,22 +1252,29 @@ namespace OrthancDatabases {
     /* Use GetOutput().AnswerChange() */
     void MongoDBIndex::GetLastChange(IDatabaseBackendOutput &output,
                                      DatabaseManager &manager) {
+        MongoDBChangesCache::Change change;
+
+        if (changesCache_.get() != nullptr && changesCache_->LookupLastChange(change)) {
+            output.AnswerChange(change.id, change.changeType,
+                                static_cast<OrthancPluginResourceType>(change.resourceType),
+                                change.publicId, change.date);
+            return;
+        }
+
         auto &database = dynamic_cast<MongoDatabase &>(manager.GetDatabase());
 
-        mongocxx::options::find options{};
-        options.sort(make_document(kvp("id", -1))).limit(1);
+        AnswerChanges(output, database, make_document().view(), -1, 1);
+    }
 
-        auto cursor = database.GetCollection("Changes").find({}, options);
+    int64_t MongoDBIndex::GetLastChangeIndex(DatabaseManager &manager) {
+        int64_t index;
 
-        for (auto &&doc: cursor) {
-            output.AnswerChange(
-                    doc["id"].get_int64().value,
-                    doc["changeType"].get_int32().value,
-                    static_cast<OrthancPluginResourceType>(doc["resourceType"].get_int32().value),
-                    GetPublicId(manager, doc["internalId"].get_int64().value),
-                    std::string(doc["date"].get_string().value)
-            );
+        if (changesCache_.get() != nullptr && changesCache_->LookupLastChangeIndex(index)) {
+            return index;
         }
+
+        auto &database = dynamic_cast<MongoDatabase &>(manager.GetDatabase());
+        return MongoDBChangesCache::ReadLastChangeIndex(database);
     }
 
     /* Use GetOutput().AnswerExportedResource() */
@@ -519,7 +1285,7 @@ namespace OrthancDatabases {
         mongocxx::options::find options{};
         options.sort(make_document(kvp("id", -1))).limit(1);
 
-        auto cursor = database.GetCollection("ExportedResources").find({}, options);
+        auto cursor = database.GetCollection("ExportedResources").find(make_document(), options);
         for (auto &&doc: cursor) {
             output.AnswerExportedResource(
                     doc["id"].get_int64().value,
@@ -536,10 +1302,193 @@ namespace OrthancDatabases {
     }
 
     /* Use GetOutput().AnswerDicomTag() */
+    // The resources matched by LookupResources() and their parents, read by batches right after the lookup, for the
+    // calls of Orthanc that expand them in the same transaction. See MongoDBIndex::PrefetchMatches().
+    class PrefetchedResources : public MongoDatabase::ITransactionState {
+    public:
+        std::map<int64_t, MongoDBResourceCache::Resource> identities;
+        std::map<std::string, int64_t> publicIds;
+        std::map<int64_t, std::shared_ptr<const MongoDBSummaryCache::Summary> > summaries;
+
+        // null if the transaction in progress has prefetched nothing
+        static PrefetchedResources *Get(MongoDatabase &database) {
+            return dynamic_cast<PrefetchedResources *>(database.GetTransactionState());
+        }
+    };
+
+    void MongoDBIndex::SetSummaryCacheSize(unsigned int size) {
+        if (size == 0) {
+            summaryCache_.reset();
+        } else {
+            summaryCache_.reset(new MongoDBSummaryCache(static_cast<size_t>(size) * 1024 * 1024));
+        }
+    }
+
+    void MongoDBIndex::InvalidateSummary(MongoDatabase &database, int64_t id) {
+        if (summaryCache_.get() == nullptr) {
+            return;
+        }
+
+        // the lookups running until the commit may still load the former summary, which is dropped again then
+        summaryCache_->Invalidate(id);
+
+        MongoDBSummaryCache *cache = summaryCache_.get();
+        database.GetWriteBuffer().OnCommit([cache, id]() {
+            cache->Invalidate(id);
+        });
+    }
+
+    static int64_t ReadRevision(const bsoncxx::document::view &view) {
+        auto revision = view["revision"];
+        return (revision && revision.type() == type::k_int64) ? revision.get_int64().value : 0;
+    }
+
+    static void AddTagToSummary(MongoDBSummaryCache::Summary &summary, const bsoncxx::document::view &tag) {
+        MongoDBSummaryCache::Tag item;
+        item.group = static_cast<uint16_t>(tag["tagGroup"].get_int32().value);
+        item.element = static_cast<uint16_t>(tag["tagElement"].get_int32().value);
+        item.value = std::string(tag["value"].get_string().value);
+        summary.mainDicomTags.push_back(std::move(item));
+    }
+
+    // the "tags" sub-document of a resource, see MongoDBTagsMigration
+    static void AddEmbeddedTagsToSummary(MongoDBSummaryCache::Summary &summary,
+                                         const bsoncxx::document::element &tags) {
+        if (!tags || tags.type() != type::k_document) {
+            return;
+        }
+
+        for (auto &&tag: tags.get_document().value) {
+            MongoDBSummaryCache::Tag item;
+            if (MongoDBTagsMigration::ParseTagKey(item.group, item.element, tag.key())) {
+                item.value = std::string(tag.get_string().value);
+                summary.mainDicomTags.push_back(std::move(item));
+            }
+        }
+    }
+
+    static void AddMetadataToSummary(MongoDBSummaryCache::Summary &summary, const bsoncxx::document::view &metadata) {
+        MongoDBSummaryCache::Metadata &item = summary.metadata[metadata["type"].get_int32().value];
+        item.value = std::string(metadata["value"].get_string().value);
+        item.revision = ReadRevision(metadata);
+    }
+
+    static void AddAttachmentToSummary(MongoDBSummaryCache::Summary &summary,
+                                       const bsoncxx::document::view &attachment) {
+        MongoDBSummaryCache::Attachment &item = summary.attachments[attachment["fileType"].get_int32().value];
+        item.uuid = std::string(attachment["uuid"].get_string().value);
+        item.uncompressedSize = attachment["uncompressedSize"].get_int64().value;
+        item.uncompressedHash = std::string(attachment["uncompressedHash"].get_string().value);
+        item.compressionType = attachment["compressionType"].get_int32().value;
+        item.compressedSize = attachment["compressedSize"].get_int64().value;
+        item.compressedHash = std::string(attachment["compressedHash"].get_string().value);
+        item.revision = ReadRevision(attachment);
+    }
+
+    std::shared_ptr<const MongoDBSummaryCache::Summary> MongoDBIndex::LookupSummary(DatabaseManager &manager,
+                                                                                     int64_t id) {
+        auto &database = dynamic_cast<MongoDatabase &>(manager.GetDatabase());
+
+        PrefetchedResources *prefetched = PrefetchedResources::Get(database);
+        if (prefetched != nullptr) {
+            auto found = prefetched->summaries.find(id);
+            if (found != prefetched->summaries.end()) {
+                return found->second;
+            }
+        }
+
+        if (summaryCache_.get() == nullptr) {
+            return std::shared_ptr<const MongoDBSummaryCache::Summary>();
+        }
+
+        std::shared_ptr<const MongoDBSummaryCache::Summary> cached = summaryCache_->Lookup(id);
+        if (cached) {
+            return cached;
+        }
+
+        const uint64_t generation = summaryCache_->GetGeneration(id);
+
+        const bool embedded = HasEmbeddedTags();
+
+        // the three collections in one round trip, joined on the resource
+        mongocxx::pipeline stages;
+        stages.match(make_document(kvp("internalId", id)));
+        if (!embedded) {
+            stages.lookup(make_document(kvp("from", "MainDicomTags"), kvp("localField", "internalId"),
+                                        kvp("foreignField", "id"), kvp("as", "tags")));
+        }
+        stages.lookup(make_document(kvp("from", "Metadata"), kvp("localField", "internalId"),
+                                    kvp("foreignField", "id"), kvp("as", "metadata")));
+        stages.lookup(make_document(kvp("from", "AttachedFiles"), kvp("localField", "internalId"),
+                                    kvp("foreignField", "id"), kvp("as", "attachments")));
+        stages.project(make_document(kvp("_id", 0), kvp("tags", 1), kvp("metadata", 1), kvp("attachments", 1)));
+
+        auto cursor = database.GetCollection("Resources").aggregate(stages);
+
+        for (auto &&doc: cursor) {
+            auto summary = std::make_shared<MongoDBSummaryCache::Summary>();
+
+            if (embedded) {
+                AddEmbeddedTagsToSummary(*summary, doc["tags"]);
+            } else {
+                for (auto &&tag: doc["tags"].get_array().value) {
+                    AddTagToSummary(*summary, tag.get_document().view());
+                }
+            }
+
+            for (auto &&metadata: doc["metadata"].get_array().value) {
+                AddMetadataToSummary(*summary, metadata.get_document().view());
+            }
+
+            for (auto &&attachment: doc["attachments"].get_array().value) {
+                AddAttachmentToSummary(*summary, attachment.get_document().view());
+            }
+
+            MongoDBSummaryCache *cache = summaryCache_.get();
+            std::shared_ptr<const MongoDBSummaryCache::Summary> result = summary;
+            database.GetWriteBuffer().OnCommit([cache, id, result, generation]() {
+                cache->Add(id, result, generation);
+            });
+
+            return result;
+        }
+
+        return std::shared_ptr<const MongoDBSummaryCache::Summary>();
+    }
+
     void MongoDBIndex::GetMainDicomTags(IDatabaseBackendOutput &output,
                                         DatabaseManager &manager,
                                         int64_t id) {
+        std::shared_ptr<const MongoDBSummaryCache::Summary> summary = LookupSummary(manager, id);
+
+        if (summary) {
+            for (const auto &tag: summary->mainDicomTags) {
+                output.AnswerDicomTag(tag.group, tag.element, tag.value);
+            }
+
+            return;
+        }
+
         auto &database = dynamic_cast<MongoDatabase &>(manager.GetDatabase());
+
+        if (HasEmbeddedTags()) {
+            auto resource = database.GetCollection("Resources").find_one(
+                    make_document(kvp("internalId", id)),
+                    mongocxx::options::find{}.projection(make_document(kvp("_id", 0), kvp("tags", 1)))
+            );
+
+            if (resource) {
+                MongoDBSummaryCache::Summary embedded;
+                AddEmbeddedTagsToSummary(embedded, resource->view()["tags"]);
+
+                for (const auto &tag: embedded.mainDicomTags) {
+                    output.AnswerDicomTag(tag.group, tag.element, tag.value);
+                }
+            }
+
+            return;
+        }
+
         auto cursor = database.GetCollection("MainDicomTags").find(make_document(kvp("id", id)));
 
         for (auto &&doc: cursor) {
@@ -551,13 +1500,277 @@ namespace OrthancDatabases {
         }
     }
 
+    void MongoDBIndex::SetResourceCacheSize(unsigned int size) {
+        if (size == 0) {
+            resourceCache_.reset();
+        } else {
+            resourceCache_.reset(new MongoDBResourceCache(static_cast<size_t>(size) * 1024 * 1024));
+        }
+    }
+
+    void MongoDBIndex::CacheResource(MongoDatabase &database, const MongoDBResourceCache::Resource &resource,
+                                     uint64_t generation) {
+        // a resource created or seen by a transaction that is rolled back must not be cached
+        MongoDBResourceCache *cache = resourceCache_.get();
+        database.GetWriteBuffer().OnCommit([cache, resource, generation]() {
+            cache->Add(resource, generation);
+        });
+    }
+
+    // a document of "Resources" with at least these fields
+    static void ParseIdentity(MongoDBResourceCache::Resource &target, const bsoncxx::document::view &view) {
+        target.internalId = view["internalId"].get_int64().value;
+        target.resourceType = view["resourceType"].get_int32().value;
+        target.publicId = std::string(view["publicId"].get_string().value);
+
+        bsoncxx::document::element parent = view["parentId"];
+        target.parentId = (parent && parent.type() == type::k_int64) ? parent.get_int64().value : -1;
+    }
+
+    // reads the identity of the resource matching "filter", false if it does not exist
+    static bool ReadIdentity(MongoDBResourceCache::Resource &target,
+                             MongoDatabase &database,
+                             bsoncxx::document::view filter) {
+        mongocxx::options::find options;
+        options.projection(make_document(
+                kvp("_id", 0), kvp("internalId", 1), kvp("resourceType", 1), kvp("parentId", 1), kvp("publicId", 1)
+        ));
+
+        auto doc = database.GetCollection("Resources").find_one(filter, options);
+
+        if (!doc) {
+            return false;
+        }
+
+        ParseIdentity(target, doc->view());
+        return true;
+    }
+
+    bool MongoDBIndex::LookupIdentity(MongoDBResourceCache::Resource &target,
+                                      DatabaseManager &manager,
+                                      int64_t internalId) {
+        if (resourceCache_.get() != nullptr && resourceCache_->LookupByInternalId(target, internalId)) {
+            return true;
+        }
+
+        auto &database = dynamic_cast<MongoDatabase &>(manager.GetDatabase());
+
+        PrefetchedResources *prefetched = PrefetchedResources::Get(database);
+        if (prefetched != nullptr) {
+            auto found = prefetched->identities.find(internalId);
+            if (found != prefetched->identities.end()) {
+                target = found->second;
+                return true;
+            }
+        }
+        const uint64_t generation = (resourceCache_.get() != nullptr ? resourceCache_->GetGeneration() : 0);
+
+        if (!ReadIdentity(target, database, make_document(kvp("internalId", internalId)).view())) {
+            return false;
+        }
+
+        if (resourceCache_.get() != nullptr) {
+            CacheResource(database, target, generation);
+        }
+        return true;
+    }
+
+    bool MongoDBIndex::LookupIdentity(MongoDBResourceCache::Resource &target,
+                                      DatabaseManager &manager,
+                                      const std::string &publicId) {
+        if (resourceCache_.get() != nullptr && resourceCache_->LookupByPublicId(target, publicId)) {
+            return true;
+        }
+
+        auto &database = dynamic_cast<MongoDatabase &>(manager.GetDatabase());
+
+        PrefetchedResources *prefetched = PrefetchedResources::Get(database);
+        if (prefetched != nullptr) {
+            auto found = prefetched->publicIds.find(publicId);
+            if (found != prefetched->publicIds.end()) {
+                target = prefetched->identities[found->second];
+                return true;
+            }
+        }
+        const uint64_t generation = (resourceCache_.get() != nullptr ? resourceCache_->GetGeneration() : 0);
+
+        if (!ReadIdentity(target, database, make_document(kvp("publicId", publicId)).view())) {
+            return false;
+        }
+
+        if (resourceCache_.get() != nullptr) {
+            CacheResource(database, target, generation);
+        }
+        return true;
+    }
+
+    void MongoDBIndex::SetQueryCacheParameters(unsigned int size, unsigned int timeToLive) {
+        if (size == 0 || timeToLive == 0) {
+            queryCache_.reset();
+        } else {
+            queryCache_.reset(new MongoDBQueryCache(static_cast<size_t>(size) * 1024 * 1024, timeToLive));
+        }
+    }
+
+    void MongoDBIndex::InvalidateQueries(MongoDatabase &database) {
+        if (queryCache_.get() != nullptr) {
+            // the answers are only cached by read-only transactions, which cannot see the changes before the commit
+            MongoDBQueryCache *cache = queryCache_.get();
+            database.GetWriteBuffer().OnCommit([cache]() {
+                cache->Invalidate();
+            });
+        }
+    }
+
+    void MongoDBIndex::PrefetchMatches(MongoDatabase &database,
+                                       const MongoDBQueryCache::Matches &matches,
+                                       uint64_t generation) {
+        // Only in read-only transactions, as the writes of a read-write transaction would leave the copies stale.
+        // Beyond a page of results, Orthanc is unlikely to expand every match.
+        static const size_t MAX_PREFETCHED = 1000;
+
+        if (!prefetchMatches_ || matches.empty() || matches.size() > MAX_PREFETCHED ||
+            database.GetWriteBuffer().IsEnabled()) {
+            return;
+        }
+
+        std::unique_ptr<PrefetchedResources> prefetched(new PrefetchedResources);
+
+        std::set<int64_t> parents;
+
+        for (const auto &match: matches) {
+            if (match.internalId == -1) {
+                continue;
+            }
+
+            MongoDBResourceCache::Resource &identity = prefetched->identities[match.internalId];
+            identity.internalId = match.internalId;
+            identity.resourceType = match.resourceType;
+            identity.parentId = match.parentId;
+            identity.publicId = match.publicId;
+            prefetched->publicIds[match.publicId] = match.internalId;
+
+            if (match.parentId != -1) {
+                parents.insert(match.parentId);
+            }
+        }
+
+        if (prefetched->identities.empty()) {
+            return;
+        }
+
+        // the parents, whose tags are also part of the expanded answers
+        array missing;
+        bool hasMissing = false;
+
+        for (const auto &parent: parents) {
+            if (prefetched->identities.find(parent) != prefetched->identities.end()) {
+                continue;
+            }
+
+            MongoDBResourceCache::Resource resource;
+            if (resourceCache_.get() != nullptr && resourceCache_->LookupByInternalId(resource, parent)) {
+                prefetched->publicIds[resource.publicId] = resource.internalId;
+                prefetched->identities[resource.internalId] = resource;
+            } else {
+                missing.append(parent);
+                hasMissing = true;
+            }
+        }
+
+        if (hasMissing) {
+            mongocxx::options::find options;
+            options.projection(make_document(
+                    kvp("_id", 0), kvp("internalId", 1), kvp("resourceType", 1), kvp("parentId", 1), kvp("publicId", 1)
+            ));
+
+            auto cursor = database.GetCollection("Resources").find(
+                    make_document(kvp("internalId", make_document(kvp("$in", missing.extract())))), options);
+
+            for (auto &&doc: cursor) {
+                MongoDBResourceCache::Resource resource;
+                ParseIdentity(resource, doc);
+                prefetched->publicIds[resource.publicId] = resource.internalId;
+                prefetched->identities[resource.internalId] = resource;
+            }
+        }
+
+        // the caches, if enabled, keep them for the following transactions
+        if (resourceCache_.get() != nullptr) {
+            for (const auto &identity: prefetched->identities) {
+                resourceCache_->Add(identity.second, generation);
+            }
+        }
+
+        // the tags, metadata and attachments of those that are not cached yet, with one query per collection
+        std::map<int64_t, std::shared_ptr<MongoDBSummaryCache::Summary> > summaries;
+        std::map<int64_t, uint64_t> generations;
+        array ids;
+
+        for (const auto &identity: prefetched->identities) {
+            if (summaryCache_.get() != nullptr) {
+                std::shared_ptr<const MongoDBSummaryCache::Summary> cached = summaryCache_->Lookup(identity.first);
+                if (cached) {
+                    prefetched->summaries[identity.first] = cached;
+                    continue;
+                }
+            }
+
+            summaries[identity.first] = std::make_shared<MongoDBSummaryCache::Summary>();
+            generations[identity.first] = (summaryCache_.get() != nullptr ?
+                                           summaryCache_->GetGeneration(identity.first) : 0);
+            ids.append(identity.first);
+        }
+
+        if (summaries.empty()) {
+            // e.g. an answer of the query cache, whose resources have all been expanded recently
+            database.SetTransactionState(prefetched.release());
+            return;
+        }
+
+        auto inIds = make_document(kvp("$in", ids.extract()));
+        auto filter = make_document(kvp("id", inIds.view()));
+
+        if (HasEmbeddedTags()) {
+            mongocxx::options::find options;
+            options.projection(make_document(kvp("_id", 0), kvp("internalId", 1), kvp("tags", 1)));
+
+            for (auto &&doc: database.GetCollection("Resources").find(
+                    make_document(kvp("internalId", inIds.view())), options)) {
+                AddEmbeddedTagsToSummary(*summaries[doc["internalId"].get_int64().value], doc["tags"]);
+            }
+        } else {
+            for (auto &&doc: database.GetCollection("MainDicomTags").find(filter.view())) {
+                AddTagToSummary(*summaries[doc["id"].get_int64().value], doc);
+            }
+        }
+
+        for (auto &&doc: database.GetCollection("Metadata").find(filter.view())) {
+            AddMetadataToSummary(*summaries[doc["id"].get_int64().value], doc);
+        }
+
+        for (auto &&doc: database.GetCollection("AttachedFiles").find(filter.view())) {
+            AddAttachmentToSummary(*summaries[doc["id"].get_int64().value], doc);
+        }
+
+        // the cache of the summaries, if enabled, keeps them for the following transactions
+        for (const auto &summary: summaries) {
+            prefetched->summaries[summary.first] = summary.second;
+
+            if (summaryCache_.get() != nullptr) {
+                summaryCache_->Add(summary.first, summary.second, generations[summary.first]);
+            }
+        }
+
+        database.SetTransactionState(prefetched.release());
+    }
+
     std::string MongoDBIndex::GetPublicId(DatabaseManager &manager,
                                           int64_t resourceId) {
-        auto &database = dynamic_cast<MongoDatabase &>(manager.GetDatabase());
-        auto result = database.GetCollection("Resources").find_one(make_document(kvp("internalId", resourceId)));
+        MongoDBResourceCache::Resource resource;
 
-        if (result) {
-            return std::string(result->view()["publicId"].get_string().value);
+        if (LookupIdentity(resource, manager, resourceId)) {
+            return resource.publicId;
         }
         throw Orthanc::OrthancException(Orthanc::ErrorCode_UnknownResource);
     }
@@ -566,20 +1779,23 @@ namespace OrthancDatabases {
                                              OrthancPluginResourceType resourceType) {
         auto &database = dynamic_cast<MongoDatabase &>(manager.GetDatabase());
 
-        int64_t count = database.GetCollection("Resources").count_documents(
-                make_document(kvp("resourceType", static_cast<int>(resourceType)))
-        );
+        const int level = static_cast<int>(resourceType);
+        if (level < 0 || level >= 4) {
+            throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+        }
+
+        MongoDBCounters::Totals totals;
+        MongoDBCounters::Read(totals, database);
 
-        return count;
+        return static_cast<uint64_t>(std::max<int64_t>(0, totals.resources[level]));
     }
 
     OrthancPluginResourceType MongoDBIndex::GetResourceType(DatabaseManager &manager,
                                                             int64_t resourceId) {
-        auto &database = dynamic_cast<MongoDatabase &>(manager.GetDatabase());
-        auto result = database.GetCollection("Resources").find_one(make_document(kvp("internalId", resourceId)));
+        MongoDBResourceCache::Resource resource;
 
-        if (result) {
-            return static_cast<OrthancPluginResourceType>(result->view()["resourceType"].get_int32().value);
+        if (LookupIdentity(resource, manager, resourceId)) {
+            return static_cast<OrthancPluginResourceType>(resource.resourceType);
         }
         throw Orthanc::OrthancException(Orthanc::ErrorCode_UnknownResource);
     }
@@ -587,45 +1803,19 @@ namespace OrthancDatabases {
     uint64_t MongoDBIndex::GetTotalCompressedSize(DatabaseManager &manager) {
         auto &database = dynamic_cast<MongoDatabase &>(manager.GetDatabase());
 
-        mongocxx::pipeline stages;
-        auto group_stage = make_document(
-                kvp("_id", bsoncxx::types::b_null()),
-                kvp("totalSize", make_document(
-                        kvp("$sum", "$compressedSize")
-                ))
-        );
-
-        stages.group(group_stage.view());
-
-        auto cursor = database.GetCollection("AttachedFiles").aggregate(stages);
+        MongoDBCounters::Totals totals;
+        MongoDBCounters::Read(totals, database);
 
-        for (auto &&doc: cursor) {
-            return doc["totalSize"].get_int64().value;
-        }
-
-        return 0;
+        return static_cast<uint64_t>(std::max<int64_t>(0, totals.compressedSize));
     }
 
     uint64_t MongoDBIndex::GetTotalUncompressedSize(DatabaseManager &manager) {
         auto &database = dynamic_cast<MongoDatabase &>(manager.GetDatabase());
 
-        mongocxx::pipeline stages;
-        auto group_stage = make_document(
-                kvp("_id", bsoncxx::types::b_null()),
-                kvp("totalSize", make_document(
-                        kvp("$sum", "$uncompressedSize")
-                ))
-        );
-
-        stages.group(group_stage.view());
-
-        auto cursor = database.GetCollection("AttachedFiles").aggregate(stages);
-
-        for (auto &&doc: cursor) {
-            return doc["totalSize"].get_int64().value;
-        }
+        MongoDBCounters::Totals totals;
+        MongoDBCounters::Read(totals, database);
 
-        return 0;
+        return static_cast<uint64_t>(std::max<int64_t>(0, totals.uncompressedSize));
     }
 
     bool MongoDBIndex::IsExistingResource(DatabaseManager &manager,
@@ -642,16 +1832,26 @@ namespace OrthancDatabases {
                                           int64_t internalId) {
         auto &database = dynamic_cast<MongoDatabase &>(manager.GetDatabase());
 
-        int64_t count = database.GetCollection("PatientRecyclingOrder").count_documents(
-                make_document(kvp("patientId", internalId))
+        int64_t count = database.GetCollection("Resources").count_documents(
+                make_document(kvp("internalId", internalId), kvp("protected", true))
         );
 
-        return !count;
+        return count > 0;
     }
 
     void MongoDBIndex::ListAvailableMetadata(std::list<int32_t> &target /*out*/,
                                              DatabaseManager &manager,
                                              int64_t id) {
+        std::shared_ptr<const MongoDBSummaryCache::Summary> summary = LookupSummary(manager, id);
+
+        if (summary) {
+            for (const auto &metadata: summary->metadata) {
+                target.push_back(metadata.first);
+            }
+
+            return;
+        }
+
         auto &database = dynamic_cast<MongoDatabase &>(manager.GetDatabase());
         auto cursor = database.GetCollection("Metadata").find(make_document(kvp("id", id)));
 
@@ -663,6 +1863,16 @@ namespace OrthancDatabases {
     void MongoDBIndex::ListAvailableAttachments(std::list<int32_t> &target /*out*/,
                                                 DatabaseManager &manager,
                                                 int64_t id) {
+        std::shared_ptr<const MongoDBSummaryCache::Summary> summary = LookupSummary(manager, id);
+
+        if (summary) {
+            for (const auto &attachment: summary->attachments) {
+                target.push_back(attachment.first);
+            }
+
+            return;
+        }
+
         auto &database = dynamic_cast<MongoDatabase &>(manager.GetDatabase());
         auto cursor = database.GetCollection("AttachedFiles").find(make_document(kvp("id", id)));
 
@@ -678,18 +1888,54 @@ namespace OrthancDatabases {
                                  const char *date) {
         auto &database = dynamic_cast<MongoDatabase &>(manager.GetDatabase());
 
-        int64_t seq = database.GetNextSequence("Changes");
+        // during a bulk load, the ids of the changes are allocated by blocks like the other ones
+        int64_t seq = database.GetNextSequence("Changes", options_.strictSequences && !bulkLoad_);
         auto collection = database.GetCollection("Changes");
 
-        auto change_document = make_document(
-                kvp("id", seq),
-                kvp("changeType", changeType),
-                kvp("internalId", resourceId),
-                kvp("resourceType", resourceType),
-                kvp("date", date)
-        );
+        bsoncxx::builder::basic::document change_document;
+        change_document.append(kvp("id", seq),
+                               kvp("changeType", changeType),
+                               kvp("internalId", resourceId),
+                               kvp("resourceType", resourceType),
+                               kvp("date", date));
+
+        ApplyRetention(database, "Changes", seq, change_document);
+
+        collection.Defer(mongocxx::model::insert_one{change_document.extract()}, true);
+
+        // with a change stream, the cache sees this change once it reaches the collection
+        if (changesCache_.get() != nullptr && !changesCache_->IsWatching()) {
+            MongoDBChangesCache::Change change;
+            change.id = seq;
+            change.changeType = changeType;
+            change.resourceType = resourceType;
+            change.internalId = resourceId;
+            change.date = date;
+
+            const int32_t level = static_cast<int32_t>(resourceType);
+
+            if (level >= 0 && level < 4 && lastInstance_.internalIds[level] == resourceId) {
+                change.publicId = lastInstance_.publicIds[level];
+            } else {
+                mongocxx::options::find options;
+                options.projection(make_document(kvp("publicId", 1)));
+
+                auto resource = database.GetCollection("Resources").find_one(
+                        make_document(kvp("internalId", resourceId)), options);
+
+                if (!resource || !resource->view()["publicId"]) {
+                    // a deleted resource, whose changes are not answered either by the collection
+                    return;
+                }
 
-        collection.insert_one(change_document.view());
+                change.publicId = std::string(resource->view()["publicId"].get_string().value);
+            }
+
+            MongoDBChangesCache *cache = changesCache_.get();
+            database.GetWriteBuffer().OnCommit([cache, change]() {
+                cache->Add(change);
+            });
+        }
     }
 
     void MongoDBIndex::LogExportedResource(DatabaseManager &manager, const OrthancPluginExportedResource &resource) {
@@ -698,19 +1944,20 @@ namespace OrthancDatabases {
         int64_t seq = database.GetNextSequence("ExportedResources");
         auto collection = database.GetCollection("ExportedResources");
 
-        auto exported_document = make_document(
-                kvp("id", seq),
-                kvp("resourceType", resource.resourceType),
-                kvp("publicId", resource.publicId),
-                kvp("remoteModality", resource.modality),
-                kvp("patientId", resource.patientId),
-                kvp("studyInstanceUid", resource.studyInstanceUid),
-                kvp("seriesInstanceUid", resource.seriesInstanceUid),
-                kvp("sopInstanceUid", resource.sopInstanceUid),
-                kvp("date", resource.date)
-        );
+        bsoncxx::builder::basic::document exported_document;
+        exported_document.append(kvp("id", seq),
+                                 kvp("resourceType", resource.resourceType),
+                                 kvp("publicId", resource.publicId),
+                                 kvp("remoteModality", resource.modality),
+                                 kvp("patientId", resource.patientId),
+                                 kvp("studyInstanceUid", resource.studyInstanceUid),
+                                 kvp("seriesInstanceUid", resource.seriesInstanceUid),
+                                 kvp("sopInstanceUid", resource.sopInstanceUid),
+                                 kvp("date", resource.date));
 
-        collection.insert_one(exported_document.view());
+        ApplyRetention(database, "ExportedResources", seq, exported_document);
+
+        collection.Defer(mongocxx::model::insert_one{exported_document.extract()}, true);
     }
 
     /* Use GetOutput().AnswerAttachment() */
@@ -719,6 +1966,22 @@ namespace OrthancDatabases {
                                         DatabaseManager &manager,
                                         int64_t id,
                                         int32_t contentType) {
+        std::shared_ptr<const MongoDBSummaryCache::Summary> summary = LookupSummary(manager, id);
+
+        if (summary) {
+            auto found = summary->attachments.find(contentType);
+            if (found == summary->attachments.end()) {
+                return false;
+            }
+
+            const MongoDBSummaryCache::Attachment &attachment = found->second;
+            output.AnswerAttachment(attachment.uuid, contentType, attachment.uncompressedSize,
+                                    attachment.uncompressedHash, attachment.compressionType,
+                                    attachment.compressedSize, attachment.compressedHash);
+            revision = attachment.revision;
+            return true;
+        }
+
         auto &database = dynamic_cast<MongoDatabase &>(manager.GetDatabase());
 
         auto doc = database.GetCollection("AttachedFiles").find_one(make_document(
@@ -835,6 +2098,8 @@ namespace OrthancDatabases {
         for (auto &&doc: cursor) {
             target.push_back(doc["id"].get_int64().value);
         }
+
+        RemoveDeletedResources(database, target);
     }
 
     void MongoDBIndex::LookupIdentifierRange(std::list<int64_t> &target /*out*/,
@@ -858,6 +2123,8 @@ namespace OrthancDatabases {
         for (auto &&doc: cursor) {
             target.push_back(doc["id"].get_int64().value);
         }
+
+        RemoveDeletedResources(database, target);
     }
 
     bool MongoDBIndex::LookupMetadata(std::string &target /*out*/,
@@ -865,6 +2132,19 @@ namespace OrthancDatabases {
                                       DatabaseManager &manager,
                                       int64_t id,
                                       int32_t metadataType) {
+        std::shared_ptr<const MongoDBSummaryCache::Summary> summary = LookupSummary(manager, id);
+
+        if (summary) {
+            auto found = summary->metadata.find(metadataType);
+            if (found == summary->metadata.end()) {
+                return false;
+            }
+
+            target = found->second.value;
+            revision = found->second.revision;
+            return true;
+        }
+
         auto &database = dynamic_cast<MongoDatabase &>(manager.GetDatabase());
         auto doc = database.GetCollection("Metadata").find_one(make_document(kvp("id", id), kvp("type", metadataType)));
 
@@ -886,67 +2166,63 @@ namespace OrthancDatabases {
     bool MongoDBIndex::LookupParent(int64_t &parentId /*out*/,
                                     DatabaseManager &manager,
                                     int64_t resourceId) {
-        auto &database = dynamic_cast<MongoDatabase &>(manager.GetDatabase());
+        MongoDBResourceCache::Resource resource;
 
-        bool res = false;
-        auto doc = database.GetCollection("Resources").find_one(make_document(kvp("internalId", resourceId)));
-
-        if (doc) {
-            bsoncxx::document::element parent = doc->view()["parentId"];
-
-            if (parent && parent.type() == type::k_int64) {
-                parentId = parent.get_int64().value;
-                res = true;
-            }
+        if (LookupIdentity(resource, manager, resourceId) && resource.parentId != -1) {
+            parentId = resource.parentId;
+            return true;
         }
-        return res;
+        return false;
     }
 
     bool MongoDBIndex::LookupResource(int64_t &id /*out*/,
                                       OrthancPluginResourceType &type /*out*/,
                                       DatabaseManager &manager,
                                       const char *publicId) {
-        auto &database = dynamic_cast<MongoDatabase &>(manager.GetDatabase());
-        auto doc = database.GetCollection("Resources").find_one(
-                make_document(kvp("publicId", publicId))
-        );
+        MongoDBResourceCache::Resource resource;
 
-        if (doc) {
-            bsoncxx::document::view view = doc->view();
-            id = view["internalId"].get_int64().value;
-            type = static_cast<OrthancPluginResourceType>(view["resourceType"].get_int32().value);
+        if (LookupIdentity(resource, manager, std::string(publicId))) {
+            id = resource.internalId;
+            type = static_cast<OrthancPluginResourceType>(resource.resourceType);
             return true;
         }
         return false;
     }
 
-    bool MongoDBIndex::SelectPatientToRecycle(int64_t &internalId /*out*/,
-                                              DatabaseManager &manager) {
-        auto &database = dynamic_cast<MongoDatabase &>(manager.GetDatabase());
-        auto result = database.GetCollection("PatientRecyclingOrder").find_one({});
+    // the unprotected patients, from the least recently updated, through the index on "recyclingStamp"
+    static bool SelectOldestPatient(int64_t &internalId, MongoDatabase &database, bsoncxx::document::view filter) {
+        mongocxx::options::find options;
+        options.sort(make_document(kvp("recyclingStamp", 1)));
+        options.projection(make_document(kvp("_id", 0), kvp("internalId", 1)));
+
+        auto result = database.GetCollection("Resources").find_one(filter, options);
 
         if (result) {
-            internalId = result->view()["patientId"].get_int64().value;
+            internalId = result->view()["internalId"].get_int64().value;
             return true;
         }
+
         return false;
     }
 
+    bool MongoDBIndex::SelectPatientToRecycle(int64_t &internalId /*out*/,
+                                              DatabaseManager &manager) {
+        auto &database = dynamic_cast<MongoDatabase &>(manager.GetDatabase());
+
+        return SelectOldestPatient(internalId, database, make_document(
+                kvp("recyclingStamp", make_document(kvp("$exists", true)))
+        ));
+    }
+
     bool MongoDBIndex::SelectPatientToRecycle(int64_t &internalId /*out*/,
                                               DatabaseManager &manager,
                                               int64_t patientIdToAvoid) {
         auto &database = dynamic_cast<MongoDatabase &>(manager.GetDatabase());
-        auto result = database.GetCollection("PatientRecyclingOrder").find_one(
-                make_document(kvp("patientId", make_document(kvp("$ne", patientIdToAvoid)))),
-                mongocxx::options::find{}.sort(make_document(kvp("id", 1)))
-        );
-
-        if (result) {
-            internalId = result->view()["patientId"].get_int64().value;
-            return true;
-        }
 
-        return false;
+        return SelectOldestPatient(internalId, database, make_document(
+                kvp("recyclingStamp", make_document(kvp("$exists", true))),
+                kvp("internalId", make_document(kvp("$ne", patientIdToAvoid)))
+        ));
     }
 
     void MongoDBIndex::SetGlobalProperty(DatabaseManager &manager,
@@ -988,6 +2264,9 @@ namespace OrthancDatabases {
         auto &database = dynamic_cast<MongoDatabase &>(manager.GetDatabase());
         auto collection = database.GetCollection("MainDicomTags");
 
+        InvalidateSummary(database, id);
+        InvalidateQueries(database);
+
         auto main_dicom_document = make_document(
                 kvp("id", id),
                 kvp("tagGroup", group),
@@ -995,7 +2274,16 @@ namespace OrthancDatabases {
                 kvp("value", value)
         );
 
-        collection.insert_one(main_dicom_document.view());
+        collection.Defer(mongocxx::model::insert_one{std::move(main_dicom_document)}, true);
+
+        if (options_.embeddedTags) {
+            database.GetCollection("Resources").Defer(mongocxx::model::update_one{
+                    make_document(kvp("internalId", id)),
+                    make_document(kvp("$set", make_document(
+                            kvp("tags." + MongoDBTagsMigration::FormatTagKey(group, element), value)
+                    )))
+            }, true);
+        }
     }
 
     void MongoDBIndex::SetIdentifierTag(DatabaseManager &manager,
@@ -1006,6 +2294,8 @@ namespace OrthancDatabases {
         auto &database = dynamic_cast<MongoDatabase &>(manager.GetDatabase());
         auto collection = database.GetCollection("DicomIdentifiers");
 
+        InvalidateQueries(database);
+
         auto dicom_identifier_document = make_document(
                 kvp("id", id),
                 kvp("tagGroup", group),
@@ -1013,7 +2303,16 @@ namespace OrthancDatabases {
                 kvp("value", value)
         );
 
-        collection.insert_one(dicom_identifier_document.view());
+        collection.Defer(mongocxx::model::insert_one{std::move(dicom_identifier_document)}, true);
+
+        if (options_.embeddedTags) {
+            database.GetCollection("Resources").Defer(mongocxx::model::update_one{
+                    make_document(kvp("internalId", id)),
+                    make_document(kvp("$set", make_document(
+                            kvp("identifiers." + MongoDBTagsMigration::FormatTagKey(group, element), value)
+                    )))
+            }, true);
+        }
     }
 
     void MongoDBIndex::SetMetadata(DatabaseManager &manager,
@@ -1024,45 +2323,42 @@ namespace OrthancDatabases {
         auto &database = dynamic_cast<MongoDatabase &>(manager.GetDatabase());
         auto collection = database.GetCollection("Metadata");
 
-        mongocxx::options::bulk_write options;
-        options.ordered(true);
-        auto bulk = collection.create_bulk_write(options);
+        InvalidateSummary(database, id);
 
-        auto deleteDocument = make_document(kvp("id", id), kvp("type", metadataType));
-        auto insertDocument = make_document(
+        // the replacement must stay after the deletion, hence not commutative
+        collection.Defer(mongocxx::model::delete_many{make_document(kvp("id", id), kvp("type", metadataType))},
+                         false);
+        collection.Defer(mongocxx::model::insert_one{make_document(
                 kvp("id", id),
                 kvp("type", metadataType),
                 kvp("value", value),
                 kvp("revision", revision)
-        );
-
-        mongocxx::model::delete_many delete_op{deleteDocument.view()};
-        mongocxx::model::insert_one insert_op{insertDocument.view()};
-
-        bulk.append(delete_op);
-        bulk.append(insert_op);
-
-        bulk.execute();
+        )}, false);
     }
 
     void MongoDBIndex::SetProtectedPatient(DatabaseManager &manager,
                                            int64_t internalId,
                                            bool isProtected) {
         auto &database = dynamic_cast<MongoDatabase &>(manager.GetDatabase());
-        auto collection = database.GetCollection("PatientRecyclingOrder");
+        auto collection = database.GetCollection("Resources");
 
         if (isProtected) {
-            collection.delete_many(make_document(
-                    kvp("patientId", internalId)
-            ));
-        } else if (IsProtectedPatient(manager, internalId)) {
-            int64_t seq = database.GetNextSequence("PatientRecyclingOrder");
-            collection.insert_one(make_document(
-                    kvp("id", seq),
-                    kvp("patientId", internalId)
-            ));
+            collection.update_one(
+                    make_document(kvp("internalId", internalId)),
+                    make_document(
+                            kvp("$set", make_document(kvp("protected", true))),
+                            kvp("$unset", make_document(kvp("recyclingStamp", "")))
+                    )
+            );
         } else {
-            // Nothing to do: The patient is already unprotected
+            // only a protected patient gets a new stamp, an unprotected one keeps its place in the recycling order
+            collection.update_one(
+                    make_document(kvp("internalId", internalId), kvp("protected", true)),
+                    make_document(
+                            kvp("$set", make_document(kvp("recyclingStamp", NextRecyclingStamp()))),
+                            kvp("$unset", make_document(kvp("protected", "")))
+                    )
+            );
         }
     }
 
@@ -1071,18 +2367,429 @@ namespace OrthancDatabases {
         auto &database = dynamic_cast<MongoDatabase &>(manager.GetDatabase());
         auto databaseInstance = database.GetObject();
 
-        auto delete_document = make_document(
-                kvp("id", internalId)
-        );
+        InvalidateSummary(database, internalId);
+        InvalidateQueries(database);
+
+        // not commutative: the new tags are inserted right after
+        database.GetCollection(databaseInstance, "MainDicomTags").Defer(
+                mongocxx::model::delete_many{make_document(kvp("id", internalId))}, false);
+        database.GetCollection(databaseInstance, "DicomIdentifiers").Defer(
+                mongocxx::model::delete_many{make_document(kvp("id", internalId))}, false);
+
+        // emptied rather than removed, so that the migration does not copy the old tags back
+        if (options_.embeddedTags) {
+            database.GetCollection(databaseInstance, "Resources").Defer(mongocxx::model::update_one{
+                    make_document(kvp("internalId", internalId)),
+                    make_document(kvp("$set", make_document(kvp("tags", make_document()),
+                                                            kvp("identifiers", make_document()))))
+            }, false);
+        }
+    }
+
+#if ORTHANC_PLUGINS_HAS_DATABASE_CONSTRAINT == 1
+
+    static bool sortConstraintLookup(Orthanc::DatabaseConstraint left, Orthanc::DatabaseConstraint right) {
+        return (left.GetLevel() > right.GetLevel());
+    }
+
+    // appends to "target" the condition of "constraint" on the value of its tag
+    static void AppendConstraintCondition(bsoncxx::builder::basic::document &target,
+                                          const Orthanc::DatabaseConstraint &constraint) {
+        switch (constraint.GetConstraintType()) {
+            case Orthanc::ConstraintType_Equal:
+                target.append(
+                        kvp("$eq", constraint.GetSingleValue())
+                );
+                /* TODO see what to do with slow regex issue
+                kvp("$regex", constraint.GetSingleValue()
+                kvp("$options", case_sensitive_option)
+                */
+                break;
+
+            case Orthanc::ConstraintType_SmallerOrEqual:
+                target.append(
+                        kvp("$lte", constraint.GetSingleValue())
+                );
+                break;
+
+            case Orthanc::ConstraintType_GreaterOrEqual:
+                target.append(
+                        kvp("$gte", constraint.GetSingleValue())
+                );
+                break;
+
+            case Orthanc::ConstraintType_List:
+                target.append(
+                        kvp("$in", [constraint](sub_array child) {
+                            for (size_t i = 0; i < constraint.GetValuesCount(); i++) {
+                                child.append(constraint.GetValue(i));
+                            }
+                        })
+                );
+                break;
+
+
+            case Orthanc::ConstraintType_Wildcard:
+                if (constraint.GetSingleValue() != "*") {
+                    target.append(
+                            kvp("$regex", ConvertWildcardToRegex(constraint.GetSingleValue()))
+                    );
+                }
+
+                break;
+
+            default:
+                throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+        }
+    }
+
+    // Appends to "stages" the stages turning the tags of one level (documents with an "id" field, in
+    // MainDicomTags or DicomIdentifiers) into the related resources at "queryLevel"
+    static void AppendLevelMapping(array &stages, int32_t level, OrthancPluginResourceType queryLevel) {
+        const std::string query = std::to_string(static_cast<int32_t>(queryLevel));
+
+        if (level < static_cast<int32_t>(queryLevel)) {
+            // going down: the resources at "queryLevel" that have the tagged resource as ancestor
+            stages.append(make_document(kvp("$lookup", make_document(
+                    kvp("from", "Resources"),
+                    kvp("localField", "id"),
+                    kvp("foreignField", std::to_string(level)),
+                    kvp("as", "resources")
+            ))));
+        } else {
+            stages.append(make_document(kvp("$lookup", make_document(
+                    kvp("from", "Resources"),
+                    kvp("localField", "id"),
+                    kvp("foreignField", "internalId"),
+                    kvp("as", "resources")
+            ))));
+
+            if (level > static_cast<int32_t>(queryLevel)) {
+                // going up: the ancestor at "queryLevel" is stored in the tagged resource
+                stages.append(make_document(kvp("$unwind", "$resources")));
+                stages.append(make_document(kvp("$lookup", make_document(
+                        kvp("from", "Resources"),
+                        kvp("localField", "resources." + query),
+                        kvp("foreignField", "internalId"),
+                        kvp("as", "resources")
+                ))));
+            }
+        }
+
+        stages.append(make_document(kvp("$unwind", "$resources")));
+        stages.append(make_document(kvp("$replaceRoot", make_document(kvp("newRoot", "$resources")))));
+        stages.append(make_document(kvp("$match", make_document(kvp("resourceType", static_cast<int32_t>(queryLevel))))));
+    }
+
+    // Appends to "stages" (that run on "collection") the union of the resources at "queryLevel" matching the
+    // criteria of each level of "streams"
+    static void AppendLevelStreams(mongocxx::pipeline &stages,
+                                   const std::string &collection,
+                                   std::map<int32_t, array> &streams,
+                                   OrthancPluginResourceType queryLevel) {
+        bool first = true;
+
+        for (auto &stream: streams) {
+            array levelStages;
+            levelStages.append(make_document(kvp("$match", make_document(kvp("$or", stream.second.extract())))));
+            AppendLevelMapping(levelStages, stream.first, queryLevel);
+
+            if (first) {
+                stages.append_stages(levelStages.view());
+                first = false;
+            } else {
+                stages.append_stage(make_document(kvp("$unionWith", make_document(
+                        kvp("coll", collection),
+                        kvp("pipeline", levelStages.view())
+                ))));
+            }
+        }
+    }
+
+    // With the embedded tags, the filter of LookupResources() on the resources at "queryLevel". The constraints on
+    // the other levels are first resolved into the ids of the matching resources, with one query per level. False if
+    // these ids are too many to be sent back in the filter, the lookup being then left to the aggregation.
+    static bool BuildEmbeddedFilter(bsoncxx::builder::basic::document &filter,
+                                    MongoDatabase &database,
+                                    const std::vector<Orthanc::DatabaseConstraint> &lookup,
+                                    OrthancPluginResourceType queryLevel) {
+        // the constraints on the same tag are merged, e.g. the two bounds of a range
+        std::map<std::pair<int32_t, std::string>, bsoncxx::builder::basic::document> conditions;
+
+        for (const auto &constraint: lookup) {
+            const std::string field = std::string(constraint.IsIdentifier() ? "identifiers." : "tags.") +
+                                      MongoDBTagsMigration::FormatTagKey(constraint.GetTag().GetGroup(),
+                                                                         constraint.GetTag().GetElement());
+
+            AppendConstraintCondition(conditions[std::make_pair(static_cast<int32_t>(constraint.GetLevel()), field)],
+                                      constraint);
+        }
+
+        std::map<int32_t, bsoncxx::builder::basic::document> levels;
+
+        for (auto &condition: conditions) {
+            auto value = condition.second.extract();
+
+            // a universal wildcard also matches the resources without the tag
+            if (!value.view().empty()) {
+                levels[condition.first.first].append(kvp(condition.first.second, value));
+            }
+        }
+
+        const int32_t query = static_cast<int32_t>(queryLevel);
+
+        filter.append(kvp("resourceType", query));
+
+        array others;
+        bool hasOthers = false;
+
+        auto resources = database.GetCollection("Resources");
+
+        for (auto &level: levels) {
+            auto criteria = level.second.extract();
+
+            if (level.first == query) {
+                for (auto &&item: criteria.view()) {
+                    filter.append(kvp(item.key(), item.get_value()));
+                }
+
+                continue;
+            }
+
+            // a resource stores its ancestors in its level fields, so that the resources at "queryLevel" are the
+            // descendants of the matched ancestors, or the ancestors stored in the matched descendants
+            const bool ancestor = (level.first < query);
+            const std::string projected = (ancestor ? "internalId" : std::to_string(query));
+
+            bsoncxx::builder::basic::document levelFilter;
+            levelFilter.append(kvp("resourceType", level.first));
+            for (auto &&item: criteria.view()) {
+                levelFilter.append(kvp(item.key(), item.get_value()));
+            }
+
+            mongocxx::options::find options;
+            options.projection(make_document(kvp("_id", 0), kvp(projected, 1)));
+
+            std::set<int64_t> ids;
+            for (auto &&doc: resources.find(levelFilter.view(), options)) {
+                auto id = doc[projected];
+                if (id && id.type() == type::k_int64) {
+                    ids.insert(id.get_int64().value);
+
+                    if (ids.size() > MongoDBLookupExecutor::MAX_STREAM_SIZE) {
+                        return false;
+                    }
+                }
+            }
+
+            array inIds;
+            for (const auto &id: ids) {
+                inIds.append(id);
+            }
+
+            others.append(make_document(kvp(ancestor ? std::to_string(level.first) : std::string("internalId"),
+                                            make_document(kvp("$in", inIds.extract())))));
+            hasOthers = true;
+        }
+
+        if (hasOthers) {
+            filter.append(kvp("$and", others.extract()));
+        }
+
+        return true;
+    }
+
+    // The ids of the resources at "queryLevel" matching "lookup", false if MongoDBLookupExecutor cannot evaluate it.
+    // "statistics" can be null, "steps" receives the streams that have been read. If "limit" is not 0, at least the
+    // "limit" smallest visible ids are returned, the others may be left out.
+    static bool ExecuteLookup(std::vector<int64_t> &target,
+                              std::vector<MongoDBLookupExecutor::Step> &steps,
+                              MongoDatabase &database,
+                              const MongoDBTagStatistics::Distributions *statistics,
+                              const std::vector<Orthanc::DatabaseConstraint> &lookup,
+                              OrthancPluginResourceType queryLevel,
+                              uint32_t limit) {
+        struct Condition {
+            bsoncxx::builder::basic::document value;
+            MongoDBLookupExecutor::Selectivity selectivity = MongoDBLookupExecutor::Selectivity_Wildcard;
+            const MongoDBTagStatistics::Distribution *distribution = nullptr;
+            double estimate = -1;  // of the equalities, lists and wildcards
+            const std::string *lower = nullptr;
+            const std::string *upper = nullptr;
+        };
+
+        // the constraints on the same tag are merged, e.g. the two bounds of a range
+        std::map<std::tuple<int32_t, bool, uint16_t, uint16_t>, Condition> conditions;
+
+        for (const auto &constraint: lookup) {
+            Condition &condition = conditions[std::make_tuple(static_cast<int32_t>(constraint.GetLevel()),
+                                                              constraint.IsIdentifier(),
+                                                              constraint.GetTag().GetGroup(),
+                                                              constraint.GetTag().GetElement())];
+
+            AppendConstraintCondition(condition.value, constraint);
+
+            if (statistics != nullptr && condition.distribution == nullptr) {
+                auto found = statistics->find(MongoDBTagStatistics::Key(constraint.IsIdentifier(),
+                                                                        constraint.GetTag().GetGroup(),
+                                                                        constraint.GetTag().GetElement()));
+                if (found != statistics->end()) {
+                    condition.distribution = &found->second;
+                }
+            }
+
+            MongoDBLookupExecutor::Selectivity selectivity;
+            double estimate = -1;
+
+            switch (constraint.GetConstraintType()) {
+                case Orthanc::ConstraintType_Equal:
+                    selectivity = MongoDBLookupExecutor::Selectivity_Equal;
+                    if (condition.distribution != nullptr) {
+                        estimate = condition.distribution->EstimateEqual(constraint.GetSingleValue());
+                    }
+                    break;
+
+                case Orthanc::ConstraintType_List:
+                    selectivity = MongoDBLookupExecutor::Selectivity_List;
+                    if (condition.distribution != nullptr && condition.distribution->IsReliable()) {
+                        estimate = 0;
+                        for (size_t i = 0; i < constraint.GetValuesCount(); i++) {
+                            estimate += condition.distribution->EstimateEqual(constraint.GetValue(i));
+                        }
+                    }
+                    break;
+
+                case Orthanc::ConstraintType_SmallerOrEqual:
+                    selectivity = MongoDBLookupExecutor::Selectivity_Range;
+                    condition.upper = &constraint.GetSingleValue();
+                    break;
+
+                case Orthanc::ConstraintType_GreaterOrEqual:
+                    selectivity = MongoDBLookupExecutor::Selectivity_Range;
+                    condition.lower = &constraint.GetSingleValue();
+                    break;
+
+                default:
+                    selectivity = MongoDBLookupExecutor::Selectivity_Wildcard;
+                    if (condition.distribution != nullptr) {
+                        estimate = condition.distribution->EstimateWildcard(constraint.GetSingleValue());
+                    }
+                    break;
+            }
+
+            condition.selectivity = std::min(condition.selectivity, selectivity);
+
+            // the constraints on the same tag must all hold
+            if (estimate >= 0 && (condition.estimate < 0 || estimate < condition.estimate)) {
+                condition.estimate = estimate;
+            }
+        }
+
+        MongoDBLookupExecutor executor(database, static_cast<int32_t>(queryLevel));
+
+        for (auto &condition: conditions) {
+            double estimate = condition.second.estimate;
+
+            if (condition.second.distribution != nullptr && condition.second.distribution->IsReliable() &&
+                (condition.second.lower != nullptr || condition.second.upper != nullptr)) {
+                const double range = condition.second.distribution->EstimateRange(condition.second.lower,
+                                                                                 condition.second.upper);
+                estimate = (estimate < 0 ? range : std::min(estimate, range));
+            }
+
+            executor.AddStream(std::get<0>(condition.first), std::get<1>(condition.first),
+                               std::get<2>(condition.first), std::get<3>(condition.first),
+                               condition.second.value.extract(), condition.second.selectivity, estimate);
+        }
+
+        bool success = executor.Execute(target, limit);
+
+        if (success && limit != 0 && target.size() == limit) {
+            array ids;
+            for (const auto &id: target) {
+                ids.append(id);
+            }
+
+            // the candidates hidden by a deletion in progress would leave less than "limit" matches, while the
+            // ids beyond the limit might have matched
+            const int64_t visible = database.GetCollection("Resources").count_documents(make_document(
+                    kvp("internalId", make_document(kvp("$in", ids.extract()))),
+                    kvp("resourceType", static_cast<int32_t>(queryLevel))
+            ));
+
+            if (visible < static_cast<int64_t>(target.size())) {
+                success = executor.Execute(target, 0);
+            }
+        }
+
+        steps = executor.GetSteps();
+        return success;
+    }
+
+    std::string MongoDBIndex::FormatLookupKey(const std::vector<Orthanc::DatabaseConstraint> &lookup,
+                                              OrthancPluginResourceType queryLevel,
+                                              uint32_t limit,
+                                              bool requestSomeInstance) {
+        std::vector<std::string> constraints;
+        constraints.reserve(lookup.size());
+
+        for (const auto &constraint: lookup) {
+            // the values are prefixed by their length, so that no separator can be forged
+            std::string item = std::to_string(constraint.GetLevel()) + ',' +
+                               std::to_string(constraint.GetTag().GetGroup()) + ',' +
+                               std::to_string(constraint.GetTag().GetElement()) + ',' +
+                               std::to_string(constraint.GetConstraintType()) + ',' +
+                               (constraint.IsIdentifier() ? 'i' : 'm') +
+                               (constraint.IsCaseSensitive() ? 's' : 'n') +
+                               (constraint.IsMandatory() ? 'r' : 'o');
+
+            for (size_t i = 0; i < constraint.GetValuesCount(); i++) {
+                const std::string &value = constraint.GetValue(i);
+                item += ',' + std::to_string(value.size()) + ':' + value;
+            }
+
+            constraints.push_back(item);
+        }
+
+        std::sort(constraints.begin(), constraints.end());
+
+        std::string key = std::to_string(queryLevel) + ';' + std::to_string(limit) + ';' +
+                          (requestSomeInstance ? "1" : "0");
+
+        for (const auto &constraint: constraints) {
+            key += ';' + std::to_string(constraint.size()) + ':' + constraint;
+        }
+
+        return key;
+    }
+
+    static void AnswerMatches(IDatabaseBackendOutput &output,
+                              const MongoDBQueryCache::Matches &matches,
+                              bool requestSomeInstance) {
+        for (const auto &match: matches) {
+            if (requestSomeInstance) {
+                output.AnswerMatchingResource(match.publicId, match.instancePublicId);
+            } else {
+                output.AnswerMatchingResource(match.publicId);
+            }
+        }
+    }
+
+    void MongoDBIndex::RecordPlan(QueryPlan &&plan) {
+        static const size_t MAX_PLANS = 16;
 
-        database.GetCollection(databaseInstance, "MainDicomTags").delete_many(delete_document.view());
-        database.GetCollection(databaseInstance, "DicomIdentifiers").delete_many(delete_document.view());
-    }
+        boost::mutex::scoped_lock lock(plansMutex_);
 
-#if ORTHANC_PLUGINS_HAS_DATABASE_CONSTRAINT == 1
+        plans_.push_back(std::move(plan));
 
-    static bool sortConstraintLookup(Orthanc::DatabaseConstraint left, Orthanc::DatabaseConstraint right) {
-        return (left.GetLevel() > right.GetLevel());
+        while (plans_.size() > MAX_PLANS) {
+            plans_.pop_front();
+        }
+    }
+
+    void MongoDBIndex::GetRecentPlans(std::vector<QueryPlan> &target) const {
+        boost::mutex::scoped_lock lock(plansMutex_);
+        target.assign(plans_.begin(), plans_.end());
     }
 
     // New primitive since Orthanc 1.5.2
@@ -1094,12 +2801,45 @@ namespace OrthancDatabases {
                                        bool requestSomeInstance) {
                                         
         auto &database = dynamic_cast<MongoDatabase &>(manager.GetDatabase());
+
+        const auto start = std::chrono::steady_clock::now();
+
+        QueryPlan plan;
+        plan.queryLevel = queryLevel;
+
+        const uint64_t generation = (resourceCache_.get() != nullptr ? resourceCache_->GetGeneration() : 0);
+
+        // the read-write transactions may see their own changes, that are not committed yet
+        const bool useCache = (queryCache_.get() != nullptr && !database.GetWriteBuffer().IsEnabled());
+
+        std::string key;
+        uint64_t queryGeneration = 0;
+
+        if (useCache) {
+            key = FormatLookupKey(lookup, queryLevel, limit, requestSomeInstance);
+            queryGeneration = queryCache_->GetGeneration();
+
+            std::shared_ptr<const MongoDBQueryCache::Matches> cached = queryCache_->Lookup(key);
+            if (cached) {
+                AnswerMatches(output, *cached, requestSomeInstance);
+                PrefetchMatches(database, *cached, generation);
+
+                plan.strategy = "Cache";
+                plan.results = cached->size();
+                plan.duration = std::chrono::duration_cast<std::chrono::microseconds>(
+                        std::chrono::steady_clock::now() - start).count();
+                RecordPlan(std::move(plan));
+                return;
+            }
+        }
+
         auto databaseInstance = database.GetObject();
 
         auto collection = database.GetCollection(databaseInstance, "Resources");
 
-        auto normalStream = array{};
-        auto identifierStream = array{};
+        // the criteria are grouped by the level of their tag, as each level is mapped differently to "queryLevel"
+        std::map<int32_t, array> normalStreams;
+        std::map<int32_t, array> identifierStreams;
 
         size_t normalCount = 0;
         size_t identifierCount = 0;
@@ -1121,52 +2861,7 @@ namespace OrthancDatabases {
 
             auto &current_document = criterias.at(query_identifier);
 
-            switch (constraint.GetConstraintType()) {
-                case Orthanc::ConstraintType_Equal:
-                    current_document.append(
-                            kvp("$eq", constraint.GetSingleValue())
-                    );
-                    /* TODO see what to do with slow regex issue
-                    kvp("$regex", constraint.GetSingleValue()
-                    kvp("$options", case_sensitive_option)
-                    */
-                    break;
-
-                case Orthanc::ConstraintType_SmallerOrEqual:
-                    current_document.append(
-                            kvp("$lte", constraint.GetSingleValue())
-                    );
-                    break;
-
-                case Orthanc::ConstraintType_GreaterOrEqual:
-                    current_document.append(
-                            kvp("$gte", constraint.GetSingleValue())
-                    );
-                    break;
-
-                case Orthanc::ConstraintType_List:
-                    current_document.append(
-                            kvp("$in", [constraint](sub_array child) {
-                                for (size_t i = 0; i < constraint.GetValuesCount(); i++) {
-                                    child.append(constraint.GetValue(i));
-                                }
-                            })
-                    );
-                    break;
-
-
-                case Orthanc::ConstraintType_Wildcard:
-                    if (constraint.GetSingleValue() != "*") {
-                        current_document.append(
-                                kvp("$regex", ConvertWildcardToRegex(constraint.GetSingleValue()))
-                        );
-                    }
-
-                    break;
-
-                default:
-                    throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
-            }
+            AppendConstraintCondition(current_document, constraint);
         }
 
         for (const auto& constraint: lookup_sorted) {
@@ -1186,10 +2881,10 @@ namespace OrthancDatabases {
 
             if (constraint.IsIdentifier()) {
                 identifierCount++;
-                identifierStream.append(criteria);
+                identifierStreams[constraint.GetLevel()].append(criteria);
             } else {
                 normalCount++;
-                normalStream.append(criteria);
+                normalStreams[constraint.GetLevel()].append(criteria);
             }
 
             criterias.erase(current_document_query);
@@ -1197,123 +2892,59 @@ namespace OrthancDatabases {
 
         mongocxx::pipeline stages;
 
-        if (normalCount > 0 && identifierCount == 0) {
-            auto normal_match_stage = make_document(
-                    kvp("$or", normalStream.extract())
-            );
-
-            stages.match(normal_match_stage.view());
-            collection = database.GetCollection(databaseInstance, "MainDicomTags");
-        } else if (normalCount == 0 && identifierCount > 0) {
-            if (identifierCount == 1) {
-                auto identifier_match_stage = make_document(
-                        kvp("$or", identifierStream.extract())
-                );
-
-                stages.match(identifier_match_stage.view());
-                collection = database.GetCollection(databaseInstance, "DicomIdentifiers");
-            } else {
-                mongocxx::pipeline identifiers_stages;
-
-                auto identifier_match_stage = make_document(
-                    kvp("$or", identifierStream.extract())
-                );
-
-                auto lookup_stage = make_document(
-                    kvp("from", "Resources"),
-                    kvp("localField", "id"),
-                    kvp("foreignField", "internalId"),
-                    kvp("as", "resources")
-                );
-
-                auto new_root_stage = make_document(
-                    kvp("newRoot", "$resources")
-                );
-
-                auto project_stage = make_document(
-                    kvp(std::to_string(queryLevel), static_cast<int>(1))
-                );
-
-                auto group_stage = make_document(
-                   kvp("_id", "$" + std::to_string(queryLevel)),
-                   kvp("count", make_document(kvp("$sum", static_cast<int>(1))))
-                );
+        // true if the stages directly match the resources, which are then unique by construction
+        bool direct = false;
 
-                auto final_match = make_document(
-                    kvp("count", make_document(kvp("$gte", static_cast<int>(identifierCount))))
-                );
+        std::vector<int64_t> candidates;
 
-                identifiers_stages.match(identifier_match_stage.view());
-                identifiers_stages.lookup(lookup_stage.view());
-                identifiers_stages.unwind("$resources");
-                identifiers_stages.replace_root(new_root_stage.view());
-                identifiers_stages.project(project_stage.view());
-                identifiers_stages.unwind("$" + std::to_string(queryLevel));
-                identifiers_stages.group(group_stage.view());
-                identifiers_stages.match(final_match.view());
+        // kept alive during the lookup, the statistics being replaced in the background
+        std::shared_ptr<const MongoDBTagStatistics::Distributions> statistics;
+        if (tagStatistics_.get() != nullptr) {
+            statistics = tagStatistics_->GetSnapshot();
+        }
 
-                auto main_tags_ids = array{};
-                mongocxx::options::aggregate identifiersAggregateOptions{};
-                identifiersAggregateOptions.allow_disk_use(true);
+        plan.strategy = "Aggregation";
 
-                auto identifier_cursor = database.GetCollection(databaseInstance, "DicomIdentifiers").aggregate(
-                    identifiers_stages, identifiersAggregateOptions
-                );
+        // the studies and series are sorted on their dates below, so that any of their matches can be answered
+        const bool sorted = (queryLevel == OrthancPluginResourceType_Study ||
+                             queryLevel == OrthancPluginResourceType_Series);
 
-                for (auto &&doc: identifier_cursor) {
-                    auto identifier = doc["_id"].type() == type::k_int32 ? doc["_id"].get_int32().value : doc["_id"].get_int64().value;
-                    main_tags_ids.append(identifier);
-                }
+        bsoncxx::builder::basic::document embeddedFilter;
 
-                auto normal_pre_match_stage = make_document(
-                       kvp("internalId", make_document(kvp("$in", main_tags_ids.extract())))
-                );
+        if (HasEmbeddedTags() && BuildEmbeddedFilter(embeddedFilter, database, lookup, queryLevel)) {
+            stages.match(embeddedFilter.view());
+            direct = true;
+            plan.strategy = "Embedded";
+        } else if (inProcessLookups_ &&
+                   ExecuteLookup(candidates, plan.steps, database, statistics.get(), lookup, queryLevel,
+                                 (sorted ? 0 : limit))) {
+            plan.strategy = "InProcess";
 
-                stages.match(normal_pre_match_stage.view());
+            array ids;
+            for (const auto &id: candidates) {
+                ids.append(id);
             }
-        } else if (normalCount == 0 && identifierCount == 0) {
-            auto match_resources_no_search_stage = make_document(
-                    kvp("resourceType", static_cast<int>(queryLevel))
-            );
 
-            stages.match(match_resources_no_search_stage.view());
-        } else if (normalCount > 0 && identifierCount > 0) {
+            // the level also discards the candidates hidden by a deletion in progress
+            stages.match(make_document(
+                    kvp("internalId", make_document(kvp("$in", ids.extract()))),
+                    kvp("resourceType", static_cast<int32_t>(queryLevel))
+            ));
+            direct = true;
+        } else if (identifierCount > 1 || (identifierCount == 1 && normalCount > 0)) {
+            // the resources at "queryLevel" matching all the identifiers
             mongocxx::pipeline identifiers_stages;
-
-            auto identifier_match_stage = make_document(
-                kvp("$or", identifierStream.extract())
-            );
-
-            auto lookup_stage = make_document(
-                kvp("from", "Resources"),
-                kvp("localField", "id"),
-                kvp("foreignField", "internalId"),
-                kvp("as", "resources")
-            );
-
-            auto new_root_stage = make_document(
-                kvp("newRoot", "$resources")
-            );
-
-            auto project_stage = make_document(
-                kvp(std::to_string(queryLevel), static_cast<int>(1))
-            );
+            AppendLevelStreams(identifiers_stages, "DicomIdentifiers", identifierStreams, queryLevel);
 
             auto group_stage = make_document(
-               kvp("_id", "$" + std::to_string(queryLevel)),
-               kvp("count", make_document(kvp("$sum", static_cast<int>(1))))
+                    kvp("_id", "$internalId"),
+                    kvp("count", make_document(kvp("$sum", static_cast<int>(1))))
             );
 
             auto final_match = make_document(
-                kvp("count", make_document(kvp("$gte", static_cast<int>(identifierCount))))
+                    kvp("count", make_document(kvp("$gte", static_cast<int>(identifierCount))))
             );
 
-            identifiers_stages.match(identifier_match_stage.view());
-            identifiers_stages.lookup(lookup_stage.view());
-            identifiers_stages.unwind("$resources");
-            identifiers_stages.replace_root(new_root_stage.view());
-            identifiers_stages.project(project_stage.view());
-            identifiers_stages.unwind("$" + std::to_string(queryLevel));
             identifiers_stages.group(group_stage.view());
             identifiers_stages.match(final_match.view());
 
@@ -1322,49 +2953,35 @@ namespace OrthancDatabases {
             identifiersAggregateOptions.allow_disk_use(true);
 
             auto identifier_cursor = database.GetCollection(databaseInstance, "DicomIdentifiers").aggregate(
-                identifiers_stages, identifiersAggregateOptions
+                    identifiers_stages, identifiersAggregateOptions
             );
 
             for (auto &&doc: identifier_cursor) {
-                auto identifier = doc["_id"].type() == type::k_int32 ? doc["_id"].get_int32().value : doc["_id"].get_int64().value;
-                main_tags_ids.append(identifier);
+                main_tags_ids.append(doc["_id"].get_int64().value);
             }
 
             auto normal_pre_match_stage = make_document(
-                    kvp("id", make_document(kvp("$in", main_tags_ids.extract())))
+                    kvp("internalId", make_document(kvp("$in", main_tags_ids.extract())))
             );
 
-            auto normal_match_stage = make_document(
-                    kvp("$or", normalStream.extract())
-            );
+            if (normalCount > 0) {
+                AppendLevelStreams(stages, "MainDicomTags", normalStreams, queryLevel);
+                collection = database.GetCollection(databaseInstance, "MainDicomTags");
+            }
 
             stages.match(normal_pre_match_stage.view());
-            stages.match(normal_match_stage.view());
-
+        } else if (identifierCount == 1) {
+            AppendLevelStreams(stages, "DicomIdentifiers", identifierStreams, queryLevel);
+            collection = database.GetCollection(databaseInstance, "DicomIdentifiers");
+        } else if (normalCount > 0) {
+            AppendLevelStreams(stages, "MainDicomTags", normalStreams, queryLevel);
             collection = database.GetCollection(databaseInstance, "MainDicomTags");
-        }
-
-        if (normalCount > 0 || identifierCount == 1) {
-            auto graph_lookup_stage = make_document(
-                    kvp("as", "resources"),
-                    kvp("startWith", "$id"),
-                    kvp("from", "Resources"),
-                    kvp("connectToField", "internalId"),
-                    kvp("connectFromField", std::to_string(queryLevel))
-            );
-
-            auto resource_replace_root_stage = make_document(
-                    kvp("newRoot", "$resources")
-            );
-
-            auto match_resources_stage = make_document(
-                    kvp("resourceType", queryLevel)
+        } else {
+            auto match_resources_no_search_stage = make_document(
+                    kvp("resourceType", static_cast<int>(queryLevel))
             );
 
-            stages.graph_lookup(graph_lookup_stage.view());
-            stages.unwind("$resources");
-            stages.replace_root(resource_replace_root_stage.view());
-            stages.match(match_resources_stage.view());
+            stages.match(match_resources_no_search_stage.view());
         }
 
         // final stages
@@ -1374,11 +2991,13 @@ namespace OrthancDatabases {
         );
         auto replace_root = make_document(kvp("newRoot", "$item"));
 
-        stages.group(group_resources.view());
-        stages.replace_root(replace_root.view());
+        if (!direct) {
+            stages.group(group_resources.view());
+            stages.replace_root(replace_root.view());
+        }
 
         // sort of the query by study or series
-        if (queryLevel == OrthancPluginResourceType_Study || queryLevel == OrthancPluginResourceType_Series) {
+        if (sorted) {
             auto sort_build_stage = make_document(
                     kvp("sorts.0", -1), kvp("sorts.1", -1)
             );
@@ -1397,56 +3016,94 @@ namespace OrthancDatabases {
 
         auto cursor = collection.aggregate(stages, aggregateOptions);
 
+        auto matches = std::make_shared<MongoDBQueryCache::Matches>();
+
         for (auto &&doc: cursor) {
+            MongoDBQueryCache::Match match;
+            match.publicId = std::string(doc["publicId"].get_string().value);
+
             if (requestSomeInstance) {
-                output.AnswerMatchingResource(
-                        std::string(doc["publicId"].get_string().value),
-                        std::string(doc["instancePublicId"].get_string().value)
-                );
-            } else {
-                output.AnswerMatchingResource(std::string(doc["publicId"].get_string().value));
+                match.instancePublicId = std::string(doc["instancePublicId"].get_string().value);
+            }
+
+            if (doc["internalId"] && doc["resourceType"]) {
+                MongoDBResourceCache::Resource identity;
+                ParseIdentity(identity, doc);
+                match.internalId = identity.internalId;
+                match.resourceType = identity.resourceType;
+                match.parentId = identity.parentId;
             }
+
+            matches->push_back(std::move(match));
+        }
+
+        if (useCache) {
+            queryCache_->Add(key, matches, queryGeneration);
         }
+
+        AnswerMatches(output, *matches, requestSomeInstance);
+
+        // Orthanc reads the tags, metadata and parents of every match right after
+        PrefetchMatches(database, *matches, generation);
+
+        plan.results = matches->size();
+        plan.duration = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start).count();
+        RecordPlan(std::move(plan));
     }
 
 #endif
 #if ORTHANC_PLUGINS_HAS_DATABASE_CONSTRAINT == 1
 
     //  helpers functions
+    // "embeddedField" is the sub-document of the resources where the tags are copied, null if they are not embedded
     static void ExecuteSetResourcesContentTags(DatabaseManager &manager, const std::string &collectionName,
                                                uint32_t count,
-                                               const OrthancPluginResourcesContentTags *tags) {
+                                               const OrthancPluginResourcesContentTags *tags,
+                                               const char *embeddedField) {
         auto &database = dynamic_cast<MongoDatabase &>(manager.GetDatabase());
         auto databaseInstance = database.GetObject();
 
         auto collection = database.GetCollection(databaseInstance, collectionName);
         auto resourceCollection = database.GetCollection(databaseInstance, "Resources");
-        auto bulk = collection.create_bulk_write();
 
         for (uint32_t i = 0; i < count; i++) {
-            auto doc = make_document(
+            collection.Defer(mongocxx::model::insert_one{make_document(
                     kvp("id", tags[i].resource),
                     kvp("tagGroup", tags[i].group),
                     kvp("tagElement", tags[i].element),
                     kvp("value", tags[i].value)
-            );
+            )}, true);
 
-            mongocxx::model::insert_one insert_op{doc.view()};
-            bulk.append(insert_op);
-
-            // study and series date and time for sorting
+            // study and series date and time for sorting, "$addToSet" commutes with the other updates
             if (collectionName == "MainDicomTags" && tags[i].group == 8 &&
                 (tags[i].element == 32 || tags[i].element == 48 || tags[i].element == 33 || tags[i].element == 49)) {
-                auto resource_find = make_document(kvp("internalId", tags[i].resource));
-                auto resource_update = make_document(
-                        kvp("$addToSet", make_document(kvp("sorts", tags[i].value)))
-                );
-
-                resourceCollection.update_one(resource_find.view(), resource_update.view());
+                resourceCollection.Defer(mongocxx::model::update_one{
+                        make_document(kvp("internalId", tags[i].resource)),
+                        make_document(kvp("$addToSet", make_document(kvp("sorts", tags[i].value))))
+                }, true);
             }
         }
 
-        if (count > 0) bulk.execute();
+        if (embeddedField != nullptr) {
+            // one update per resource
+            std::map<int64_t, bsoncxx::builder::basic::document> embedded;
+
+            for (uint32_t i = 0; i < count; i++) {
+                embedded[tags[i].resource].append(kvp(
+                        std::string(embeddedField) + '.' + MongoDBTagsMigration::FormatTagKey(tags[i].group,
+                                                                                              tags[i].element),
+                        tags[i].value
+                ));
+            }
+
+            for (auto &resource: embedded) {
+                resourceCollection.Defer(mongocxx::model::update_one{
+                        make_document(kvp("internalId", resource.first)),
+                        make_document(kvp("$set", resource.second.extract()))
+                }, true);
+            }
+        }
     }
 
     static void ExecuteSetResourcesContentMetadata(DatabaseManager &manager, const std::string &collectionName,
@@ -1456,32 +3113,19 @@ namespace OrthancDatabases {
         auto databaseInstance = database.GetObject();
 
         auto collection = database.GetCollection(databaseInstance, collectionName);
-        auto bulk = collection.create_bulk_write();
-
-        auto removeArray = array{};
-        std::vector<bsoncxx::document::value> metaDocuments;
 
         for (uint32_t i = 0; i < count; i++) {
-            auto insertDoc = make_document(
-                    kvp("id", meta[i].resource),
-                    kvp("type", meta[i].metadata),
-                    kvp("value", meta[i].value)
-            );
-
-            auto removeDoc = make_document(
+            collection.Defer(mongocxx::model::delete_one{make_document(
                     kvp("id", meta[i].resource),
                     kvp("type", meta[i].metadata)
-            );
+            )}, false);
 
-            mongocxx::model::delete_one delete_one{removeDoc.view()};
-            mongocxx::model::insert_one insert_op{insertDoc.view()};
-
-            bulk.append(delete_one);
-            bulk.append(insert_op);
+            collection.Defer(mongocxx::model::insert_one{make_document(
+                    kvp("id", meta[i].resource),
+                    kvp("type", meta[i].metadata),
+                    kvp("value", meta[i].value)
+            )}, false);
         }
-
-        // just check for the $or not throw error
-        if (count > 0) bulk.execute();
     }
 
     // New primitive since Orthanc 1.5.2
@@ -1493,8 +3137,33 @@ namespace OrthancDatabases {
             const OrthancPluginResourcesContentTags *mainDicomTags,
             uint32_t countMetadata,
             const OrthancPluginResourcesContentMetadata *metadata) {
-        ExecuteSetResourcesContentTags(manager, "DicomIdentifiers", countIdentifierTags, identifierTags);
-        ExecuteSetResourcesContentTags(manager, "MainDicomTags", countMainDicomTags, mainDicomTags);
+        if (countIdentifierTags > 0 || countMainDicomTags > 0) {
+            InvalidateQueries(dynamic_cast<MongoDatabase &>(manager.GetDatabase()));
+        }
+
+        if (summaryCache_.get() != nullptr) {
+            auto &database = dynamic_cast<MongoDatabase &>(manager.GetDatabase());
+
+            std::set<int64_t> resources;
+            for (uint32_t i = 0; i < countIdentifierTags; i++) {
+                resources.insert(identifierTags[i].resource);
+            }
+            for (uint32_t i = 0; i < countMainDicomTags; i++) {
+                resources.insert(mainDicomTags[i].resource);
+            }
+            for (uint32_t i = 0; i < countMetadata; i++) {
+                resources.insert(metadata[i].resource);
+            }
+
+            for (const auto &resource: resources) {
+                InvalidateSummary(database, resource);
+            }
+        }
+
+        ExecuteSetResourcesContentTags(manager, "DicomIdentifiers", countIdentifierTags, identifierTags,
+                                       options_.embeddedTags ? "identifiers" : nullptr);
+        ExecuteSetResourcesContentTags(manager, "MainDicomTags", countMainDicomTags, mainDicomTags,
+                                       options_.embeddedTags ? "tags" : nullptr);
         ExecuteSetResourcesContentMetadata(manager, "Metadata", countMetadata, metadata);
     }
 
@@ -1537,22 +3206,17 @@ namespace OrthancDatabases {
     void MongoDBIndex::TagMostRecentPatient(DatabaseManager &manager,
                                             int64_t patient) {
 
-        auto &database = dynamic_cast<MongoDatabase &>(manager.GetDatabase());
-
-        auto collection = database.GetCollection("PatientRecyclingOrder");
-        auto recyclingOrderDoc = collection.find_one(make_document(kvp("patientId", patient)));
+        if (bulkLoad_) {
+            return;  // the recycling order is rebuilt by ExitBulkLoad()
+        }
 
-        if (recyclingOrderDoc) {
-            int64_t seq = recyclingOrderDoc->view()["id"].get_int64().value;
-            collection.delete_many(make_document(kvp("id", seq)));
+        auto &database = dynamic_cast<MongoDatabase &>(manager.GetDatabase());
 
-            // Refresh the patient "id" in list of unprotected patients
-            seq = database.GetNextSequence("PatientRecyclingOrder");
-            collection.insert_one(make_document(
-                    kvp("id", seq),
-                    kvp("patientId", patient)
-            ));
-        }
+        // Refresh the stamp of the patient, protected patients have none
+        database.GetCollection("Resources").Defer(mongocxx::model::update_one{
+                make_document(kvp("internalId", patient), kvp("recyclingStamp", make_document(kvp("$exists", true)))),
+                make_document(kvp("$set", make_document(kvp("recyclingStamp", NextRecyclingStamp()))))
+        }, false);
     }
 
 #if defined(ORTHANC_PLUGINS_VERSION_IS_ABOVE)      // Macro introduced in 1.3.1
@@ -1564,6 +3228,27 @@ namespace OrthancDatabases {
                                                std::string &parentPublicId,
                                                DatabaseManager &manager,
                                                const char *publicId) {
+        if (resourceCache_.get() != nullptr) {
+            // two lookups in memory in the common case, instead of the aggregation below
+            MongoDBResourceCache::Resource resource, parent;
+
+            if (!LookupIdentity(resource, manager, std::string(publicId))) {
+                return false;
+            }
+
+            if (resource.parentId == -1) {
+                parentPublicId.clear();
+            } else if (LookupIdentity(parent, manager, resource.parentId)) {
+                parentPublicId = parent.publicId;
+            } else {
+                parentPublicId.clear();
+            }
+
+            id = resource.internalId;
+            type = static_cast<OrthancPluginResourceType>(resource.resourceType);
+            return true;
+        }
+
         auto &database = dynamic_cast<MongoDatabase &>(manager.GetDatabase());
 
         mongocxx::pipeline stages;
@@ -1624,6 +3309,16 @@ namespace OrthancDatabases {
     void MongoDBIndex::GetAllMetadata(std::map<int32_t, std::string> &result,
                                       DatabaseManager &manager,
                                       int64_t id) {
+        std::shared_ptr<const MongoDBSummaryCache::Summary> summary = LookupSummary(manager, id);
+
+        if (summary) {
+            for (const auto &metadata: summary->metadata) {
+                result[metadata.first] = metadata.second.value;
+            }
+
+            return;
+        }
+
         auto &database = dynamic_cast<MongoDatabase &>(manager.GetDatabase());
         auto metadataCursor = database.GetCollection("Metadata").find(make_document(kvp("id", id)));
 
@@ -1636,210 +3331,265 @@ namespace OrthancDatabases {
 #endif
 #if ORTHANC_PLUGINS_HAS_DATABASE_CONSTRAINT == 1
 
-    void MongoDBIndex::CreateInstance(OrthancPluginCreateInstanceResult &result,
-                                      DatabaseManager &manager,
-                                      const char *hashPatient,
-                                      const char *hashStudy,
-                                      const char *hashSeries,
-                                      const char *hashInstance) {
-        auto &database = dynamic_cast<MongoDatabase &>(manager.GetDatabase());
+    static bool IsDuplicateKey(const mongocxx::operation_exception &e) {
+        if (e.code().value() == 11000) {
+            return true;
+        }
 
-        auto collection = database.GetCollection("Resources");
-        auto instance = collection.find_one(
-                make_document(kvp("publicId", hashInstance), kvp("resourceType", 3))
-        );
+        if (e.raw_server_error()) {
+            auto errors = e.raw_server_error()->view()["writeErrors"];
 
-        if (instance) {
-            result.isNewInstance = false;
-            result.instanceId = instance->view()["internalId"].get_int64().value;
-        } else {
-            auto bulk = collection.create_bulk_write();
+            if (errors && errors.type() == type::k_array) {
+                for (auto &&error: errors.get_array().value) {
+                    if (error["code"] && error["code"].get_int32().value == 11000) {
+                        return true;
+                    }
+                }
+            }
+        }
 
-            auto patient = collection.find_one(
-                    make_document(kvp("publicId", hashPatient), kvp("resourceType", 0))
-            );
-            auto study = collection.find_one(
-                    make_document(kvp("publicId", hashStudy), kvp("resourceType", 1))
-            );
-            auto series = collection.find_one(
-                    make_document(kvp("publicId", hashSeries), kvp("resourceType", 2))
-            );
+        return false;
+    }
 
-            if (patient) {
-                result.isNewPatient = false;
-                result.patientId = patient->view()["internalId"].get_int64().value;
-            } else {
-                if (study && series && instance) {
-                    throw Orthanc::OrthancException(Orthanc::ErrorCode_Database);
-                }
+    // Creates the resource at "level" below the already known "ancestors", unless a concurrent transaction has
+    // created it in the meantime. Returns the internal id of the resource in the database.
+    static int64_t UpsertResource(bool &isNew,
+                                  MongoDatabase &database,
+                                  MongoCollection &collection,
+                                  int32_t level,
+                                  const char *publicId,
+                                  const int64_t (&ancestors)[4],
+                                  const char *hashInstance,
+                                  int64_t recyclingStamp) {
+        const int64_t id = database.GetNextSequence("Resources");
+
+        bsoncxx::builder::basic::document resource;
+        resource.append(kvp("internalId", id));
+        resource.append(kvp("resourceType", level));
+        resource.append(kvp("publicId", publicId));
+
+        if (level == 0) {
+            resource.append(kvp("parentId", bsoncxx::types::b_null()));
+        } else {
+            resource.append(kvp("parentId", ancestors[level - 1]));
+        }
 
-                int64_t patientId = database.GetNextSequence("Resources");
-                auto patient_document = make_document(
-                        kvp("internalId", patientId),
-                        kvp("resourceType", 0),
-                        kvp("publicId", hashPatient),
-                        kvp("parentId", bsoncxx::types::b_null()),
+        // only the ancestors (and the resource itself) are stored, the descendants are found through these fields
+        for (int32_t i = 0; i < level; i++) {
+            resource.append(kvp(std::to_string(i), ancestors[i]));
+        }
 
-                        kvp("0", make_array(patientId)),
-                        kvp("1", make_array()),
-                        kvp("2", make_array()),
-                        kvp("3", make_array()),
+        resource.append(kvp(std::to_string(level), id));
 
-                        kvp("instancePublicId", hashInstance)
-                );
+        if (level == 1 || level == 2) {
+            resource.append(kvp("sorts", make_array()));
+        }
 
-                mongocxx::model::insert_one insert_patient{patient_document.view()};
-                bulk.append(insert_patient);
+        resource.append(kvp("instancePublicId", hashInstance));
 
-                result.isNewPatient = true;
-                result.patientId = patientId;
+        // a new patient is queued for recycling, except during a bulk load (see ExitBulkLoad())
+        if (level == 0) {
+            resource.append(kvp("size", static_cast<int64_t>(0)));
+
+            if (recyclingStamp != 0) {
+                resource.append(kvp("recyclingStamp", recyclingStamp));
             }
+        }
 
-            if (study) {
-                result.isNewStudy = false;
-                result.studyId = study->view()["internalId"].get_int64().value;
-            } else {
-                if (series && instance) {
-                    throw Orthanc::OrthancException(Orthanc::ErrorCode_Database);
-                }
+        mongocxx::options::find_one_and_update options;
+        options.upsert(true);
+        options.return_document(mongocxx::options::return_document::k_after);
+        options.projection(make_document(kvp("internalId", 1)));
 
-                int64_t studyId = database.GetNextSequence("Resources");
-                auto study_document = make_document(
-                        kvp("internalId", studyId),
-                        kvp("resourceType", 1),
-                        kvp("publicId", hashStudy),
-                        kvp("parentId", result.patientId),
+        auto filter = make_document(kvp("publicId", publicId));
+        auto update = make_document(kvp("$setOnInsert", resource.extract()));
 
-                        kvp("0", make_array(result.patientId)),
-                        kvp("1", make_array(studyId)),
-                        kvp("2", make_array()),
-                        kvp("3", make_array()),
+        for (int attempt = 0; attempt < 2; attempt++) {
+            try {
+                auto existing = collection.find_one_and_update(filter.view(), update.view(), options);
 
-                        kvp("sorts", make_array()),
-                        kvp("instancePublicId", hashInstance)
-                );
+                if (existing) {
+                    const int64_t actual = existing->view()["internalId"].get_int64().value;
+                    isNew = (actual == id);
+                    return actual;
+                }
+            } catch (const mongocxx::operation_exception &e) {
+                // two upserts raced on the unique index, the second attempt finds the winner
+                if (!IsDuplicateKey(e) || attempt > 0) {
+                    throw;
+                }
+            }
+        }
 
-                mongocxx::model::insert_one insert_study{study_document.view()};
-                bulk.append(insert_study);
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_Database);
+    }
 
-                result.studyId = studyId;
-                result.isNewStudy = true;
-            }
+    // Without MongoDB transactions, the resources are created right away, so that the unique index on their public
+    // id arbitrates between concurrent transactions, while their tags, attachments and changes wait for the commit.
+    // If the transaction is discarded, the resource is removed again, unless another transaction has meanwhile
+    // attached a child to it: otherwise, the retry of Orthanc would find an instance without anything attached.
+    static void RemoveOnRollback(MongoDatabase &database, int64_t internalId) {
+        MongoDatabase *target = &database;
 
-            if (series) {
-                result.isNewSeries = false;
-                result.seriesId = series->view()["internalId"].get_int64().value;
-            } else {
-                if (instance) {
-                    throw Orthanc::OrthancException(Orthanc::ErrorCode_Database);
+        database.GetWriteBuffer().OnRollback([target, internalId]() {
+            try {
+                auto resources = target->GetObject()["Resources"];
+
+                if (!resources.find_one(make_document(kvp("parentId", internalId)))) {
+                    resources.delete_one(make_document(kvp("internalId", internalId)));
                 }
+            } catch (const std::exception &e) {
+                LOG(ERROR) << "Cannot remove the resource " << internalId << " of a discarded transaction: "
+                           << e.what();
+            }
+        });
+    }
 
-                int64_t seriesId = database.GetNextSequence("Resources");
-                auto series_document = make_document(
-                        kvp("internalId", seriesId),
-                        kvp("resourceType", 2),
-                        kvp("publicId", hashSeries),
-                        kvp("parentId", result.studyId),
+    void MongoDBIndex::CreateInstance(OrthancPluginCreateInstanceResult &result,
+                                      DatabaseManager &manager,
+                                      const char *hashPatient,
+                                      const char *hashStudy,
+                                      const char *hashSeries,
+                                      const char *hashInstance) {
+        auto &database = dynamic_cast<MongoDatabase &>(manager.GetDatabase());
+        auto collection = database.GetCollection("Resources");
 
-                        kvp("0", make_array(result.patientId)),
-                        kvp("1", make_array(result.studyId)),
-                        kvp("2", make_array(seriesId)),
-                        kvp("3", make_array()),
+        const char *hashes[4] = {hashPatient, hashStudy, hashSeries, hashInstance};
+        int64_t ids[4] = {0, 0, 0, 0};
+        bool found[4] = {false, false, false, false};
 
-                        kvp("sorts", make_array()),
-                        kvp("instancePublicId", hashInstance)
-                );
+        const uint64_t generation = (resourceCache_.get() != nullptr ? resourceCache_->GetGeneration() : 0);
 
-                mongocxx::model::insert_one insert_series{series_document.view()};
-                bulk.append(insert_series);
+        {
+            // the four levels are looked up at once
+            mongocxx::options::find options;
+            options.projection(make_document(kvp("internalId", 1), kvp("resourceType", 1), kvp("publicId", 1)));
+
+            auto cursor = collection.find(make_document(
+                    kvp("publicId", make_document(
+                            kvp("$in", make_array(hashPatient, hashStudy, hashSeries, hashInstance))
+                    ))
+            ), options);
+
+            for (auto &&doc: cursor) {
+                const int32_t level = doc["resourceType"].get_int32().value;
 
-                result.seriesId = seriesId;
-                result.isNewSeries = true;
+                if (level >= 0 && level < 4 &&
+                    doc["publicId"].get_string().value == bsoncxx::stdx::string_view(hashes[level])) {
+                    ids[level] = doc["internalId"].get_int64().value;
+                    found[level] = true;
+                }
             }
+        }
 
-            int64_t instanceId = database.GetNextSequence("Resources");
-            auto instance_document = make_document(
-                    kvp("internalId", instanceId),
-                    kvp("resourceType", 3),
-                    kvp("publicId", hashInstance),
-                    kvp("parentId", result.seriesId),
+        if (found[3]) {
+            result.isNewInstance = false;
+            result.instanceId = ids[3];
+            return;
+        }
 
-                    kvp("0", make_array(result.patientId)),
-                    kvp("1", make_array(result.studyId)),
-                    kvp("2", make_array(result.seriesId)),
-                    kvp("3", make_array(instanceId)),
+        // a missing resource cannot have an existing descendant
+        bool hasDescendant = false;
+        for (int32_t level = 2; level >= 0; level--) {
+            if (!found[level] && hasDescendant) {
+                throw Orthanc::OrthancException(Orthanc::ErrorCode_Database);
+            }
 
-                    kvp("instancePublicId", hashInstance)
-            );
+            hasDescendant = hasDescendant || found[level];
+        }
 
-            mongocxx::model::insert_one insert_instance{instance_document.view()};
-            bulk.append(insert_instance);
-
-            result.isNewInstance = true;
-            result.instanceId = instanceId;
-
-            if (result.patientId) {
-                auto find_patient_document = make_document(kvp("internalId", result.patientId));
-                auto update_patient_document = make_document(
-                        kvp("$addToSet", make_document(
-                                kvp("0", result.patientId),
-                                kvp("1", result.studyId),
-                                kvp("2", result.seriesId),
-                                kvp("3", result.instanceId)
-                        ))
-                );
+        // the missing parents are created top-down, each one below the id that actually won in the database
+        bool isNew[3] = {false, false, false};
 
-                mongocxx::model::update_one update_patient{
-                        find_patient_document.view(), update_patient_document.view()
-                };
+        for (int32_t level = 0; level < 3; level++) {
+            if (!found[level]) {
+                ids[level] = UpsertResource(isNew[level], database, collection, level, hashes[level], ids,
+                                            hashInstance, (level == 0 && !bulkLoad_) ? NextRecyclingStamp() : 0);
 
-                bulk.append(update_patient);
+                if (isNew[level]) {
+                    RemoveOnRollback(database, ids[level]);
+                }
             }
+        }
 
-            if (result.studyId) {
-                auto find_study_document = make_document(kvp("internalId", result.studyId));
-                auto update_study_document = make_document(
-                        kvp("$addToSet", make_document(
-                                kvp("0", result.patientId),
-                                kvp("1", result.studyId),
-                                kvp("2", result.seriesId),
-                                kvp("3", result.instanceId)
-                        ))
-                );
+        result.isNewPatient = isNew[0];
+        result.patientId = ids[0];
+        result.isNewStudy = isNew[1];
+        result.studyId = ids[1];
+        result.isNewSeries = isNew[2];
+        result.seriesId = ids[2];
+
+        const int64_t instanceId = database.GetNextSequence("Resources");
+        auto instance_document = make_document(
+                kvp("internalId", instanceId),
+                kvp("resourceType", 3),
+                kvp("publicId", hashInstance),
+                kvp("parentId", result.seriesId),
+
+                kvp("0", result.patientId),
+                kvp("1", result.studyId),
+                kvp("2", result.seriesId),
+                kvp("3", instanceId),
+
+                kvp("instancePublicId", hashInstance)
+        );
 
-                mongocxx::model::update_one update_study{find_study_document.view(), update_study_document.view()};
-                bulk.append(update_study);
+        try {
+            collection.insert_one(instance_document.view());
+        } catch (const mongocxx::operation_exception &e) {
+            // the instance has been inserted concurrently, the unique index on publicId rejects this copy
+            if (!IsDuplicateKey(e)) {
+                throw;
             }
 
-            if (result.seriesId) {
-                auto find_series_document = make_document(kvp("internalId", result.seriesId));
-                auto update_series_document = make_document(
-                        kvp("$addToSet", make_document(
-                                kvp("0", result.patientId),
-                                kvp("1", result.studyId),
-                                kvp("2", result.seriesId),
-                                kvp("3", result.instanceId)
-                        ))
-                );
+            auto instance = collection.find_one(make_document(kvp("publicId", hashInstance)));
+            if (!instance) {
+                throw;
+            }
+
+            result.isNewInstance = false;
+            result.instanceId = instance->view()["internalId"].get_int64().value;
+            return;
+        }
+
+        RemoveOnRollback(database, instanceId);
 
-                mongocxx::model::update_one update_series{find_series_document.view(), update_series_document.view()};
-                bulk.append(update_series);
+        result.isNewInstance = true;
+        result.instanceId = instanceId;
+
+        InvalidateSubtrees(database, std::set<int64_t>{result.studyId});
+        InvalidateQueries(database);
+
+        {
+            MongoDBCounters::Totals added;
+            for (int32_t level = 0; level < 3; level++) {
+                added.resources[level] = (isNew[level] ? 1 : 0);
             }
+            added.resources[3] = 1;
 
-            bulk.execute();
+            MongoDBCounters::Apply(database, added);
+        }
 
-            if (result.isNewPatient) {
-                // add patient to PatientRecyclingOrder
-                int64_t id = database.GetNextSequence("PatientRecyclingOrder");
-                database.GetCollection("PatientRecyclingOrder").insert_one(make_document(
-                        kvp("id", id),
-                        kvp("patientId", result.patientId)
-                ));
-            } else {
-                // update patient order in PatientRecyclingOrder
-                TagMostRecentPatient(manager, result.patientId);
+        ids[3] = instanceId;
+        for (int32_t level = 0; level < 4; level++) {
+            lastInstance_.internalIds[level] = ids[level];
+            lastInstance_.publicIds[level] = hashes[level];
+
+            // Orthanc looks the new instance and its parents up right after storing it
+            if (resourceCache_.get() != nullptr) {
+                MongoDBResourceCache::Resource resource;
+                resource.internalId = ids[level];
+                resource.resourceType = level;
+                resource.parentId = (level == 0 ? -1 : ids[level - 1]);
+                resource.publicId = hashes[level];
+                CacheResource(database, resource, generation);
             }
         }
+
+        // a new patient already got its stamp when it was created
+        if (!result.isNewPatient) {
+            TagMostRecentPatient(manager, result.patientId);
+        }
     }
 
 #endif
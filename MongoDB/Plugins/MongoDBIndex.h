@@ -19,33 +19,253 @@
 #pragma once
 
 #include <mongocxx/cursor.hpp>
+#include <boost/thread/mutex.hpp>
+#include <atomic>
+#include <deque>
 #include <bsoncxx/document/value.hpp>
 
+#include "MongoDBChangesCache.h"
+#include "MongoDBCounters.h"
+#include "MongoDBLookupExecutor.h"
+#include "MongoDBQueryCache.h"
+#include "MongoDBResourceCache.h"
+#include "MongoDBSubtreeCache.h"
+#include "MongoDBSummaryCache.h"
+#include "MongoDBResourcePurger.h"
+#include "MongoDBTagStatistics.h"
+#include "MongoDBTagsMigration.h"
+#include "../../Framework/MongoDB/MongoDatabase.h"
 #include "../../Framework/Plugins/IndexBackend.h"
 
 namespace OrthancDatabases {
     class MongoDBIndex : public IndexBackend {
     private:
         std::string url_;
-        int chunkSize_;
+        MongoDatabase::Options options_;
+
+        // shared by the connections of all the factories, created with the first one, see CreateDatabaseFactory()
+        boost::mutex factoriesMutex_;
+        std::shared_ptr<MongoGroupCommit> groupCommit_;  // null if "groupCommitWindow" is 0
+        std::shared_ptr<MongoExecutor> executor_;  // null if "parallelWrites" is 0
+
+        // bulk-load mode, see EnterBulkLoad()
+        std::atomic<bool> bulkLoad_;
+        bool bulkLoadOnStartup_;
+        boost::mutex bulkLoadMutex_;
+
+        // removes the resources hidden by DeleteResource(), see SetPurgeParameters()
+        std::unique_ptr<MongoDBResourcePurger> purger_;
+        unsigned int purgeBatchSize_;
+        unsigned int purgeThrottle_;
+
+        // reconciles the counters of the index every "countersInterval_" seconds, see MongoDBCounters
+        std::unique_ptr<MongoDBCounters> counters_;
+        unsigned int countersInterval_;
+
+        // last stamp handed out by NextRecyclingStamp()
+        std::atomic<int64_t> lastRecyclingStamp_;
+
+        // The least recently updated unprotected patient, i.e. the one with the lowest "recyclingStamp" in
+        // "Resources", is the next one to recycle. Protected patients have no stamp, but a "protected" flag.
+        int64_t NextRecyclingStamp();
+
+        // the most recent changes, see SetChangesCacheSize()
+        std::unique_ptr<MongoDBChangesCache> changesCache_;
+        unsigned int changesCacheSize_;
+
+        // identity of the resources, null if disabled, see SetResourceCacheSize()
+        std::unique_ptr<MongoDBResourceCache> resourceCache_;
+
+        // adds "resource", read from the database at "generation", once the transaction in progress is committed
+        void CacheResource(MongoDatabase &database, const MongoDBResourceCache::Resource &resource,
+                           uint64_t generation);
+
+        // the identity of a resource, from the cache if possible, false if the resource does not exist
+        bool LookupIdentity(MongoDBResourceCache::Resource &target, DatabaseManager &manager, int64_t internalId);
+
+        bool LookupIdentity(MongoDBResourceCache::Resource &target, DatabaseManager &manager,
+                            const std::string &publicId);
+
+        // children of the studies and of the series, null if disabled, see SetSubtreeCacheSize()
+        std::unique_ptr<MongoDBSubtreeCache> subtreeCache_;
+
+        // the children of a study or a series through the subtree of its study, false if the cache is disabled or
+        // if "id" is neither a study nor a series
+        bool LookupChildren(std::vector<MongoDBSubtreeCache::Child> &target, DatabaseManager &manager, int64_t id);
+
+        // drops the subtrees of "studies" now and once the transaction in progress is committed
+        void InvalidateSubtrees(MongoDatabase &database, const std::set<int64_t> &studies);
+
+        // tags, metadata and attachments of the resources, null if disabled, see SetSummaryCacheSize()
+        std::unique_ptr<MongoDBSummaryCache> summaryCache_;
+
+        // the summary of a resource, null if the cache is disabled or if the resource does not exist
+        std::shared_ptr<const MongoDBSummaryCache::Summary> LookupSummary(DatabaseManager &manager, int64_t id);
+
+        // drops the summary of "id" now and once the transaction in progress is committed
+        void InvalidateSummary(MongoDatabase &database, int64_t id);
+
+        // reads the identities, tags, metadata and attachments of the resources matched by LookupResources() and
+        // of their parents with a few batched queries, for the rest of the transaction and for the caches. The
+        // resources already in the caches are not read again. "generation" is the one of the cache of the
+        // identities before the lookup.
+        void PrefetchMatches(MongoDatabase &database, const MongoDBQueryCache::Matches &matches,
+                             uint64_t generation);
+
+        // see PrefetchMatches()
+        bool prefetchMatches_;
+
+        // answers of LookupResources(), null if disabled, see SetQueryCacheParameters()
+        std::unique_ptr<MongoDBQueryCache> queryCache_;
+
+        // invalidates the cached answers of LookupResources() once the transaction in progress is committed
+        void InvalidateQueries(MongoDatabase &database);
+
+        // LookupResources() intersects the ids matching each constraint in the plugin, see MongoDBLookupExecutor
+        bool inProcessLookups_;
+
+        // distributions of the values of the tags, used to order the streams of MongoDBLookupExecutor, null if disabled
+        std::unique_ptr<MongoDBTagStatistics> tagStatistics_;
+        unsigned int tagStatisticsInterval_;
+
+        // copies the tags of the existing resources into the resources themselves, null unless "embeddedTags" is set
+        std::unique_ptr<MongoDBTagsMigration> tagsMigration_;
+
+        // the embedded tags can be read instead of the "MainDicomTags" and "DicomIdentifiers" collections
+        bool HasEmbeddedTags() const {
+            return tagsMigration_.get() != nullptr && tagsMigration_->IsComplete();
+        }
+
+    public:
+        // how LookupResources() has answered a request
+        struct QueryPlan {
+            OrthancPluginResourceType queryLevel = OrthancPluginResourceType_Patient;
+            std::string strategy;  // "Cache", "Embedded", "InProcess" or "Aggregation"
+            // read by MongoDBLookupExecutor, also when it gave up for the aggregation
+            std::vector<MongoDBLookupExecutor::Step> steps;
+            size_t results = 0;
+            uint64_t duration = 0;  // in microseconds
+        };
+
+    private:
+        // the most recent plans, for GET /mongodb/query-plans
+        mutable boost::mutex plansMutex_;
+        std::deque<QueryPlan> plans_;
+
+        void RecordPlan(QueryPlan &&plan);
 
     protected:
-        // methods overriden for mongodb
+        // methods overriden for mongodb, the sizes of the signalled files are subtracted from "removed"
         void SignalDeletedFiles(
                 IDatabaseBackendOutput &output,
-                mongocxx::cursor& cursor
+                mongocxx::cursor& cursor,
+                MongoDBCounters::Totals &removed
         );
 
-        void SignalDeletedResources(
-                IDatabaseBackendOutput &output,
-                const std::vector <bsoncxx::document::view> deleted_resources_vec
-        );
 
     public:
         explicit MongoDBIndex(OrthancPluginContext *context);  // Opens in memory
 
         MongoDBIndex(OrthancPluginContext *context, const std::string &url_, const int &chunkSize_);
 
+        virtual ~MongoDBIndex();
+
+        // number of deleted resources purged at once, and pause in milliseconds between two batches
+        void SetPurgeParameters(unsigned int batchSize, unsigned int throttle) {
+            purgeBatchSize_ = batchSize;
+            purgeThrottle_ = throttle;
+        }
+
+        // number of recent changes served from memory, 0 to disable the cache
+        void SetChangesCacheSize(unsigned int size) {
+            changesCacheSize_ = size;
+        }
+
+        // memory bound of the cache of the identity of the resources, in MB, 0 to disable it
+        void SetResourceCacheSize(unsigned int size);
+
+        // null if disabled
+        const MongoDBResourceCache *GetResourceCache() const {
+            return resourceCache_.get();
+        }
+
+        // memory bound of the cache of the subtrees of the studies, in MB, 0 to disable it
+        void SetSubtreeCacheSize(unsigned int size);
+
+        // null if disabled
+        MongoDBSubtreeCache *GetSubtreeCache() {
+            return subtreeCache_.get();
+        }
+
+        // memory bound of the cache of the tags, metadata and attachments of the resources, in MB, 0 to disable it
+        void SetSummaryCacheSize(unsigned int size);
+
+        // null if disabled
+        const MongoDBSummaryCache *GetSummaryCache() const {
+            return summaryCache_.get();
+        }
+
+        // memory bound of the cache of the answers of LookupResources() in MB, 0 to disable it, and delay in
+        // seconds after which an answer expires
+        void SetQueryCacheParameters(unsigned int size, unsigned int timeToLive);
+
+        // null if disabled
+        MongoDBQueryCache *GetQueryCache() {
+            return queryCache_.get();
+        }
+
+        // reads the summaries of the matches of the lookups at once, rather than one by one as Orthanc expands them
+        void SetPrefetchMatches(bool enabled) {
+            prefetchMatches_ = enabled;
+        }
+
+        // evaluates the constraints of the lookups in the plugin rather than in an aggregation, when possible
+        void SetInProcessLookups(bool enabled) {
+            inProcessLookups_ = enabled;
+        }
+
+        // seconds between two computations of the statistics of the tags, 0 to disable them
+        void SetTagStatisticsInterval(unsigned int interval) {
+            tagStatisticsInterval_ = interval;
+        }
+
+        // null if disabled
+        const MongoDBTagStatistics *GetTagStatistics() const {
+            return tagStatistics_.get();
+        }
+
+        // the plans of the most recent lookups, the oldest first
+        void GetRecentPlans(std::vector<QueryPlan> &target) const;
+
+        // seconds between two reconciliations of the counters with the collections, 0 to disable them
+        void SetCountersReconciliationInterval(unsigned int interval) {
+            countersInterval_ = interval;
+        }
+
+        // settings of the connections opened by CreateDatabaseFactory()
+        void SetOptions(const MongoDatabase::Options &options) {
+            options_ = options;
+        }
+
+        const MongoDatabase::Options &GetOptions() const {
+            return options_;
+        }
+
+        // enters the bulk-load mode from ConfigureDatabase(), to be called before the registration of the index
+        void SetBulkLoadOnStartup(bool enabled) {
+            bulkLoadOnStartup_ = enabled;
+        }
+
+        bool IsBulkLoad() const {
+            return bulkLoad_;
+        }
+
+        // Drops the secondary indexes, and stops maintaining the recycling order of the patients, until
+        // ExitBulkLoad() rebuilds both. The mode is persisted in the database, and survives a restart.
+        void EnterBulkLoad(DatabaseManager &manager);
+
+        void ExitBulkLoad(DatabaseManager &manager);
+
         IDatabaseFactory *CreateDatabaseFactory() override;
 
         void ConfigureDatabase(DatabaseManager &manager) override;
@@ -242,6 +462,13 @@ namespace OrthancDatabases {
                                      uint32_t limit,
                                      bool requestSomeInstance) override;
 
+        // the arguments of LookupResources() in a form that does not depend on the order of the constraints, the
+        // key of MongoDBQueryCache
+        static std::string FormatLookupKey(const std::vector<Orthanc::DatabaseConstraint> &lookup,
+                                           OrthancPluginResourceType queryLevel,
+                                           uint32_t limit,
+                                           bool requestSomeInstance);
+
 #endif
 
 #if ORTHANC_PLUGINS_HAS_DATABASE_CONSTRAINT == 1
@@ -314,9 +541,7 @@ namespace OrthancDatabases {
         }
 
         // New primitive since Orthanc 1.5.2
-        int64_t GetLastChangeIndex(DatabaseManager &manager) override {
-            return -1;
-        }
+        int64_t GetLastChangeIndex(DatabaseManager &manager) override;
 
         // methods overriden for mongodb
     };
@@ -0,0 +1,227 @@
+/**
+ * MongoDB Plugin - A plugin for Orthanc DICOM Server for storing DICOM data in MongoDB Database
+ * Copyright (C) 2017 - 2023  (Doc Cirrus GmbH)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#include "MongoDBIndexRestApi.h"
+
+#include "../../Resources/Orthanc/Plugins/OrthancPluginCppWrapper.h"
+
+#include <Logging.h>
+#include <OrthancException.h>
+
+#include <stdio.h>
+
+namespace OrthancDatabases {
+    static MongoDBIndex *index_ = nullptr;
+
+    static void AnswerBulkLoad(OrthancPluginRestOutput *output) {
+        Json::Value answer = Json::objectValue;
+        answer["Enabled"] = index_->IsBulkLoad();
+
+        std::string s = answer.toStyledString();
+        OrthancPluginAnswerBuffer(OrthancPlugins::GetGlobalContext(), output, s.c_str(), s.size(),
+                                  "application/json");
+    }
+
+    static void BulkLoad(OrthancPluginRestOutput *output,
+                         const char *url,
+                         const OrthancPluginHttpRequest *request) {
+        if (index_ == nullptr) {
+            throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+        }
+
+        switch (request->method) {
+            case OrthancPluginHttpMethod_Get:
+                break;
+
+            case OrthancPluginHttpMethod_Put:
+            case OrthancPluginHttpMethod_Delete: {
+                // a connection of its own, the pool of the index keeps serving the ingest meanwhile
+                DatabaseManager manager(index_->CreateDatabaseFactory());
+
+                if (request->method == OrthancPluginHttpMethod_Put) {
+                    index_->EnterBulkLoad(manager);
+                } else {
+                    index_->ExitBulkLoad(manager);
+                }
+
+                break;
+            }
+
+            default:
+                OrthancPluginSendMethodNotAllowed(OrthancPlugins::GetGlobalContext(), output, "GET,PUT,DELETE");
+                return;
+        }
+
+        AnswerBulkLoad(output);
+    }
+
+    // the statistics of "cache" in "answer[name]", nothing if the cache is disabled
+    template <typename Cache>
+    static void AddCacheStatistics(Json::Value &answer, const char *name, Cache *cache) {
+        if (cache == nullptr) {
+            return;
+        }
+
+        typename Cache::Statistics statistics;
+        cache->GetStatistics(statistics);
+
+        Json::Value item = Json::objectValue;
+        item["Hits"] = static_cast<Json::UInt64>(statistics.hits);
+        item["Misses"] = static_cast<Json::UInt64>(statistics.misses);
+        item["Count"] = static_cast<Json::UInt64>(statistics.count);
+        item["Size"] = static_cast<Json::UInt64>(statistics.size);
+        item["MaxSize"] = static_cast<Json::UInt64>(statistics.maxSize);
+        answer[name] = item;
+    }
+
+    static void Caches(OrthancPluginRestOutput *output,
+                       const char *url,
+                       const OrthancPluginHttpRequest *request) {
+        if (index_ == nullptr) {
+            throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+        }
+
+        if (request->method != OrthancPluginHttpMethod_Get) {
+            OrthancPluginSendMethodNotAllowed(OrthancPlugins::GetGlobalContext(), output, "GET");
+            return;
+        }
+
+        Json::Value answer = Json::objectValue;
+
+        AddCacheStatistics(answer, "Resources", index_->GetResourceCache());
+        AddCacheStatistics(answer, "Subtrees", index_->GetSubtreeCache());
+        AddCacheStatistics(answer, "Summaries", index_->GetSummaryCache());
+        AddCacheStatistics(answer, "Queries", index_->GetQueryCache());
+
+        std::string s = answer.toStyledString();
+        OrthancPluginAnswerBuffer(OrthancPlugins::GetGlobalContext(), output, s.c_str(), s.size(),
+                                  "application/json");
+    }
+
+    static const char *FormatLevel(int32_t level) {
+        switch (level) {
+            case OrthancPluginResourceType_Patient:
+                return "Patient";
+            case OrthancPluginResourceType_Study:
+                return "Study";
+            case OrthancPluginResourceType_Series:
+                return "Series";
+            case OrthancPluginResourceType_Instance:
+                return "Instance";
+            default:
+                return "Unknown";
+        }
+    }
+
+    static std::string FormatTag(uint16_t group, uint16_t element) {
+        char buffer[16];
+        sprintf(buffer, "%04x,%04x", group, element);
+        return buffer;
+    }
+
+    static void QueryPlans(OrthancPluginRestOutput *output,
+                           const char *url,
+                           const OrthancPluginHttpRequest *request) {
+        if (index_ == nullptr) {
+            throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+        }
+
+        if (request->method != OrthancPluginHttpMethod_Get) {
+            OrthancPluginSendMethodNotAllowed(OrthancPlugins::GetGlobalContext(), output, "GET");
+            return;
+        }
+
+        Json::Value answer = Json::objectValue;
+
+        std::vector<MongoDBIndex::QueryPlan> plans;
+        index_->GetRecentPlans(plans);
+
+        answer["Plans"] = Json::arrayValue;
+
+        for (const auto &plan: plans) {
+            Json::Value item = Json::objectValue;
+            item["QueryLevel"] = FormatLevel(plan.queryLevel);
+            item["Strategy"] = plan.strategy;
+            item["Results"] = static_cast<Json::UInt64>(plan.results);
+            item["Duration"] = static_cast<Json::UInt64>(plan.duration);
+            item["Steps"] = Json::arrayValue;
+
+            for (const auto &step: plan.steps) {
+                Json::Value stepItem = Json::objectValue;
+                stepItem["Level"] = FormatLevel(step.level);
+                stepItem["Tag"] = FormatTag(step.group, step.element);
+                stepItem["Identifier"] = step.identifier;
+                stepItem["Restricted"] = step.restricted;
+                stepItem["Count"] = static_cast<Json::UInt64>(step.count);
+
+                if (step.estimate >= 0) {
+                    stepItem["Estimate"] = static_cast<Json::UInt64>(step.estimate);
+                }
+
+                item["Steps"].append(stepItem);
+            }
+
+            answer["Plans"].append(item);
+        }
+
+        const MongoDBTagStatistics *tagStatistics = index_->GetTagStatistics();
+        if (tagStatistics != nullptr) {
+            std::shared_ptr<const MongoDBTagStatistics::Distributions> snapshot = tagStatistics->GetSnapshot();
+
+            if (snapshot) {
+                Json::Value statistics = Json::objectValue;
+
+                for (const auto &distribution: *snapshot) {
+                    Json::Value item = Json::objectValue;
+                    item["Count"] = static_cast<Json::UInt64>(distribution.second.count);
+                    item["Samples"] = static_cast<Json::UInt64>(distribution.second.samples);
+                    item["Distinct"] = static_cast<Json::UInt64>(distribution.second.distinct);
+
+                    // the identifiers are indexed apart from the other main tags
+                    const std::string tag = FormatTag(std::get<1>(distribution.first),
+                                                      std::get<2>(distribution.first));
+                    statistics[std::get<0>(distribution.first) ? "Identifiers" : "MainDicomTags"][tag] = item;
+                }
+
+                answer["Statistics"] = statistics;
+            }
+        }
+
+        std::string s = answer.toStyledString();
+        OrthancPluginAnswerBuffer(OrthancPlugins::GetGlobalContext(), output, s.c_str(), s.size(),
+                                  "application/json");
+    }
+
+    void MongoDBIndexRestApi::Register(MongoDBIndex &index) {
+        if (index_ != nullptr) {
+            throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+        }
+
+        index_ = &index;
+
+        OrthancPlugins::RegisterRestCallback<BulkLoad>("/mongodb/bulk-load", true);
+        OrthancPlugins::RegisterRestCallback<Caches>("/mongodb/caches", true);
+        OrthancPlugins::RegisterRestCallback<QueryPlans>("/mongodb/query-plans", true);
+    }
+
+    void MongoDBIndexRestApi::Finalize() {
+        index_ = nullptr;
+    }
+}
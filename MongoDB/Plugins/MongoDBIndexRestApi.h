@@ -0,0 +1,42 @@
+/**
+ * MongoDB Plugin - A plugin for Orthanc DICOM Server for storing DICOM data in MongoDB Database
+ * Copyright (C) 2017 - 2023  (Doc Cirrus GmbH)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#pragma once
+
+#include "MongoDBIndex.h"
+
+namespace OrthancDatabases {
+    /**
+     * Administration routes of the MongoDB index:
+     *
+     * - GET /mongodb/bulk-load tells whether the bulk-load mode is active,
+     * - PUT /mongodb/bulk-load enters it, DELETE /mongodb/bulk-load leaves it (this rebuilds the secondary indexes
+     *   and the recycling order, and only answers once done).
+     * - GET /mongodb/caches gives the size and the hits of the in-memory caches of the index.
+     * - GET /mongodb/query-plans explains the most recent lookups, with the statistics of the tags they relied on.
+     **/
+    class MongoDBIndexRestApi {
+    public:
+        // the index must live until Finalize()
+        static void Register(MongoDBIndex &index);
+
+        static void Finalize();
+    };
+}
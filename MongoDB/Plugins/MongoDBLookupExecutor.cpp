@@ -0,0 +1,340 @@
+/**
+ * MongoDB Plugin - A plugin for Orthanc DICOM Server for storing DICOM data in MongoDB Database
+ * Copyright (C) 2017 - 2023  (Doc Cirrus GmbH)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+
+
+#include "MongoDBLookupExecutor.h"
+
+#include "../../Framework/MongoDB/MongoDatabase.h"
+
+#include <algorithm>
+#include <map>
+
+using bsoncxx::builder::basic::array;
+
+namespace OrthancDatabases {
+    // below this number of candidates, the following streams only look for them
+    static const size_t MAX_CANDIDATES = 1000;
+
+    static void SortIds(std::vector<int64_t> &ids) {
+        std::sort(ids.begin(), ids.end());
+        ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+    }
+
+    static bsoncxx::document::value FormatIn(const std::vector<int64_t> &ids) {
+        array values;
+        for (const int64_t id: ids) {
+            values.append(id);
+        }
+
+        return make_document(kvp("$in", values.extract()));
+    }
+
+    MongoDBLookupExecutor::MongoDBLookupExecutor(MongoDatabase &database, int32_t queryLevel) :
+            database_(database), queryLevel_(queryLevel) {
+    }
+
+    void MongoDBLookupExecutor::AddStream(int32_t level, bool identifier, uint16_t group, uint16_t element,
+                                          bsoncxx::document::value condition, Selectivity selectivity,
+                                          double estimate) {
+        // a universal wildcard also matches the resources without the tag
+        if (!condition.view().empty()) {
+            streams_.push_back(Stream{level, identifier, group, element, std::move(condition), selectivity,
+                                      estimate});
+        }
+    }
+
+    bool MongoDBLookupExecutor::ReadStream(std::vector<int64_t> &target, const Stream &stream,
+                                           const std::vector<int64_t> *candidates) {
+        bsoncxx::builder::basic::document filter;
+        filter.append(kvp("tagGroup", static_cast<int32_t>(stream.group)));
+        filter.append(kvp("tagElement", static_cast<int32_t>(stream.element)));
+        filter.append(kvp("value", stream.condition.view()));
+
+        if (candidates != nullptr) {
+            filter.append(kvp("id", FormatIn(*candidates)));
+        }
+
+        // only the indexed fields are read, so that the documents themselves are not fetched
+        mongocxx::options::find options;
+        options.projection(make_document(kvp("_id", 0), kvp("id", 1)))
+                .limit(static_cast<int64_t>(MAX_STREAM_SIZE + 1));
+
+        auto cursor = database_.GetCollection(stream.identifier ? "DicomIdentifiers" : "MainDicomTags").find(
+                filter.view(), options);
+
+        target.clear();
+
+        for (auto &&doc: cursor) {
+            target.push_back(doc["id"].get_int64().value);
+        }
+
+        if (target.size() > MAX_STREAM_SIZE) {
+            return false;
+        }
+
+        SortIds(target);
+        return true;
+    }
+
+    bool MongoDBLookupExecutor::MapToQueryLevel(std::vector<int64_t> &target, int32_t level,
+                                                const std::vector<int64_t> &ids) {
+        if (level == queryLevel_) {
+            target = ids;
+            return true;
+        }
+
+        // the resources store the ids of their ancestors in their level fields
+        const bool ancestors = (level < queryLevel_);
+
+        bsoncxx::builder::basic::document filter;
+        if (ancestors) {
+            filter.append(kvp("resourceType", queryLevel_));
+            filter.append(kvp(std::to_string(level), FormatIn(ids)));
+        } else {
+            filter.append(kvp("internalId", FormatIn(ids)));
+        }
+
+        const std::string field = (ancestors ? std::string("internalId") : std::to_string(queryLevel_));
+
+        mongocxx::options::find options;
+        options.projection(make_document(kvp("_id", 0), kvp(field, 1)))
+                .limit(static_cast<int64_t>(MAX_STREAM_SIZE + 1));
+
+        auto cursor = database_.GetCollection("Resources").find(filter.view(), options);
+
+        target.clear();
+
+        for (auto &&doc: cursor) {
+            auto id = doc[field];
+
+            // the resources being deleted have lost their level fields
+            if (id && id.type() == bsoncxx::type::k_int64) {
+                target.push_back(id.get_int64().value);
+            }
+        }
+
+        if (target.size() > MAX_STREAM_SIZE) {
+            return false;
+        }
+
+        SortIds(target);
+        return true;
+    }
+
+    bool MongoDBLookupExecutor::MapFromQueryLevel(std::vector<int64_t> &target, int32_t level,
+                                                  const std::vector<int64_t> &ids) {
+        if (level == queryLevel_) {
+            target = ids;
+            return true;
+        }
+
+        const bool ancestors = (level < queryLevel_);
+
+        bsoncxx::builder::basic::document filter;
+        if (ancestors) {
+            filter.append(kvp("internalId", FormatIn(ids)));
+        } else {
+            filter.append(kvp("resourceType", level));
+            filter.append(kvp(std::to_string(queryLevel_), FormatIn(ids)));
+        }
+
+        const std::string field = (ancestors ? std::to_string(level) : std::string("internalId"));
+
+        mongocxx::options::find options;
+        options.projection(make_document(kvp("_id", 0), kvp(field, 1)))
+                .limit(static_cast<int64_t>(MAX_STREAM_SIZE + 1));
+
+        auto cursor = database_.GetCollection("Resources").find(filter.view(), options);
+
+        target.clear();
+
+        for (auto &&doc: cursor) {
+            auto id = doc[field];
+            if (id && id.type() == bsoncxx::type::k_int64) {
+                target.push_back(id.get_int64().value);
+            }
+        }
+
+        if (target.size() > MAX_STREAM_SIZE) {
+            return false;
+        }
+
+        SortIds(target);
+        return true;
+    }
+
+    bool MongoDBLookupExecutor::Execute(std::vector<int64_t> &target, size_t limit) {
+        steps_.clear();
+
+        if (streams_.empty()) {
+            return false;
+        }
+
+        const bool estimated = std::all_of(streams_.begin(), streams_.end(), [](const Stream &stream) {
+            return stream.estimate >= 0;
+        });
+
+        // By increasing estimate if the statistics cover all the streams, by selectivity class otherwise. The
+        // identifiers come first at equal rank, as they are the most discriminating tags.
+        std::stable_sort(streams_.begin(), streams_.end(), [estimated](const Stream &left, const Stream &right) {
+            if (estimated && left.estimate != right.estimate) {
+                return left.estimate < right.estimate;
+            } else if (!estimated && left.selectivity != right.selectivity) {
+                return left.selectivity < right.selectivity;
+            } else {
+                return left.identifier && !right.identifier;
+            }
+        });
+
+        // not worth reading into memory, even the most selective stream
+        if (estimated && streams_.front().estimate > static_cast<double>(MAX_STREAM_SIZE)) {
+            return false;
+        }
+
+        // the levels in the order of their most selective stream
+        std::vector<int32_t> levels;
+        std::map<int32_t, std::vector<const Stream *> > streamsByLevel;
+
+        for (const auto &stream: streams_) {
+            std::vector<const Stream *> &streams = streamsByLevel[stream.level];
+            if (streams.empty()) {
+                levels.push_back(stream.level);
+            }
+
+            streams.push_back(&stream);
+        }
+
+        std::vector<int64_t> result;
+        bool first = true;
+
+        for (const int32_t level: levels) {
+            const std::vector<const Stream *> &streams = streamsByLevel[level];
+
+            // The intersection yielding the ids at the query level can stop at the "limit" smallest ones: the last
+            // intersection of the last level, or the last stream of the only level if it is the query level.
+            const bool last = (level == levels.back());
+            const bool direct = (last && first && level == queryLevel_);
+
+            // few resources left at the query level: only their relatives at this level are looked for
+            std::vector<int64_t> scope;
+            const bool scoped = (!first && result.size() <= MAX_CANDIDATES &&
+                                 MapFromQueryLevel(scope, level, result));
+
+            std::vector<int64_t> ids;
+
+            for (size_t i = 0; i < streams.size(); i++) {
+                const std::vector<int64_t> *candidates = nullptr;
+                if (i == 0) {
+                    candidates = (scoped ? &scope : nullptr);
+                } else if (ids.size() <= MAX_CANDIDATES) {
+                    candidates = &ids;
+                }
+
+                std::vector<int64_t> stream;
+                if (!ReadStream(stream, *streams[i], candidates)) {
+                    return false;
+                }
+
+                steps_.push_back(Step{level, streams[i]->identifier, streams[i]->group, streams[i]->element,
+                                      streams[i]->estimate, candidates != nullptr, stream.size()});
+
+                if (i == 0) {
+                    ids.swap(stream);
+                } else {
+                    Intersect(ids, stream, (direct && i + 1 == streams.size() ? limit : 0));
+                }
+
+                // no need to read the other streams
+                if (ids.empty()) {
+                    target.clear();
+                    return true;
+                }
+            }
+
+            std::vector<int64_t> mapped;
+            if (!MapToQueryLevel(mapped, level, ids)) {
+                return false;
+            }
+
+            if (first) {
+                result.swap(mapped);
+                first = false;
+            } else {
+                Intersect(result, mapped, (last ? limit : 0));
+            }
+
+            if (result.empty()) {
+                break;
+            }
+        }
+
+        if (limit != 0 && result.size() > limit) {
+            result.resize(limit);
+        }
+
+        target.swap(result);
+        return true;
+    }
+
+    void MongoDBLookupExecutor::Intersect(std::vector<int64_t> &target, const std::vector<int64_t> &other,
+                                          size_t limit) {
+        // each id of the smaller vector is searched in the larger one, from the position of the previous id, with
+        // steps doubling until they pass it, then a binary search within the last step
+        const std::vector<int64_t> &smaller = (target.size() <= other.size() ? target : other);
+        const std::vector<int64_t> &larger = (target.size() <= other.size() ? other : target);
+        const size_t size = larger.size();
+
+        std::vector<int64_t> result;
+        result.reserve(smaller.size());
+
+        size_t low = 0;
+
+        for (const int64_t value: smaller) {
+            size_t step = 1;
+            size_t high = low;
+
+            while (high < size && larger[high] < value) {
+                low = high + 1;
+                high = low + step;
+                step *= 2;
+            }
+
+            const auto begin = larger.begin() + static_cast<std::ptrdiff_t>(low);
+            const auto end = larger.begin() + static_cast<std::ptrdiff_t>(std::min(high, size));
+            low = static_cast<size_t>(std::lower_bound(begin, end, value) - larger.begin());
+
+            if (low == size) {
+                break;
+            }
+
+            if (larger[low] == value) {
+                result.push_back(value);
+                low++;
+
+                if (result.size() == limit) {
+                    break;
+                }
+            }
+        }
+
+        target.swap(result);
+    }
+}
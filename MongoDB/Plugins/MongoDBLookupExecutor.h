@@ -0,0 +1,117 @@
+/**
+ * MongoDB Plugin - A plugin for Orthanc DICOM Server for storing DICOM data in MongoDB Database
+ * Copyright (C) 2017 - 2023  (Doc Cirrus GmbH)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+
+
+#pragma once
+
+#include <bsoncxx/document/value.hpp>
+
+#include <boost/noncopyable.hpp>
+
+#include <cstdint>
+#include <vector>
+
+namespace OrthancDatabases {
+    class MongoDatabase;
+
+    /**
+     * Evaluation in the plugin of the constraints of MongoDBIndex::LookupResources(), instead of one aggregation.
+     * Each constraint is read as a stream of internal ids from the index on (tagGroup, tagElement, value, id) of
+     * "MainDicomTags" or "DicomIdentifiers", which covers the query, and the streams of a level are intersected with
+     * a galloping merge, the most selective first. Once few candidates are left, the following streams only look for
+     * them. The survivors of each level are then mapped to the query level through the ancestor ids of the resources,
+     * and once few of them are left, the next levels only look for their relatives.
+     *
+     * The selectivity of the streams is estimated from MongoDBTagStatistics if available, from the type of their
+     * condition otherwise. Execute() gives up on the lookups whose streams are too large to be held in memory.
+     **/
+    class MongoDBLookupExecutor : public boost::noncopyable {
+    public:
+        // beyond this number of ids, a stream is not read into memory and the lookup is left to the aggregation
+        static const size_t MAX_STREAM_SIZE = 100000;
+
+        // expected selectivity of a condition, from the most to the least selective
+        enum Selectivity {
+            Selectivity_Equal,
+            Selectivity_List,
+            Selectivity_Range,
+            Selectivity_Wildcard
+        };
+
+        // a stream read by Execute(), to explain the plan
+        struct Step {
+            int32_t level;
+            bool identifier;
+            uint16_t group;
+            uint16_t element;
+            double estimate;   // estimated number of ids, negative if unknown
+            bool restricted;   // only the candidates left by the previous steps were looked for
+            size_t count;      // number of ids actually read
+        };
+
+    private:
+        struct Stream {
+            int32_t level;
+            bool identifier;
+            uint16_t group;
+            uint16_t element;
+            bsoncxx::document::value condition;
+            Selectivity selectivity;
+            double estimate;
+        };
+
+        MongoDatabase &database_;
+        int32_t queryLevel_;
+        std::vector<Stream> streams_;
+        std::vector<Step> steps_;
+
+        // the sorted ids of the resources matching "stream", among "candidates" if not null
+        bool ReadStream(std::vector<int64_t> &target, const Stream &stream, const std::vector<int64_t> *candidates);
+
+        // the sorted ids of the resources at the query level related to the resources "ids" at "level"
+        bool MapToQueryLevel(std::vector<int64_t> &target, int32_t level, const std::vector<int64_t> &ids);
+
+        // the reverse, the sorted ids of the resources at "level" related to the resources "ids" at the query level
+        bool MapFromQueryLevel(std::vector<int64_t> &target, int32_t level, const std::vector<int64_t> &ids);
+
+    public:
+        MongoDBLookupExecutor(MongoDatabase &database, int32_t queryLevel);
+
+        // "condition" applies to the value of the tag, e.g. {"$gte": "20200101"}, an empty condition matches all.
+        // "estimate" is the expected number of matching resources, negative if unknown.
+        void AddStream(int32_t level, bool identifier, uint16_t group, uint16_t element,
+                       bsoncxx::document::value condition, Selectivity selectivity, double estimate);
+
+        // The sorted ids of the resources at the query level matching all the streams, including the resources
+        // hidden by a deletion in progress. False if there is no stream, or if the lookup is too large. If "limit"
+        // is not 0, only the "limit" smallest ids are kept, and the last intersection stops once they are found.
+        bool Execute(std::vector<int64_t> &target, size_t limit);
+
+        // the streams read by the last call to Execute(), in their order
+        const std::vector<Step> &GetSteps() const {
+            return steps_;
+        }
+
+        // keeps in "target" the ids also in "other", both being sorted without duplicates, at most "limit" of them
+        // if it is not 0
+        static void Intersect(std::vector<int64_t> &target, const std::vector<int64_t> &other, size_t limit = 0);
+    };
+}
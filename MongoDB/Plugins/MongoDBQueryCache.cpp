@@ -0,0 +1,115 @@
+/**
+ * MongoDB Plugin - A plugin for Orthanc DICOM Server for storing DICOM data in MongoDB Database
+ * Copyright (C) 2017 - 2023  (Doc Cirrus GmbH)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+
+#include "MongoDBQueryCache.h"
+
+namespace OrthancDatabases {
+    // approximate cost of an answer and of each of its matches besides their strings
+    static const size_t ANSWER_OVERHEAD = 256;
+
+    static size_t GetCost(const std::string &key, const MongoDBQueryCache::Matches &matches) {
+        size_t cost = ANSWER_OVERHEAD + 2 * key.size();
+
+        for (const auto &match: matches) {
+            cost += sizeof(match) + match.publicId.size() + match.instancePublicId.size();
+        }
+
+        return cost;
+    }
+
+    void MongoDBQueryCache::Remove(std::unordered_map<std::string, Entry>::iterator entry) {
+        size_ -= entry->second.cost;
+        order_.erase(entry->second.position);
+        entries_.erase(entry);
+    }
+
+    MongoDBQueryCache::MongoDBQueryCache(size_t maxSize, unsigned int timeToLive) :
+            size_(0), maxSize_(maxSize), timeToLive_(timeToLive), hits_(0), misses_(0), generation_(0) {
+    }
+
+    void MongoDBQueryCache::Add(const std::string &key, const std::shared_ptr<const Matches> &matches,
+                                uint64_t generation) {
+        const size_t cost = GetCost(key, *matches);
+
+        // an answer that does not fit would evict all the others
+        if (cost > maxSize_ / 2) {
+            return;
+        }
+
+        boost::mutex::scoped_lock lock(mutex_);
+
+        if (generation != generation_.load()) {
+            return;
+        }
+
+        auto found = entries_.find(key);
+        if (found != entries_.end()) {
+            Remove(found);
+        }
+
+        order_.push_front(key);
+
+        Entry entry;
+        entry.matches = matches;
+        entry.generation = generation;
+        entry.expiration = std::chrono::steady_clock::now() + timeToLive_;
+        entry.cost = cost;
+        entry.position = order_.begin();
+        entries_[key] = entry;
+        size_ += cost;
+
+        while (size_ > maxSize_) {
+            Remove(entries_.find(order_.back()));
+        }
+    }
+
+    std::shared_ptr<const MongoDBQueryCache::Matches> MongoDBQueryCache::Lookup(const std::string &key) {
+        boost::mutex::scoped_lock lock(mutex_);
+
+        auto found = entries_.find(key);
+
+        if (found != entries_.end() &&
+            (found->second.generation != generation_.load() ||
+             found->second.expiration < std::chrono::steady_clock::now())) {
+            Remove(found);
+            found = entries_.end();
+        }
+
+        if (found == entries_.end()) {
+            misses_++;
+            return std::shared_ptr<const Matches>();
+        }
+
+        hits_++;
+        order_.splice(order_.begin(), order_, found->second.position);
+        return found->second.matches;
+    }
+
+    void MongoDBQueryCache::GetStatistics(Statistics &target) {
+        boost::mutex::scoped_lock lock(mutex_);
+
+        target.hits = hits_;
+        target.misses = misses_;
+        target.count = entries_.size();
+        target.size = size_;
+        target.maxSize = maxSize_;
+    }
+}
@@ -0,0 +1,106 @@
+/**
+ * MongoDB Plugin - A plugin for Orthanc DICOM Server for storing DICOM data in MongoDB Database
+ * Copyright (C) 2017 - 2023  (Doc Cirrus GmbH)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace OrthancDatabases {
+    /**
+     * The answers of the recent calls to LookupResources(), keyed by a normalized form of their arguments, so that
+     * the clients repeating the same C-FIND or QIDO-RS query do not rerun the aggregation. Any committed change of
+     * the resources or of their tags bumps a generation counter, which invalidates all the answers at once. The
+     * answers also expire after a delay, and the least recently used ones are evicted once over the memory bound.
+     **/
+    class MongoDBQueryCache : public boost::noncopyable {
+    public:
+        struct Match {
+            int64_t internalId = -1;
+            int32_t resourceType = 0;
+            int64_t parentId = -1;
+            std::string publicId;
+            std::string instancePublicId;  // empty if not requested
+        };
+
+        typedef std::vector<Match> Matches;
+
+        struct Statistics {
+            uint64_t hits = 0;
+            uint64_t misses = 0;
+            uint64_t count = 0;  // number of queries
+            uint64_t size = 0;  // bytes
+            uint64_t maxSize = 0;
+        };
+
+    private:
+        struct Entry {
+            std::shared_ptr<const Matches> matches;
+            uint64_t generation;
+            std::chrono::steady_clock::time_point expiration;
+            size_t cost;
+            std::list<std::string>::iterator position;
+        };
+
+        boost::mutex mutex_;
+        std::list<std::string> order_;  // of use, the most recently used query first
+        std::unordered_map<std::string, Entry> entries_;
+        size_t size_;
+        size_t maxSize_;
+        std::chrono::seconds timeToLive_;
+        uint64_t hits_;
+        uint64_t misses_;
+
+        std::atomic<uint64_t> generation_;
+
+        void Remove(std::unordered_map<std::string, Entry>::iterator entry);
+
+    public:
+        // "maxSize" is in bytes, "timeToLive" in seconds
+        MongoDBQueryCache(size_t maxSize, unsigned int timeToLive);
+
+        // to be read before running the query, and given to Add()
+        uint64_t GetGeneration() const {
+            return generation_.load();
+        }
+
+        // invalidates all the answers, to be called once the changes are committed
+        void Invalidate() {
+            generation_++;
+        }
+
+        // ignored if the cache has been invalidated since "generation"
+        void Add(const std::string &key, const std::shared_ptr<const Matches> &matches, uint64_t generation);
+
+        // null if the answer is not in the cache, or no longer valid
+        std::shared_ptr<const Matches> Lookup(const std::string &key);
+
+        void GetStatistics(Statistics &target);
+    };
+}
@@ -0,0 +1,195 @@
+/**
+ * MongoDB Plugin - A plugin for Orthanc DICOM Server for storing DICOM data in MongoDB Database
+ * Copyright (C) 2017 - 2023  (Doc Cirrus GmbH)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+
+#include "MongoDBResourceCache.h"
+
+#include <boost/thread/locks.hpp>
+
+#include <functional>
+
+namespace OrthancDatabases {
+    static const size_t SHARDS_COUNT = 16;
+
+    // approximate cost of an entry besides its public id: the node of the map, the bucket, and the eviction queue
+    static const size_t ENTRY_OVERHEAD = sizeof(MongoDBResourceCache::Resource) + 64;
+
+    template<typename Key>
+    class MongoDBResourceCache::Shard : public boost::noncopyable {
+    private:
+        mutable boost::shared_mutex mutex_;
+        std::unordered_map<Key, Resource> entries_;
+        std::deque<Key> order_;  // of insertion, the oldest entries are evicted first
+        size_t size_;
+
+        static size_t GetCost(const Resource &resource) {
+            return ENTRY_OVERHEAD + resource.publicId.size();
+        }
+
+        void Evict(size_t maxSize) {
+            while (size_ > maxSize && !order_.empty()) {
+                // the queue may still hold the keys of removed entries
+                auto found = entries_.find(order_.front());
+                if (found != entries_.end()) {
+                    size_ -= GetCost(found->second);
+                    entries_.erase(found);
+                }
+
+                order_.pop_front();
+            }
+        }
+
+    public:
+        Shard() : size_(0) {
+        }
+
+        void Add(const Key &key, const Resource &resource, size_t maxSize) {
+            boost::unique_lock<boost::shared_mutex> lock(mutex_);
+
+            if (entries_.emplace(key, resource).second) {
+                order_.push_back(key);
+                size_ += GetCost(resource);
+                Evict(maxSize);
+            }
+        }
+
+        bool Lookup(Resource &target, const Key &key) const {
+            boost::shared_lock<boost::shared_mutex> lock(mutex_);
+
+            auto found = entries_.find(key);
+            if (found == entries_.end()) {
+                return false;
+            }
+
+            target = found->second;
+            return true;
+        }
+
+        void Remove(const Key &key) {
+            boost::unique_lock<boost::shared_mutex> lock(mutex_);
+
+            auto found = entries_.find(key);
+            if (found != entries_.end()) {
+                size_ -= GetCost(found->second);
+                entries_.erase(found);
+            }
+
+            // keeps the queue bounded when the same resources are cached and removed over and over
+            if (order_.size() > 2 * entries_.size() + 1024) {
+                std::deque<Key> order;
+                for (const auto &key: order_) {
+                    if (entries_.find(key) != entries_.end()) {
+                        order.push_back(key);
+                    }
+                }
+
+                order_.swap(order);
+            }
+        }
+
+        void GetStatistics(uint64_t &count, uint64_t &size) const {
+            boost::shared_lock<boost::shared_mutex> lock(mutex_);
+            count += entries_.size();
+            size += size_;
+        }
+    };
+
+    MongoDBResourceCache::Shard<int64_t> &MongoDBResourceCache::GetShard(int64_t internalId) const {
+        // the internal ids are consecutive, their low bits spread them evenly
+        return byInternalId_[static_cast<uint64_t>(internalId) % SHARDS_COUNT];
+    }
+
+    MongoDBResourceCache::Shard<std::string> &MongoDBResourceCache::GetShard(const std::string &publicId) const {
+        return byPublicId_[std::hash<std::string>()(publicId) % SHARDS_COUNT];
+    }
+
+    MongoDBResourceCache::MongoDBResourceCache(size_t maxSize) :
+            shardSize_(maxSize / (2 * SHARDS_COUNT)),
+            byInternalId_(new Shard<int64_t>[SHARDS_COUNT]),
+            byPublicId_(new Shard<std::string>[SHARDS_COUNT]),
+            generation_(0), hits_(0), misses_(0) {
+    }
+
+    MongoDBResourceCache::~MongoDBResourceCache() = default;
+
+    void MongoDBResourceCache::Add(const Resource &resource, uint64_t generation) {
+        if (generation_.load() != generation) {
+            return;
+        }
+
+        GetShard(resource.internalId).Add(resource.internalId, resource, shardSize_);
+        GetShard(resource.publicId).Add(resource.publicId, resource, shardSize_);
+
+        // a removal may have run between the check and the insertion, in which case both entries are dropped
+        if (generation_.load() != generation) {
+            GetShard(resource.internalId).Remove(resource.internalId);
+            GetShard(resource.publicId).Remove(resource.publicId);
+        }
+    }
+
+    bool MongoDBResourceCache::LookupByInternalId(Resource &target, int64_t internalId) {
+        if (GetShard(internalId).Lookup(target, internalId)) {
+            hits_++;
+            return true;
+        }
+
+        misses_++;
+        return false;
+    }
+
+    bool MongoDBResourceCache::LookupByPublicId(Resource &target, const std::string &publicId) {
+        if (GetShard(publicId).Lookup(target, publicId)) {
+            hits_++;
+            return true;
+        }
+
+        misses_++;
+        return false;
+    }
+
+    void MongoDBResourceCache::Remove(const std::map<int64_t, std::string> &resources) {
+        if (resources.empty()) {
+            return;
+        }
+
+        // bumped first, so that the lookups running meanwhile do not add these resources back
+        generation_++;
+
+        for (const auto &resource: resources) {
+            GetShard(resource.first).Remove(resource.first);
+            GetShard(resource.second).Remove(resource.second);
+        }
+    }
+
+    void MongoDBResourceCache::GetStatistics(Statistics &target) const {
+        target = Statistics();
+        target.hits = hits_.load();
+        target.misses = misses_.load();
+        target.maxSize = shardSize_ * 2 * SHARDS_COUNT;
+
+        for (size_t i = 0; i < SHARDS_COUNT; i++) {
+            byInternalId_[i].GetStatistics(target.count, target.size);
+            byPublicId_[i].GetStatistics(target.count, target.size);
+        }
+
+        // every resource is indexed twice
+        target.count /= 2;
+    }
+}
@@ -0,0 +1,100 @@
+/**
+ * MongoDB Plugin - A plugin for Orthanc DICOM Server for storing DICOM data in MongoDB Database
+ * Copyright (C) 2017 - 2023  (Doc Cirrus GmbH)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread/shared_mutex.hpp>
+
+#include <atomic>
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+namespace OrthancDatabases {
+    /**
+     * The identity of the resources (internal id, public id, level and parent), which never changes between the
+     * creation and the deletion of a resource, kept in memory for the lookups of Orthanc. The entries are spread
+     * over shards, each one under a reader-writer lock, and indexed by internal id and by public id in different
+     * shards. Every shard evicts its oldest entries once over its share of the memory bound.
+     *
+     * A deletion bumps a generation counter: the entries read from the database before a deletion, which may
+     * describe a deleted resource, are discarded rather than added.
+     **/
+    class MongoDBResourceCache : public boost::noncopyable {
+    public:
+        struct Resource {
+            int64_t internalId = -1;
+            int32_t resourceType = 0;
+            int64_t parentId = -1;  // -1 for the patients
+            std::string publicId;
+        };
+
+        struct Statistics {
+            uint64_t hits = 0;
+            uint64_t misses = 0;
+            uint64_t count = 0;  // number of resources
+            uint64_t size = 0;  // bytes
+            uint64_t maxSize = 0;
+        };
+
+    private:
+        template<typename Key>
+        class Shard;
+
+        size_t shardSize_;
+        std::unique_ptr<Shard<int64_t>[]> byInternalId_;
+        std::unique_ptr<Shard<std::string>[]> byPublicId_;
+
+        std::atomic<uint64_t> generation_;
+        std::atomic<uint64_t> hits_;
+        std::atomic<uint64_t> misses_;
+
+        Shard<int64_t> &GetShard(int64_t internalId) const;
+
+        Shard<std::string> &GetShard(const std::string &publicId) const;
+
+    public:
+        // "maxSize" is in bytes
+        explicit MongoDBResourceCache(size_t maxSize);
+
+        ~MongoDBResourceCache();
+
+        // to be read before reading the resource from the database, and given to Add()
+        uint64_t GetGeneration() const {
+            return generation_.load();
+        }
+
+        // ignored if a resource has been removed since "generation"
+        void Add(const Resource &resource, uint64_t generation);
+
+        bool LookupByInternalId(Resource &target, int64_t internalId);
+
+        bool LookupByPublicId(Resource &target, const std::string &publicId);
+
+        // the deleted resources, public ids indexed by internal id
+        void Remove(const std::map<int64_t, std::string> &resources);
+
+        void GetStatistics(Statistics &target) const;
+    };
+}
@@ -0,0 +1,174 @@
+/**
+ * MongoDB Plugin - A plugin for Orthanc DICOM Server for storing DICOM data in MongoDB Database
+ * Copyright (C) 2017 - 2023  (Doc Cirrus GmbH)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#include "MongoDBResourcePurger.h"
+
+#include "../../Framework/MongoDB/MongoDatabase.h"
+
+#include <Logging.h>
+#include <OrthancException.h>
+
+using bsoncxx::builder::basic::array;
+
+namespace OrthancDatabases {
+    // the hidden resources left by another Orthanc, or by a previous run, are looked for at this pace
+    static const unsigned int POLLING_INTERVAL = 10000;  // milliseconds
+
+    // removes at most "batchSize" hidden resources, returns the number of resources removed
+    static size_t PurgeBatch(MongoDatabase &database, unsigned int batchSize) {
+        mongocxx::options::find options;
+        options.projection(make_document(kvp("deleted.internalId", 1))).limit(static_cast<int64_t>(batchSize));
+
+        auto cursor = database.GetCollection("Resources").find(
+                make_document(kvp("deleted.internalId", make_document(kvp("$exists", true)))), options
+        );
+
+        array ids;
+        size_t count = 0;
+
+        for (auto &&doc: cursor) {
+            ids.append(doc["deleted"]["internalId"].get_int64().value);
+            count++;
+        }
+
+        if (count == 0) {
+            return 0;
+        }
+
+        auto inIds = make_document(kvp("$in", ids.extract()));
+
+        database.GetCollection("MainDicomTags").delete_many(make_document(kvp("id", inIds.view())));
+        database.GetCollection("DicomIdentifiers").delete_many(make_document(kvp("id", inIds.view())));
+        database.GetCollection("Metadata").delete_many(make_document(kvp("id", inIds.view())));
+        database.GetCollection("AttachedFiles").delete_many(make_document(kvp("id", inIds.view())));
+
+        // the entries of a capped collection cannot be deleted, they are skipped by GetChanges() until overwritten
+        if (database.GetOptions().changesRetention.mode != MongoDatabase::Options::Retention_Capped) {
+            database.GetCollection("Changes").delete_many(make_document(kvp("internalId", inIds.view())));
+        }
+
+        // last, so that an interrupted batch is resumed by the next one
+        database.GetCollection("Resources").delete_many(make_document(kvp("deleted.internalId", inIds.view())));
+
+        return count;
+    }
+
+    MongoDBResourcePurger::MongoDBResourcePurger(IDatabaseFactory *factory, unsigned int batchSize,
+                                                 unsigned int throttle) :
+            factory_(factory), batchSize_(batchSize), throttle_(throttle), pending_(true), done_(false) {
+        if (factory == nullptr) {
+            throw Orthanc::OrthancException(Orthanc::ErrorCode_NullPointer);
+        }
+
+        if (batchSize == 0) {
+            throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+        }
+    }
+
+    MongoDBResourcePurger::~MongoDBResourcePurger() {
+        Stop();
+    }
+
+    bool MongoDBResourcePurger::WaitFor(unsigned int milliseconds) {
+        boost::mutex::scoped_lock lock(mutex_);
+
+        const boost::system_time timeout = boost::get_system_time() + boost::posix_time::milliseconds(milliseconds);
+
+        while (!done_ && !pending_) {
+            if (!wakeup_.timed_wait(lock, timeout)) {
+                break;
+            }
+        }
+
+        pending_ = false;
+        return !done_;
+    }
+
+    void MongoDBResourcePurger::Worker() {
+        std::unique_ptr<IDatabase> connection;
+
+        while (WaitFor(POLLING_INTERVAL)) {
+            try {
+                if (connection.get() == nullptr) {
+                    connection.reset(factory_->Open());
+                }
+
+                auto &database = dynamic_cast<MongoDatabase &>(*connection);
+
+                size_t total = 0;
+
+                for (;;) {
+                    const size_t count = PurgeBatch(database, batchSize_);
+                    total += count;
+
+                    if (count < batchSize_ || !WaitFor(throttle_)) {
+                        break;
+                    }
+                }
+
+                if (total > 0) {
+                    LOG(INFO) << "Purged " << total << " deleted resource(s) from the MongoDB index";
+                }
+            } catch (const Orthanc::OrthancException &e) {
+                LOG(ERROR) << "Cannot purge the deleted resources: " << e.What();
+                connection.reset();
+            } catch (const std::exception &e) {
+                LOG(ERROR) << "Cannot purge the deleted resources: " << e.what();
+                connection.reset();
+            }
+        }
+    }
+
+    void MongoDBResourcePurger::Start() {
+        if (thread_.joinable()) {
+            throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+        }
+
+        {
+            boost::mutex::scoped_lock lock(mutex_);
+            done_ = false;
+            pending_ = true;
+        }
+
+        thread_ = boost::thread(&MongoDBResourcePurger::Worker, this);
+    }
+
+    void MongoDBResourcePurger::Stop() {
+        {
+            boost::mutex::scoped_lock lock(mutex_);
+            done_ = true;
+        }
+
+        wakeup_.notify_all();
+
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+    }
+
+    void MongoDBResourcePurger::Wake() {
+        {
+            boost::mutex::scoped_lock lock(mutex_);
+            pending_ = true;
+        }
+
+        wakeup_.notify_all();
+    }
+}
@@ -0,0 +1,65 @@
+/**
+ * MongoDB Plugin - A plugin for Orthanc DICOM Server for storing DICOM data in MongoDB Database
+ * Copyright (C) 2017 - 2023  (Doc Cirrus GmbH)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#pragma once
+
+#include "../../Framework/Common/IDatabaseFactory.h"
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread.hpp>
+
+#include <memory>
+
+namespace OrthancDatabases {
+    /**
+     * Background removal of the resources hidden by MongoDBIndex::DeleteResource(), together with their tags,
+     * metadata, attachments and changes. The rows are removed by batches of "batchSize" resources, with a pause of
+     * "throttle" milliseconds between two batches, so that a large deletion never holds the database for long.
+     **/
+    class MongoDBResourcePurger : public boost::noncopyable {
+    private:
+        std::unique_ptr<IDatabaseFactory> factory_;
+        unsigned int batchSize_;
+        unsigned int throttle_;
+
+        boost::mutex mutex_;
+        boost::condition_variable wakeup_;
+        bool pending_;
+        bool done_;
+        boost::thread thread_;
+
+        void Worker();
+
+        bool WaitFor(unsigned int milliseconds);
+
+    public:
+        // takes the ownership of "factory"
+        MongoDBResourcePurger(IDatabaseFactory *factory, unsigned int batchSize, unsigned int throttle);
+
+        ~MongoDBResourcePurger();
+
+        void Start();
+
+        void Stop();
+
+        // to be called after a deletion, so that the purge starts without waiting for the next polling
+        void Wake();
+    };
+}
@@ -24,6 +24,8 @@
 
 #include <bson.h>
 
+#include <algorithm>
+
 #include <Compatibility.h>  // For std::unique_ptr<>
 #include <Logging.h>
 
@@ -49,6 +51,21 @@ namespace OrthancDatabases {
     static OrthancPluginContext *context_ = nullptr;
     static std::unique_ptr<MongoDBStorageArea> backend_;
 
+    MongoDBStorageArea::Accessor::Connection::Connection(Accessor &accessor) :
+            accessor_(accessor), client_(accessor.PopClient()), gridfs_(nullptr) {
+        gridfs_ = mongoc_client_get_gridfs(client_, accessor_.database_name_, nullptr, nullptr);
+
+        if (!gridfs_) {
+            accessor_.PushClient(client_);
+            throw Orthanc::OrthancException(Orthanc::ErrorCode_Database, "Cannot open GridFS");
+        }
+    }
+
+    MongoDBStorageArea::Accessor::Connection::~Connection() {
+        mongoc_gridfs_destroy(gridfs_);
+        accessor_.PushClient(client_);
+    }
+
     // overrides
     mongoc_gridfs_file_t *MongoDBStorageArea::Accessor::CreateMongoDBFile(
             mongoc_gridfs_t *gridfs,
@@ -97,8 +114,8 @@ namespace OrthancDatabases {
                                               const void *content,
                                               size_t size,
                                               OrthancPluginContentType type) {
-        mongoc_client_t *client = PopClient();
-        mongoc_gridfs_t *gridfs = mongoc_client_get_gridfs(client, database_name_, nullptr, nullptr);
+        Connection connection(*this);
+        mongoc_gridfs_t *gridfs = connection.GetGridFS();
 
         mongoc_gridfs_file_t *file = CreateMongoDBFile(gridfs, uuid, type, true);
         mongoc_stream_t *stream = CreateMongoDBStream(file);
@@ -115,16 +132,13 @@ namespace OrthancDatabases {
 
         mongoc_stream_destroy(stream);
         mongoc_gridfs_file_destroy(file);
-        mongoc_gridfs_destroy(gridfs);
-
-        PushClient(client);
     }
 
     void MongoDBStorageArea::Accessor::ReadWhole(OrthancPluginMemoryBuffer64 *target,
                                                  const std::string &uuid,
                                                  OrthancPluginContentType type) {
-        mongoc_client_t *client = PopClient();
-        mongoc_gridfs_t *gridfs = mongoc_client_get_gridfs(client, database_name_, nullptr, nullptr);
+        Connection connection(*this);
+        mongoc_gridfs_t *gridfs = connection.GetGridFS();
 
         mongoc_gridfs_file_t *file = CreateMongoDBFile(gridfs, uuid, type, false);
         mongoc_stream_t *stream = CreateMongoDBStream(file);
@@ -141,17 +155,37 @@ namespace OrthancDatabases {
 
         mongoc_stream_destroy(stream);
         mongoc_gridfs_file_destroy(file);
-        mongoc_gridfs_destroy(gridfs);
+    };
+
+    void MongoDBStorageArea::Accessor::ReadWhole(std::string &target,
+                                                 const std::string &uuid,
+                                                 OrthancPluginContentType type) {
+        Connection connection(*this);
+        mongoc_gridfs_t *gridfs = connection.GetGridFS();
+
+        mongoc_gridfs_file_t *file = CreateMongoDBFile(gridfs, uuid, type, false);
+        mongoc_stream_t *stream = CreateMongoDBStream(file);
+
+        target.resize(static_cast<size_t>(mongoc_gridfs_file_get_length(file)));
 
-        PushClient(client);
+        if (!target.empty()) {
+            mongoc_iovec_t iov;
+            iov.iov_len = target.size();
+            iov.iov_base = &target[0];
+
+            mongoc_stream_readv(stream, &iov, 1, -1, 0);
+        }
+
+        mongoc_stream_destroy(stream);
+        mongoc_gridfs_file_destroy(file);
     };
 
     void MongoDBStorageArea::Accessor::ReadRange(OrthancPluginMemoryBuffer64 *target,
                                                  const std::string &uuid,
                                                  OrthancPluginContentType type,
                                                  uint64_t rangeStart) {
-        mongoc_client_t *client = PopClient();
-        mongoc_gridfs_t *gridfs = mongoc_client_get_gridfs(client, database_name_, nullptr, nullptr);
+        Connection connection(*this);
+        mongoc_gridfs_t *gridfs = connection.GetGridFS();
 
         mongoc_gridfs_file_t *file = CreateMongoDBFile(gridfs, uuid, type, false);
         mongoc_gridfs_file_seek(file, static_cast<int64_t>(rangeStart), SEEK_SET);
@@ -167,15 +201,12 @@ namespace OrthancDatabases {
 
         mongoc_stream_destroy(stream);
         mongoc_gridfs_file_destroy(file);
-        mongoc_gridfs_destroy(gridfs);
-
-        PushClient(client);
     };
 
     void MongoDBStorageArea::Accessor::Remove(const std::string &uuid, OrthancPluginContentType type) {
         bson_error_t error;
-        mongoc_client_t *client = PopClient();
-        mongoc_gridfs_t *gridfs = mongoc_client_get_gridfs(client, database_name_, nullptr, nullptr);
+        Connection connection(*this);
+        mongoc_gridfs_t *gridfs = connection.GetGridFS();
 
         mongoc_gridfs_file_t *file = CreateMongoDBFile(gridfs, uuid, type, false);
 
@@ -186,24 +217,120 @@ namespace OrthancDatabases {
             throw Orthanc::OrthancException(Orthanc::ErrorCode_Database);
         }
 
-        mongoc_gridfs_destroy(gridfs);
-        PushClient(client);
     };
 
+    bool MongoDBStorageArea::Accessor::LookupSize(uint64_t &size, const std::string &uuid) {
+        Connection connection(*this);
+        mongoc_gridfs_t *gridfs = connection.GetGridFS();
+
+        auto regex = "^" + uuid;
+        bson_t *filter = BCON_NEW ("filename", "{", "$regex", BCON_REGEX(BCON_UTF8(regex.c_str()), "x"), "}");
+        mongoc_gridfs_file_t *file = mongoc_gridfs_find_one_with_opts(gridfs, filter, nullptr, nullptr);
+        bson_destroy(filter);
+
+        bool found = (file != nullptr);
+
+        if (found) {
+            size = static_cast<uint64_t>(mongoc_gridfs_file_get_length(file));
+            mongoc_gridfs_file_destroy(file);
+        }
+
+
+        return found;
+    }
+
+    mongoc_client_t *MongoDBStorageArea::Accessor::PopClient() {
+        // fast path: a client is idle in the pool, no need to measure anything
+        mongoc_client_t *client = mongoc_client_pool_try_pop(pool_);
+
+        if (monitor_ == nullptr) {
+            if (!client) {
+                client = mongoc_client_pool_pop(pool_);
+            }
+        } else if (client) {
+            monitor_->SignalAcquired(0);
+        } else {
+            const boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+
+            // blocks until a client is pushed back, or until "waitQueueTimeoutMS" of the URI is reached
+            client = mongoc_client_pool_pop(pool_);
+
+            if (client) {
+                const boost::posix_time::time_duration elapsed =
+                        boost::posix_time::microsec_clock::universal_time() - start;
+                monitor_->SignalAcquired(static_cast<uint64_t>(elapsed.total_microseconds()));
+            } else {
+                monitor_->SignalTimeout();
+            }
+        }
+
+        if (!client) {
+            LOG(ERROR) << "MongoDBGridFS::MongoDBGridFS - Cannot initialize mongodb client.";
+            throw Orthanc::OrthancException(Orthanc::ErrorCode_Database);
+        }
+
+        return client;
+    }
+
+    void MongoDBStorageArea::Accessor::PushClient(mongoc_client_t *client) {
+        mongoc_client_pool_push(pool_, client);
+
+        if (monitor_ != nullptr) {
+            monitor_->SignalReleased();
+        }
+    }
+
     MongoDBStorageArea::MongoDBStorageArea(const std::string &url, const int &chunkSize,
                                            const int &maxConnectionRetries) :
-            chunkSize_(chunkSize) {
+            chunkSize_(chunkSize), monitor_("storage", 100 /* default "maxPoolSize" of the driver */) {
         uri_ = mongoc_uri_new(url.c_str());
         pool_ = mongoc_client_pool_new(uri_);
 
         mongoc_client_pool_set_error_api(pool_, MONGOC_ERROR_API_VERSION_2);
+
+        const int32_t maxPoolSize = mongoc_uri_get_option_as_int32(uri_, MONGOC_URI_MAXPOOLSIZE, 0);
+        if (maxPoolSize > 0) {
+            monitor_.SetSize(static_cast<size_t>(maxPoolSize));
+        }
     }
 
     MongoDBStorageArea::~MongoDBStorageArea() {
+        if (controller_) {
+            controller_->Stop();
+            controller_.reset();
+        }
+
         mongoc_client_pool_destroy(pool_);
         mongoc_uri_destroy(uri_);
     }
 
+    void MongoDBStorageArea::ConfigurePool(OrthancPluginContext *context, size_t countConnections,
+                                           size_t maxCountConnections, unsigned int monitoringInterval) {
+        if (controller_) {
+            throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+        }
+
+        if (countConnections == 0) {
+            // the driver already applies the "maxPoolSize" of the connection string
+            countConnections = monitor_.GetSize();
+        } else {
+            mongoc_client_pool_max_size(pool_, static_cast<uint32_t>(countConnections));
+            monitor_.SetSize(countConnections);
+        }
+
+        if (monitoringInterval != 0) {
+            controller_.reset(new ConnectionPoolController(context, monitoringInterval));
+
+            // the clients are created lazily by the driver, so resizing only moves the concurrency limit
+            controller_->AddPool(monitor_, [this](size_t target) {
+                mongoc_client_pool_max_size(pool_, static_cast<uint32_t>(target));
+                return target;
+            }, countConnections, std::max(countConnections, maxCountConnections));
+
+            controller_->Start();
+        }
+    }
+
     static OrthancPluginErrorCode StorageCreate(const char *uuid,
                                                 const void *content,
                                                 int64_t size,
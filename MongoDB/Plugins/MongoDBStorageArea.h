@@ -23,6 +23,8 @@
 #include <orthanc/OrthancCPlugin.h>
 #include "../../Resources/Orthanc/Plugins/OrthancPluginCppWrapper.h"
 
+#include "../../Framework/Common/ConnectionPoolMonitor.h"
+
 #include <Compatibility.h>  // For std::unique_ptr<>
 #include <Logging.h>
 
@@ -32,6 +34,8 @@ namespace OrthancDatabases {
         int chunkSize_;
         mongoc_uri_t *uri_;
         mongoc_client_pool_t *pool_;
+        ConnectionPoolMonitor monitor_;
+        std::unique_ptr<ConnectionPoolController> controller_;
 
     public:
         class Accessor : public boost::noncopyable {
@@ -40,18 +44,37 @@ namespace OrthancDatabases {
             // does not own that
             mongoc_client_pool_t *pool_;
             mongoc_uri_t *uri_;
+            ConnectionPoolMonitor *monitor_;
             const char *database_name_;
 
             int chunk_size_;
 
+            // a client of the pool and its GridFS, both given back when leaving the scope, also on errors
+            class Connection : public boost::noncopyable {
+            private:
+                Accessor &accessor_;
+                mongoc_client_t *client_;
+                mongoc_gridfs_t *gridfs_;
+
+            public:
+                explicit Connection(Accessor &accessor);
+
+                ~Connection();
+
+                mongoc_gridfs_t *GetGridFS() const {
+                    return gridfs_;
+                }
+            };
+
             mongoc_gridfs_file_t *CreateMongoDBFile(mongoc_gridfs_t *gridfs, const std::string &uuid,
                                                     OrthancPluginContentType type, bool createFile);
 
             static mongoc_stream_t *CreateMongoDBStream(mongoc_gridfs_file_t *file);
 
         public:
-            explicit Accessor(mongoc_client_pool_t *pool, mongoc_uri_t *uri, int chunk_size) : pool_(pool), uri_(uri),
-                                                                                               chunk_size_(chunk_size) {
+            explicit Accessor(mongoc_client_pool_t *pool, mongoc_uri_t *uri, int chunk_size,
+                              ConnectionPoolMonitor *monitor = nullptr) : pool_(pool), uri_(uri), monitor_(monitor),
+                                                                          chunk_size_(chunk_size) {
                 database_name_ = mongoc_uri_get_database(uri_);
                 if (!database_name_) {
                     LOG(ERROR) << "MongoDBGridFS::MongoDBGridFS - Cannot not parse mongodb URI.";
@@ -61,20 +84,9 @@ namespace OrthancDatabases {
 
             virtual ~Accessor() {};
 
-            mongoc_client_t* PopClient() {
-                mongoc_client_t *client = mongoc_client_pool_pop (pool_);
+            mongoc_client_t* PopClient();
 
-                if (!client) {
-                    LOG(ERROR) << "MongoDBGridFS::MongoDBGridFS - Cannot initialize mongodb client.";
-                    throw Orthanc::OrthancException(Orthanc::ErrorCode_Database);
-                }
-
-                return client;
-            }
-
-            void PushClient(mongoc_client_t * client) {
-                mongoc_client_pool_push (pool_, client);
-            }
+            void PushClient(mongoc_client_t * client);
 
             virtual void Create(const std::string &uuid,
                                 const void *content,
@@ -85,24 +97,39 @@ namespace OrthancDatabases {
                                    const std::string &uuid,
                                    OrthancPluginContentType type);
 
+            // same as above, but without going through an Orthanc memory buffer
+            virtual void ReadWhole(std::string &target,
+                                   const std::string &uuid,
+                                   OrthancPluginContentType type);
+
             virtual void ReadRange(OrthancPluginMemoryBuffer64 *target,
                                    const std::string &uuid,
                                    OrthancPluginContentType type,
                                    uint64_t rangeStart);
 
             virtual void Remove(const std::string &uuid, OrthancPluginContentType type);
+
+            // returns false if there is no file for this uuid
+            virtual bool LookupSize(uint64_t &size, const std::string &uuid);
         };
 
         explicit MongoDBStorageArea(const std::string &url, const int &chunkSize, const int &maxConnectionRetries);
 
         ~MongoDBStorageArea();
 
+        // limits the number of concurrent clients to "countConnections" (0 for the "maxPoolSize" of the connection
+        // string, 100 by default), which the controller may raise up to
+        // "maxCountConnections" if the accessors are queueing; the metrics are published every "monitoringInterval"
+        // seconds (0 to disable both the metrics and the resizing)
+        void ConfigurePool(OrthancPluginContext *context, size_t countConnections, size_t maxCountConnections,
+                           unsigned int monitoringInterval);
+
         static void Register(OrthancPluginContext *context, MongoDBStorageArea *backend);   // Takes ownership
 
         static void Finalize();
 
         virtual Accessor* CreateAccessor() {
-            return new Accessor(pool_, uri_, chunkSize_);
+            return new Accessor(pool_, uri_, chunkSize_, &monitor_);
         }
     };
 }
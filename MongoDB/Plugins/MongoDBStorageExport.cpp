@@ -0,0 +1,308 @@
+/**
+ * MongoDB Plugin - A plugin for Orthanc DICOM Server for storing DICOM data in MongoDB Database
+ * Copyright (C) 2017 - 2023  (Doc Cirrus GmbH)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#include "MongoDBStorageExport.h"
+
+#include <algorithm>
+#include <boost/thread.hpp>
+#include <map>
+
+#include <Compatibility.h>  // For std::unique_ptr<>
+#include <Logging.h>
+#include <OrthancException.h>
+#include <Toolbox.h>
+
+namespace OrthancDatabases {
+    static MongoDBStorageExport *export_ = nullptr;
+
+    namespace {
+        // ordered window of files being read in the background
+        class ReadAheadQueue : public boost::noncopyable {
+        private:
+            struct Slot {
+                std::string content;
+                std::string error;
+            };
+
+            MongoDBStorageArea &storage_;
+            const std::vector<MongoDBStorageExport::Item> &items_;
+            size_t window_;
+
+            boost::mutex mutex_;
+            boost::condition_variable changed_;
+            std::map<size_t, Slot> ready_;
+            size_t next_;       // next item to be read by a worker
+            size_t consumed_;   // number of items already handed over to the caller
+            bool stopped_;
+
+            std::vector<boost::thread *> workers_;
+
+            void Worker() {
+                std::unique_ptr<MongoDBStorageArea::Accessor> accessor(storage_.CreateAccessor());
+
+                for (;;) {
+                    size_t index;
+
+                    {
+                        boost::mutex::scoped_lock lock(mutex_);
+
+                        while (!stopped_ && next_ < items_.size() && next_ >= consumed_ + window_) {
+                            changed_.wait(lock);
+                        }
+
+                        if (stopped_ || next_ >= items_.size()) {
+                            return;
+                        }
+
+                        index = next_++;
+                    }
+
+                    Slot slot;
+
+                    try {
+                        accessor->ReadWhole(slot.content, items_[index].uuid, items_[index].type);
+                    }
+                    catch (Orthanc::OrthancException &e) {
+                        slot.error = e.What();
+                    }
+                    catch (std::runtime_error &e) {
+                        slot.error = e.what();
+                    }
+                    catch (...) {
+                        slot.error = "Native exception";
+                    }
+
+                    {
+                        boost::mutex::scoped_lock lock(mutex_);
+                        ready_[index].content.swap(slot.content);
+                        ready_[index].error.swap(slot.error);
+                    }
+
+                    changed_.notify_all();
+                }
+            }
+
+        public:
+            ReadAheadQueue(MongoDBStorageArea &storage,
+                           const std::vector<MongoDBStorageExport::Item> &items,
+                           unsigned int readAhead) :
+                    storage_(storage), items_(items), window_(readAhead == 0 ? 1 : readAhead),
+                    next_(0), consumed_(0), stopped_(false) {
+                size_t countWorkers = std::min(window_, items_.size());
+
+                for (size_t i = 0; i < countWorkers; i++) {
+                    workers_.push_back(new boost::thread(&ReadAheadQueue::Worker, this));
+                }
+            }
+
+            ~ReadAheadQueue() {
+                {
+                    boost::mutex::scoped_lock lock(mutex_);
+                    stopped_ = true;
+                }
+
+                changed_.notify_all();
+
+                for (auto &worker: workers_) {
+                    if (worker->joinable()) {
+                        worker->join();
+                    }
+
+                    delete worker;
+                }
+            }
+
+            // blocks until the "index"-th item is available, items must be consumed in order
+            void Dequeue(std::string &content, size_t index) {
+                boost::mutex::scoped_lock lock(mutex_);
+
+                while (ready_.find(index) == ready_.end()) {
+                    changed_.wait(lock);
+                }
+
+                auto slot = ready_.find(index);
+
+                if (!slot->second.error.empty()) {
+                    LOG(ERROR) << "MongoDBStorageExport - Cannot read attachment " << items_[index].uuid
+                               << ": " << slot->second.error;
+                    throw Orthanc::OrthancException(Orthanc::ErrorCode_UnknownResource);
+                }
+
+                content.swap(slot->second.content);
+                ready_.erase(slot);
+                consumed_ = index + 1;
+
+                changed_.notify_all();
+            }
+        };
+    }
+
+    MongoDBStorageExport::MongoDBStorageExport(MongoDBStorageArea &storage, unsigned int readAhead) :
+            storage_(storage), readAhead_(readAhead) {
+    }
+
+    void MongoDBStorageExport::ResolveResource(std::vector<Item> &items,
+                                               const std::string &level,
+                                               const std::string &publicId) {
+        std::vector<std::string> instances;
+
+        if (level == "instances") {
+            instances.push_back(publicId);
+        } else {
+            Json::Value children;
+
+            if (!OrthancPlugins::RestApiGet(children, "/" + level + "/" + publicId + "/instances", false) ||
+                children.type() != Json::arrayValue) {
+                throw Orthanc::OrthancException(Orthanc::ErrorCode_UnknownResource);
+            }
+
+            for (Json::Value::ArrayIndex i = 0; i < children.size(); i++) {
+                instances.push_back(children[i]["ID"].asString());
+            }
+        }
+
+        for (auto &instance: instances) {
+            Json::Value info;
+
+            if (!OrthancPlugins::RestApiGet(info, "/instances/" + instance + "/attachments/dicom/info", false) ||
+                !info.isMember("Uuid")) {
+                throw Orthanc::OrthancException(Orthanc::ErrorCode_UnknownResource);
+            }
+
+            Item item;
+            item.uuid = info["Uuid"].asString();
+            item.type = OrthancPluginContentType_Dicom;
+            items.push_back(item);
+        }
+    }
+
+    void MongoDBStorageExport::Stream(OrthancPluginContext *context,
+                                      OrthancPluginRestOutput *output,
+                                      const std::vector<Item> &items) {
+        ReadAheadQueue queue(storage_, items, readAhead_);
+
+        // read the first file before starting the answer, so that a missing file still gives a proper HTTP error
+        std::string content;
+
+        if (!items.empty()) {
+            queue.Dequeue(content, 0);
+        }
+
+        if (OrthancPluginStartMultipartAnswer(context, output, "mixed", "application/octet-stream") !=
+            OrthancPluginErrorCode_Success) {
+            throw Orthanc::OrthancException(Orthanc::ErrorCode_NetworkProtocol);
+        }
+
+        for (size_t i = 0; i < items.size(); i++) {
+            if (i != 0) {
+                try {
+                    queue.Dequeue(content, i);
+                }
+                catch (Orthanc::OrthancException &) {
+                    // the HTTP status is already sent, the only option is to truncate the answer
+                    return;
+                }
+            }
+
+            const char *keys[] = {"Content-Location"};
+            const char *values[] = {items[i].uuid.c_str()};
+
+            if (OrthancPluginSendMultipartItem2(context, output, content.empty() ? nullptr : content.c_str(),
+                                                static_cast<uint32_t>(content.size()), 1, keys, values) !=
+                OrthancPluginErrorCode_Success) {
+                LOG(WARNING) << "MongoDBStorageExport - The client has closed the connection";
+                return;
+            }
+
+            content.clear();
+            content.shrink_to_fit();
+        }
+    }
+
+    static void ExportUuids(OrthancPluginRestOutput *output,
+                            const char *url,
+                            const OrthancPluginHttpRequest *request) {
+        OrthancPluginContext *context = OrthancPlugins::GetGlobalContext();
+
+        if (request->method != OrthancPluginHttpMethod_Post) {
+            OrthancPluginSendMethodNotAllowed(context, output, "POST");
+            return;
+        }
+
+        Json::Value body;
+
+        if (!OrthancPlugins::ReadJson(body, request->body, request->bodySize) ||
+            !body.isMember("Uuids") || body["Uuids"].type() != Json::arrayValue) {
+            throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat,
+                                            "The body must be a JSON object with a \"Uuids\" array");
+        }
+
+        std::vector<MongoDBStorageExport::Item> items;
+
+        for (Json::Value::ArrayIndex i = 0; i < body["Uuids"].size(); i++) {
+            MongoDBStorageExport::Item item;
+            item.uuid = body["Uuids"][i].asString();
+
+            // the uuid is the prefix of the name of the file in GridFS
+            if (!Orthanc::Toolbox::IsUuid(item.uuid)) {
+                throw Orthanc::OrthancException(Orthanc::ErrorCode_BadRequest,
+                                                "Not a valid uuid: " + item.uuid);
+            }
+
+            item.type = OrthancPluginContentType_Unknown;  // the type is not part of the lookup of the file
+            items.push_back(item);
+        }
+
+        export_->Stream(context, output, items);
+    }
+
+    static void ExportResource(OrthancPluginRestOutput *output,
+                               const char *url,
+                               const OrthancPluginHttpRequest *request) {
+        OrthancPluginContext *context = OrthancPlugins::GetGlobalContext();
+
+        if (request->method != OrthancPluginHttpMethod_Get) {
+            OrthancPluginSendMethodNotAllowed(context, output, "GET");
+            return;
+        }
+
+        std::vector<MongoDBStorageExport::Item> items;
+        MongoDBStorageExport::ResolveResource(items, request->groups[0], request->groups[1]);
+
+        export_->Stream(context, output, items);
+    }
+
+    void MongoDBStorageExport::Register(OrthancPluginContext *context, MongoDBStorageArea &storage,
+                                        unsigned int readAhead) {
+        if (export_ != nullptr) {
+            throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+        }
+
+        export_ = new MongoDBStorageExport(storage, readAhead);
+
+        OrthancPlugins::RegisterRestCallback<ExportUuids>("/mongodb/storage/export", true);
+        OrthancPlugins::RegisterRestCallback<ExportResource>(
+                "/(patients|studies|series|instances)/([^/]+)/mongodb-export", true
+        );
+    }
+
+    void MongoDBStorageExport::Finalize() {
+        delete export_;
+        export_ = nullptr;
+    }
+}
@@ -0,0 +1,58 @@
+/**
+ * MongoDB Plugin - A plugin for Orthanc DICOM Server for storing DICOM data in MongoDB Database
+ * Copyright (C) 2017 - 2023  (Doc Cirrus GmbH)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#pragma once
+
+#include "MongoDBStorageArea.h"
+
+#include <boost/noncopyable.hpp>
+#include <string>
+#include <vector>
+
+namespace OrthancDatabases {
+    /**
+     * Streams a list of attachments out of GridFS as a multipart answer.
+     *
+     * The files are read by a small pool of workers, at most "readAhead" of
+     * them being held in memory at any time, so that the memory footprint
+     * does not depend on the number of exported files.
+     **/
+    class MongoDBStorageExport : public boost::noncopyable {
+    public:
+        struct Item {
+            std::string uuid;
+            OrthancPluginContentType type;
+        };
+
+    private:
+        MongoDBStorageArea &storage_;
+        unsigned int readAhead_;
+
+    public:
+        MongoDBStorageExport(MongoDBStorageArea &storage, unsigned int readAhead);
+
+        // fills "items" with the attachments of an Orthanc resource, resolved through the REST API of the core
+        static void ResolveResource(std::vector<Item> &items, const std::string &level, const std::string &publicId);
+
+        void Stream(OrthancPluginContext *context, OrthancPluginRestOutput *output, const std::vector<Item> &items);
+
+        static void Register(OrthancPluginContext *context, MongoDBStorageArea &storage, unsigned int readAhead);
+
+        static void Finalize();
+    };
+}
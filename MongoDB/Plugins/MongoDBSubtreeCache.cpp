@@ -0,0 +1,162 @@
+/**
+ * MongoDB Plugin - A plugin for Orthanc DICOM Server for storing DICOM data in MongoDB Database
+ * Copyright (C) 2017 - 2023  (Doc Cirrus GmbH)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+
+#include "MongoDBSubtreeCache.h"
+
+#include <boost/thread/locks.hpp>
+
+namespace OrthancDatabases {
+    // approximate cost of a resource besides its public id: the element of its vector, and the bucket of its parent
+    static const size_t CHILD_OVERHEAD = sizeof(MongoDBSubtreeCache::Child) + 64;
+
+    std::atomic<uint64_t> &MongoDBSubtreeCache::GetGenerationCounter(int64_t study) const {
+        return generations_[static_cast<uint64_t>(study) % GENERATIONS_COUNT];
+    }
+
+    void MongoDBSubtreeCache::RemoveInternal(std::unordered_map<int64_t, Entry>::iterator study) {
+        for (const auto &parent: *study->second.subtree) {
+            parents_.erase(parent.first);
+        }
+
+        size_ -= study->second.cost;
+        order_.erase(study->second.position);
+        studies_.erase(study);
+    }
+
+    MongoDBSubtreeCache::MongoDBSubtreeCache(size_t maxSize) :
+            size_(0), maxSize_(maxSize), hits_(0), misses_(0),
+            generations_(new std::atomic<uint64_t>[GENERATIONS_COUNT]) {
+        for (size_t i = 0; i < GENERATIONS_COUNT; i++) {
+            generations_[i] = 0;
+        }
+    }
+
+    void MongoDBSubtreeCache::Add(int64_t study, const Subtree &subtree, uint64_t generation) {
+        size_t cost = 0;
+        for (const auto &parent: subtree) {
+            cost += CHILD_OVERHEAD;
+
+            for (const auto &child: parent.second) {
+                cost += CHILD_OVERHEAD + child.publicId.size();
+            }
+        }
+
+        // a study that does not fit would evict all the others
+        if (cost > maxSize_ / 2) {
+            return;
+        }
+
+        auto copy = std::make_shared<const Subtree>(subtree);
+
+        boost::mutex::scoped_lock lock(mutex_);
+
+        // checked under the lock, as Invalidate() bumps the generation before taking it
+        if (GetGeneration(study) != generation) {
+            return;
+        }
+
+        auto found = studies_.find(study);
+        if (found != studies_.end()) {
+            RemoveInternal(found);
+        }
+
+        order_.push_front(study);
+
+        Entry entry;
+        entry.subtree = copy;
+        entry.cost = cost;
+        entry.position = order_.begin();
+        studies_[study] = entry;
+
+        for (const auto &parent: subtree) {
+            parents_[parent.first] = study;
+        }
+
+        size_ += cost;
+
+        while (size_ > maxSize_ && !order_.empty()) {
+            RemoveInternal(studies_.find(order_.back()));
+        }
+    }
+
+    bool MongoDBSubtreeCache::LookupChildren(std::vector<Child> &target, int64_t parent) {
+        std::shared_ptr<const Subtree> subtree;
+
+        {
+            boost::mutex::scoped_lock lock(mutex_);
+
+            auto study = parents_.find(parent);
+            if (study == parents_.end()) {
+                misses_++;
+                return false;
+            }
+
+            auto entry = studies_.find(study->second);
+            order_.splice(order_.begin(), order_, entry->second.position);
+            subtree = entry->second.subtree;
+            hits_++;
+        }
+
+        // the subtree is immutable, it is read outside of the lock
+        auto children = subtree->find(parent);
+        if (children == subtree->end()) {
+            target.clear();
+        } else {
+            target = children->second;
+        }
+
+        return true;
+    }
+
+    void MongoDBSubtreeCache::Invalidate(int64_t study) {
+        GetGenerationCounter(study)++;
+
+        boost::mutex::scoped_lock lock(mutex_);
+
+        auto found = studies_.find(study);
+        if (found != studies_.end()) {
+            RemoveInternal(found);
+        }
+    }
+
+    void MongoDBSubtreeCache::Clear() {
+        for (size_t i = 0; i < GENERATIONS_COUNT; i++) {
+            generations_[i]++;
+        }
+
+        boost::mutex::scoped_lock lock(mutex_);
+
+        order_.clear();
+        studies_.clear();
+        parents_.clear();
+        size_ = 0;
+    }
+
+    void MongoDBSubtreeCache::GetStatistics(Statistics &target) {
+        boost::mutex::scoped_lock lock(mutex_);
+
+        target.hits = hits_;
+        target.misses = misses_;
+        target.count = studies_.size();
+        target.size = size_;
+        target.maxSize = maxSize_;
+    }
+}
@@ -0,0 +1,108 @@
+/**
+ * MongoDB Plugin - A plugin for Orthanc DICOM Server for storing DICOM data in MongoDB Database
+ * Copyright (C) 2017 - 2023  (Doc Cirrus GmbH)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace OrthancDatabases {
+    /**
+     * The children of the series of a study, and of the study itself, loaded with a single query on the "1"
+     * (study) field of "Resources" the first time one of them is requested. The studies are evicted in least
+     * recently used order once over the memory bound.
+     *
+     * A study is invalidated as a whole when an instance is added to it or when one of its resources is deleted. As
+     * for MongoDBResourceCache, the subtrees read from the database before an invalidation of their study are
+     * discarded rather than added.
+     **/
+    class MongoDBSubtreeCache : public boost::noncopyable {
+    public:
+        struct Child {
+            int64_t internalId;
+            std::string publicId;
+        };
+
+        // the children of the study and of its series, indexed by the internal id of their parent
+        typedef std::unordered_map<int64_t, std::vector<Child> > Subtree;
+
+        struct Statistics {
+            uint64_t hits = 0;
+            uint64_t misses = 0;
+            uint64_t count = 0;  // number of studies
+            uint64_t size = 0;  // bytes
+            uint64_t maxSize = 0;
+        };
+
+    private:
+        static const size_t GENERATIONS_COUNT = 64;
+
+        struct Entry {
+            std::shared_ptr<const Subtree> subtree;
+            size_t cost;
+            std::list<int64_t>::iterator position;
+        };
+
+        boost::mutex mutex_;
+        std::list<int64_t> order_;  // of use, the most recently used study first
+        std::unordered_map<int64_t, Entry> studies_;
+        std::unordered_map<int64_t, int64_t> parents_;  // the study of every cached parent (the study and its series)
+        size_t size_;
+        size_t maxSize_;
+        uint64_t hits_;
+        uint64_t misses_;
+
+        // bumped by the invalidations, striped by study
+        std::unique_ptr<std::atomic<uint64_t>[]> generations_;
+
+        std::atomic<uint64_t> &GetGenerationCounter(int64_t study) const;
+
+        void RemoveInternal(std::unordered_map<int64_t, Entry>::iterator study);
+
+    public:
+        // "maxSize" is in bytes
+        explicit MongoDBSubtreeCache(size_t maxSize);
+
+        // to be read before loading the subtree of "study" from the database, and given to Add()
+        uint64_t GetGeneration(int64_t study) const {
+            return GetGenerationCounter(study).load();
+        }
+
+        // ignored if "study" has been invalidated since "generation"
+        void Add(int64_t study, const Subtree &subtree, uint64_t generation);
+
+        // false if "parent" is not a study or a series of a cached study
+        bool LookupChildren(std::vector<Child> &target, int64_t parent);
+
+        void Invalidate(int64_t study);
+
+        void Clear();
+
+        void GetStatistics(Statistics &target);
+    };
+}
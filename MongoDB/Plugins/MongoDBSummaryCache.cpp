@@ -0,0 +1,183 @@
+/**
+ * MongoDB Plugin - A plugin for Orthanc DICOM Server for storing DICOM data in MongoDB Database
+ * Copyright (C) 2017 - 2023  (Doc Cirrus GmbH)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+
+#include "MongoDBSummaryCache.h"
+
+#include <boost/thread/locks.hpp>
+
+namespace OrthancDatabases {
+    static const size_t SHARDS_COUNT = 16;
+
+    // approximate cost of a summary and of each of its entries besides their strings
+    static const size_t SUMMARY_OVERHEAD = sizeof(MongoDBSummaryCache::Summary) + 128;
+    static const size_t ENTRY_OVERHEAD = 64;
+
+    static size_t GetCost(const MongoDBSummaryCache::Summary &summary) {
+        size_t cost = SUMMARY_OVERHEAD;
+
+        for (const auto &tag: summary.mainDicomTags) {
+            cost += sizeof(tag) + tag.value.size();
+        }
+
+        for (const auto &metadata: summary.metadata) {
+            cost += ENTRY_OVERHEAD + metadata.second.value.size();
+        }
+
+        for (const auto &attachment: summary.attachments) {
+            cost += ENTRY_OVERHEAD + sizeof(attachment.second) + attachment.second.uuid.size() +
+                    attachment.second.uncompressedHash.size() + attachment.second.compressedHash.size();
+        }
+
+        return cost;
+    }
+
+    class MongoDBSummaryCache::Shard : public boost::noncopyable {
+    private:
+        struct Entry {
+            std::shared_ptr<const Summary> summary;
+            size_t cost;
+            std::list<int64_t>::iterator position;
+        };
+
+        mutable boost::mutex mutex_;
+        std::list<int64_t> order_;  // of use, the most recently used resource first
+        std::unordered_map<int64_t, Entry> entries_;
+        size_t size_;
+        uint64_t generation_;  // bumped by the invalidations of the resources of this shard
+        uint64_t hits_;
+        uint64_t misses_;
+
+        void Remove(std::unordered_map<int64_t, Entry>::iterator entry) {
+            size_ -= entry->second.cost;
+            order_.erase(entry->second.position);
+            entries_.erase(entry);
+        }
+
+    public:
+        Shard() : size_(0), generation_(0), hits_(0), misses_(0) {
+        }
+
+        uint64_t GetGeneration() const {
+            boost::mutex::scoped_lock lock(mutex_);
+            return generation_;
+        }
+
+        void Add(int64_t internalId, const std::shared_ptr<const Summary> &summary, uint64_t generation,
+                 size_t maxSize) {
+            const size_t cost = GetCost(*summary);
+
+            boost::mutex::scoped_lock lock(mutex_);
+
+            if (generation != generation_ || cost > maxSize) {
+                return;
+            }
+
+            auto found = entries_.find(internalId);
+            if (found != entries_.end()) {
+                Remove(found);
+            }
+
+            order_.push_front(internalId);
+
+            Entry entry;
+            entry.summary = summary;
+            entry.cost = cost;
+            entry.position = order_.begin();
+            entries_[internalId] = entry;
+            size_ += cost;
+
+            while (size_ > maxSize) {
+                Remove(entries_.find(order_.back()));
+            }
+        }
+
+        std::shared_ptr<const Summary> Lookup(int64_t internalId) {
+            boost::mutex::scoped_lock lock(mutex_);
+
+            auto found = entries_.find(internalId);
+            if (found == entries_.end()) {
+                misses_++;
+                return std::shared_ptr<const Summary>();
+            }
+
+            hits_++;
+            order_.splice(order_.begin(), order_, found->second.position);
+            return found->second.summary;
+        }
+
+        void Invalidate(int64_t internalId) {
+            boost::mutex::scoped_lock lock(mutex_);
+
+            generation_++;
+
+            auto found = entries_.find(internalId);
+            if (found != entries_.end()) {
+                Remove(found);
+            }
+        }
+
+        void GetStatistics(Statistics &target) const {
+            boost::mutex::scoped_lock lock(mutex_);
+
+            target.hits += hits_;
+            target.misses += misses_;
+            target.count += entries_.size();
+            target.size += size_;
+        }
+    };
+
+    MongoDBSummaryCache::Shard &MongoDBSummaryCache::GetShard(int64_t internalId) const {
+        return shards_[static_cast<uint64_t>(internalId) % SHARDS_COUNT];
+    }
+
+    MongoDBSummaryCache::MongoDBSummaryCache(size_t maxSize) :
+            shardSize_(maxSize / SHARDS_COUNT),
+            shards_(new Shard[SHARDS_COUNT]) {
+    }
+
+    MongoDBSummaryCache::~MongoDBSummaryCache() = default;
+
+    uint64_t MongoDBSummaryCache::GetGeneration(int64_t internalId) const {
+        return GetShard(internalId).GetGeneration();
+    }
+
+    void MongoDBSummaryCache::Add(int64_t internalId, const std::shared_ptr<const Summary> &summary,
+                                  uint64_t generation) {
+        GetShard(internalId).Add(internalId, summary, generation, shardSize_);
+    }
+
+    std::shared_ptr<const MongoDBSummaryCache::Summary> MongoDBSummaryCache::Lookup(int64_t internalId) {
+        return GetShard(internalId).Lookup(internalId);
+    }
+
+    void MongoDBSummaryCache::Invalidate(int64_t internalId) {
+        GetShard(internalId).Invalidate(internalId);
+    }
+
+    void MongoDBSummaryCache::GetStatistics(Statistics &target) const {
+        target = Statistics();
+        target.maxSize = shardSize_ * SHARDS_COUNT;
+
+        for (size_t i = 0; i < SHARDS_COUNT; i++) {
+            shards_[i].GetStatistics(target);
+        }
+    }
+}
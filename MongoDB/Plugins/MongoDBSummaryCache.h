@@ -0,0 +1,109 @@
+/**
+ * MongoDB Plugin - A plugin for Orthanc DICOM Server for storing DICOM data in MongoDB Database
+ * Copyright (C) 2017 - 2023  (Doc Cirrus GmbH)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <atomic>
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace OrthancDatabases {
+    /**
+     * The main DICOM tags, metadata and attachments of the resources, assembled from a single aggregation and kept
+     * in memory for the lookups that Orthanc issues for every resource it expands (/tools/find, QIDO-RS...). The
+     * summaries are spread over shards, each one evicting its least recently used summaries once over its share of
+     * the memory bound.
+     *
+     * Every write to the tags, metadata or attachments of a resource invalidates its summary. As for
+     * MongoDBSubtreeCache, the summaries read from the database before an invalidation are discarded.
+     **/
+    class MongoDBSummaryCache : public boost::noncopyable {
+    public:
+        struct Tag {
+            uint16_t group;
+            uint16_t element;
+            std::string value;
+        };
+
+        struct Metadata {
+            std::string value;
+            int64_t revision;
+        };
+
+        struct Attachment {
+            std::string uuid;
+            int64_t uncompressedSize;
+            std::string uncompressedHash;
+            int32_t compressionType;
+            int64_t compressedSize;
+            std::string compressedHash;
+            int64_t revision;
+        };
+
+        struct Summary {
+            std::vector<Tag> mainDicomTags;
+            std::map<int32_t, Metadata> metadata;  // indexed by type
+            std::map<int32_t, Attachment> attachments;  // indexed by content type
+        };
+
+        struct Statistics {
+            uint64_t hits = 0;
+            uint64_t misses = 0;
+            uint64_t count = 0;  // number of resources
+            uint64_t size = 0;  // bytes
+            uint64_t maxSize = 0;
+        };
+
+    private:
+        class Shard;
+
+        size_t shardSize_;
+        std::unique_ptr<Shard[]> shards_;
+
+        Shard &GetShard(int64_t internalId) const;
+
+    public:
+        // "maxSize" is in bytes
+        explicit MongoDBSummaryCache(size_t maxSize);
+
+        ~MongoDBSummaryCache();
+
+        // to be read before reading the summary of "internalId" from the database, and given to Add()
+        uint64_t GetGeneration(int64_t internalId) const;
+
+        // ignored if "internalId" has been invalidated since "generation"
+        void Add(int64_t internalId, const std::shared_ptr<const Summary> &summary, uint64_t generation);
+
+        // null if the summary is not in the cache
+        std::shared_ptr<const Summary> Lookup(int64_t internalId);
+
+        void Invalidate(int64_t internalId);
+
+        void GetStatistics(Statistics &target) const;
+    };
+}
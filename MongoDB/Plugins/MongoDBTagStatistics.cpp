@@ -0,0 +1,378 @@
+/**
+ * MongoDB Plugin - A plugin for Orthanc DICOM Server for storing DICOM data in MongoDB Database
+ * Copyright (C) 2017 - 2023  (Doc Cirrus GmbH)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+
+
+#include "MongoDBTagStatistics.h"
+
+#include "../../Framework/MongoDB/MongoDatabase.h"
+
+#include <Logging.h>
+#include <OrthancException.h>
+
+#include <algorithm>
+#include <cmath>
+
+namespace OrthancDatabases {
+    // number of values of each tag read to estimate its distribution
+    static const int32_t SAMPLE_ROWS = 2000;
+
+    // below this number of sampled values, a tag having more rows gets no estimate
+    static const uint64_t MIN_SAMPLES = 50;
+
+    static const size_t MAX_FREQUENT_VALUES = 16;
+
+    static const size_t HISTOGRAM_BUCKETS = 16;
+
+    static bool IsDate(const std::string &value) {
+        return (value.size() == 8 && std::all_of(value.begin(), value.end(), [](char c) {
+            return c >= '0' && c <= '9';
+        }));
+    }
+
+    // "YYYYMMDD" as an approximate number of days, the missing digits being zeros, e.g. "2023" is 2023-00-00
+    static double DateToNumber(const std::string &value) {
+        int digits[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+
+        for (size_t i = 0; i < 8 && i < value.size(); i++) {
+            if (value[i] >= '0' && value[i] <= '9') {
+                digits[i] = value[i] - '0';
+            }
+        }
+
+        const int year = digits[0] * 1000 + digits[1] * 100 + digits[2] * 10 + digits[3];
+        const int month = digits[4] * 10 + digits[5];
+        const int day = digits[6] * 10 + digits[7];
+
+        return static_cast<double>(year) * 372 + month * 31 + day;
+    }
+
+    void MongoDBTagStatistics::Summarize(Distribution &target, std::vector<std::string> &sample, uint64_t count) {
+        target.count = count;
+        target.samples = sample.size();
+
+        const size_t n = sample.size();
+        if (n == 0) {
+            return;
+        }
+
+        std::map<std::string, uint64_t> frequencies;
+        for (const auto &value: sample) {
+            frequencies[value]++;
+        }
+
+        // the values seen once in the sample stand for the values not seen at all (GEE estimator)
+        const uint64_t seen = frequencies.size();
+        uint64_t seenOnce = 0;
+
+        for (const auto &frequency: frequencies) {
+            if (frequency.second == 1) {
+                seenOnce++;
+            }
+        }
+
+        if (n >= count) {
+            target.distinct = seen;
+        } else if (seenOnce == n) {
+            // no repeated value at all, e.g. the UIDs
+            target.distinct = count;
+        } else {
+            const double estimate = std::sqrt(static_cast<double>(count) / static_cast<double>(n)) *
+                                    static_cast<double>(seenOnce) + static_cast<double>(seen - seenOnce);
+            target.distinct = std::min(count, std::max(seen, static_cast<uint64_t>(std::llround(estimate))));
+        }
+
+        for (const auto &frequency: frequencies) {
+            if (frequency.second >= 2) {
+                target.frequent.push_back(std::make_pair(frequency.first, frequency.second));
+            }
+        }
+
+        std::stable_sort(target.frequent.begin(), target.frequent.end(),
+                         [](const std::pair<std::string, uint64_t> &left,
+                            const std::pair<std::string, uint64_t> &right) {
+                             return left.second > right.second;
+                         });
+
+        if (target.frequent.size() > MAX_FREQUENT_VALUES) {
+            target.frequent.resize(MAX_FREQUENT_VALUES);
+        }
+
+        for (auto &frequent: target.frequent) {
+            frequent.second = std::max<uint64_t>(1, frequent.second * count / n);
+        }
+
+        if (std::all_of(sample.begin(), sample.end(), IsDate)) {
+            std::sort(sample.begin(), sample.end());
+
+            for (size_t i = 0; i <= HISTOGRAM_BUCKETS; i++) {
+                target.histogram.push_back(sample[i * (n - 1) / HISTOGRAM_BUCKETS]);
+            }
+        }
+    }
+
+    bool MongoDBTagStatistics::Distribution::IsReliable() const {
+        // a small sample is fine if it holds all the rows
+        return (samples >= MIN_SAMPLES || samples >= count);
+    }
+
+    double MongoDBTagStatistics::Distribution::EstimateEqual(const std::string &value) const {
+        if (!IsReliable()) {
+            return -1;
+        }
+
+        uint64_t listed = 0;
+
+        for (const auto &frequent: this->frequent) {
+            if (frequent.first == value) {
+                return static_cast<double>(frequent.second);
+            }
+
+            listed += frequent.second;
+        }
+
+        // the other values share the other rows evenly
+        if (distinct <= frequent.size() || count <= listed) {
+            return 1;
+        }
+
+        return std::max(1.0, static_cast<double>(count - listed) / static_cast<double>(distinct - frequent.size()));
+    }
+
+    double MongoDBTagStatistics::Distribution::EstimateRange(const std::string *lower,
+                                                             const std::string *upper) const {
+        if (!IsReliable()) {
+            return -1;
+        }
+
+        if (histogram.size() < 2) {
+            // each bound is assumed to keep a third of the rows
+            double estimate = static_cast<double>(count);
+            if (lower != nullptr) {
+                estimate /= 3;
+            }
+            if (upper != nullptr) {
+                estimate /= 3;
+            }
+
+            return std::max(1.0, estimate);
+        }
+
+        const double buckets = static_cast<double>(histogram.size() - 1);
+
+        // position of "value" in the histogram, in buckets, interpolated within the bucket holding it
+        auto position = [this, buckets](const std::string &value) {
+            const double date = DateToNumber(value);
+
+            if (date <= DateToNumber(histogram.front())) {
+                return 0.0;
+            } else if (date >= DateToNumber(histogram.back())) {
+                return buckets;
+            }
+
+            for (size_t i = 1; i < histogram.size(); i++) {
+                const double high = DateToNumber(histogram[i]);
+
+                if (date < high) {
+                    const double low = DateToNumber(histogram[i - 1]);
+                    return static_cast<double>(i - 1) + (high > low ? (date - low) / (high - low) : 0.5);
+                }
+            }
+
+            return buckets;
+        };
+
+        const double from = (lower == nullptr ? 0.0 : position(*lower));
+        const double to = (upper == nullptr ? buckets : position(*upper));
+
+        return std::max(1.0, static_cast<double>(count) * std::max(0.0, to - from) / buckets);
+    }
+
+    double MongoDBTagStatistics::Distribution::EstimateWildcard(const std::string &pattern) const {
+        if (!IsReliable()) {
+            return -1;
+        }
+
+        const size_t wildcard = pattern.find_first_of("*?");
+
+        if (wildcard == std::string::npos) {
+            return EstimateEqual(pattern);
+        } else if (wildcard == 0) {
+            return static_cast<double>(count);
+        }
+
+        const std::string prefix = pattern.substr(0, wildcard);
+
+        if (histogram.size() >= 2) {
+            // e.g. "2023*" for the dates of a year, from "2023" to "20231231"
+            static const std::string LAST_DATE = "99991231";
+            const std::string end = prefix + (prefix.size() < LAST_DATE.size() ? LAST_DATE.substr(prefix.size()) : "");
+            return EstimateRange(&prefix, &end);
+        }
+
+        // the frequent values with this prefix, or a tenth of the rows
+        double estimate = 0;
+        for (const auto &frequent: this->frequent) {
+            if (frequent.first.compare(0, prefix.size(), prefix) == 0) {
+                estimate += static_cast<double>(frequent.second);
+            }
+        }
+
+        return std::max(estimate, std::max(1.0, static_cast<double>(count) / 10));
+    }
+
+    void MongoDBTagStatistics::Compute(Distributions &target, MongoDatabase &database) {
+        target.clear();
+
+        for (const bool identifier: {false, true}) {
+            auto collection = database.GetCollection(identifier ? "DicomIdentifiers" : "MainDicomTags");
+
+            // the tags are listed by skipping from one to the next in the index on (tagGroup, tagElement, ...)
+            mongocxx::options::find options;
+            options.sort(make_document(kvp("tagGroup", 1), kvp("tagElement", 1)));
+            options.projection(make_document(kvp("_id", 0), kvp("tagGroup", 1), kvp("tagElement", 1)));
+
+            int32_t group = -1;
+            int32_t element = 0;
+
+            for (;;) {
+                auto next = collection.find_one(make_document(
+                        kvp("tagGroup", group), kvp("tagElement", make_document(kvp("$gt", element)))), options);
+
+                if (!next) {
+                    next = collection.find_one(make_document(
+                            kvp("tagGroup", make_document(kvp("$gt", group)))), options);
+                }
+
+                if (!next) {
+                    break;
+                }
+
+                group = next->view()["tagGroup"].get_int32().value;
+                element = next->view()["tagElement"].get_int32().value;
+
+                const auto filter = make_document(kvp("tagGroup", group), kvp("tagElement", element));
+
+                // both only read the index, the sample being drawn by the server among the values of the tag
+                const int64_t count = collection.count_documents(filter.view());
+
+                mongocxx::pipeline pipeline;
+                pipeline.match(filter.view());
+                pipeline.project(make_document(kvp("_id", 0), kvp("value", 1)));
+                pipeline.sample(SAMPLE_ROWS);
+
+                std::vector<std::string> sample;
+                for (auto &&doc: collection.aggregate(pipeline)) {
+                    sample.push_back(std::string(doc["value"].get_string().value));
+                }
+
+                // rows may have been added in between
+                Distribution &distribution = target[Key(identifier, static_cast<uint16_t>(group),
+                                                        static_cast<uint16_t>(element))];
+                Summarize(distribution, sample, std::max<uint64_t>(sample.size(), static_cast<uint64_t>(count)));
+            }
+        }
+    }
+
+    MongoDBTagStatistics::MongoDBTagStatistics(IDatabaseFactory *factory, unsigned int interval) :
+            factory_(factory), interval_(interval), paused_(false), done_(false) {
+        if (factory == nullptr) {
+            throw Orthanc::OrthancException(Orthanc::ErrorCode_NullPointer);
+        }
+
+        if (interval == 0) {
+            throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+        }
+    }
+
+    MongoDBTagStatistics::~MongoDBTagStatistics() {
+        Stop();
+    }
+
+    void MongoDBTagStatistics::Worker() {
+        for (;;) {
+            // the secondary indexes are dropped during a bulk load, and the distributions keep changing anyway
+            if (!paused_) {
+                try {
+                    std::unique_ptr<IDatabase> connection(factory_->Open());
+
+                    std::shared_ptr<Distributions> distributions = std::make_shared<Distributions>();
+                    Compute(*distributions, dynamic_cast<MongoDatabase &>(*connection));
+
+                    {
+                        boost::mutex::scoped_lock lock(snapshotMutex_);
+                        snapshot_ = distributions;
+                    }
+
+                    LOG(INFO) << "Statistics of " << distributions->size() << " tag(s) computed for the MongoDB index";
+                } catch (const Orthanc::OrthancException &e) {
+                    LOG(ERROR) << "Cannot compute the statistics of the tags of the MongoDB index: " << e.What();
+                } catch (const std::exception &e) {
+                    LOG(ERROR) << "Cannot compute the statistics of the tags of the MongoDB index: " << e.what();
+                }
+            }
+
+            boost::mutex::scoped_lock lock(mutex_);
+
+            const boost::system_time timeout = boost::get_system_time() + boost::posix_time::seconds(interval_);
+
+            while (!done_) {
+                if (!wakeup_.timed_wait(lock, timeout)) {
+                    break;
+                }
+            }
+
+            if (done_) {
+                return;
+            }
+        }
+    }
+
+    void MongoDBTagStatistics::Start() {
+        if (thread_.joinable()) {
+            throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+        }
+
+        {
+            boost::mutex::scoped_lock lock(mutex_);
+            done_ = false;
+        }
+
+        thread_ = boost::thread(&MongoDBTagStatistics::Worker, this);
+    }
+
+    void MongoDBTagStatistics::Stop() {
+        {
+            boost::mutex::scoped_lock lock(mutex_);
+            done_ = true;
+        }
+
+        wakeup_.notify_all();
+
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+    }
+
+    std::shared_ptr<const MongoDBTagStatistics::Distributions> MongoDBTagStatistics::GetSnapshot() const {
+        boost::mutex::scoped_lock lock(snapshotMutex_);
+        return snapshot_;
+    }
+}
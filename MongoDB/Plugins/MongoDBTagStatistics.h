@@ -0,0 +1,122 @@
+/**
+ * MongoDB Plugin - A plugin for Orthanc DICOM Server for storing DICOM data in MongoDB Database
+ * Copyright (C) 2017 - 2023  (Doc Cirrus GmbH)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+
+
+#pragma once
+
+#include "../../Framework/Common/IDatabaseFactory.h"
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread.hpp>
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <vector>
+
+namespace OrthancDatabases {
+    class MongoDatabase;
+
+    /**
+     * Approximate distribution of the values of each tag of "MainDicomTags" and "DicomIdentifiers", used by
+     * MongoDBLookupExecutor to evaluate the most selective constraints first. Each tag is sampled on its own through
+     * the index on (tagGroup, tagElement, value, id), so that the tags of the patients and studies are not drowned in
+     * the ones of the instances: the number of rows is counted, and a random sample of the values gives the number of
+     * distinct values, the most frequent ones, and for the dates an equi-depth histogram. The tags having too few
+     * sampled values for their number of rows give no estimate.
+     *
+     * The statistics are recomputed every "interval" seconds in a thread of its own, and the lookups read the last
+     * complete snapshot.
+     **/
+    class MongoDBTagStatistics : public boost::noncopyable {
+    public:
+        struct Distribution {
+            uint64_t count = 0;     // number of rows, i.e. of resources having the tag
+            uint64_t samples = 0;   // number of values the distribution is estimated from
+            uint64_t distinct = 0;  // estimated number of distinct values
+
+            // the values seen several times in the sample, with their estimated number of rows
+            std::vector<std::pair<std::string, uint64_t> > frequent;
+
+            // sorted bounds of buckets holding the same number of rows, only if all the values are dates
+            std::vector<std::string> histogram;
+
+            // false if the sample is too small to estimate anything, the estimates below being then negative
+            bool IsReliable() const;
+
+            // estimated number of rows whose value is "value"
+            double EstimateEqual(const std::string &value) const;
+
+            // estimated number of rows whose value is between the bounds (included), null for no bound
+            double EstimateRange(const std::string *lower, const std::string *upper) const;
+
+            // estimated number of rows matching the DICOM wildcard "pattern"
+            double EstimateWildcard(const std::string &pattern) const;
+        };
+
+        // (identifier, group, element)
+        typedef std::tuple<bool, uint16_t, uint16_t> Key;
+
+        typedef std::map<Key, Distribution> Distributions;
+
+    private:
+        std::unique_ptr<IDatabaseFactory> factory_;
+        unsigned int interval_;
+
+        mutable boost::mutex snapshotMutex_;
+        std::shared_ptr<const Distributions> snapshot_;
+
+        std::atomic<bool> paused_;
+
+        boost::mutex mutex_;
+        boost::condition_variable wakeup_;
+        bool done_;
+        boost::thread thread_;
+
+        void Worker();
+
+    public:
+        // the distribution of "count" rows, from a random sample of their values, which may be reordered
+        static void Summarize(Distribution &target, std::vector<std::string> &sample, uint64_t count);
+
+        static void Compute(Distributions &target, MongoDatabase &database);
+
+        // takes the ownership of "factory", "interval" is in seconds
+        MongoDBTagStatistics(IDatabaseFactory *factory, unsigned int interval);
+
+        ~MongoDBTagStatistics();
+
+        // computes the statistics at once, then every "interval" seconds, in a thread of its own
+        void Start();
+
+        void Stop();
+
+        // the statistics are not recomputed while paused, e.g. during a bulk load
+        void SetPaused(bool paused) {
+            paused_ = paused;
+        }
+
+        // null until the statistics have been computed once
+        std::shared_ptr<const Distributions> GetSnapshot() const;
+    };
+}
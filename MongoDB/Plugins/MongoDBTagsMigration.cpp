@@ -0,0 +1,301 @@
+/**
+ * MongoDB Plugin - A plugin for Orthanc DICOM Server for storing DICOM data in MongoDB Database
+ * Copyright (C) 2017 - 2023  (Doc Cirrus GmbH)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+
+
+#include "MongoDBTagsMigration.h"
+
+#include "../../Framework/MongoDB/MongoDatabase.h"
+#include "../../Framework/Plugins/GlobalProperties.h"
+
+#include <Logging.h>
+#include <OrthancException.h>
+
+#include <boost/lexical_cast.hpp>
+
+#include <cstdio>
+#include <map>
+#include <vector>
+
+using bsoncxx::builder::basic::array;
+using bsoncxx::builder::basic::make_array;
+
+namespace OrthancDatabases {
+    // the last internal id whose tags have been copied
+    static const int32_t GlobalProperty_EmbeddedTagsCheckpoint = Orthanc::GlobalProperty_DatabaseInternal4;
+
+    // set once all the resources carry their tags
+    static const int32_t GlobalProperty_EmbeddedTags = Orthanc::GlobalProperty_DatabaseInternal5;
+
+    // delay before retrying a migration that failed
+    static const unsigned int RETRY_INTERVAL = 10000;  // milliseconds
+
+    static bool LookupProperty(std::string &target, MongoDatabase &database, int32_t property) {
+        auto doc = database.GetCollection("GlobalProperties").find_one(make_document(kvp("property", property)));
+
+        if (doc) {
+            target = std::string(doc->view()["value"].get_string().value);
+            return true;
+        }
+
+        return false;
+    }
+
+    static void StoreProperty(MongoDatabase &database, int32_t property, const std::string &value) {
+        database.GetCollection("GlobalProperties").update_one(
+                make_document(kvp("property", property)),
+                make_document(kvp("$set", make_document(kvp("value", value)))),
+                mongocxx::options::update{}.upsert(true)
+        );
+    }
+
+    // the tags of "collection" whose resource is in "ids", grouped by resource
+    static void ReadTags(std::map<int64_t, bsoncxx::builder::basic::document> &target,
+                         MongoDatabase &database,
+                         const std::string &collection,
+                         const bsoncxx::document::view &ids) {
+        auto cursor = database.GetCollection(collection).find(make_document(kvp("id", ids)));
+
+        for (auto &&doc: cursor) {
+            target[doc["id"].get_int64().value].append(kvp(
+                    MongoDBTagsMigration::FormatTagKey(static_cast<uint16_t>(doc["tagGroup"].get_int32().value),
+                                                       static_cast<uint16_t>(doc["tagElement"].get_int32().value)),
+                    doc["value"].get_string().value
+            ));
+        }
+    }
+
+    // copies the tags of at most "batchSize" resources after "checkpoint", returns the number of resources visited
+    static size_t MigrateBatch(int64_t &checkpoint, MongoDatabase &database, unsigned int batchSize) {
+        mongocxx::options::find options;
+        options.projection(make_document(kvp("internalId", 1)))
+                .sort(make_document(kvp("internalId", 1)))
+                .limit(static_cast<int64_t>(batchSize));
+
+        auto cursor = database.GetCollection("Resources").find(
+                make_document(kvp("internalId", make_document(kvp("$gt", checkpoint)))), options
+        );
+
+        std::vector<int64_t> ids;
+        array inIds;
+
+        for (auto &&doc: cursor) {
+            ids.push_back(doc["internalId"].get_int64().value);
+            inIds.append(ids.back());
+        }
+
+        if (ids.empty()) {
+            return 0;
+        }
+
+        auto filter = make_document(kvp("$in", inIds.extract()));
+
+        std::map<int64_t, bsoncxx::builder::basic::document> tags;
+        std::map<int64_t, bsoncxx::builder::basic::document> identifiers;
+        ReadTags(tags, database, "MainDicomTags", filter.view());
+        ReadTags(identifiers, database, "DicomIdentifiers", filter.view());
+
+        // a sub-document written by the index in the meantime is more recent than the collections read above
+        auto bulk = database.GetCollection("Resources").create_bulk_write();
+
+        for (const int64_t id: ids) {
+            bulk.append(mongocxx::model::update_one{
+                    make_document(kvp("internalId", id), kvp("tags", make_document(kvp("$exists", false)))),
+                    make_document(kvp("$set", make_document(kvp("tags", tags[id].extract()))))
+            });
+
+            bulk.append(mongocxx::model::update_one{
+                    make_document(kvp("internalId", id), kvp("identifiers", make_document(kvp("$exists", false)))),
+                    make_document(kvp("$set", make_document(kvp("identifiers", identifiers[id].extract()))))
+            });
+        }
+
+        bulk.execute();
+
+        checkpoint = ids.back();
+        return ids.size();
+    }
+
+    MongoDBTagsMigration::MongoDBTagsMigration(IDatabaseFactory *factory, unsigned int batchSize,
+                                               unsigned int throttle) :
+            factory_(factory), batchSize_(batchSize), throttle_(throttle), complete_(false), done_(false) {
+        if (factory == nullptr) {
+            throw Orthanc::OrthancException(Orthanc::ErrorCode_NullPointer);
+        }
+
+        if (batchSize == 0) {
+            throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+        }
+    }
+
+    MongoDBTagsMigration::~MongoDBTagsMigration() {
+        Stop();
+    }
+
+    bool MongoDBTagsMigration::WaitFor(unsigned int milliseconds) {
+        boost::mutex::scoped_lock lock(mutex_);
+
+        const boost::system_time timeout = boost::get_system_time() + boost::posix_time::milliseconds(milliseconds);
+
+        while (!done_) {
+            if (!wakeup_.timed_wait(lock, timeout)) {
+                break;
+            }
+        }
+
+        return !done_;
+    }
+
+    void MongoDBTagsMigration::Worker() {
+        std::unique_ptr<IDatabase> connection;
+        unsigned int delay = 0;
+
+        while (!complete_ && WaitFor(delay)) {
+            delay = RETRY_INTERVAL;
+
+            try {
+                if (connection.get() == nullptr) {
+                    connection.reset(factory_->Open());
+                }
+
+                auto &database = dynamic_cast<MongoDatabase &>(*connection);
+
+                std::string value;
+                if (LookupProperty(value, database, GlobalProperty_EmbeddedTags) && value == "1") {
+                    complete_ = true;
+                    break;
+                }
+
+                int64_t checkpoint = -1;
+                if (LookupProperty(value, database, GlobalProperty_EmbeddedTagsCheckpoint)) {
+                    checkpoint = boost::lexical_cast<int64_t>(value);
+                } else {
+                    LOG(WARNING) << "Copying the tags of the resources into the Resources collection of the MongoDB "
+                                 << "index, this may take a while";
+                }
+
+                for (;;) {
+                    const size_t count = MigrateBatch(checkpoint, database, batchSize_);
+
+                    if (count == 0) {
+                        StoreProperty(database, GlobalProperty_EmbeddedTags, "1");
+                        complete_ = true;
+                        LOG(WARNING) << "The tags of all the resources are now embedded in the MongoDB index";
+                        break;
+                    }
+
+                    StoreProperty(database, GlobalProperty_EmbeddedTagsCheckpoint,
+                                  boost::lexical_cast<std::string>(checkpoint));
+
+                    if (!WaitFor(throttle_)) {
+                        break;
+                    }
+                }
+            } catch (const Orthanc::OrthancException &e) {
+                LOG(ERROR) << "Cannot embed the tags of the resources: " << e.What();
+                connection.reset();
+            } catch (const std::exception &e) {
+                LOG(ERROR) << "Cannot embed the tags of the resources: " << e.what();
+                connection.reset();
+            }
+        }
+    }
+
+    void MongoDBTagsMigration::Start() {
+        if (thread_.joinable()) {
+            throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+        }
+
+        {
+            boost::mutex::scoped_lock lock(mutex_);
+            done_ = false;
+        }
+
+        thread_ = boost::thread(&MongoDBTagsMigration::Worker, this);
+    }
+
+    void MongoDBTagsMigration::Stop() {
+        {
+            boost::mutex::scoped_lock lock(mutex_);
+            done_ = true;
+        }
+
+        wakeup_.notify_all();
+
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+    }
+
+    std::string MongoDBTagsMigration::FormatTagKey(uint16_t group, uint16_t element) {
+        char key[9];
+        snprintf(key, sizeof(key), "%04x%04x", group, element);
+        return std::string(key);
+    }
+
+    bool MongoDBTagsMigration::ParseTagKey(uint16_t &group, uint16_t &element, bsoncxx::stdx::string_view key) {
+        if (key.size() != 8) {
+            return false;
+        }
+
+        uint32_t value = 0;
+
+        for (const char c: key) {
+            value <<= 4;
+
+            if (c >= '0' && c <= '9') {
+                value |= static_cast<uint32_t>(c - '0');
+            } else if (c >= 'a' && c <= 'f') {
+                value |= static_cast<uint32_t>(c - 'a' + 10);
+            } else {
+                return false;
+            }
+        }
+
+        group = static_cast<uint16_t>(value >> 16);
+        element = static_cast<uint16_t>(value & 0xffff);
+        return true;
+    }
+
+    void MongoDBTagsMigration::Reset(MongoDatabase &database) {
+        std::string value;
+        if (!LookupProperty(value, database, GlobalProperty_EmbeddedTagsCheckpoint) &&
+            !LookupProperty(value, database, GlobalProperty_EmbeddedTags)) {
+            return;  // the tags have never been embedded
+        }
+
+        LOG(WARNING) << "Removing the embedded tags from the Resources collection of the MongoDB index";
+
+        database.DropIndex("Resources", "tags.$**_1");
+        database.DropIndex("Resources", "identifiers.$**_1");
+
+        database.GetCollection("Resources").update_many(
+                make_document(kvp("$or", make_array(
+                        make_document(kvp("tags", make_document(kvp("$exists", true)))),
+                        make_document(kvp("identifiers", make_document(kvp("$exists", true))))
+                ))),
+                make_document(kvp("$unset", make_document(kvp("tags", ""), kvp("identifiers", ""))))
+        );
+
+        database.GetCollection("GlobalProperties").delete_many(make_document(kvp("property", make_document(
+                kvp("$in", make_array(GlobalProperty_EmbeddedTagsCheckpoint, GlobalProperty_EmbeddedTags))
+        ))));
+    }
+}
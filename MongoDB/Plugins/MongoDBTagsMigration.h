@@ -0,0 +1,88 @@
+/**
+ * MongoDB Plugin - A plugin for Orthanc DICOM Server for storing DICOM data in MongoDB Database
+ * Copyright (C) 2017 - 2023  (Doc Cirrus GmbH)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+
+
+#pragma once
+
+#include "../../Framework/Common/IDatabaseFactory.h"
+
+#include <bsoncxx/stdx/string_view.hpp>
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread.hpp>
+
+#include <atomic>
+#include <memory>
+#include <string>
+
+namespace OrthancDatabases {
+    class MongoDatabase;
+
+    /**
+     * Background copy of the "MainDicomTags" and "DicomIdentifiers" collections into the "tags" and "identifiers"
+     * sub-documents of the resources, see the "EmbeddedTags" option. The resources are walked by increasing internal
+     * id, by batches of "batchSize" with a pause of "throttle" milliseconds in between, and the last migrated id is
+     * saved in the global properties so that a restart resumes the copy where it stopped. The resources created or
+     * modified meanwhile are written in both forms by the index, and are left alone.
+     *
+     * The index keeps reading the collections until IsComplete().
+     **/
+    class MongoDBTagsMigration : public boost::noncopyable {
+    private:
+        std::unique_ptr<IDatabaseFactory> factory_;
+        unsigned int batchSize_;
+        unsigned int throttle_;
+        std::atomic<bool> complete_;
+
+        boost::mutex mutex_;
+        boost::condition_variable wakeup_;
+        bool done_;
+        boost::thread thread_;
+
+        void Worker();
+
+        bool WaitFor(unsigned int milliseconds);
+
+    public:
+        // takes the ownership of "factory"
+        MongoDBTagsMigration(IDatabaseFactory *factory, unsigned int batchSize, unsigned int throttle);
+
+        ~MongoDBTagsMigration();
+
+        void Start();
+
+        void Stop();
+
+        // true once all the resources carry their tags, the embedded tags can then be read
+        bool IsComplete() const {
+            return complete_;
+        }
+
+        // the key of a tag in the sub-documents, "ggggeeee" in lowercase hexadecimal
+        static std::string FormatTagKey(uint16_t group, uint16_t element);
+
+        static bool ParseTagKey(uint16_t &group, uint16_t &element, bsoncxx::stdx::string_view key);
+
+        // Drops the embedded tags and the progress of the migration. To be called when "EmbeddedTags" is disabled,
+        // as the sub-documents are no longer maintained from then on.
+        static void Reset(MongoDatabase &database);
+    };
+}
@@ -18,6 +18,7 @@
 
 #include <mongoc.h>
 #include "MongoDBStorageArea.h"
+#include "MongoDBStorageExport.h"
 
 #include "../../Framework/Plugins/PluginInitialization.h"
 #include "../../Resources/Orthanc/Plugins/OrthancPluginCppWrapper.h"
@@ -59,6 +60,16 @@ ORTHANC_PLUGINS_API int32_t OrthancPluginInitialize(OrthancPluginContext *contex
 
         // const unsigned int countConnections = mongodb.GetUnsignedIntegerValue("IndexConnectionsCount", 5);
         const unsigned int maxConnectionRetries = mongodb.GetUnsignedIntegerValue("MaxConnectionRetries", 10);
+        const unsigned int exportReadAhead = mongodb.GetUnsignedIntegerValue("ExportReadAhead", 4);
+
+        // 0 keeps the "maxPoolSize" of the connection string
+        unsigned int countConnections = 0;
+        mongodb.LookupUnsignedIntegerValue(countConnections, "StorageConnectionsCount");
+
+        const unsigned int maxCountConnections = mongodb.GetUnsignedIntegerValue("MaxStorageConnectionsCount",
+                                                                                countConnections);
+        const unsigned int monitoringInterval = mongodb.GetUnsignedIntegerValue("ConnectionPoolMonitoringInterval",
+                                                                               10);
 
         if (connectionUri.empty()) {
             throw Orthanc::OrthancException(
@@ -67,11 +78,14 @@ ORTHANC_PLUGINS_API int32_t OrthancPluginInitialize(OrthancPluginContext *contex
             );
         }
 
-        OrthancDatabases::MongoDBStorageArea::Register(
-                context, new OrthancDatabases::MongoDBStorageArea(
-                        connectionUri, static_cast<int>(chunkSize), static_cast<int>(maxConnectionRetries)
-                )
-        );
+        std::unique_ptr<OrthancDatabases::MongoDBStorageArea> storage(new OrthancDatabases::MongoDBStorageArea(
+                connectionUri, static_cast<int>(chunkSize), static_cast<int>(maxConnectionRetries)
+        ));
+
+        storage->ConfigurePool(context, countConnections, maxCountConnections, monitoringInterval);
+
+        OrthancDatabases::MongoDBStorageExport::Register(context, *storage, exportReadAhead);
+        OrthancDatabases::MongoDBStorageArea::Register(context, storage.release());
     }
     catch (Orthanc::OrthancException &e) {
         LOG(ERROR) << e.What();
@@ -88,6 +102,7 @@ ORTHANC_PLUGINS_API int32_t OrthancPluginInitialize(OrthancPluginContext *contex
 
 ORTHANC_PLUGINS_API void OrthancPluginFinalize() {
     LOG(WARNING) << "MongoDB storage area is finalizing";
+    OrthancDatabases::MongoDBStorageExport::Finalize();
     OrthancDatabases::MongoDBStorageArea::Finalize();
     
     mongoc_cleanup();
@@ -0,0 +1,153 @@
+/**
+ * MongoDB Plugin - A plugin for Orthanc DICOM Server for storing DICOM data in MongoDB Database
+ * Copyright (C) 2017 - 2023  (Doc Cirrus GmbH)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#include "../Plugins/MongoDBChangesCache.h"
+
+#include <gtest/gtest.h>
+
+using namespace OrthancDatabases;
+
+
+static MongoDBChangesCache::Change MakeChange(int64_t id, int64_t internalId) {
+    MongoDBChangesCache::Change change;
+    change.id = id;
+    change.changeType = 1;
+    change.resourceType = 3;
+    change.internalId = internalId;
+    change.publicId = "instance" + std::to_string(internalId);
+    change.date = "20230101T120000";
+    return change;
+}
+
+TEST(MongoDBChangesCache, Eviction) {
+    MongoDBChangesCache cache(4);
+    cache.Reset(0);
+
+    std::vector<MongoDBChangesCache::Change> changes;
+    bool done = false;
+
+    ASSERT_TRUE(cache.LookupChanges(changes, done, 0, 10));
+    ASSERT_TRUE(changes.empty());
+    ASSERT_TRUE(done);
+
+    for (int64_t id = 1; id <= 6; id++) {
+        cache.Add(MakeChange(id, 100 + id));
+    }
+
+    // the changes 1 and 2 have been overwritten
+    ASSERT_FALSE(cache.LookupChanges(changes, done, 0, 10));
+    ASSERT_FALSE(cache.LookupChanges(changes, done, 1, 10));
+
+    ASSERT_TRUE(cache.LookupChanges(changes, done, 2, 10));
+    ASSERT_EQ(4u, changes.size());
+    ASSERT_EQ(3, changes.front().id);
+    ASSERT_EQ(6, changes.back().id);
+    ASSERT_EQ("instance106", changes.back().publicId);
+    ASSERT_TRUE(done);
+
+    ASSERT_TRUE(cache.LookupChanges(changes, done, 2, 2));
+    ASSERT_EQ(2u, changes.size());
+    ASSERT_EQ(3, changes[0].id);
+    ASSERT_EQ(4, changes[1].id);
+    ASSERT_FALSE(done);
+
+    ASSERT_TRUE(cache.LookupChanges(changes, done, 6, 10));
+    ASSERT_TRUE(changes.empty());
+    ASSERT_TRUE(done);
+
+    MongoDBChangesCache::Change last;
+    ASSERT_TRUE(cache.LookupLastChange(last));
+    ASSERT_EQ(6, last.id);
+
+    // the changes of deleted resources are dropped
+    cache.Remove({105});
+    ASSERT_TRUE(cache.LookupChanges(changes, done, 2, 10));
+    ASSERT_EQ(3u, changes.size());
+    ASSERT_EQ(4, changes[1].id);
+    ASSERT_EQ(6, changes[2].id);
+}
+
+TEST(MongoDBChangesCache, Reset) {
+    MongoDBChangesCache cache(4);
+
+    // the changes up to 10 are only in the collection
+    cache.Reset(10);
+
+    std::vector<MongoDBChangesCache::Change> changes;
+    bool done = false;
+
+    ASSERT_FALSE(cache.LookupChanges(changes, done, 5, 10));
+    ASSERT_TRUE(cache.LookupChanges(changes, done, 10, 10));
+    ASSERT_TRUE(changes.empty());
+
+    cache.Add(MakeChange(11, 1));
+    ASSERT_TRUE(cache.LookupChanges(changes, done, 10, 10));
+    ASSERT_EQ(1u, changes.size());
+
+    // a change too large for a slot sends the requests before it to the collection
+    MongoDBChangesCache::Change large = MakeChange(12, 2);
+    large.publicId = std::string(100, 'x');
+    cache.Add(large);
+    ASSERT_FALSE(cache.LookupChanges(changes, done, 11, 10));
+    ASSERT_TRUE(cache.LookupChanges(changes, done, 12, 10));
+
+    cache.Invalidate();
+    ASSERT_FALSE(cache.LookupChanges(changes, done, 12, 10));
+}
+
+TEST(MongoDBChangesCache, CommitOrder) {
+    MongoDBChangesCache cache(16);
+    cache.Reset(0);
+
+    std::vector<MongoDBChangesCache::Change> changes;
+    bool done = false;
+
+    // the transaction of the change 2 commits after the one of the change 3
+    cache.Add(MakeChange(1, 101));
+    cache.Add(MakeChange(3, 103));
+
+    ASSERT_TRUE(cache.LookupChanges(changes, done, 0, 10));
+    ASSERT_EQ(1u, changes.size());
+    ASSERT_EQ(1, changes[0].id);
+    ASSERT_FALSE(done);
+
+    // the change 2 may still come: the collection decides
+    ASSERT_FALSE(cache.LookupChanges(changes, done, 1, 10));
+
+    cache.Add(MakeChange(2, 102));
+    ASSERT_TRUE(cache.LookupChanges(changes, done, 1, 10));
+    ASSERT_EQ(2u, changes.size());
+    ASSERT_EQ(2, changes[0].id);
+    ASSERT_EQ(3, changes[1].id);
+    ASSERT_TRUE(done);
+
+    // the changes of a deleted resource are no gap, but there is nothing to answer before the missing change 5
+    cache.Add(MakeChange(4, 104));
+    cache.Add(MakeChange(6, 106));
+    cache.Remove({104});
+    ASSERT_FALSE(cache.LookupChanges(changes, done, 3, 10));
+
+    cache.Add(MakeChange(5, 105));
+    ASSERT_TRUE(cache.LookupChanges(changes, done, 3, 10));
+    ASSERT_EQ(2u, changes.size());
+    ASSERT_EQ(5, changes[0].id);
+    ASSERT_EQ(6, changes[1].id);
+    ASSERT_TRUE(done);
+}
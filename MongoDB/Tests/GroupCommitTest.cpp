@@ -0,0 +1,90 @@
+/**
+ * MongoDB Plugin - A plugin for Orthanc DICOM Server for storing DICOM data in MongoDB Database
+ * Copyright (C) 2017 - 2023  (Doc Cirrus GmbH)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+
+
+#include "../../Framework/Common/ITransaction.h"
+#include "../../Framework/MongoDB/MongoDatabase.h"
+
+#include <Toolbox.h>
+
+#include <gtest/gtest.h>
+
+#include <boost/thread.hpp>
+
+using namespace OrthancDatabases;
+
+// needs a MongoDB server, as StorageTest
+static const std::string connectionUri = "mongodb://host.docker.internal:27017/";
+
+TEST(MongoGroupCommit, ConcurrentConnections) {
+    const std::string database = "test_db_" + Orthanc::Toolbox::GenerateUuid();
+
+    MongoDatabase::Options options;
+    options.groupCommitWindow = 500;
+    options.parallelWrites = 0;
+
+    auto groupCommit = std::make_shared<MongoGroupCommit>(options.groupCommitWindow);
+
+    // one factory per connection, as Orthanc does
+    std::unique_ptr<IDatabaseFactory> factory1(
+            MongoDatabase::CreateDatabaseFactory(connectionUri + database, options, groupCommit, nullptr));
+    std::unique_ptr<IDatabaseFactory> factory2(
+            MongoDatabase::CreateDatabaseFactory(connectionUri + database, options, groupCommit, nullptr));
+
+    std::unique_ptr<IDatabase> connection1(factory1->Open());
+    std::unique_ptr<IDatabase> connection2(factory2->Open());
+
+    auto commit = [](IDatabase *connection, int32_t value, bool *success) {
+        try {
+            std::unique_ptr<ITransaction> transaction(connection->CreateTransaction(TransactionType_ReadWrite));
+            dynamic_cast<MongoDatabase &>(*connection).GetCollection("GroupCommit").Defer(
+                    mongocxx::model::insert_one{make_document(kvp("value", value))}, true
+            );
+            transaction->Commit();
+            *success = true;
+        } catch (...) {
+            *success = false;
+        }
+    };
+
+    bool success1 = false;
+    bool success2 = false;
+
+    boost::thread thread1(commit, connection1.get(), 1, &success1);
+    boost::thread thread2(commit, connection2.get(), 2, &success2);
+    thread1.join();
+    thread2.join();
+
+    ASSERT_TRUE(success1);
+    ASSERT_TRUE(success2);
+
+    // the second commit has joined the window of the first one
+    uint64_t groups = 0;
+    uint64_t commits = 0;
+    groupCommit->GetStatistics(groups, commits);
+    ASSERT_EQ(1u, groups);
+    ASSERT_EQ(2u, commits);
+
+    auto &mongo = dynamic_cast<MongoDatabase &>(*connection1);
+    ASSERT_EQ(2, mongo.GetObject()["GroupCommit"].count_documents(make_document()));
+
+    mongo.GetObject().drop();
+}
@@ -0,0 +1,138 @@
+/**
+ * MongoDB Plugin - A plugin for Orthanc DICOM Server for storing DICOM data in MongoDB Database
+ * Copyright (C) 2017 - 2023  (Doc Cirrus GmbH)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#include "../Plugins/MongoDBLookupExecutor.h"
+
+#include <Logging.h>
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <iterator>
+#include <random>
+#include <set>
+
+using namespace OrthancDatabases;
+
+
+static std::vector<int64_t> ReferenceIntersection(const std::vector<int64_t> &a, const std::vector<int64_t> &b) {
+    std::vector<int64_t> result;
+    std::set_intersection(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(result));
+    return result;
+}
+
+static void CheckIntersect(const std::vector<int64_t> &a, const std::vector<int64_t> &b) {
+    std::vector<int64_t> target = a;
+    MongoDBLookupExecutor::Intersect(target, b);
+    ASSERT_EQ(ReferenceIntersection(a, b), target);
+
+    // the operation is symmetric
+    target = b;
+    MongoDBLookupExecutor::Intersect(target, a);
+    ASSERT_EQ(ReferenceIntersection(a, b), target);
+}
+
+TEST(MongoDBLookupExecutor, IntersectEmpty) {
+    CheckIntersect({}, {});
+    CheckIntersect({}, {1, 2, 3});
+    CheckIntersect({1, 2, 3}, {});
+}
+
+TEST(MongoDBLookupExecutor, IntersectDisjoint) {
+    CheckIntersect({1, 3, 5}, {2, 4, 6});
+    CheckIntersect({1, 2, 3}, {10, 20, 30});
+    CheckIntersect({10, 20, 30}, {1, 2, 3});
+}
+
+TEST(MongoDBLookupExecutor, IntersectBoundaries) {
+    std::vector<int64_t> large;
+    for (int64_t i = 0; i < 1000; i++) {
+        large.push_back(2 * i);
+    }
+
+    // the first and last elements, and the positions reached by the successive doublings of the gallop
+    CheckIntersect({0}, large);
+    CheckIntersect({1998}, large);
+    CheckIntersect({1999}, large);
+    CheckIntersect({2000}, large);
+
+    for (int64_t step = 1; step < 1000; step *= 2) {
+        CheckIntersect({2 * step}, large);
+        CheckIntersect({2 * step - 2, 2 * step, 2 * step + 1}, large);
+        CheckIntersect({2 * (step - 1) + 1}, large);
+    }
+
+    CheckIntersect(large, large);
+}
+
+TEST(MongoDBLookupExecutor, IntersectRandom) {
+    std::mt19937 generator(42);
+
+    for (int round = 0; round < 200; round++) {
+        std::uniform_int_distribution<int64_t> values(0, 1 + round * 10);
+        std::set<int64_t> a, b;
+
+        const size_t sizeA = generator() % 50;
+        const size_t sizeB = generator() % 2000;
+
+        for (size_t i = 0; i < sizeA; i++) {
+            a.insert(values(generator));
+        }
+
+        for (size_t i = 0; i < sizeB; i++) {
+            b.insert(values(generator));
+        }
+
+        CheckIntersect(std::vector<int64_t>(a.begin(), a.end()), std::vector<int64_t>(b.begin(), b.end()));
+    }
+}
+
+TEST(MongoDBLookupExecutor, IntersectLimit) {
+    const std::vector<int64_t> a = {1, 2, 4, 6, 8, 9, 12};
+    const std::vector<int64_t> b = {2, 3, 4, 8, 10, 12, 14, 16, 18};
+
+    for (size_t limit = 0; limit < 6; limit++) {
+        // the smallest ids are kept, whichever vector is the smaller one
+        std::vector<int64_t> expected = ReferenceIntersection(a, b);
+        if (limit != 0 && expected.size() > limit) {
+            expected.resize(limit);
+        }
+
+        std::vector<int64_t> target = a;
+        MongoDBLookupExecutor::Intersect(target, b, limit);
+        ASSERT_EQ(expected, target);
+
+        target = b;
+        MongoDBLookupExecutor::Intersect(target, a, limit);
+        ASSERT_EQ(expected, target);
+    }
+}
+
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    Orthanc::Logging::Initialize();
+
+    int result = RUN_ALL_TESTS();
+
+    Orthanc::Logging::Finalize();
+
+    return result;
+}
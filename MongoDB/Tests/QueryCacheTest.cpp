@@ -0,0 +1,103 @@
+/**
+ * MongoDB Plugin - A plugin for Orthanc DICOM Server for storing DICOM data in MongoDB Database
+ * Copyright (C) 2017 - 2023  (Doc Cirrus GmbH)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#include "../Plugins/MongoDBIndex.h"
+#include "../Plugins/MongoDBQueryCache.h"
+
+#include <gtest/gtest.h>
+
+#include <boost/thread.hpp>
+
+using namespace OrthancDatabases;
+
+
+#if ORTHANC_PLUGINS_HAS_DATABASE_CONSTRAINT == 1
+static Orthanc::DatabaseConstraint MakeConstraint(Orthanc::ResourceType level, uint16_t group, uint16_t element,
+                                                  Orthanc::ConstraintType type,
+                                                  const std::vector<std::string> &values) {
+    return Orthanc::DatabaseConstraint(level, Orthanc::DicomTag(group, element), false, type, values, true, true);
+}
+
+TEST(MongoDBIndex, FormatLookupKey) {
+    const Orthanc::DatabaseConstraint sex = MakeConstraint(Orthanc::ResourceType_Patient, 0x0010, 0x0040,
+                                                           Orthanc::ConstraintType_Equal, {"F"});
+    const Orthanc::DatabaseConstraint date = MakeConstraint(Orthanc::ResourceType_Study, 0x0008, 0x0020,
+                                                            Orthanc::ConstraintType_Equal, {"20200101"});
+
+    const std::string key = MongoDBIndex::FormatLookupKey({sex, date}, OrthancPluginResourceType_Study, 10, false);
+
+    // the order of the constraints does not matter
+    ASSERT_EQ(key, MongoDBIndex::FormatLookupKey({date, sex}, OrthancPluginResourceType_Study, 10, false));
+
+    // the other arguments do
+    ASSERT_NE(key, MongoDBIndex::FormatLookupKey({sex, date}, OrthancPluginResourceType_Series, 10, false));
+    ASSERT_NE(key, MongoDBIndex::FormatLookupKey({sex, date}, OrthancPluginResourceType_Study, 0, false));
+    ASSERT_NE(key, MongoDBIndex::FormatLookupKey({sex, date}, OrthancPluginResourceType_Study, 10, true));
+    ASSERT_NE(key, MongoDBIndex::FormatLookupKey({sex}, OrthancPluginResourceType_Study, 10, false));
+
+    // the values cannot be forged from the separators
+    const Orthanc::DatabaseConstraint joined = MakeConstraint(Orthanc::ResourceType_Patient, 0x0010, 0x0040,
+                                                              Orthanc::ConstraintType_List, {"F,1:M"});
+    const Orthanc::DatabaseConstraint list = MakeConstraint(Orthanc::ResourceType_Patient, 0x0010, 0x0040,
+                                                            Orthanc::ConstraintType_List, {"F", "M"});
+    ASSERT_NE(MongoDBIndex::FormatLookupKey({joined}, OrthancPluginResourceType_Patient, 0, false),
+              MongoDBIndex::FormatLookupKey({list}, OrthancPluginResourceType_Patient, 0, false));
+}
+#endif
+
+
+TEST(MongoDBQueryCache, Generation) {
+    MongoDBQueryCache cache(1024 * 1024, 3600);
+
+    auto matches = std::make_shared<MongoDBQueryCache::Matches>(1);
+    (*matches)[0].publicId = "patient";
+
+    // an answer computed before an invalidation is not kept
+    uint64_t generation = cache.GetGeneration();
+    cache.Invalidate();
+    cache.Add("key", matches, generation);
+    ASSERT_FALSE(cache.Lookup("key"));
+
+    generation = cache.GetGeneration();
+    cache.Add("key", matches, generation);
+    ASSERT_TRUE(cache.Lookup("key"));
+    ASSERT_EQ("patient", (*cache.Lookup("key"))[0].publicId);
+    ASSERT_FALSE(cache.Lookup("other"));
+
+    // an invalidation drops the answers already in the cache
+    cache.Invalidate();
+    ASSERT_FALSE(cache.Lookup("key"));
+
+    MongoDBQueryCache::Statistics statistics;
+    cache.GetStatistics(statistics);
+    ASSERT_EQ(2u, statistics.hits);
+    ASSERT_EQ(3u, statistics.misses);
+    ASSERT_EQ(0u, statistics.count);
+}
+
+TEST(MongoDBQueryCache, TimeToLive) {
+    MongoDBQueryCache cache(1024 * 1024, 0);
+
+    auto matches = std::make_shared<MongoDBQueryCache::Matches>();
+    cache.Add("key", matches, cache.GetGeneration());
+
+    boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+    ASSERT_FALSE(cache.Lookup("key"));
+}
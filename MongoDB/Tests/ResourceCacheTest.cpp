@@ -0,0 +1,56 @@
+/**
+ * MongoDB Plugin - A plugin for Orthanc DICOM Server for storing DICOM data in MongoDB Database
+ * Copyright (C) 2017 - 2023  (Doc Cirrus GmbH)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#include "../Plugins/MongoDBResourceCache.h"
+
+#include <gtest/gtest.h>
+
+using namespace OrthancDatabases;
+
+
+TEST(MongoDBResourceCache, Generation) {
+    MongoDBResourceCache cache(1024 * 1024);
+
+    MongoDBResourceCache::Resource resource;
+    resource.internalId = 42;
+    resource.resourceType = 1;
+    resource.parentId = 7;
+    resource.publicId = "study";
+
+    // read before the deletion of a resource: it may describe a deleted resource
+    uint64_t generation = cache.GetGeneration();
+    cache.Remove({{43, "other"}});
+    cache.Add(resource, generation);
+
+    MongoDBResourceCache::Resource found;
+    ASSERT_FALSE(cache.LookupByInternalId(found, 42));
+    ASSERT_FALSE(cache.LookupByPublicId(found, "study"));
+
+    cache.Add(resource, cache.GetGeneration());
+    ASSERT_TRUE(cache.LookupByInternalId(found, 42));
+    ASSERT_EQ("study", found.publicId);
+    ASSERT_EQ(7, found.parentId);
+    ASSERT_TRUE(cache.LookupByPublicId(found, "study"));
+    ASSERT_EQ(42, found.internalId);
+
+    cache.Remove({{42, "study"}});
+    ASSERT_FALSE(cache.LookupByInternalId(found, 42));
+    ASSERT_FALSE(cache.LookupByPublicId(found, "study"));
+}
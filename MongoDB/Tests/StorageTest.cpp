@@ -91,6 +91,24 @@ TEST_F(MongoDBStorageTest, StoreFiles)
     accessor = nullptr;
 }
 
+TEST_F(MongoDBStorageTest, ReadUnknownFiles)
+{
+    std::unique_ptr<OrthancDatabases::MongoDBStorageArea::Accessor> accessor(storage_->CreateAccessor());
+    accessor->Create(filename, input_data.c_str(), input_data.length(), type);
+
+    // more failed reads than the 100 clients of the pool: each one must give its client back
+    for (int i = 0; i < 200; i++) {
+        std::string content;
+        ASSERT_THROW(accessor->ReadWhole(content, Orthanc::Toolbox::GenerateUuid(), type), Orthanc::OrthancException);
+    }
+
+    std::string content;
+    accessor->ReadWhole(content, filename, type);
+    ASSERT_EQ(input_data, content);
+
+    accessor->Remove(filename, type);
+}
+
  
 int main(int argc, char **argv) 
 {
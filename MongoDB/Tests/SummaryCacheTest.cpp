@@ -0,0 +1,46 @@
+/**
+ * MongoDB Plugin - A plugin for Orthanc DICOM Server for storing DICOM data in MongoDB Database
+ * Copyright (C) 2017 - 2023  (Doc Cirrus GmbH)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#include "../Plugins/MongoDBSummaryCache.h"
+
+#include <gtest/gtest.h>
+
+using namespace OrthancDatabases;
+
+
+TEST(MongoDBSummaryCache, Generation) {
+    MongoDBSummaryCache cache(1024 * 1024);
+
+    auto summary = std::make_shared<MongoDBSummaryCache::Summary>();
+    summary->mainDicomTags.push_back(MongoDBSummaryCache::Tag{0x0010, 0x0010, "Name"});
+
+    // read before the summary has been modified
+    uint64_t generation = cache.GetGeneration(42);
+    cache.Invalidate(42);
+    cache.Add(42, summary, generation);
+    ASSERT_FALSE(cache.Lookup(42));
+
+    cache.Add(42, summary, cache.GetGeneration(42));
+    ASSERT_TRUE(cache.Lookup(42));
+    ASSERT_EQ("Name", cache.Lookup(42)->mainDicomTags[0].value);
+
+    cache.Invalidate(42);
+    ASSERT_FALSE(cache.Lookup(42));
+}
@@ -0,0 +1,125 @@
+/**
+ * MongoDB Plugin - A plugin for Orthanc DICOM Server for storing DICOM data in MongoDB Database
+ * Copyright (C) 2017 - 2023  (Doc Cirrus GmbH)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+
+
+#include "../Plugins/MongoDBTagStatistics.h"
+
+#include <gtest/gtest.h>
+
+#include <cstdio>
+#include <random>
+
+using namespace OrthancDatabases;
+
+TEST(MongoDBTagStatistics, Unique) {
+    std::vector<std::string> sample;
+    for (int i = 0; i < 2000; i++) {
+        sample.push_back("1.2.3." + std::to_string(i));
+    }
+
+    MongoDBTagStatistics::Distribution distribution;
+    MongoDBTagStatistics::Summarize(distribution, sample, 1000000);
+
+    ASSERT_EQ(1000000u, distribution.count);
+    ASSERT_EQ(1000000u, distribution.distinct);
+    ASSERT_TRUE(distribution.frequent.empty());
+    ASSERT_DOUBLE_EQ(1.0, distribution.EstimateEqual("1.2.3.4"));
+    ASSERT_DOUBLE_EQ(1.0, distribution.EstimateEqual("unknown"));
+}
+
+TEST(MongoDBTagStatistics, Frequent) {
+    std::vector<std::string> sample;
+    for (int i = 0; i < 2000; i++) {
+        sample.push_back(i % 4 == 0 ? "M" : "F");
+    }
+
+    MongoDBTagStatistics::Distribution distribution;
+    MongoDBTagStatistics::Summarize(distribution, sample, 1000000);
+
+    ASSERT_EQ(2u, distribution.distinct);
+    ASSERT_EQ(2u, distribution.frequent.size());
+    ASSERT_NEAR(750000, distribution.EstimateEqual("F"), 1);
+    ASSERT_NEAR(250000, distribution.EstimateEqual("M"), 1);
+    ASSERT_LT(distribution.EstimateEqual("O"), 10);
+
+    // a wildcard keeps at least a tenth of the rows
+    ASSERT_NEAR(750000, distribution.EstimateWildcard("F*"), 1);
+    ASSERT_NEAR(100000, distribution.EstimateWildcard("X*"), 1);
+
+    // without histogram, each bound keeps a third of the rows
+    const std::string lower = "A";
+    const std::string upper = "Z";
+    ASSERT_NEAR(1000000.0 / 3, distribution.EstimateRange(&lower, nullptr), 1);
+    ASSERT_NEAR(1000000.0 / 9, distribution.EstimateRange(&lower, &upper), 1);
+}
+
+TEST(MongoDBTagStatistics, Dates) {
+    // the days of 2000 to 2019, evenly
+    std::vector<std::string> sample;
+    std::mt19937 generator(42);
+
+    for (int i = 0; i < 2000; i++) {
+        char date[16];
+        sprintf(date, "%04d%02d%02d", 2000 + static_cast<int>(generator() % 20),
+                1 + static_cast<int>(generator() % 12), 1 + static_cast<int>(generator() % 28));
+        sample.push_back(date);
+    }
+
+    MongoDBTagStatistics::Distribution distribution;
+    MongoDBTagStatistics::Summarize(distribution, sample, 1000000);
+
+    ASSERT_FALSE(distribution.histogram.empty());
+
+    // a year is about a twentieth of the rows
+    const std::string lower = "20100101";
+    const std::string upper = "20101231";
+    ASSERT_NEAR(50000, distribution.EstimateRange(&lower, &upper), 15000);
+    ASSERT_NEAR(50000, distribution.EstimateWildcard("2010*"), 15000);
+
+    // the open ranges
+    ASSERT_NEAR(500000, distribution.EstimateRange(&lower, nullptr), 50000);
+    ASSERT_NEAR(500000, distribution.EstimateRange(nullptr, &lower), 50000);
+    ASSERT_GE(distribution.EstimateRange(nullptr, nullptr), 999999);
+}
+
+TEST(MongoDBTagStatistics, FewSamples) {
+    std::vector<std::string> sample;
+    for (int i = 0; i < 10; i++) {
+        sample.push_back(i % 2 == 0 ? "M" : "F");
+    }
+
+    // too few values to tell anything about a million rows
+    MongoDBTagStatistics::Distribution distribution;
+    MongoDBTagStatistics::Summarize(distribution, sample, 1000000);
+
+    const std::string lower = "A";
+    ASSERT_FALSE(distribution.IsReliable());
+    ASSERT_LT(distribution.EstimateEqual("F"), 0);
+    ASSERT_LT(distribution.EstimateRange(&lower, nullptr), 0);
+    ASSERT_LT(distribution.EstimateWildcard("F*"), 0);
+
+    // unless they are all the rows
+    MongoDBTagStatistics::Distribution complete;
+    MongoDBTagStatistics::Summarize(complete, sample, sample.size());
+
+    ASSERT_TRUE(complete.IsReliable());
+    ASSERT_DOUBLE_EQ(5.0, complete.EstimateEqual("F"));
+}
@@ -0,0 +1,51 @@
+/**
+ * MongoDB Plugin - A plugin for Orthanc DICOM Server for storing DICOM data in MongoDB Database
+ * Copyright (C) 2017 - 2023  (Doc Cirrus GmbH)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+
+
+#include "../Plugins/MongoDBTagsMigration.h"
+
+#include <gtest/gtest.h>
+
+using namespace OrthancDatabases;
+
+TEST(MongoDBTagsMigration, TagKey) {
+    ASSERT_EQ("00100020", MongoDBTagsMigration::FormatTagKey(0x0010, 0x0020));
+    ASSERT_EQ("7fe00010", MongoDBTagsMigration::FormatTagKey(0x7fe0, 0x0010));
+
+    for (uint32_t value: {0x00000000u, 0x00080020u, 0x0020000du, 0xabcdef01u, 0xffffffffu}) {
+        const uint16_t group = static_cast<uint16_t>(value >> 16);
+        const uint16_t element = static_cast<uint16_t>(value & 0xffff);
+
+        uint16_t parsedGroup = 0;
+        uint16_t parsedElement = 0;
+        ASSERT_TRUE(MongoDBTagsMigration::ParseTagKey(parsedGroup, parsedElement,
+                                                      MongoDBTagsMigration::FormatTagKey(group, element)));
+        ASSERT_EQ(group, parsedGroup);
+        ASSERT_EQ(element, parsedElement);
+    }
+
+    uint16_t group, element;
+    ASSERT_FALSE(MongoDBTagsMigration::ParseTagKey(group, element, ""));
+    ASSERT_FALSE(MongoDBTagsMigration::ParseTagKey(group, element, "0010002"));
+    ASSERT_FALSE(MongoDBTagsMigration::ParseTagKey(group, element, "001000200"));
+    ASSERT_FALSE(MongoDBTagsMigration::ParseTagKey(group, element, "0010002G"));
+    ASSERT_FALSE(MongoDBTagsMigration::ParseTagKey(group, element, "0010,0020"));
+}
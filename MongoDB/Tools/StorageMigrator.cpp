@@ -0,0 +1,413 @@
+/**
+ * MongoDB Plugin - A plugin for Orthanc DICOM Server for storing DICOM data in MongoDB Database
+ * Copyright (C) 2017 - 2023  (Doc Cirrus GmbH)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+/**
+ * Standalone tool copying the content of an Orthanc "StorageDirectory" (filesystem storage area) into GridFS,
+ * using the very same code as the storage plugin:
+ *
+ *   OrthancMongoDBMigrator --storage=/var/lib/orthanc/db --uri=mongodb://localhost:27017/orthanc \
+ *                          [--chunk-size=261120] [--threads=8] [--checkpoint=migration.txt] [--dry-run]
+ *
+ * The storage directory is made of two levels of folders ("ab/cd/abcd...") that are spread over a work-stealing
+ * pool of threads. Every second-level folder that is completely migrated is appended to the checkpoint file, so
+ * that an interrupted migration can be restarted and skips the folders that are already done. Files that already
+ * exist in GridFS with the same size are skipped as well, and the size of every uploaded file is verified.
+ **/
+
+#include <mongoc.h>
+#include "../Plugins/MongoDBStorageArea.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/thread.hpp>
+
+#include <atomic>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <set>
+
+#include <Compatibility.h>  // For std::unique_ptr<>
+#include <Logging.h>
+#include <OrthancException.h>
+
+namespace OrthancDatabases {
+    namespace {
+        bool IsHexFolder(const boost::filesystem::path &path) {
+            std::string name = path.filename().string();
+            return (name.size() == 2 && isxdigit(name[0]) && isxdigit(name[1]) &&
+                    boost::filesystem::is_directory(path));
+        }
+
+        OrthancPluginContentType GuessContentType(const std::string &content) {
+            // the filesystem storage does not keep the type of the attachments, sniff it from the content
+            if (content.size() > 132 && content.compare(128, 4, "DICM") == 0) {
+                return OrthancPluginContentType_Dicom;
+            } else if (!content.empty() && content[0] == '{') {
+                return OrthancPluginContentType_DicomAsJson;
+            } else {
+                return OrthancPluginContentType_Unknown;
+            }
+        }
+
+        class Checkpoint : public boost::noncopyable {
+        private:
+            boost::mutex mutex_;
+            std::set<std::string> done_;
+            std::ofstream output_;
+
+        public:
+            explicit Checkpoint(const std::string &path) {
+                if (path.empty()) {
+                    return;
+                }
+
+                std::ifstream input(path.c_str());
+                std::string line;
+
+                while (std::getline(input, line)) {
+                    if (!line.empty()) {
+                        done_.insert(line);
+                    }
+                }
+
+                output_.open(path.c_str(), std::ios::app);
+
+                if (!output_.good()) {
+                    throw Orthanc::OrthancException(Orthanc::ErrorCode_CannotWriteFile, "Cannot open the checkpoint " + path);
+                }
+            }
+
+            size_t GetSize() const {
+                return done_.size();
+            }
+
+            bool IsDone(const std::string &unit) {
+                boost::mutex::scoped_lock lock(mutex_);
+                return done_.find(unit) != done_.end();
+            }
+
+            void SetDone(const std::string &unit) {
+                boost::mutex::scoped_lock lock(mutex_);
+                done_.insert(unit);
+
+                if (output_.is_open()) {
+                    output_ << unit << std::endl;
+                }
+            }
+        };
+
+        // every worker owns a deque, takes its own work from the back, and steals from the front of the others
+        class WorkStealingQueues : public boost::noncopyable {
+        private:
+            struct Queue {
+                boost::mutex mutex;
+                std::deque<std::string> units;
+            };
+
+            std::vector<std::unique_ptr<Queue>> queues_;
+            std::atomic<size_t> pending_;
+
+        public:
+            explicit WorkStealingQueues(size_t countWorkers) : pending_(0) {
+                for (size_t i = 0; i < countWorkers; i++) {
+                    queues_.emplace_back(new Queue);
+                }
+            }
+
+            void Push(size_t worker, const std::string &unit) {
+                pending_++;
+
+                Queue &queue = *queues_[worker % queues_.size()];
+                boost::mutex::scoped_lock lock(queue.mutex);
+                queue.units.push_back(unit);
+            }
+
+            void SetDone() {
+                pending_--;
+            }
+
+            bool Pop(std::string &unit, size_t worker) {
+                for (;;) {
+                    {
+                        Queue &own = *queues_[worker];
+                        boost::mutex::scoped_lock lock(own.mutex);
+
+                        if (!own.units.empty()) {
+                            unit = own.units.back();
+                            own.units.pop_back();
+                            return true;
+                        }
+                    }
+
+                    for (size_t i = 1; i < queues_.size(); i++) {
+                        Queue &victim = *queues_[(worker + i) % queues_.size()];
+                        boost::mutex::scoped_lock lock(victim.mutex);
+
+                        if (!victim.units.empty()) {
+                            unit = victim.units.front();
+                            victim.units.pop_front();
+                            return true;
+                        }
+                    }
+
+                    if (pending_ == 0) {
+                        return false;
+                    }
+
+                    // some units are still being expanded by other workers
+                    boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+                }
+            }
+        };
+
+        class Migrator : public boost::noncopyable {
+        private:
+            MongoDBStorageArea &storage_;
+            boost::filesystem::path root_;
+            Checkpoint &checkpoint_;
+            bool dryRun_;
+
+            WorkStealingQueues queues_;
+            size_t countWorkers_;
+
+            std::atomic<uint64_t> countUploaded_;
+            std::atomic<uint64_t> countSkipped_;
+            std::atomic<uint64_t> countFailed_;
+            std::atomic<uint64_t> bytesUploaded_;
+
+            bool MigrateFile(MongoDBStorageArea::Accessor &accessor, const boost::filesystem::path &path) {
+                const std::string uuid = path.filename().string();
+                const uint64_t expectedSize = boost::filesystem::file_size(path);
+
+                uint64_t size;
+                if (accessor.LookupSize(size, uuid)) {
+                    if (size == expectedSize) {
+                        countSkipped_++;
+                        return true;
+                    }
+
+                    LOG(WARNING) << "Size mismatch for already existing file " << uuid << ", uploading it again";
+
+                    if (!dryRun_) {
+                        accessor.Remove(uuid, OrthancPluginContentType_Unknown);
+                    }
+                }
+
+                if (dryRun_) {
+                    countUploaded_++;
+                    return true;
+                }
+
+                std::string content;
+
+                {
+                    std::ifstream input(path.string().c_str(), std::ios::binary);
+                    content.assign(std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>());
+
+                    if (content.size() != expectedSize) {
+                        LOG(ERROR) << "Cannot read file " << path.string();
+                        return false;
+                    }
+                }
+
+                accessor.Create(uuid, content.empty() ? nullptr : content.c_str(), content.size(),
+                                GuessContentType(content));
+
+                if (!accessor.LookupSize(size, uuid) || size != expectedSize) {
+                    LOG(ERROR) << "Verification failed after upload of " << uuid;
+                    return false;
+                }
+
+                countUploaded_++;
+                bytesUploaded_ += expectedSize;
+                return true;
+            }
+
+            void ProcessUnit(MongoDBStorageArea::Accessor &accessor, size_t worker, const std::string &unit) {
+                boost::filesystem::path folder = root_ / unit;
+
+                if (unit.size() == 2) {
+                    // first level: expand into second-level units
+                    for (boost::filesystem::directory_iterator it(folder), end; it != end; ++it) {
+                        if (IsHexFolder(it->path())) {
+                            std::string child = unit + "/" + it->path().filename().string();
+
+                            if (!checkpoint_.IsDone(child)) {
+                                queues_.Push(worker, child);
+                            }
+                        }
+                    }
+
+                    return;
+                }
+
+                bool success = true;
+
+                for (boost::filesystem::directory_iterator it(folder), end; it != end; ++it) {
+                    if (!boost::filesystem::is_regular_file(it->path())) {
+                        continue;
+                    }
+
+                    bool migrated = false;
+
+                    try {
+                        migrated = MigrateFile(accessor, it->path());
+                    }
+                    catch (Orthanc::OrthancException &e) {
+                        LOG(ERROR) << "Cannot migrate " << it->path().string() << ": " << e.What();
+                    }
+
+                    if (!migrated) {
+                        countFailed_++;
+                        success = false;
+                    }
+
+                    uint64_t total = countUploaded_ + countSkipped_;
+                    if (total % 10000 == 0 && total != 0) {
+                        LOG(WARNING) << "Progress: " << countUploaded_ << " uploaded (" << (bytesUploaded_ / (1024 * 1024))
+                                     << " MB), " << countSkipped_ << " skipped, " << countFailed_ << " failed";
+                    }
+                }
+
+                if (success && !dryRun_) {
+                    checkpoint_.SetDone(unit);
+                }
+            }
+
+            void Worker(size_t worker) {
+                std::unique_ptr<MongoDBStorageArea::Accessor> accessor(storage_.CreateAccessor());
+                std::string unit;
+
+                while (queues_.Pop(unit, worker)) {
+                    try {
+                        ProcessUnit(*accessor, worker, unit);
+                    }
+                    catch (std::exception &e) {
+                        LOG(ERROR) << "Cannot process folder " << unit << ": " << e.what();
+                        countFailed_++;
+                    }
+                    catch (Orthanc::OrthancException &e) {
+                        LOG(ERROR) << "Cannot process folder " << unit << ": " << e.What();
+                        countFailed_++;
+                    }
+
+                    queues_.SetDone();
+                }
+            }
+
+        public:
+            Migrator(MongoDBStorageArea &storage, const std::string &root, Checkpoint &checkpoint,
+                     size_t countWorkers, bool dryRun) :
+                    storage_(storage), root_(root), checkpoint_(checkpoint), dryRun_(dryRun),
+                    queues_(countWorkers), countWorkers_(countWorkers), countUploaded_(0), countSkipped_(0),
+                    countFailed_(0), bytesUploaded_(0) {
+            }
+
+            bool Run() {
+                if (!boost::filesystem::is_directory(root_)) {
+                    throw Orthanc::OrthancException(Orthanc::ErrorCode_InexistentFile,
+                                                    "Not a storage directory: " + root_.string());
+                }
+
+                size_t i = 0;
+                for (boost::filesystem::directory_iterator it(root_), end; it != end; ++it) {
+                    if (IsHexFolder(it->path())) {
+                        queues_.Push(i++, it->path().filename().string());
+                    }
+                }
+
+                std::vector<boost::thread *> workers;
+                for (size_t worker = 0; worker < countWorkers_; worker++) {
+                    workers.push_back(new boost::thread(&Migrator::Worker, this, worker));
+                }
+
+                for (auto &worker: workers) {
+                    worker->join();
+                    delete worker;
+                }
+
+                LOG(WARNING) << "Migration finished: " << countUploaded_ << " uploaded ("
+                             << (bytesUploaded_ / (1024 * 1024)) << " MB), " << countSkipped_ << " skipped, "
+                             << countFailed_ << " failed";
+
+                return countFailed_ == 0;
+            }
+        };
+    }
+}
+
+
+static bool LookupArgument(std::string &value, int argc, char **argv, const std::string &name) {
+    const std::string prefix = "--" + name + "=";
+
+    for (int i = 1; i < argc; i++) {
+        std::string argument(argv[i]);
+
+        if (argument == "--" + name) {
+            value.clear();
+            return true;
+        } else if (argument.compare(0, prefix.size(), prefix) == 0) {
+            value = argument.substr(prefix.size());
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+int main(int argc, char **argv) {
+    Orthanc::Logging::Initialize();
+
+    std::string storage, uri, value;
+
+    if (!LookupArgument(storage, argc, argv, "storage") || !LookupArgument(uri, argc, argv, "uri")) {
+        std::cerr << "Usage: " << argv[0] << " --storage=<StorageDirectory> --uri=<MongoDB connection uri>"
+                  << " [--chunk-size=261120] [--threads=8] [--checkpoint=<file>] [--dry-run]" << std::endl;
+        return -1;
+    }
+
+    int chunkSize = LookupArgument(value, argc, argv, "chunk-size") ? std::stoi(value) : 261120;
+    size_t threads = LookupArgument(value, argc, argv, "threads") ? std::stoul(value) : 8;
+    std::string checkpointPath = LookupArgument(value, argc, argv, "checkpoint") ? value : "";
+    bool dryRun = LookupArgument(value, argc, argv, "dry-run");
+
+    int result = 0;
+    mongoc_init();
+
+    try {
+        OrthancDatabases::MongoDBStorageArea area(uri, chunkSize, 10);
+        OrthancDatabases::Checkpoint checkpoint(checkpointPath);
+
+        if (checkpoint.GetSize() > 0) {
+            LOG(WARNING) << "Resuming migration, " << checkpoint.GetSize() << " folder(s) already done";
+        }
+
+        OrthancDatabases::Migrator migrator(area, storage, checkpoint, threads == 0 ? 1 : threads, dryRun);
+        result = migrator.Run() ? 0 : 1;
+    }
+    catch (Orthanc::OrthancException &e) {
+        LOG(ERROR) << e.What();
+        result = -1;
+    }
+
+    mongoc_cleanup();
+    Orthanc::Logging::Finalize();
+
+    return result;
+}
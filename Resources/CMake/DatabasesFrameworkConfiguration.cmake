@@ -47,9 +47,13 @@ endif()
 set(ORTHANC_DATABASES_ROOT ${CMAKE_CURRENT_LIST_DIR}/../..)
 
 set(DATABASES_SOURCES
+  ${ORTHANC_DATABASES_ROOT}/Framework/Common/ConnectionPoolMonitor.cpp
   ${ORTHANC_DATABASES_ROOT}/Framework/Common/DatabaseManager.cpp
   ${ORTHANC_DATABASES_ROOT}/Framework/Common/DatabasesEnumerations.cpp
   ${ORTHANC_DATABASES_ROOT}/Framework/MongoDB/MongoDatabase.cpp
+  ${ORTHANC_DATABASES_ROOT}/Framework/MongoDB/MongoExecutor.cpp
+  ${ORTHANC_DATABASES_ROOT}/Framework/MongoDB/MongoGroupCommit.cpp
+  ${ORTHANC_DATABASES_ROOT}/Framework/MongoDB/MongoWriteBuffer.cpp
   )
 
 #####################################################################